@@ -0,0 +1,160 @@
+#include "allocator.h"
+
+#include <stdint.h>
+#include <stdalign.h>
+#include <string.h>
+
+// Every allocation is aligned for any type.
+#define ARENA_ALIGN alignof(max_align_t)
+#define ARENA_ALIGN_UP(SIZE) (((SIZE) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    // usable size after the header
+    size_t size;
+};
+
+#define ARENA_HEADER_SIZE ARENA_ALIGN_UP(sizeof(struct ArenaChunk))
+
+static void *arena_vtable_alloc(void *ctx, size_t size) {
+    return arena_alloc(ctx, size);
+}
+
+static void *arena_vtable_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    struct Arena *arena = ctx;
+
+    if (ptr == NULL) {
+        return arena_alloc(arena, new_size);
+    }
+
+    // the most recent allocation can grow or shrink in place
+    if (ptr == arena->last && new_size <= SIZE_MAX - ARENA_ALIGN &&
+        ARENA_ALIGN_UP(new_size) <= (size_t)(arena->end - arena->last)) {
+        arena->ptr = arena->last + ARENA_ALIGN_UP(new_size);
+        return ptr;
+    }
+
+    void *new_ptr = arena_alloc(arena, new_size);
+    if (new_ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+
+    return new_ptr;
+}
+
+static void arena_vtable_free(void *ctx, void *ptr) {
+    struct Arena *arena = ctx;
+
+    if (ptr != NULL && ptr == arena->last) {
+        arena->ptr = arena->last;
+        arena->last = NULL;
+    }
+}
+
+void arena_init(struct Arena *arena, size_t chunk_size) {
+    arena->allocator = (struct Allocator){
+        .alloc   = arena_vtable_alloc,
+        .realloc = arena_vtable_realloc,
+        .free    = arena_vtable_free,
+        .ctx     = arena,
+    };
+    arena->storage = NULL;
+    arena->storage_size = 0;
+    arena->chunks = NULL;
+    arena->ptr  = NULL;
+    arena->end  = NULL;
+    arena->last = NULL;
+    arena->chunk_size = chunk_size == 0 ? ARENA_DEFAULT_CHUNK_SIZE : chunk_size;
+    arena->capacity = 0;
+}
+
+void arena_init_with_storage(struct Arena *arena, void *storage, size_t storage_size) {
+    arena_init(arena, 0);
+
+    const size_t padding = (ARENA_ALIGN - (uintptr_t)storage % ARENA_ALIGN) % ARENA_ALIGN;
+    if (storage == NULL || storage_size <= padding) {
+        return;
+    }
+
+    arena->storage = (char*)storage + padding;
+    arena->storage_size = storage_size - padding;
+    arena->ptr = arena->storage;
+    arena->end = arena->storage + arena->storage_size;
+    arena->capacity = arena->storage_size;
+}
+
+static bool arena_add_chunk(struct Arena *arena, size_t size) {
+    if (size > SIZE_MAX - ARENA_HEADER_SIZE) {
+        return false;
+    }
+
+    struct ArenaChunk *chunk = malloc(ARENA_HEADER_SIZE + size);
+    if (chunk == NULL) {
+        return false;
+    }
+
+    chunk->next = arena->chunks;
+    chunk->size = size;
+
+    arena->chunks = chunk;
+    arena->ptr = (char*)chunk + ARENA_HEADER_SIZE;
+    arena->end = arena->ptr + size;
+    arena->capacity += size;
+
+    return true;
+}
+
+void *arena_alloc(struct Arena *arena, size_t size) {
+    if (size > SIZE_MAX - ARENA_ALIGN) {
+        return NULL;
+    }
+
+    size = ARENA_ALIGN_UP(size);
+
+    if (arena->ptr == NULL || size > (size_t)(arena->end - arena->ptr)) {
+        // the rest of the current chunk is wasted
+        const size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        if (!arena_add_chunk(arena, chunk_size)) {
+            return NULL;
+        }
+    }
+
+    arena->last = arena->ptr;
+    arena->ptr += size;
+
+    return arena->last;
+}
+
+void arena_reset(struct Arena *arena) {
+    if (arena->chunks != NULL && (arena->chunks->next != NULL || arena->storage != NULL)) {
+        // merge everything into one chunk that fits it all next time
+        const size_t capacity = arena->capacity;
+
+        arena_destroy(arena);
+        arena_add_chunk(arena, capacity);
+    } else if (arena->chunks != NULL) {
+        arena->ptr = (char*)arena->chunks + ARENA_HEADER_SIZE;
+    } else {
+        arena->ptr = arena->storage;
+    }
+
+    arena->last = NULL;
+}
+
+void arena_destroy(struct Arena *arena) {
+    struct ArenaChunk *chunk = arena->chunks;
+
+    while (chunk != NULL) {
+        struct ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+    arena->storage = NULL;
+    arena->storage_size = 0;
+    arena->ptr  = NULL;
+    arena->end  = NULL;
+    arena->last = NULL;
+    arena->capacity = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Where the memory of an AST, a bytecode buffer or a VM stack comes from.
+// Everything that takes an allocator uses malloc(), realloc() and free() if it
+// is NULL.
+struct Allocator {
+    void *(*alloc)(void *ctx, size_t size);
+    // old_size is the size ptr was last (re)allocated with
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *ctx, void *ptr);
+    void *ctx;
+};
+
+static inline void *allocator_alloc(const struct Allocator *allocator, size_t size) {
+    return allocator == NULL ? malloc(size) : allocator->alloc(allocator->ctx, size);
+}
+
+static inline void *allocator_realloc(const struct Allocator *allocator, void *ptr, size_t old_size, size_t new_size) {
+    return allocator == NULL ? realloc(ptr, new_size) : allocator->realloc(allocator->ctx, ptr, old_size, new_size);
+}
+
+static inline void allocator_free(const struct Allocator *allocator, void *ptr) {
+    if (allocator == NULL) {
+        free(ptr);
+    } else {
+        allocator->free(allocator->ctx, ptr);
+    }
+}
+
+struct ArenaChunk;
+
+// Bump pointer allocator for one-shot work like parse, compile, evaluate and
+// discard. Freeing only takes back the most recent allocation and reallocating
+// it grows it in place if possible, everything else is released at once by
+// arena_reset(). After a reset the memory is kept in a single chunk, so a loop
+// that needs about the same amount every time doesn't allocate from the system
+// anymore. The arena must not be moved after arena_init() because allocator
+// points to it.
+//
+// Given storage (e.g. on the stack) is used before any chunk, so small work
+// doesn't touch the heap at all. Once it doesn't suffice a reset replaces it by
+// a chunk.
+struct Arena {
+    struct Allocator allocator;
+
+    // caller memory, NULL if there is none
+    char *storage;
+    size_t storage_size;
+
+    // allocated chunks, current chunk first
+    struct ArenaChunk *chunks;
+    char *ptr;
+    char *end;
+    // most recent allocation
+    char *last;
+
+    // minimal size of new chunks
+    size_t chunk_size;
+    // total size of the storage and all chunks
+    size_t capacity;
+};
+
+#define ARENA_DEFAULT_CHUNK_SIZE 65536
+
+void arena_init(struct Arena *arena, size_t chunk_size);
+// Doesn't take ownership of storage.
+void arena_init_with_storage(struct Arena *arena, void *storage, size_t storage_size);
+// Returns NULL if out of memory.
+void *arena_alloc(struct Arena *arena, size_t size);
+void arena_reset(struct Arena *arena);
+void arena_destroy(struct Arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
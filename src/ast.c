@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "ast.h"
 
@@ -8,7 +9,7 @@ static void node_print(const struct Ast *ast, size_t node_index, char *const *co
 static long node_eval(const struct Ast *ast, size_t node_index, const long args[]);
 
 void ast_destroy(struct Ast *ast) {
-    free(ast->nodes);
+    allocator_free(ast->allocator, ast->nodes);
     ast->nodes = NULL;
     ast->nodes_capacity = 0;
     ast->nodes_used = 0;
@@ -61,6 +62,27 @@ long node_eval(const struct Ast *ast, size_t node_index, const long args[]) {
             return left / right;
         }
 
+        case NODE_SHL:
+        {
+            const long left  = node_eval(ast, node->binary.left_index, args);
+            const long right = node_eval(ast, node->binary.right_index, args);
+            return ast_shl(left, right);
+        }
+
+        case NODE_MULHI:
+        {
+            const long left  = node_eval(ast, node->binary.left_index, args);
+            const long right = node_eval(ast, node->binary.right_index, args);
+            return ast_mulhi(left, right);
+        }
+
+        case NODE_SAR:
+        {
+            const long left  = node_eval(ast, node->binary.left_index, args);
+            const long right = node_eval(ast, node->binary.right_index, args);
+            return ast_sar(left, right);
+        }
+
         case NODE_INV:
         {
             const long value = node_eval(ast, node->child_index, args);
@@ -79,6 +101,277 @@ long node_eval(const struct Ast *ast, size_t node_index, const long args[]) {
     }
 }
 
+bool ast_compact(struct Ast *ast) {
+    if (ast->nodes_used == 0) {
+        return true;
+    }
+
+    if (ast->nodes_used > (SIZE_MAX / sizeof(size_t) - 1) / 2) {
+        return false;
+    }
+
+    // new_indices[old index] is SIZE_MAX while a node hasn't been emitted yet
+    size_t *new_indices = allocator_alloc(ast->allocator, sizeof(size_t) * ast->nodes_used);
+    // Explicit DFS stack, so arbitrarily deep trees can be compacted. Every
+    // node pushes its children at most once and shared nodes might be pushed
+    // by several parents, hence 2 * n + 1 is enough.
+    size_t *stack = allocator_alloc(ast->allocator, sizeof(size_t) * (2 * ast->nodes_used + 1));
+    struct AstNode *new_nodes = allocator_alloc(ast->allocator, sizeof(struct AstNode) * ast->nodes_used);
+
+    if (new_indices == NULL || stack == NULL || new_nodes == NULL) {
+        allocator_free(ast->allocator, new_nodes);
+        allocator_free(ast->allocator, stack);
+        allocator_free(ast->allocator, new_indices);
+        return false;
+    }
+
+    for (size_t index = 0; index < ast->nodes_used; ++ index) {
+        new_indices[index] = SIZE_MAX;
+    }
+
+    size_t stack_used = 0;
+    size_t new_used = 0;
+
+    stack[stack_used ++] = AST_ROOT_NODE_INDEX(ast);
+
+    while (stack_used > 0) {
+        const size_t node_index = stack[stack_used - 1];
+        const struct AstNode *node = &ast->nodes[node_index];
+
+        if (new_indices[node_index] != SIZE_MAX) {
+            // shared sub-tree that was already emitted
+            -- stack_used;
+            continue;
+        }
+
+        // Push children that still need to be emitted. A node is only
+        // emitted once all its children are.
+        switch (node->type) {
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+            case NODE_SHL:
+            case NODE_MULHI:
+            case NODE_SAR:
+            {
+                const size_t left_index  = node->binary.left_index;
+                const size_t right_index = node->binary.right_index;
+                const bool left_pending  = new_indices[left_index]  == SIZE_MAX;
+                const bool right_pending = new_indices[right_index] == SIZE_MAX;
+
+                if (left_pending || right_pending) {
+                    // right first, so left is emitted first
+                    if (right_pending) {
+                        stack[stack_used ++] = right_index;
+                    }
+                    if (left_pending && left_index != right_index) {
+                        stack[stack_used ++] = left_index;
+                    }
+                    continue;
+                }
+
+                new_nodes[new_used] = *node;
+                new_nodes[new_used].binary.left_index  = new_indices[left_index];
+                new_nodes[new_used].binary.right_index = new_indices[right_index];
+                break;
+            }
+
+            case NODE_INV:
+                if (new_indices[node->child_index] == SIZE_MAX) {
+                    stack[stack_used ++] = node->child_index;
+                    continue;
+                }
+
+                new_nodes[new_used] = *node;
+                new_nodes[new_used].child_index = new_indices[node->child_index];
+                break;
+
+            case NODE_INT:
+            case NODE_VAR:
+                new_nodes[new_used] = *node;
+                break;
+
+            default:
+                assert(false);
+                break;
+        }
+
+        new_indices[node_index] = new_used;
+        ++ new_used;
+        -- stack_used;
+    }
+
+    // copied back, so the capacity of a reused AST is kept
+    memcpy(ast->nodes, new_nodes, sizeof(struct AstNode) * new_used);
+    ast->nodes_used = new_used;
+
+    allocator_free(ast->allocator, new_nodes);
+    allocator_free(ast->allocator, stack);
+    allocator_free(ast->allocator, new_indices);
+
+    return true;
+}
+
+void ast_set_root(struct Ast *ast, size_t root_index) {
+    const size_t last_index = AST_ROOT_NODE_INDEX(ast);
+    if (last_index == root_index) {
+        return;
+    }
+
+    const struct AstNode last = ast->nodes[last_index];
+    ast->nodes[last_index] = ast->nodes[root_index];
+    ast->nodes[root_index] = last;
+
+    for (size_t index = 0; index < ast->nodes_used; ++ index) {
+        struct AstNode *node = &ast->nodes[index];
+        switch (node->type) {
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+            case NODE_SHL:
+            case NODE_MULHI:
+            case NODE_SAR:
+                if (node->binary.left_index == last_index) {
+                    node->binary.left_index = root_index;
+                }
+                if (node->binary.right_index == last_index) {
+                    node->binary.right_index = root_index;
+                }
+                break;
+
+            case NODE_INV:
+                if (node->child_index == last_index) {
+                    node->child_index = root_index;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+long ast_eval_linear(const struct Ast *ast, const long args[], long values[]) {
+    const struct AstNode *nodes = ast->nodes;
+    const size_t nodes_used = ast->nodes_used;
+
+    for (size_t index = 0; index < nodes_used; ++ index) {
+        const struct AstNode *node = &nodes[index];
+
+        switch (node->type) {
+            case NODE_ADD:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = values[node->binary.left_index] + values[node->binary.right_index];
+                break;
+
+            case NODE_SUB:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = values[node->binary.left_index] - values[node->binary.right_index];
+                break;
+
+            case NODE_MUL:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = values[node->binary.left_index] * values[node->binary.right_index];
+                break;
+
+            case NODE_DIV:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = values[node->binary.left_index] / values[node->binary.right_index];
+                break;
+
+            case NODE_SHL:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = ast_shl(values[node->binary.left_index], values[node->binary.right_index]);
+                break;
+
+            case NODE_MULHI:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = ast_mulhi(values[node->binary.left_index], values[node->binary.right_index]);
+                break;
+
+            case NODE_SAR:
+                assert(node->binary.left_index < index && node->binary.right_index < index);
+                values[index] = ast_sar(values[node->binary.left_index], values[node->binary.right_index]);
+                break;
+
+            case NODE_INV:
+                assert(node->child_index < index);
+                values[index] = -values[node->child_index];
+                break;
+
+            case NODE_INT:
+                values[index] = node->value;
+                break;
+
+            case NODE_VAR:
+                values[index] = args[node->arg_index];
+                break;
+
+            default:
+                assert(false);
+                values[index] = 0;
+                break;
+        }
+    }
+
+    return nodes_used == 0 ? 0 : values[nodes_used - 1];
+}
+
+bool ast_count_uses(const struct Ast *ast, size_t uses[]) {
+    for (size_t index = 0; index < ast->nodes_used; ++ index) {
+        uses[index] = 0;
+    }
+
+    if (ast->nodes_used == 0) {
+        return true;
+    }
+
+    // every reachable node is pushed exactly once
+    size_t *stack = allocator_alloc(ast->allocator, sizeof(size_t) * ast->nodes_used);
+    if (stack == NULL) {
+        return false;
+    }
+
+    size_t stack_used = 0;
+    stack[stack_used ++] = AST_ROOT_NODE_INDEX(ast);
+
+    while (stack_used > 0) {
+        const struct AstNode *node = &ast->nodes[stack[-- stack_used]];
+
+        switch (node->type) {
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+            case NODE_SHL:
+            case NODE_MULHI:
+            case NODE_SAR:
+                if (uses[node->binary.left_index] ++ == 0) {
+                    stack[stack_used ++] = node->binary.left_index;
+                }
+                if (uses[node->binary.right_index] ++ == 0) {
+                    stack[stack_used ++] = node->binary.right_index;
+                }
+                break;
+
+            case NODE_INV:
+                if (uses[node->child_index] ++ == 0) {
+                    stack[stack_used ++] = node->child_index;
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    allocator_free(ast->allocator, stack);
+
+    return true;
+}
+
 void node_print(const struct Ast *ast, size_t node_index, char *const *const args, FILE *stream) {
     assert(node_index < ast->nodes_used);
 
@@ -116,6 +409,30 @@ void node_print(const struct Ast *ast, size_t node_index, char *const *const arg
             fputc(')', stream);
             return;
 
+        case NODE_SHL:
+            fputc('(', stream);
+            node_print(ast, node->binary.left_index, args, stream);
+            fprintf(stream, " << ");
+            node_print(ast, node->binary.right_index, args, stream);
+            fputc(')', stream);
+            return;
+
+        case NODE_MULHI:
+            fprintf(stream, "mulhi(");
+            node_print(ast, node->binary.left_index, args, stream);
+            fprintf(stream, ", ");
+            node_print(ast, node->binary.right_index, args, stream);
+            fputc(')', stream);
+            return;
+
+        case NODE_SAR:
+            fputc('(', stream);
+            node_print(ast, node->binary.left_index, args, stream);
+            fprintf(stream, " >> ");
+            node_print(ast, node->binary.right_index, args, stream);
+            fputc(')', stream);
+            return;
+
         case NODE_INV:
         {
             fputc('-', stream);
@@ -137,6 +454,28 @@ void node_print(const struct Ast *ast, size_t node_index, char *const *const arg
     }
 }
 
+bool ast_reserve(struct Ast *ast, size_t capacity) {
+    if (capacity <= ast->nodes_capacity) {
+        return true;
+    }
+
+    if (capacity > SIZE_MAX / sizeof(struct AstNode)) {
+        return false;
+    }
+
+    struct AstNode *new_nodes = allocator_realloc(ast->allocator, ast->nodes,
+        ast->nodes_capacity * sizeof(struct AstNode), capacity * sizeof(struct AstNode));
+
+    if (new_nodes == NULL) {
+        return false;
+    }
+
+    ast->nodes = new_nodes;
+    ast->nodes_capacity = capacity;
+
+    return true;
+}
+
 bool ast_append_node(struct Ast *ast, const struct AstNode *node) {
     if (ast->nodes_used == ast->nodes_capacity) {
         if (ast->nodes_capacity > SIZE_MAX / 2 / sizeof(struct AstNode)) {
@@ -146,14 +485,10 @@ bool ast_append_node(struct Ast *ast, const struct AstNode *node) {
         const size_t new_capacity = ast->nodes_capacity == 0 ?
             64 :
             ast->nodes_capacity * 2;
-        struct AstNode *new_nodes = realloc(ast->nodes, new_capacity * sizeof(struct AstNode));
 
-        if (new_nodes == NULL) {
+        if (!ast_reserve(ast, new_capacity)) {
             return false;
         }
-
-        ast->nodes = new_nodes;
-        ast->nodes_capacity = new_capacity;
     }
 
     ast->nodes[ast->nodes_used] = *node;
@@ -161,3 +496,25 @@ bool ast_append_node(struct Ast *ast, const struct AstNode *node) {
 
     return true;
 }
+
+bool ast_copy(struct Ast *dest, const struct Ast *src) {
+    assert(dest->nodes_used == 0);
+
+    if (src->nodes_used == 0) {
+        return true;
+    }
+
+    struct AstNode *nodes = allocator_alloc(dest->allocator, src->nodes_used * sizeof(struct AstNode));
+    if (nodes == NULL) {
+        return false;
+    }
+
+    memcpy(nodes, src->nodes, src->nodes_used * sizeof(struct AstNode));
+
+    allocator_free(dest->allocator, dest->nodes);
+    dest->nodes = nodes;
+    dest->nodes_used = src->nodes_used;
+    dest->nodes_capacity = src->nodes_used;
+
+    return true;
+}
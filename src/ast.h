@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#include "allocator.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,6 +19,15 @@ enum NodeType {
     NODE_INV = 256,
     NODE_INT,
     NODE_VAR,
+    // Only created by optimize_strength(). The right child is always a NODE_INT
+    // shift count in the range [0, 63].
+    NODE_SHL,
+    // Only created by optimize_strength(). The high 64 bits of the signed 128
+    // bit product. The right child is always a NODE_INT.
+    NODE_MULHI,
+    // Only created by optimize_strength(). Arithmetic shift right, the right
+    // child is always a NODE_INT shift count in the range [0, 63].
+    NODE_SAR,
 };
 
 struct AstNode {
@@ -43,11 +54,58 @@ struct Ast {
     struct AstNode *nodes;
     size_t nodes_used;
     size_t nodes_capacity;
+
+    // Used for the nodes and the temporary memory of passes over the AST.
+    // NULL for malloc(), kept by ast_destroy().
+    const struct Allocator *allocator;
 };
 
+// Shift left with the same wrapping semantics as multiplying by 2^count.
+static inline long ast_shl(long value, long count) {
+    return (long)((unsigned long)value << (count & 63));
+}
+
+// High 64 bits of the signed 128 bit product, i.e. floor(left * right / 2^64).
+static inline long ast_mulhi(long left, long right) {
+    return (long)(((__int128)left * right) >> 64);
+}
+
+// Arithmetic shift right, i.e. floor(value / 2^count).
+static inline long ast_sar(long value, long count) {
+    return value >> (count & 63);
+}
+
+// Makes room for at least capacity nodes in total, so that appending up to
+// that many doesn't reallocate. Returns false if out of memory.
+bool ast_reserve(struct Ast *ast, size_t capacity);
 bool ast_append_node(struct Ast *ast, const struct AstNode *node);
+
+// Copies the nodes of src into dest, which must be empty, using the allocator
+// of dest. Returns false if out of memory.
+bool ast_copy(struct Ast *dest, const struct Ast *src);
 void ast_print(const struct Ast *ast, char *const *const args, FILE *stream);
 long ast_eval(const struct Ast *ast, const long args[]);
+
+// Drops all nodes that aren't reachable from the root node and renumbers the
+// rest in post-order, so that children always come before their parents.
+// Shared sub-trees stay shared. The nodes stay in the same memory with the same
+// capacity. Returns false if out of memory, in which case the AST is unchanged.
+bool ast_compact(struct Ast *ast);
+
+// Makes the node at root_index the root by swapping it with the last node. For
+// passes that append nodes. Needs no allocation and therefore can't fail. The
+// root must not be referenced by any other node.
+void ast_set_root(struct Ast *ast, size_t root_index);
+
+// Evaluates a compacted AST (see ast_compact()) in one linear pass over the
+// node array without recursion. values needs space for nodes_used elements.
+long ast_eval_linear(const struct Ast *ast, const long args[], long values[]);
+
+// Counts for every node how many reachable parent nodes reference it. More than
+// one means the node is shared (see optimize_cse()). uses needs space for
+// nodes_used elements. Returns false if out of memory.
+bool ast_count_uses(const struct Ast *ast, size_t uses[]);
+
 void ast_destroy(struct Ast *ast);
 
 #define AST_ROOT_NODE_INDEX(AST) ((AST)->nodes_used - 1)
@@ -55,6 +113,7 @@ void ast_destroy(struct Ast *ast);
         .nodes = NULL, \
         .nodes_used = 0, \
         .nodes_capacity = 0, \
+        .allocator = NULL, \
     }
 
 #ifdef __cplusplus
@@ -0,0 +1,681 @@
+#include "batch.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// The stack holds vectors of BATCH_TILE_SIZE rows instead of scalars. Every
+// opcode is applied to a whole tile before the next opcode is decoded, so the
+// dispatch cost is amortized and the kernels below can use SIMD instructions.
+//
+// There is no SIMD instruction for 64 bit integer division, so division is
+// always done with scalar code. There is also no 64 bit low multiply before
+// AVX-512, so it is composed of 32 bit multiplies:
+//
+//   a * b = lo(a) * lo(b) + ((hi(a) * lo(b) + lo(a) * hi(b)) << 32)  (mod 2^64)
+//
+// That is why optimize_strength() replaces multiplications by constants with
+// shifts and additions for the batch VM more eagerly than for the others.
+//
+// The high half of a signed 64 bit multiply (MULHI) is composed the same way
+// from four 32 bit multiplies and a sign correction, and the arithmetic shift
+// right (SAR) from a logical shift, since there is no 64 bit variant of either
+// before AVX-512. Both still beat scalar division by far, which is what
+// optimize_strength() uses them for.
+
+struct BatchKernels {
+    void (*add)(long *dest, const long *src, size_t count);
+    void (*sub)(long *dest, const long *src, size_t count);
+    void (*mul)(long *dest, const long *src, size_t count);
+    void (*add_scalar)(long *dest, long value, size_t count);
+    void (*mul_scalar)(long *dest, long value, size_t count);
+    void (*shl)(long *dest, unsigned int shift, size_t count);
+    void (*sar)(long *dest, unsigned int shift, size_t count);
+    void (*mulhi_scalar)(long *dest, long value, size_t count);
+    void (*inv)(long *dest, size_t count);
+};
+
+// ---- scalar -----------------------------------------------------------------
+
+static void batch_add_scalar_isa(long *dest, const long *src, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] += src[index];
+    }
+}
+
+static void batch_sub_scalar_isa(long *dest, const long *src, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] -= src[index];
+    }
+}
+
+static void batch_mul_scalar_isa(long *dest, const long *src, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] *= src[index];
+    }
+}
+
+static void batch_add_value_scalar_isa(long *dest, long value, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] += value;
+    }
+}
+
+static void batch_mul_value_scalar_isa(long *dest, long value, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] *= value;
+    }
+}
+
+static void batch_shl_scalar_isa(long *dest, unsigned int shift, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] = ast_shl(dest[index], shift);
+    }
+}
+
+static void batch_sar_scalar_isa(long *dest, unsigned int shift, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] = ast_sar(dest[index], shift);
+    }
+}
+
+static void batch_mulhi_value_scalar_isa(long *dest, long value, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] = ast_mulhi(dest[index], value);
+    }
+}
+
+static void batch_inv_scalar_isa(long *dest, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] = -dest[index];
+    }
+}
+
+static const struct BatchKernels batch_kernels_scalar = {
+    .add          = batch_add_scalar_isa,
+    .sub          = batch_sub_scalar_isa,
+    .mul          = batch_mul_scalar_isa,
+    .add_scalar   = batch_add_value_scalar_isa,
+    .mul_scalar   = batch_mul_value_scalar_isa,
+    .shl          = batch_shl_scalar_isa,
+    .sar          = batch_sar_scalar_isa,
+    .mulhi_scalar = batch_mulhi_value_scalar_isa,
+    .inv          = batch_inv_scalar_isa,
+};
+
+static void batch_div(long *dest, const long *src, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] /= src[index];
+    }
+}
+
+static void batch_div_value(long *dest, long value, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] /= value;
+    }
+}
+
+static void batch_fill(long *dest, long value, size_t count) {
+    for (size_t index = 0; index < count; ++ index) {
+        dest[index] = value;
+    }
+}
+
+#if defined(__x86_64__)
+
+// ---- SSE2 -------------------------------------------------------------------
+
+static inline __m128i batch_mullo_epi64_sse2(__m128i a, __m128i b) {
+    const __m128i lo    = _mm_mul_epu32(a, b);
+    const __m128i cross = _mm_add_epi64(
+        _mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+        _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(lo, _mm_slli_epi64(cross, 32));
+}
+
+// all bits set in lanes holding negative values
+static inline __m128i batch_sign_epi64_sse2(__m128i a) {
+    return _mm_shuffle_epi32(_mm_srai_epi32(a, 31), _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+// The unsigned high half from the four partial products, then corrected for
+// the signs: hi_signed(a * b) = hi_unsigned(a * b) - (a < 0 ? b : 0) - (b < 0 ? a : 0)
+static inline __m128i batch_mulhi_epi64_sse2(__m128i a, __m128i b) {
+    const __m128i mask  = _mm_set1_epi64x(0xFFFFFFFF);
+    const __m128i a_hi  = _mm_srli_epi64(a, 32);
+    const __m128i b_hi  = _mm_srli_epi64(b, 32);
+    const __m128i lo_lo = _mm_mul_epu32(a, b);
+    const __m128i lo_hi = _mm_mul_epu32(a, b_hi);
+    const __m128i hi_lo = _mm_mul_epu32(a_hi, b);
+    const __m128i hi_hi = _mm_mul_epu32(a_hi, b_hi);
+    const __m128i mid   = _mm_add_epi64(
+        _mm_srli_epi64(lo_lo, 32),
+        _mm_add_epi64(_mm_and_si128(lo_hi, mask), _mm_and_si128(hi_lo, mask)));
+    const __m128i hi    = _mm_add_epi64(
+        _mm_add_epi64(hi_hi, _mm_srli_epi64(mid, 32)),
+        _mm_add_epi64(_mm_srli_epi64(lo_hi, 32), _mm_srli_epi64(hi_lo, 32)));
+    return _mm_sub_epi64(hi, _mm_add_epi64(
+        _mm_and_si128(batch_sign_epi64_sse2(a), b),
+        _mm_and_si128(batch_sign_epi64_sse2(b), a)));
+}
+
+#define BATCH_SSE2_BINARY(NAME, EXPR) \
+    static void NAME(long *dest, const long *src, size_t count) { \
+        size_t index = 0; \
+        for (; index + 2 <= count; index += 2) { \
+            const __m128i a = _mm_loadu_si128((const __m128i*)(dest + index)); \
+            const __m128i b = _mm_loadu_si128((const __m128i*)(src  + index)); \
+            _mm_storeu_si128((__m128i*)(dest + index), EXPR); \
+        } \
+        for (; index < count; ++ index) { \
+            const long a = dest[index]; \
+            const long b = src[index]; \
+            dest[index] = EXPR ## _SCALAR; \
+        } \
+    }
+
+#define BATCH_SSE2_VALUE(NAME, EXPR) \
+    static void NAME(long *dest, long value, size_t count) { \
+        const __m128i b = _mm_set1_epi64x(value); \
+        size_t index = 0; \
+        for (; index + 2 <= count; index += 2) { \
+            const __m128i a = _mm_loadu_si128((const __m128i*)(dest + index)); \
+            _mm_storeu_si128((__m128i*)(dest + index), EXPR); \
+        } \
+        for (; index < count; ++ index) { \
+            const long a = dest[index]; \
+            dest[index] = EXPR ## _SCALAR(value); \
+        } \
+    }
+
+#define BATCH_SSE2_ADD _mm_add_epi64(a, b)
+#define BATCH_SSE2_ADD_SCALAR a + b
+#define BATCH_SSE2_SUB _mm_sub_epi64(a, b)
+#define BATCH_SSE2_SUB_SCALAR a - b
+#define BATCH_SSE2_MUL batch_mullo_epi64_sse2(a, b)
+#define BATCH_SSE2_MUL_SCALAR a * b
+
+#define BATCH_SSE2_ADD_VALUE _mm_add_epi64(a, b)
+#define BATCH_SSE2_ADD_VALUE_SCALAR(VALUE) a + (VALUE)
+#define BATCH_SSE2_MUL_VALUE batch_mullo_epi64_sse2(a, b)
+#define BATCH_SSE2_MUL_VALUE_SCALAR(VALUE) a * (VALUE)
+#define BATCH_SSE2_MULHI_VALUE batch_mulhi_epi64_sse2(a, b)
+#define BATCH_SSE2_MULHI_VALUE_SCALAR(VALUE) ast_mulhi(a, (VALUE))
+
+BATCH_SSE2_BINARY(batch_add_sse2, BATCH_SSE2_ADD)
+BATCH_SSE2_BINARY(batch_sub_sse2, BATCH_SSE2_SUB)
+BATCH_SSE2_BINARY(batch_mul_sse2, BATCH_SSE2_MUL)
+BATCH_SSE2_VALUE(batch_add_value_sse2, BATCH_SSE2_ADD_VALUE)
+BATCH_SSE2_VALUE(batch_mul_value_sse2, BATCH_SSE2_MUL_VALUE)
+BATCH_SSE2_VALUE(batch_mulhi_value_sse2, BATCH_SSE2_MULHI_VALUE)
+
+static void batch_shl_sse2(long *dest, unsigned int shift, size_t count) {
+    const __m128i b = _mm_cvtsi32_si128((int)shift);
+    size_t index = 0;
+    for (; index + 2 <= count; index += 2) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(dest + index));
+        _mm_storeu_si128((__m128i*)(dest + index), _mm_sll_epi64(a, b));
+    }
+    for (; index < count; ++ index) {
+        dest[index] = ast_shl(dest[index], shift);
+    }
+}
+
+// (a ^ sign) flips negative values to non-negative ones, for which the logical
+// shift is the arithmetic one, and flipping back gives floor(a / 2^shift).
+static void batch_sar_sse2(long *dest, unsigned int shift, size_t count) {
+    const __m128i b = _mm_cvtsi32_si128((int)shift);
+    size_t index = 0;
+    for (; index + 2 <= count; index += 2) {
+        const __m128i a    = _mm_loadu_si128((const __m128i*)(dest + index));
+        const __m128i sign = batch_sign_epi64_sse2(a);
+        _mm_storeu_si128((__m128i*)(dest + index), _mm_xor_si128(_mm_srl_epi64(_mm_xor_si128(a, sign), b), sign));
+    }
+    for (; index < count; ++ index) {
+        dest[index] = ast_sar(dest[index], shift);
+    }
+}
+
+static void batch_inv_sse2(long *dest, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t index = 0;
+    for (; index + 2 <= count; index += 2) {
+        const __m128i a = _mm_loadu_si128((const __m128i*)(dest + index));
+        _mm_storeu_si128((__m128i*)(dest + index), _mm_sub_epi64(zero, a));
+    }
+    for (; index < count; ++ index) {
+        dest[index] = -dest[index];
+    }
+}
+
+static const struct BatchKernels batch_kernels_sse2 = {
+    .add          = batch_add_sse2,
+    .sub          = batch_sub_sse2,
+    .mul          = batch_mul_sse2,
+    .add_scalar   = batch_add_value_sse2,
+    .mul_scalar   = batch_mul_value_sse2,
+    .shl          = batch_shl_sse2,
+    .sar          = batch_sar_sse2,
+    .mulhi_scalar = batch_mulhi_value_sse2,
+    .inv          = batch_inv_sse2,
+};
+
+// ---- AVX2 -------------------------------------------------------------------
+
+#define BATCH_AVX2 __attribute__((target("avx2")))
+
+BATCH_AVX2
+static inline __m256i batch_mullo_epi64_avx2(__m256i a, __m256i b) {
+    const __m256i lo    = _mm256_mul_epu32(a, b);
+    const __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+// all bits set in lanes holding negative values
+BATCH_AVX2
+static inline __m256i batch_sign_epi64_avx2(__m256i a) {
+    return _mm256_shuffle_epi32(_mm256_srai_epi32(a, 31), _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+// The unsigned high half from the four partial products, then corrected for
+// the signs: hi_signed(a * b) = hi_unsigned(a * b) - (a < 0 ? b : 0) - (b < 0 ? a : 0)
+BATCH_AVX2
+static inline __m256i batch_mulhi_epi64_avx2(__m256i a, __m256i b) {
+    const __m256i mask  = _mm256_set1_epi64x(0xFFFFFFFF);
+    const __m256i a_hi  = _mm256_srli_epi64(a, 32);
+    const __m256i b_hi  = _mm256_srli_epi64(b, 32);
+    const __m256i lo_lo = _mm256_mul_epu32(a, b);
+    const __m256i lo_hi = _mm256_mul_epu32(a, b_hi);
+    const __m256i hi_lo = _mm256_mul_epu32(a_hi, b);
+    const __m256i hi_hi = _mm256_mul_epu32(a_hi, b_hi);
+    const __m256i mid   = _mm256_add_epi64(
+        _mm256_srli_epi64(lo_lo, 32),
+        _mm256_add_epi64(_mm256_and_si256(lo_hi, mask), _mm256_and_si256(hi_lo, mask)));
+    const __m256i hi    = _mm256_add_epi64(
+        _mm256_add_epi64(hi_hi, _mm256_srli_epi64(mid, 32)),
+        _mm256_add_epi64(_mm256_srli_epi64(lo_hi, 32), _mm256_srli_epi64(hi_lo, 32)));
+    return _mm256_sub_epi64(hi, _mm256_add_epi64(
+        _mm256_and_si256(batch_sign_epi64_avx2(a), b),
+        _mm256_and_si256(batch_sign_epi64_avx2(b), a)));
+}
+
+#define BATCH_AVX2_BINARY(NAME, EXPR) \
+    BATCH_AVX2 \
+    static void NAME(long *dest, const long *src, size_t count) { \
+        size_t index = 0; \
+        for (; index + 4 <= count; index += 4) { \
+            const __m256i a = _mm256_loadu_si256((const __m256i*)(dest + index)); \
+            const __m256i b = _mm256_loadu_si256((const __m256i*)(src  + index)); \
+            _mm256_storeu_si256((__m256i*)(dest + index), EXPR); \
+        } \
+        for (; index < count; ++ index) { \
+            const long a = dest[index]; \
+            const long b = src[index]; \
+            dest[index] = EXPR ## _SCALAR; \
+        } \
+    }
+
+#define BATCH_AVX2_VALUE(NAME, EXPR) \
+    BATCH_AVX2 \
+    static void NAME(long *dest, long value, size_t count) { \
+        const __m256i b = _mm256_set1_epi64x(value); \
+        size_t index = 0; \
+        for (; index + 4 <= count; index += 4) { \
+            const __m256i a = _mm256_loadu_si256((const __m256i*)(dest + index)); \
+            _mm256_storeu_si256((__m256i*)(dest + index), EXPR); \
+        } \
+        for (; index < count; ++ index) { \
+            const long a = dest[index]; \
+            dest[index] = EXPR ## _SCALAR(value); \
+        } \
+    }
+
+#define BATCH_AVX2_ADD _mm256_add_epi64(a, b)
+#define BATCH_AVX2_ADD_SCALAR a + b
+#define BATCH_AVX2_SUB _mm256_sub_epi64(a, b)
+#define BATCH_AVX2_SUB_SCALAR a - b
+#define BATCH_AVX2_MUL batch_mullo_epi64_avx2(a, b)
+#define BATCH_AVX2_MUL_SCALAR a * b
+
+#define BATCH_AVX2_ADD_VALUE _mm256_add_epi64(a, b)
+#define BATCH_AVX2_ADD_VALUE_SCALAR(VALUE) a + (VALUE)
+#define BATCH_AVX2_MUL_VALUE batch_mullo_epi64_avx2(a, b)
+#define BATCH_AVX2_MUL_VALUE_SCALAR(VALUE) a * (VALUE)
+#define BATCH_AVX2_MULHI_VALUE batch_mulhi_epi64_avx2(a, b)
+#define BATCH_AVX2_MULHI_VALUE_SCALAR(VALUE) ast_mulhi(a, (VALUE))
+
+BATCH_AVX2_BINARY(batch_add_avx2, BATCH_AVX2_ADD)
+BATCH_AVX2_BINARY(batch_sub_avx2, BATCH_AVX2_SUB)
+BATCH_AVX2_BINARY(batch_mul_avx2, BATCH_AVX2_MUL)
+BATCH_AVX2_VALUE(batch_add_value_avx2, BATCH_AVX2_ADD_VALUE)
+BATCH_AVX2_VALUE(batch_mul_value_avx2, BATCH_AVX2_MUL_VALUE)
+BATCH_AVX2_VALUE(batch_mulhi_value_avx2, BATCH_AVX2_MULHI_VALUE)
+
+BATCH_AVX2
+static void batch_shl_avx2(long *dest, unsigned int shift, size_t count) {
+    const __m128i b = _mm_cvtsi32_si128((int)shift);
+    size_t index = 0;
+    for (; index + 4 <= count; index += 4) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)(dest + index));
+        _mm256_storeu_si256((__m256i*)(dest + index), _mm256_sll_epi64(a, b));
+    }
+    for (; index < count; ++ index) {
+        dest[index] = ast_shl(dest[index], shift);
+    }
+}
+
+// (a ^ sign) flips negative values to non-negative ones, for which the logical
+// shift is the arithmetic one, and flipping back gives floor(a / 2^shift).
+BATCH_AVX2
+static void batch_sar_avx2(long *dest, unsigned int shift, size_t count) {
+    const __m128i b = _mm_cvtsi32_si128((int)shift);
+    size_t index = 0;
+    for (; index + 4 <= count; index += 4) {
+        const __m256i a    = _mm256_loadu_si256((const __m256i*)(dest + index));
+        const __m256i sign = batch_sign_epi64_avx2(a);
+        _mm256_storeu_si256((__m256i*)(dest + index), _mm256_xor_si256(_mm256_srl_epi64(_mm256_xor_si256(a, sign), b), sign));
+    }
+    for (; index < count; ++ index) {
+        dest[index] = ast_sar(dest[index], shift);
+    }
+}
+
+BATCH_AVX2
+static void batch_inv_avx2(long *dest, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t index = 0;
+    for (; index + 4 <= count; index += 4) {
+        const __m256i a = _mm256_loadu_si256((const __m256i*)(dest + index));
+        _mm256_storeu_si256((__m256i*)(dest + index), _mm256_sub_epi64(zero, a));
+    }
+    for (; index < count; ++ index) {
+        dest[index] = -dest[index];
+    }
+}
+
+static const struct BatchKernels batch_kernels_avx2 = {
+    .add          = batch_add_avx2,
+    .sub          = batch_sub_avx2,
+    .mul          = batch_mul_avx2,
+    .add_scalar   = batch_add_value_avx2,
+    .mul_scalar   = batch_mul_value_avx2,
+    .shl          = batch_shl_avx2,
+    .sar          = batch_sar_avx2,
+    .mulhi_scalar = batch_mulhi_value_avx2,
+    .inv          = batch_inv_avx2,
+};
+
+// Detected once at load time, so every batch call doesn't query the CPU again.
+static enum BatchIsa batch_isa = BATCH_ISA_SSE2;
+
+__attribute__((constructor))
+static void batch_init_isa(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        batch_isa = BATCH_ISA_AVX2;
+    } else {
+        // SSE2 is part of the x86_64 baseline
+        batch_isa = BATCH_ISA_SSE2;
+    }
+}
+
+enum BatchIsa batch_detect_isa(void) {
+    return batch_isa;
+}
+
+#else
+
+enum BatchIsa batch_detect_isa(void) {
+    return BATCH_ISA_SCALAR;
+}
+
+#endif
+
+const char *get_batch_isa_name(enum BatchIsa isa) {
+    switch (isa) {
+        case BATCH_ISA_SCALAR: return "scalar";
+        case BATCH_ISA_SSE2:   return "SSE2";
+        case BATCH_ISA_AVX2:   return "AVX2";
+        default:
+            assert(false);
+            return "illegal instruction set";
+    }
+}
+
+static const struct BatchKernels *batch_get_kernels(enum BatchIsa isa) {
+    const enum BatchIsa supported = batch_detect_isa();
+    if (isa > supported) {
+        isa = supported;
+    }
+
+    switch (isa) {
+#if defined(__x86_64__)
+        case BATCH_ISA_AVX2: return &batch_kernels_avx2;
+        case BATCH_ISA_SSE2: return &batch_kernels_sse2;
+#endif
+        default:             return &batch_kernels_scalar;
+    }
+}
+
+static void batch_exec_tile(const struct BatchKernels *kernels, const void *bytecode,
+        const long *const columns[], size_t row, size_t count, long *stack, long results[]) {
+    const uint8_t *codeptr = (const uint8_t*)bytecode + sizeof(size_t);
+    // points behind the top vector
+    long *top = stack;
+
+    for (;;) {
+        const uint8_t code = *codeptr;
+        ++ codeptr;
+
+        switch (code) {
+            case CODE_ADD:
+                top -= BATCH_TILE_SIZE;
+                kernels->add(top - BATCH_TILE_SIZE, top, count);
+                break;
+
+            case CODE_SUB:
+                top -= BATCH_TILE_SIZE;
+                kernels->sub(top - BATCH_TILE_SIZE, top, count);
+                break;
+
+            case CODE_MUL:
+                top -= BATCH_TILE_SIZE;
+                kernels->mul(top - BATCH_TILE_SIZE, top, count);
+                break;
+
+            case CODE_DIV:
+                top -= BATCH_TILE_SIZE;
+                batch_div(top - BATCH_TILE_SIZE, top, count);
+                break;
+
+            case CODE_INV:
+                kernels->inv(top - BATCH_TILE_SIZE, count);
+                break;
+
+            case CODE_SHL:
+                kernels->shl(top - BATCH_TILE_SIZE, *codeptr, count);
+                codeptr += sizeof(uint8_t);
+                break;
+
+            case CODE_MULHI:
+                kernels->mulhi_scalar(top - BATCH_TILE_SIZE, bytecode_read_int64(codeptr), count);
+                codeptr += sizeof(int64_t);
+                break;
+
+            case CODE_SAR:
+                kernels->sar(top - BATCH_TILE_SIZE, *codeptr, count);
+                codeptr += sizeof(uint8_t);
+                break;
+
+            case CODE_ADD_VAR:
+                kernels->add(top - BATCH_TILE_SIZE, columns[bytecode_read_uint16(codeptr)] + row, count);
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_SUB_VAR:
+                kernels->sub(top - BATCH_TILE_SIZE, columns[bytecode_read_uint16(codeptr)] + row, count);
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_MUL_VAR:
+                kernels->mul(top - BATCH_TILE_SIZE, columns[bytecode_read_uint16(codeptr)] + row, count);
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_DIV_VAR:
+                batch_div(top - BATCH_TILE_SIZE, columns[bytecode_read_uint16(codeptr)] + row, count);
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_ADD_VAL:
+                kernels->add_scalar(top - BATCH_TILE_SIZE, bytecode_read_int32(codeptr), count);
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_SUB_VAL:
+                // can't overflow, the value is only 32 bit
+                kernels->add_scalar(top - BATCH_TILE_SIZE, -(long)bytecode_read_int32(codeptr), count);
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_MUL_VAL:
+                kernels->mul_scalar(top - BATCH_TILE_SIZE, bytecode_read_int32(codeptr), count);
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_DIV_VAL:
+                batch_div_value(top - BATCH_TILE_SIZE, bytecode_read_int32(codeptr), count);
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_VAR_VAR_ADD:
+            case CODE_VAR_VAR_SUB:
+            case CODE_VAR_VAR_MUL:
+            case CODE_VAR_VAR_DIV:
+            {
+                const long *left  = columns[bytecode_read_uint16(codeptr)] + row;
+                const long *right = columns[bytecode_read_uint16(codeptr + sizeof(uint16_t))] + row;
+                memcpy(top, left, count * sizeof(long));
+
+                switch (code) {
+                    case CODE_VAR_VAR_ADD: kernels->add(top, right, count); break;
+                    case CODE_VAR_VAR_SUB: kernels->sub(top, right, count); break;
+                    case CODE_VAR_VAR_MUL: kernels->mul(top, right, count); break;
+                    default:               batch_div(top, right, count);    break;
+                }
+
+                top += BATCH_TILE_SIZE;
+                codeptr += 2 * sizeof(uint16_t);
+                break;
+            }
+
+            case CODE_VAL8:
+                batch_fill(top, (int8_t)*codeptr, count);
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(int8_t);
+                break;
+
+            case CODE_VAL16:
+                batch_fill(top, bytecode_read_int16(codeptr), count);
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(int16_t);
+                break;
+
+            case CODE_VAL32:
+                batch_fill(top, bytecode_read_int32(codeptr), count);
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_VAL64:
+                batch_fill(top, bytecode_read_int64(codeptr), count);
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(int64_t);
+                break;
+
+            case CODE_VAR8:
+                memcpy(top, columns[*codeptr] + row, count * sizeof(long));
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(uint8_t);
+                break;
+
+            case CODE_VAR16:
+                memcpy(top, columns[bytecode_read_uint16(codeptr)] + row, count * sizeof(long));
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_VAR32:
+                memcpy(top, columns[bytecode_read_uint32(codeptr)] + row, count * sizeof(long));
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_VAR64:
+                memcpy(top, columns[bytecode_read_uint64(codeptr)] + row, count * sizeof(long));
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(uint64_t);
+                break;
+
+            case CODE_FRAME:
+                top = stack + BATCH_TILE_SIZE * bytecode_read_uint32(codeptr);
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_LOAD:
+                memcpy(top, stack + BATCH_TILE_SIZE * bytecode_read_uint32(codeptr), count * sizeof(long));
+                top += BATCH_TILE_SIZE;
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_STORE:
+                memcpy(stack + BATCH_TILE_SIZE * bytecode_read_uint32(codeptr), top - BATCH_TILE_SIZE, count * sizeof(long));
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_RET:
+                memcpy(results, top - BATCH_TILE_SIZE, count * sizeof(long));
+                return;
+
+            default:
+                assert(false);
+                return;
+        }
+    }
+}
+
+bool bytecode_eval_batch(struct VmContext *ctx, const void *bytecode,
+        const long *const columns[], long results[], size_t row_count) {
+    return bytecode_eval_batch_isa(ctx, bytecode, columns, results, row_count, batch_detect_isa());
+}
+
+bool bytecode_eval_batch_isa(struct VmContext *ctx, const void *bytecode,
+        const long *const columns[], long results[], size_t row_count, enum BatchIsa isa) {
+    const size_t stack_size = *(const size_t*)bytecode;
+
+    ctx->error = VM_ERROR_NONE;
+
+    if (stack_size > SIZE_MAX / BATCH_TILE_SIZE) {
+        ctx->error = VM_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+
+    if (!vm_context_reserve(ctx, stack_size * BATCH_TILE_SIZE)) {
+        return false;
+    }
+
+    const struct BatchKernels *kernels = batch_get_kernels(isa);
+
+    for (size_t row = 0; row < row_count; row += BATCH_TILE_SIZE) {
+        const size_t count = row_count - row < BATCH_TILE_SIZE ? row_count - row : BATCH_TILE_SIZE;
+        batch_exec_tile(kernels, bytecode, columns, row, count, ctx->stack, results + row);
+    }
+
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef BATCH_H
+#define BATCH_H
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of rows that are evaluated by each opcode at once. The stack of the
+// VmContext holds stack_size vectors of this many rows.
+#define BATCH_TILE_SIZE 256
+
+enum BatchIsa {
+    BATCH_ISA_SCALAR,
+    BATCH_ISA_SSE2,
+    BATCH_ISA_AVX2,
+};
+
+// Best instruction set supported by the running CPU, detected once at load
+// time.
+enum BatchIsa batch_detect_isa(void);
+const char *get_batch_isa_name(enum BatchIsa isa);
+
+// Evaluates bytecode for row_count rows. The arguments are given column-major:
+// columns[arg_index][row]. Returns false on error and sets ctx->error.
+bool bytecode_eval_batch(struct VmContext *ctx, const void *bytecode,
+    const long *const columns[], long results[], size_t row_count);
+
+// Same as bytecode_eval_batch(), but uses the given instruction set (or the
+// best supported one, if the CPU doesn't support it).
+bool bytecode_eval_batch_isa(struct VmContext *ctx, const void *bytecode,
+    const long *const columns[], long results[], size_t row_count, enum BatchIsa isa);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
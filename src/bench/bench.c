@@ -0,0 +1,949 @@
+#include "ast.h"
+#include "parser.h"
+#include "optimizer.h"
+#include "strength.h"
+#include "bytecode.h"
+#include "regvm.h"
+#include "batch.h"
+#include "compact_ast.h"
+#include "buffer.h"
+#include "closure.h"
+#include "allocator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Each measurement runs for at least this long.
+#define BENCH_MIN_SECONDS 0.25
+
+static char *const bench_arg_names[] = { "a", "b", "c", "d", "e", "f", "g", "h" };
+static const long bench_arg_values[] = { 3, 7, 11, 13, 17, 19, 23, 29 };
+
+#define BENCH_ARGC (sizeof(bench_arg_names) / sizeof(bench_arg_names[0]))
+
+// rows per batch evaluation
+#define BENCH_ROWS 65536
+
+struct BenchExpr {
+    const char *name;
+    char *code;
+    bool generated;
+};
+
+// Prevents the compiler from optimizing away benchmarked calls.
+static volatile long bench_sink = 0;
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long bench_random(unsigned long *state) {
+    // xorshift64
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Generates a random expression with about node_count nodes. Divisors are
+// always strictly positive (arguments or constants) so evaluation can't fail.
+static bool bench_generate(struct Buffer *buffer, size_t node_count, unsigned long *state) {
+    if (node_count <= 1) {
+        char str[32];
+        int len;
+        if (bench_random(state) % 3 == 0) {
+            len = snprintf(str, sizeof(str), "%lu", bench_random(state) % 100);
+        } else {
+            len = snprintf(str, sizeof(str), "%s", bench_arg_names[bench_random(state) % BENCH_ARGC]);
+        }
+        return buffer_append(buffer, str, (size_t)len);
+    }
+
+    static const char ops[] = { '+', '-', '*', '+', '-', '/' };
+    const char op = ops[bench_random(state) % sizeof(ops)];
+
+    if (!buffer_append_byte(buffer, '(')) {
+        return false;
+    }
+
+    if (op == '/') {
+        if (!bench_generate(buffer, node_count - 2, state)) {
+            return false;
+        }
+        char str[32];
+        const int len = bench_random(state) % 2 == 0 ?
+            snprintf(str, sizeof(str), " / %lu)", bench_random(state) % 100 + 1) :
+            snprintf(str, sizeof(str), " / %s)", bench_arg_names[bench_random(state) % BENCH_ARGC]);
+        return buffer_append(buffer, str, (size_t)len);
+    }
+
+    const size_t left_count = (node_count - 1) / 2;
+    const char infix[] = { ' ', op, ' ' };
+
+    return
+        bench_generate(buffer, left_count, state) &&
+        buffer_append(buffer, infix, sizeof(infix)) &&
+        bench_generate(buffer, node_count - 1 - left_count, state) &&
+        buffer_append_byte(buffer, ')');
+}
+
+static char *bench_generate_code(size_t node_count, unsigned long seed) {
+    struct Buffer buffer = BUFFER_INIT;
+    unsigned long state = seed;
+
+    if (!bench_generate(&buffer, node_count, &state) || !buffer_append_byte(&buffer, 0)) {
+        buffer_destroy(&buffer);
+        return NULL;
+    }
+
+    return buffer.data;
+}
+
+// Generates "a/2 + a/3 + ... + a/(term_count + 1)", a long sum of opaque terms
+// for the polynomial pass.
+static char *bench_generate_chain(size_t term_count) {
+    struct Buffer buffer = BUFFER_INIT;
+
+    for (size_t index = 0; index < term_count; ++ index) {
+        char str[32];
+        const int len = snprintf(str, sizeof(str), index == 0 ? "a/%zu" : " + a/%zu", index + 2);
+        if (!buffer_append(&buffer, str, (size_t)len)) {
+            buffer_destroy(&buffer);
+            return NULL;
+        }
+    }
+
+    if (!buffer_append_byte(&buffer, 0)) {
+        buffer_destroy(&buffer);
+        return NULL;
+    }
+
+    return buffer.data;
+}
+
+static size_t bench_count_nodes(const struct Ast *ast, size_t node_index) {
+    const struct AstNode *node = &ast->nodes[node_index];
+
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+            return 1 +
+                bench_count_nodes(ast, node->binary.left_index) +
+                bench_count_nodes(ast, node->binary.right_index);
+
+        case NODE_INV:
+            return 1 + bench_count_nodes(ast, node->child_index);
+
+        default:
+            return 1;
+    }
+}
+
+static double bench_ast_eval(const struct Ast *ast) {
+    size_t iterations = 0;
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t count = 0; count < 1000; ++ count) {
+            bench_sink += ast_eval(ast, bench_arg_values);
+        }
+        iterations += 1000;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    return (double)iterations / elapsed;
+}
+
+static double bench_ast_eval_linear(const struct Ast *ast) {
+    long *values = malloc(sizeof(long) * ast->nodes_used);
+    size_t iterations = 0;
+
+    if (values == NULL) {
+        return 0;
+    }
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t count = 0; count < 1000; ++ count) {
+            bench_sink += ast_eval_linear(ast, bench_arg_values, values);
+        }
+        iterations += 1000;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    free(values);
+
+    return (double)iterations / elapsed;
+}
+
+static double bench_bytecode_eval(const struct Bytecode *bytecode) {
+    struct VmContext ctx;
+    size_t iterations = 0;
+    long result = 0;
+
+    if (!vm_context_init(&ctx, bytecode->bytes.data)) {
+        return 0;
+    }
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t count = 0; count < 1000; ++ count) {
+            if (!bytecode_eval_ctx(&ctx, bytecode->bytes.data, bench_arg_values, &result)) {
+                vm_context_destroy(&ctx);
+                return 0;
+            }
+            bench_sink += result;
+        }
+        iterations += 1000;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    vm_context_destroy(&ctx);
+
+    return (double)iterations / elapsed;
+}
+
+static double bench_regcode_eval(const struct RegCode *code) {
+    struct VmContext ctx = VM_CONTEXT_INIT;
+    size_t iterations = 0;
+    long result = 0;
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t count = 0; count < 1000; ++ count) {
+            if (!regcode_eval_ctx(&ctx, code, bench_arg_values, &result)) {
+                vm_context_destroy(&ctx);
+                return 0;
+            }
+            bench_sink += result;
+        }
+        iterations += 1000;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    vm_context_destroy(&ctx);
+
+    return (double)iterations / elapsed;
+}
+
+static double bench_closure_eval(const struct ClosureCode *code) {
+    size_t iterations = 0;
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t count = 0; count < 1000; ++ count) {
+            bench_sink += closure_eval(code, bench_arg_values);
+        }
+        iterations += 1000;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    return (double)iterations / elapsed;
+}
+
+static bool bench_expr(const struct BenchExpr *expr) {
+    struct Parser parser = parse_string(expr->code, bench_arg_names, BENCH_ARGC);
+    struct Bytecode bytecode = BYTECODE_INIT;
+    struct RegCode regcode = REGCODE_INIT;
+    struct ClosureCode closure = CLOSURE_CODE_INIT;
+    bool ok = false;
+
+    if (parser.error != ERROR_NONE) {
+        parser_print_error(&parser, stderr);
+        goto cleanup;
+    }
+
+    optimize(&parser.ast);
+
+    const size_t node_count = bench_count_nodes(&parser.ast, AST_ROOT_NODE_INDEX(&parser.ast));
+
+    size_t eliminated = 0;
+    if (!optimize_cse(&parser.ast, &eliminated)) {
+        perror("eliminating common subexpressions");
+        goto cleanup;
+    }
+
+    size_t lowered = 0;
+    if (!optimize_strength(&parser.ast, get_strength_costs(STRENGTH_TARGET_VM), &lowered)) {
+        perror("reducing strength");
+        goto cleanup;
+    }
+
+    bytecode = bytecode_compile(&parser.ast);
+    if (bytecode.stack_size == 0) {
+        fprintf(stderr, "%s: bytecode compilation failed\n", expr->name);
+        goto cleanup;
+    }
+
+    regcode = regcode_compile(&parser.ast);
+    if (regcode.reg_count == 0) {
+        fprintf(stderr, "%s: register code compilation failed\n", expr->name);
+        goto cleanup;
+    }
+
+    closure = closure_compile(&parser.ast);
+    if (closure.closures == NULL) {
+        fprintf(stderr, "%s: closure compilation failed\n", expr->name);
+        goto cleanup;
+    }
+
+    const double ast_rate = bench_ast_eval(&parser.ast);
+    const double linear_rate = bench_ast_eval_linear(&parser.ast);
+    const double bytecode_rate = bench_bytecode_eval(&bytecode);
+    const double regcode_rate = bench_regcode_eval(&regcode);
+    const double closure_rate = bench_closure_eval(&closure);
+
+    printf("%-12s %7zu %5zu %5zu %9zu %8.2f %12.0f %12.0f %9zu %12.0f %10zu %12.0f %12.0f\n",
+        expr->name,
+        node_count,
+        eliminated,
+        lowered,
+        bytecode.bytes.used,
+        (double)bytecode.bytes.used / (double)node_count,
+        ast_rate,
+        linear_rate,
+        bytecode_count_instructions(bytecode.bytes.data),
+        bytecode_rate,
+        regcode.instrs_used,
+        regcode_rate,
+        closure_rate);
+
+    ok = true;
+
+cleanup:
+    closure_destroy(&closure);
+    regcode_destroy(&regcode);
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+
+    return ok;
+}
+
+static double bench_compact_ast_eval(const struct CompactAst *compact) {
+    long *values = malloc(sizeof(long) * compact->nodes_used);
+    size_t iterations = 0;
+
+    if (values == NULL) {
+        return 0;
+    }
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t count = 0; count < 1000; ++ count) {
+            bench_sink += compact_ast_eval(compact, bench_arg_values, values);
+        }
+        iterations += 1000;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    free(values);
+
+    return (double)iterations / elapsed;
+}
+
+enum BenchParseMode {
+    BENCH_PARSE_SLICE,
+    BENCH_PARSE_LEX,
+    BENCH_PARSE_TOKENS,
+    BENCH_PARSE_STREAM,
+};
+
+// like reads from a pipe
+#define BENCH_STREAM_CHUNK_SIZE 4096
+
+// Returns code bytes per second, or 0 on error.
+static double bench_parse(const struct BenchExpr *expr, const struct ArgSchema *schema, struct TokenStream *tokens,
+        enum BenchParseMode mode) {
+    const size_t code_size = strlen(expr->code);
+    size_t iterations = 0;
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        if (mode == BENCH_PARSE_LEX) {
+            if (!tokenize_slice(tokens, expr->code, code_size)) {
+                fprintf(stderr, "%s: tokenizing failed: %s\n", expr->name, get_parser_error_message(tokens->error));
+                return 0;
+            }
+            bench_sink += (long)tokens->tokens_used;
+        } else {
+            struct Parser parser = PARSER_INIT;
+
+            if (mode == BENCH_PARSE_STREAM) {
+                parser = parse_stream(schema, &PARSER_OPTIONS_INIT);
+                for (size_t index = 0; index < code_size; index += BENCH_STREAM_CHUNK_SIZE) {
+                    const size_t chunk_size = code_size - index < BENCH_STREAM_CHUNK_SIZE ? code_size - index : BENCH_STREAM_CHUNK_SIZE;
+                    if (!parser_feed(&parser, expr->code + index, chunk_size)) {
+                        break;
+                    }
+                }
+                parser_finish(&parser);
+            } else if (mode == BENCH_PARSE_SLICE) {
+                parser = parse_slice_with_schema(expr->code, code_size, schema);
+            } else {
+                parser = parse_tokens(tokens, expr->code, code_size, schema);
+            }
+
+            if (parser.error != ERROR_NONE) {
+                parser_print_error(&parser, stderr);
+                parser_destroy(&parser);
+                return 0;
+            }
+            bench_sink += (long)parser.ast.nodes_used;
+            parser_destroy(&parser);
+        }
+
+        ++ iterations;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    return (double)code_size * (double)iterations / elapsed;
+}
+
+static bool bench_parse_expr(const struct BenchExpr *expr) {
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct TokenStream tokens = TOKEN_STREAM_INIT;
+    bool ok = false;
+
+    if (!arg_schema_init(&schema, bench_arg_names, BENCH_ARGC)) {
+        fprintf(stderr, "%s: argument schema failed: %s\n", expr->name, get_parser_error_message(schema.error));
+        goto cleanup;
+    }
+
+    // lexing runs before parsing tokens, so the stream is filled
+    const double slice_rate  = bench_parse(expr, &schema, &tokens, BENCH_PARSE_SLICE);
+    const double lex_rate    = bench_parse(expr, &schema, &tokens, BENCH_PARSE_LEX);
+    const double tokens_rate = lex_rate == 0 ? 0 : bench_parse(expr, &schema, &tokens, BENCH_PARSE_TOKENS);
+    const double stream_rate = bench_parse(expr, &schema, &tokens, BENCH_PARSE_STREAM);
+
+    if (slice_rate == 0 || lex_rate == 0 || tokens_rate == 0 || stream_rate == 0) {
+        goto cleanup;
+    }
+
+    printf("%-12s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        expr->name,
+        strlen(expr->code),
+        slice_rate / 1e6,
+        lex_rate / 1e6,
+        tokens_rate / 1e6,
+        1 / (1 / lex_rate + 1 / tokens_rate) / 1e6,
+        stream_rate / 1e6);
+
+    ok = true;
+
+cleanup:
+    arg_schema_destroy(&schema);
+    token_stream_destroy(&tokens);
+
+    return ok;
+}
+
+// Microseconds per run of a pass on a fresh copy of the parsed AST, on struct
+// Ast or on the compact layout.
+enum BenchPass {
+    BENCH_PASS_CSE,
+    BENCH_PASS_COMPACT_FOLD,
+    BENCH_PASS_COMPACT_CSE,
+};
+
+static double bench_pass(const struct Ast *parsed, enum BenchPass pass, size_t *removed) {
+    size_t iterations = 0;
+    double pass_seconds = 0;
+
+    const double start = bench_now();
+
+    do {
+        struct Ast ast = AST_INIT;
+        struct CompactAst compact = COMPACT_AST_INIT;
+
+        if (!ast_copy(&ast, parsed) ||
+            (pass != BENCH_PASS_CSE && !compact_ast_init(&compact, &ast, false))) {
+            ast_destroy(&ast);
+            return 0;
+        }
+
+        const double pass_start = bench_now();
+        bool ok;
+        switch (pass) {
+            case BENCH_PASS_CSE:          ok = optimize_cse(&ast, removed); break;
+            case BENCH_PASS_COMPACT_FOLD: ok = compact_ast_optimize(&compact, removed); break;
+            default:                      ok = compact_ast_cse(&compact, removed); break;
+        }
+        pass_seconds += bench_now() - pass_start;
+
+        compact_ast_destroy(&compact);
+        ast_destroy(&ast);
+
+        if (!ok) {
+            return 0;
+        }
+
+        ++ iterations;
+    } while (bench_now() - start < BENCH_MIN_SECONDS);
+
+    return pass_seconds * 1e6 / (double)iterations;
+}
+
+static bool bench_pass_expr(const struct BenchExpr *expr) {
+    struct Parser parser = parse_string(expr->code, bench_arg_names, BENCH_ARGC);
+    bool ok = false;
+
+    if (parser.error != ERROR_NONE) {
+        parser_print_error(&parser, stderr);
+        goto cleanup;
+    }
+
+    size_t eliminated = 0;
+    size_t compact_eliminated = 0;
+    size_t folded = 0;
+    const double cse_us = bench_pass(&parser.ast, BENCH_PASS_CSE, &eliminated);
+    const double compact_cse_us = bench_pass(&parser.ast, BENCH_PASS_COMPACT_CSE, &compact_eliminated);
+    const double fold_us = bench_pass(&parser.ast, BENCH_PASS_COMPACT_FOLD, &folded);
+
+    if (cse_us == 0 || compact_cse_us == 0 || fold_us == 0) {
+        fprintf(stderr, "%s: optimization pass failed\n", expr->name);
+        goto cleanup;
+    }
+
+    printf("%-12s %7zu %10.2f %10zu %10.2f %10zu %10.2f %10zu\n",
+        expr->name,
+        parser.ast.nodes_used,
+        cse_us,
+        eliminated,
+        compact_cse_us,
+        compact_eliminated,
+        fold_us,
+        folded);
+
+    ok = true;
+
+cleanup:
+    parser_destroy(&parser);
+
+    return ok;
+}
+
+// Times optimize() on opaque chains of doubling length. The time per node
+// should stay flat; growing with the length means a pass went super-linear.
+static bool bench_optimize_chains() {
+    double prev_seconds = 0;
+
+    for (size_t term_count = 8192; term_count <= 65536; term_count *= 2) {
+        char *code = bench_generate_chain(term_count);
+        if (code == NULL) {
+            perror("generating expression");
+            return false;
+        }
+
+        struct Parser parser = parse_string(code, bench_arg_names, BENCH_ARGC);
+        free(code);
+
+        if (parser.error != ERROR_NONE) {
+            parser_print_error(&parser, stderr);
+            parser_destroy(&parser);
+            return false;
+        }
+
+        const size_t node_count = parser.ast.nodes_used;
+        const double start = bench_now();
+        optimize(&parser.ast);
+        const double seconds = bench_now() - start;
+
+        bench_sink += ast_eval(&parser.ast, bench_arg_values);
+        parser_destroy(&parser);
+
+        char name[32];
+        snprintf(name, sizeof(name), "chain%zuk", term_count / 1024);
+
+        printf("%-12s %10zu %10.2f %10.1f %10.2f\n",
+            name,
+            node_count,
+            seconds * 1e3,
+            seconds * 1e9 / (double)node_count,
+            prev_seconds == 0 ? 0 : seconds / prev_seconds);
+
+        prev_seconds = seconds;
+    }
+
+    return true;
+}
+
+// Counts allocator calls, delegating to malloc().
+struct BenchAllocCounter {
+    size_t allocs;
+    size_t reallocs;
+};
+
+static void *bench_count_alloc(void *ctx, size_t size) {
+    struct BenchAllocCounter *counter = ctx;
+    ++ counter->allocs;
+    return malloc(size);
+}
+
+static void *bench_count_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    struct BenchAllocCounter *counter = ctx;
+    (void)old_size;
+    if (ptr == NULL) {
+        ++ counter->allocs;
+    } else {
+        ++ counter->reallocs;
+    }
+    return realloc(ptr, new_size);
+}
+
+static void bench_count_free(void *ctx, void *ptr) {
+    (void)ctx;
+    free(ptr);
+}
+
+static bool bench_alloc_expr(const struct BenchExpr *expr, const struct ArgSchema *schema) {
+    struct BenchAllocCounter parse_counter   = { .allocs = 0, .reallocs = 0 };
+    struct BenchAllocCounter compile_counter = { .allocs = 0, .reallocs = 0 };
+    const struct Allocator parse_allocator = {
+        .alloc   = bench_count_alloc,
+        .realloc = bench_count_realloc,
+        .free    = bench_count_free,
+        .ctx     = &parse_counter,
+    };
+    struct Allocator compile_allocator = parse_allocator;
+    compile_allocator.ctx = &compile_counter;
+
+    struct ParserOptions options = PARSER_OPTIONS_INIT;
+    struct Bytecode bytecode = { .bytes = BUFFER_INIT, .stack_size = 0 };
+    bool ok = false;
+
+    options.allocator = &parse_allocator;
+    struct Parser parser = parse_slice_with_options(expr->code, strlen(expr->code), schema, &options);
+
+    if (parser.error != ERROR_NONE) {
+        parser_print_error(&parser, stderr);
+        goto cleanup;
+    }
+
+    // the passes allocate their temporaries from the allocator of the AST
+    const struct BenchAllocCounter parsed = parse_counter;
+    size_t eliminated = 0;
+    optimize(&parser.ast);
+    if (!optimize_cse(&parser.ast, &eliminated)) {
+        fprintf(stderr, "%s: common subexpression elimination failed\n", expr->name);
+        goto cleanup;
+    }
+
+    bytecode = bytecode_compile_with_allocator(&parser.ast, &compile_allocator);
+    if (bytecode.stack_size == 0) {
+        fprintf(stderr, "%s: compiling bytecode failed\n", expr->name);
+        goto cleanup;
+    }
+
+    printf("%-12s %10zu %10zu %10zu %10zu %10zu %10zu %10zu\n",
+        expr->name,
+        strlen(expr->code),
+        parsed.allocs,
+        parsed.reallocs,
+        parse_counter.allocs - parsed.allocs,
+        parse_counter.reallocs - parsed.reallocs,
+        compile_counter.allocs,
+        compile_counter.reallocs);
+
+    ok = true;
+
+cleanup:
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+
+    return ok;
+}
+
+static bool bench_memory_expr(const struct BenchExpr *expr) {
+    struct Parser parser = parse_string(expr->code, bench_arg_names, BENCH_ARGC);
+    struct CompactAst compact = COMPACT_AST_INIT;
+    bool ok = false;
+
+    if (parser.error != ERROR_NONE) {
+        parser_print_error(&parser, stderr);
+        goto cleanup;
+    }
+
+    optimize(&parser.ast);
+
+    if (!compact_ast_init(&compact, &parser.ast, false)) {
+        fprintf(stderr, "%s: compact AST conversion failed\n", expr->name);
+        goto cleanup;
+    }
+
+    const size_t ast_size = parser.ast.nodes_used * sizeof(struct AstNode);
+    const size_t compact_size = compact_ast_memory_size(&compact);
+
+    printf("%-12s %7zu %10zu %10zu %8.2f %12.0f %12.0f\n",
+        expr->name,
+        compact.nodes_used,
+        ast_size,
+        compact_size,
+        (double)ast_size / (double)compact_size,
+        bench_ast_eval_linear(&parser.ast),
+        bench_compact_ast_eval(&compact));
+
+    ok = true;
+
+cleanup:
+    compact_ast_destroy(&compact);
+    parser_destroy(&parser);
+
+    return ok;
+}
+
+// rows per second evaluating one row at a time
+static double bench_rows_scalar_loop(const struct Bytecode *bytecode, const long *const columns[], long results[]) {
+    struct VmContext ctx = VM_CONTEXT_INIT;
+    size_t iterations = 0;
+    long args[BENCH_ARGC];
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        for (size_t row = 0; row < BENCH_ROWS; ++ row) {
+            for (size_t arg_index = 0; arg_index < BENCH_ARGC; ++ arg_index) {
+                args[arg_index] = columns[arg_index][row];
+            }
+            if (!bytecode_eval_ctx(&ctx, bytecode->bytes.data, args, &results[row])) {
+                vm_context_destroy(&ctx);
+                return 0;
+            }
+        }
+        iterations += BENCH_ROWS;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    vm_context_destroy(&ctx);
+
+    return (double)iterations / elapsed;
+}
+
+static double bench_rows_batch(const struct Bytecode *bytecode, const long *const columns[], long results[], enum BatchIsa isa) {
+    struct VmContext ctx = VM_CONTEXT_INIT;
+    size_t iterations = 0;
+
+    const double start = bench_now();
+    double elapsed;
+
+    do {
+        if (!bytecode_eval_batch_isa(&ctx, bytecode->bytes.data, columns, results, BENCH_ROWS, isa)) {
+            vm_context_destroy(&ctx);
+            return 0;
+        }
+        iterations += BENCH_ROWS;
+        elapsed = bench_now() - start;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    vm_context_destroy(&ctx);
+
+    return (double)iterations / elapsed;
+}
+
+static bool bench_batch_expr(const struct BenchExpr *expr, const long *const columns[], long results[]) {
+    struct Parser parser = parse_string(expr->code, bench_arg_names, BENCH_ARGC);
+    struct Bytecode bytecode = BYTECODE_INIT;
+    bool ok = false;
+
+    if (parser.error != ERROR_NONE) {
+        parser_print_error(&parser, stderr);
+        goto cleanup;
+    }
+
+    optimize(&parser.ast);
+
+    size_t eliminated = 0;
+    if (!optimize_cse(&parser.ast, &eliminated)) {
+        perror("eliminating common subexpressions");
+        goto cleanup;
+    }
+
+    // 64 bit multiplication is especially expensive with SIMD
+    size_t lowered = 0;
+    if (!optimize_strength(&parser.ast, get_strength_costs(STRENGTH_TARGET_BATCH), &lowered)) {
+        perror("reducing strength");
+        goto cleanup;
+    }
+
+    bytecode = bytecode_compile(&parser.ast);
+    if (bytecode.stack_size == 0) {
+        fprintf(stderr, "%s: bytecode compilation failed\n", expr->name);
+        goto cleanup;
+    }
+
+    printf("%-12s %12.0f", expr->name, bench_rows_scalar_loop(&bytecode, columns, results));
+
+    for (enum BatchIsa isa = BATCH_ISA_SCALAR; isa <= batch_detect_isa(); ++ isa) {
+        printf(" %12.0f", bench_rows_batch(&bytecode, columns, results, isa));
+    }
+    putchar('\n');
+
+    ok = true;
+
+cleanup:
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+
+    return ok;
+}
+
+int main() {
+    struct BenchExpr exprs[] = {
+        { .name = "linear",     .code = "a + 3*b - c*4 + d - 5*e + f*g - h + 100" },
+        { .name = "poly",       .code = "a*a*a + 3*a*a*b - 2*a*b*b + b*b*b - 7" },
+        { .name = "div",        .code = "(a*b + c) / 7 + (d - e*f) / g + h / 3" },
+        { .name = "terms",      .code = "a + 3*a - 2*a + b*a - a*b + 5*(c + d) - 5*c - 4*d + e*f*2 - f*e + g - (g - h)" },
+        { .name = "consts",     .code = "a*8 + b*9 - c*15 + d*40 - e*1024 + (f + g)*17 - h*3 + (a - h)*65" },
+        { .name = "divconst",   .code = "a/7 + b/-3 - c/10 + d/641 - (e + f)/1000 + g/16 - h/3 + (a - b)/-100" },
+        { .name = "shared",     .code = "(a*b + 3) * (a*b + 3) - (c - d) / (b*a + 3) + (c - d) * e * (3 + a*b)" },
+        { .name = "random10",   .code = bench_generate_code(10, 1),   .generated = true },
+        { .name = "random100",  .code = bench_generate_code(100, 2),  .generated = true },
+        { .name = "random1000", .code = bench_generate_code(1000, 3), .generated = true },
+    };
+    // not used for the eval and batch tables, too slow for those
+    struct BenchExpr big_expr = { .name = "random200k", .code = bench_generate_code(200000, 4), .generated = true };
+    const size_t expr_count = sizeof(exprs) / sizeof(exprs[0]);
+    int status = 0;
+
+    printf("%-12s %7s %5s %5s %9s %8s %12s %12s %9s %12s %10s %12s %12s\n",
+        "expression", "nodes", "cse", "sr", "bytecode", "B/node", "ast eval/s", "linear/s",
+        "vm instrs", "vm eval/s", "reg instrs", "reg eval/s", "closure/s");
+
+    for (size_t index = 0; index < expr_count; ++ index) {
+        if (exprs[index].code == NULL) {
+            perror("generating expression");
+            status = 1;
+            continue;
+        }
+
+        if (!bench_expr(&exprs[index])) {
+            status = 1;
+        }
+    }
+
+    long *batch_data = malloc(sizeof(long) * BENCH_ROWS * (BENCH_ARGC + 1));
+    if (batch_data == NULL) {
+        perror("allocating batch data");
+        status = 1;
+    } else {
+        const long *columns[BENCH_ARGC];
+        long *results = batch_data + BENCH_ROWS * BENCH_ARGC;
+        unsigned long state = 4;
+
+        // strictly positive so divisions can't fail
+        for (size_t index = 0; index < BENCH_ROWS * BENCH_ARGC; ++ index) {
+            batch_data[index] = (long)(bench_random(&state) % 1000) + 1;
+        }
+
+        for (size_t arg_index = 0; arg_index < BENCH_ARGC; ++ arg_index) {
+            columns[arg_index] = batch_data + BENCH_ROWS * arg_index;
+        }
+
+        printf("\n%-12s %12s", "rows/s", "scalar loop");
+        for (enum BatchIsa isa = BATCH_ISA_SCALAR; isa <= batch_detect_isa(); ++ isa) {
+            printf(" %12s", get_batch_isa_name(isa));
+        }
+        putchar('\n');
+
+        for (size_t index = 0; index < expr_count; ++ index) {
+            if (exprs[index].code != NULL && !bench_batch_expr(&exprs[index], columns, results)) {
+                status = 1;
+            }
+        }
+
+        free(batch_data);
+    }
+
+    printf("\n%-12s %7s %10s %10s %8s %12s %12s\n",
+        "memory", "nodes", "ast B", "compact B", "ratio", "linear/s", "compact/s");
+
+    for (size_t index = 0; index <= expr_count; ++ index) {
+        const struct BenchExpr *expr = index < expr_count ? &exprs[index] : &big_expr;
+
+        if (expr->code == NULL) {
+            perror("generating expression");
+            status = 1;
+        } else if (!bench_memory_expr(expr)) {
+            status = 1;
+        }
+    }
+
+    printf("\n%-12s %10s %10s %10s %10s %10s %10s\n",
+        "parse MB/s", "bytes", "slice", "lex", "tokens", "two-phase", "stream");
+
+    for (size_t index = 0; index <= expr_count; ++ index) {
+        const struct BenchExpr *expr = index < expr_count ? &exprs[index] : &big_expr;
+
+        if (expr->code != NULL && !bench_parse_expr(expr)) {
+            status = 1;
+        }
+    }
+
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    if (!arg_schema_init(&schema, bench_arg_names, BENCH_ARGC)) {
+        fprintf(stderr, "argument schema failed: %s\n", get_parser_error_message(schema.error));
+        status = 1;
+    } else {
+        printf("\n%-12s %10s %10s %10s %10s %10s %10s %10s\n",
+            "allocations", "bytes", "parse", "realloc", "optimize", "realloc", "compile", "realloc");
+
+        for (size_t index = 0; index <= expr_count; ++ index) {
+            const struct BenchExpr *expr = index < expr_count ? &exprs[index] : &big_expr;
+
+            if (expr->code != NULL && !bench_alloc_expr(expr, &schema)) {
+                status = 1;
+            }
+        }
+    }
+    arg_schema_destroy(&schema);
+
+    printf("\n%-12s %7s %10s %10s %10s %10s %10s %10s\n",
+        "pass us", "nodes", "cse", "removed", "compact", "removed", "fold", "removed");
+
+    for (size_t index = 0; index <= expr_count; ++ index) {
+        const struct BenchExpr *expr = index < expr_count ? &exprs[index] : &big_expr;
+
+        if (expr->code != NULL && !bench_pass_expr(expr)) {
+            status = 1;
+        }
+    }
+
+    printf("\n%-12s %10s %10s %10s %10s\n", "optimize", "nodes", "ms", "ns/node", "x prev");
+
+    if (!bench_optimize_chains()) {
+        status = 1;
+    }
+
+    for (size_t index = 0; index < expr_count; ++ index) {
+        if (exprs[index].generated) {
+            free(exprs[index].code);
+        }
+    }
+    free(big_expr.code);
+
+    return status;
+}
@@ -6,15 +6,13 @@
 #include <string.h>
 #include <stdio.h>
 
+// first capacity if none was reserved, the capacity doubles from there
+#define BUFFER_MIN_CAPACITY 64
+
 struct Buffer buffer_create(size_t initial_capacity) {
-    struct Buffer buffer = { .data = NULL, .used = 0, .capacity = 0 };
+    struct Buffer buffer = BUFFER_INIT;
 
-    if (initial_capacity > 0) {
-        buffer.data = malloc(initial_capacity);
-        if (buffer.data) {
-            buffer.capacity = initial_capacity;
-        }
-    }
+    buffer_reserve(&buffer, initial_capacity);
 
     return buffer;
 }
@@ -23,6 +21,23 @@ void buffer_clear(struct Buffer *buffer) {
     buffer->used = 0;
 }
 
+bool buffer_reserve(struct Buffer *buffer, size_t capacity) {
+    if (capacity <= buffer->capacity) {
+        return true;
+    }
+
+    char *new_data = allocator_realloc(buffer->allocator, buffer->data, buffer->capacity, capacity);
+
+    if (new_data == NULL) {
+        return false;
+    }
+
+    buffer->data     = new_data;
+    buffer->capacity = capacity;
+
+    return true;
+}
+
 bool buffer_append(struct Buffer *buffer, const char *data, size_t size) {
     if (buffer->used > SIZE_MAX - size) {
         errno = ENOMEM;
@@ -34,18 +49,17 @@ bool buffer_append(struct Buffer *buffer, const char *data, size_t size) {
             errno = ENOMEM;
             return false;
         }
-        const size_t new_capacity = buffer->capacity == 0 ?
-            BUFSIZ :
+        size_t new_capacity = buffer->capacity < BUFFER_MIN_CAPACITY / 2 ?
+            BUFFER_MIN_CAPACITY :
             buffer->capacity * 2;
 
-        char *new_data = realloc(buffer->data, new_capacity);
+        if (new_capacity < buffer->used + size) {
+            new_capacity = buffer->used + size;
+        }
 
-        if (new_data == NULL) {
+        if (!buffer_reserve(buffer, new_capacity)) {
             return false;
         }
-
-        buffer->data     = new_data;
-        buffer->capacity = new_capacity;
     }
 
     memcpy(buffer->data + buffer->used, data, size);
@@ -60,7 +74,7 @@ bool buffer_append_byte(struct Buffer *buffer, char byte) {
 }
 
 void buffer_destroy(struct Buffer *buffer) {
-    free(buffer->data);
+    allocator_free(buffer->allocator, buffer->data);
 
     buffer->data = NULL;
     buffer->capacity = 0;
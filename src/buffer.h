@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#include "allocator.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,12 +15,17 @@ struct Buffer {
     char *data;
     size_t used;
     size_t capacity;
+    // NULL for malloc(), kept by buffer_destroy()
+    const struct Allocator *allocator;
 };
 
-#define BUFFER_INIT (struct Buffer){ .data = NULL, .used = 0, .capacity = 0 }
+#define BUFFER_INIT (struct Buffer){ .data = NULL, .used = 0, .capacity = 0, .allocator = NULL }
 
 struct Buffer buffer_create(size_t initial_capacity);
 void buffer_clear(struct Buffer *buffer);
+// Makes room for at least capacity bytes in total. Returns false if out of
+// memory.
+bool buffer_reserve(struct Buffer *buffer, size_t capacity);
 bool buffer_append(struct Buffer *buffer, const char *data, size_t size);
 bool buffer_append_byte(struct Buffer *buffer, char byte);
 void buffer_destroy(struct Buffer *buffer);
@@ -5,27 +5,126 @@
 #include <assert.h>
 #include <limits.h>
 
-// This bytecode is endian dependant!
-bool bytecode_write_int(struct Buffer *buffer, long value) {
+static bool bytecode_write_code(struct Buffer *buffer, enum ByteCode code) {
+    return buffer_append_byte(buffer, (char)code);
+}
+
+static bool bytecode_write_size(struct Buffer *buffer, size_t value) {
     return buffer_append(buffer, (const char*)&value, sizeof(value));
 }
 
-bool bytecode_write_size(struct Buffer *buffer, size_t value) {
+static bool bytecode_write_val(struct Buffer *buffer, long value) {
+    if (value >= INT8_MIN && value <= INT8_MAX) {
+        const int8_t narrow = (int8_t)value;
+        return bytecode_write_code(buffer, CODE_VAL8) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+    } else if (value >= INT16_MIN && value <= INT16_MAX) {
+        const int16_t narrow = (int16_t)value;
+        return bytecode_write_code(buffer, CODE_VAL16) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+    } else if (value >= INT32_MIN && value <= INT32_MAX) {
+        const int32_t narrow = (int32_t)value;
+        return bytecode_write_code(buffer, CODE_VAL32) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+    } else {
+        const int64_t wide = (int64_t)value;
+        return bytecode_write_code(buffer, CODE_VAL64) && buffer_append(buffer, (const char*)&wide, sizeof(wide));
+    }
+}
+
+static bool bytecode_write_var(struct Buffer *buffer, size_t arg_index) {
+    if (arg_index <= UINT8_MAX) {
+        const uint8_t narrow = (uint8_t)arg_index;
+        return bytecode_write_code(buffer, CODE_VAR8) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+    } else if (arg_index <= UINT16_MAX) {
+        const uint16_t narrow = (uint16_t)arg_index;
+        return bytecode_write_code(buffer, CODE_VAR16) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+    } else if (arg_index <= UINT32_MAX) {
+        const uint32_t narrow = (uint32_t)arg_index;
+        return bytecode_write_code(buffer, CODE_VAR32) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+    } else {
+        const uint64_t wide = (uint64_t)arg_index;
+        return bytecode_write_code(buffer, CODE_VAR64) && buffer_append(buffer, (const char*)&wide, sizeof(wide));
+    }
+}
+
+static bool is_fusable_var(const struct AstNode *node) {
+    return node->type == NODE_VAR && node->arg_index <= UINT16_MAX;
+}
+
+static bool is_fusable_val(const struct AstNode *node) {
+    return node->type == NODE_INT && node->value >= INT32_MIN && node->value <= INT32_MAX;
+}
+
+static bool bytecode_write_fused_var(struct Buffer *buffer, const struct AstNode *node) {
+    const uint16_t arg_index = (uint16_t)node->arg_index;
+    return buffer_append(buffer, (const char*)&arg_index, sizeof(arg_index));
+}
+
+static bool bytecode_write_fused_val(struct Buffer *buffer, const struct AstNode *node) {
+    const int32_t value = (int32_t)node->value;
     return buffer_append(buffer, (const char*)&value, sizeof(value));
 }
 
-enum ByteCode {
-    CODE_ADD,
-    CODE_SUB,
-    CODE_MUL,
-    CODE_DIV,
-    CODE_INV,
-    CODE_VAL,
-    CODE_VAR,
-    CODE_RET,
+static bool is_shift_count(const struct AstNode *node) {
+    return node->type == NODE_INT && node->value >= 0 && node->value <= 63;
+}
+
+static bool bytecode_write_shift(struct Buffer *buffer, enum ByteCode code, long count) {
+    const uint8_t narrow = (uint8_t)count;
+    return bytecode_write_code(buffer, code) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+}
+
+static bool bytecode_write_mulhi(struct Buffer *buffer, long factor) {
+    const int64_t wide = factor;
+    return bytecode_write_code(buffer, CODE_MULHI) && buffer_append(buffer, (const char*)&wide, sizeof(wide));
+}
+
+// Local slots of shared nodes. slots[node index] is SIZE_MAX until the node
+// was computed the first time.
+struct LocalSlots {
+    const size_t *uses;
+    size_t *slots;
+    size_t slots_used;
 };
 
-bool node_compile(struct Bytecode *bytecode, const struct Ast *ast, size_t node_index, size_t stack_size) {
+static bool node_compile(struct Bytecode *bytecode, const struct Ast *ast, struct LocalSlots *locals, size_t node_index, size_t stack_size);
+
+static bool is_leaf(const struct AstNode *node) {
+    return node->type == NODE_INT || node->type == NODE_VAR;
+}
+
+static bool is_shared(const struct Ast *ast, const struct LocalSlots *locals, size_t node_index) {
+    if (locals->uses[node_index] < 2) {
+        return false;
+    }
+
+    // Nodes with only leaf children are about as cheap to compute again as to
+    // LOAD, and sharing them would cost an additional STORE.
+    const struct AstNode *node = &ast->nodes[node_index];
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+            return !is_leaf(&ast->nodes[node->binary.left_index]) || !is_leaf(&ast->nodes[node->binary.right_index]);
+
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+            return !is_leaf(&ast->nodes[node->binary.left_index]);
+
+        case NODE_INV:
+            return !is_leaf(&ast->nodes[node->child_index]);
+
+        default:
+            return false;
+    }
+}
+
+static bool bytecode_write_slot(struct Buffer *buffer, enum ByteCode code, size_t slot) {
+    const uint32_t narrow = (uint32_t)slot;
+    return bytecode_write_code(buffer, code) && buffer_append(buffer, (const char*)&narrow, sizeof(narrow));
+}
+
+static bool node_compile_value(struct Bytecode *bytecode, const struct Ast *ast, struct LocalSlots *locals, size_t node_index, size_t stack_size) {
     assert(node_index < ast->nodes_used);
 
     const struct AstNode *node = &ast->nodes[node_index];
@@ -33,76 +132,123 @@ bool node_compile(struct Bytecode *bytecode, const struct Ast *ast, size_t node_
 
     switch (node->type) {
         case NODE_ADD:
-            if (!node_compile(bytecode, ast, node->binary.left_index, stack_size)) {
-                return false;
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        {
+            const struct AstNode *left  = &ast->nodes[node->binary.left_index];
+            const struct AstNode *right = &ast->nodes[node->binary.right_index];
+            const bool commutative = node->type == NODE_ADD || node->type == NODE_MUL;
+            enum ByteCode code;
+
+            switch (node->type) {
+                case NODE_ADD: code = CODE_ADD; break;
+                case NODE_SUB: code = CODE_SUB; break;
+                case NODE_MUL: code = CODE_MUL; break;
+                default:       code = CODE_DIV; break;
             }
-            if (!node_compile(bytecode, ast, node->binary.right_index, result_stack_size)) {
-                return false;
+
+            if (is_fusable_var(left) && is_fusable_var(right)) {
+                // VAR x; VAR y; <OP> -> VAR_VAR_<OP> x y
+                if (!bytecode_write_code(&bytecode->bytes, CODE_VAR_VAR_ADD + code) ||
+                    !bytecode_write_fused_var(&bytecode->bytes, left) ||
+                    !bytecode_write_fused_var(&bytecode->bytes, right)) {
+                    return false;
+                }
+                break;
             }
-            if (!bytecode_write_int(&bytecode->bytes, CODE_ADD)) {
-                return false;
+
+            // Evaluation has no side effects, so the operands of commutative
+            // operations may be swapped to get a fusable right hand side.
+            size_t other_index = node->binary.left_index;
+            const struct AstNode *leaf = right;
+
+            if (commutative && !is_fusable_var(right) && !is_fusable_val(right) &&
+                (is_fusable_var(left) || is_fusable_val(left))) {
+                other_index = node->binary.right_index;
+                leaf = left;
             }
-            break;
 
-        case NODE_SUB:
-            if (!node_compile(bytecode, ast, node->binary.left_index, stack_size)) {
+            if (is_fusable_var(leaf)) {
+                // <X>; VAR y; <OP> -> <X>; <OP>_VAR y
+                if (!node_compile(bytecode, ast, locals, other_index, stack_size) ||
+                    !bytecode_write_code(&bytecode->bytes, CODE_ADD_VAR + code) ||
+                    !bytecode_write_fused_var(&bytecode->bytes, leaf)) {
+                    return false;
+                }
+                break;
+            }
+
+            if (is_fusable_val(leaf)) {
+                // <X>; VAL 3; <OP> -> <X>; <OP>_VAL 3
+                if (!node_compile(bytecode, ast, locals, other_index, stack_size) ||
+                    !bytecode_write_code(&bytecode->bytes, CODE_ADD_VAL + code) ||
+                    !bytecode_write_fused_val(&bytecode->bytes, leaf)) {
+                    return false;
+                }
+                break;
+            }
+
+            if (!node_compile(bytecode, ast, locals, node->binary.left_index, stack_size)) {
                 return false;
             }
-            if (!node_compile(bytecode, ast, node->binary.right_index, result_stack_size)) {
+            if (!node_compile(bytecode, ast, locals, node->binary.right_index, result_stack_size)) {
                 return false;
             }
-            if (!bytecode_write_int(&bytecode->bytes, CODE_SUB)) {
+            if (!bytecode_write_code(&bytecode->bytes, code)) {
                 return false;
             }
             break;
+        }
 
-        case NODE_MUL:
-            if (!node_compile(bytecode, ast, node->binary.left_index, stack_size)) {
+        case NODE_SHL:
+        case NODE_SAR:
+        {
+            const struct AstNode *count = &ast->nodes[node->binary.right_index];
+            if (!is_shift_count(count)) {
                 return false;
             }
-            if (!node_compile(bytecode, ast, node->binary.right_index, result_stack_size)) {
+            if (!node_compile(bytecode, ast, locals, node->binary.left_index, stack_size)) {
                 return false;
             }
-            if (!bytecode_write_int(&bytecode->bytes, CODE_MUL)) {
+            if (!bytecode_write_shift(&bytecode->bytes, node->type == NODE_SHL ? CODE_SHL : CODE_SAR, count->value)) {
                 return false;
             }
             break;
+        }
 
-        case NODE_DIV:
-            if (!node_compile(bytecode, ast, node->binary.left_index, stack_size)) {
+        case NODE_MULHI:
+        {
+            const struct AstNode *factor = &ast->nodes[node->binary.right_index];
+            if (factor->type != NODE_INT) {
                 return false;
             }
-            if (!node_compile(bytecode, ast, node->binary.right_index, result_stack_size)) {
+            if (!node_compile(bytecode, ast, locals, node->binary.left_index, stack_size)) {
                 return false;
             }
-            if (!bytecode_write_int(&bytecode->bytes, CODE_DIV)) {
+            if (!bytecode_write_mulhi(&bytecode->bytes, factor->value)) {
                 return false;
             }
             break;
+        }
 
         case NODE_INV:
-            if (!node_compile(bytecode, ast, node->child_index, stack_size)) {
+            if (!node_compile(bytecode, ast, locals, node->child_index, stack_size)) {
                 return false;
             }
-            if (!bytecode_write_int(&bytecode->bytes, CODE_INV)) {
+            if (!bytecode_write_code(&bytecode->bytes, CODE_INV)) {
                 return false;
             }
             break;
 
         case NODE_INT:
-            if (!bytecode_write_int(&bytecode->bytes, CODE_VAL)) {
-                return false;
-            }
-            if (!bytecode_write_int(&bytecode->bytes, node->value)) {
+            if (!bytecode_write_val(&bytecode->bytes, node->value)) {
                 return false;
             }
             break;
 
         case NODE_VAR:
-            if (!bytecode_write_int(&bytecode->bytes, CODE_VAR)) {
-                return false;
-            }
-            if (!bytecode_write_size(&bytecode->bytes, node->arg_index)) {
+            if (!bytecode_write_var(&bytecode->bytes, node->arg_index)) {
                 return false;
             }
             break;
@@ -119,128 +265,714 @@ bool node_compile(struct Bytecode *bytecode, const struct Ast *ast, size_t node_
     return true;
 }
 
+static bool node_compile(struct Bytecode *bytecode, const struct Ast *ast, struct LocalSlots *locals, size_t node_index, size_t stack_size) {
+    if (!is_shared(ast, locals, node_index)) {
+        return node_compile_value(bytecode, ast, locals, node_index, stack_size);
+    }
+
+    size_t *slot = &locals->slots[node_index];
+
+    if (*slot != SIZE_MAX) {
+        if (!bytecode_write_slot(&bytecode->bytes, CODE_LOAD, *slot)) {
+            return false;
+        }
+
+        if (stack_size + 1 > bytecode->stack_size) {
+            bytecode->stack_size = stack_size + 1;
+        }
+
+        return true;
+    }
+
+    // first use computes the value, the others load it
+    if (!node_compile_value(bytecode, ast, locals, node_index, stack_size)) {
+        return false;
+    }
+
+    *slot = locals->slots_used;
+    ++ locals->slots_used;
+
+    return bytecode_write_slot(&bytecode->bytes, CODE_STORE, *slot);
+}
+
+// Upper bound of the size of the bytecode of a tree: every node takes at most
+// an opcode and an 8 byte operand, fused nodes less. Only the LOADs of shared
+// nodes can exceed this, then the buffer grows.
+static size_t bytecode_estimate_size(size_t nodes_used, size_t slot_count) {
+    const size_t node_size = 1 + sizeof(int64_t);
+    const size_t slot_size = 1 + sizeof(uint32_t);
+
+    if (nodes_used > (SIZE_MAX / 2 - slot_size * slot_count) / node_size) {
+        return 0;
+    }
+
+    // stack size, FRAME, STOREs and RET
+    return sizeof(size_t) + slot_size + node_size * nodes_used + slot_size * slot_count + 1;
+}
+
 struct Bytecode bytecode_compile(const struct Ast *ast) {
+    return bytecode_compile_with_allocator(ast, NULL);
+}
+
+struct Bytecode bytecode_compile_with_allocator(const struct Ast *ast, const struct Allocator *allocator) {
     struct Bytecode bytecode = { .bytes = BUFFER_INIT, .stack_size = 0 };
+    bytecode.bytes.allocator = allocator;
+    bytecode_compile_into(&bytecode, ast);
+    return bytecode;
+}
+
+bool bytecode_compile_into(struct Bytecode *bytecode, const struct Ast *ast) {
+    const struct Allocator *allocator = bytecode->bytes.allocator;
+    struct LocalSlots locals = { .uses = NULL, .slots = NULL, .slots_used = 0 };
+    bool ok = false;
+
+    buffer_clear(&bytecode->bytes);
+    bytecode->stack_size = 0;
+
+    size_t *uses  = allocator_alloc(allocator, sizeof(size_t) * ast->nodes_used);
+    size_t *slots = allocator_alloc(allocator, sizeof(size_t) * ast->nodes_used);
+
+    if (uses == NULL || slots == NULL || !ast_count_uses(ast, uses)) {
+        goto error;
+    }
+
+    locals.uses  = uses;
+    locals.slots = slots;
+
+    size_t slot_count = 0;
+    for (size_t index = 0; index < ast->nodes_used; ++ index) {
+        slots[index] = SIZE_MAX;
+        if (is_shared(ast, &locals, index)) {
+            ++ slot_count;
+        }
+    }
+
+    if (slot_count > UINT32_MAX) {
+        goto error;
+    }
+
+    if (!buffer_reserve(&bytecode->bytes, bytecode_estimate_size(ast->nodes_used, slot_count))) {
+        goto error;
+    }
 
     // stack size placeholder
-    if (!bytecode_write_size(&bytecode.bytes, 0)) {
+    if (!bytecode_write_size(&bytecode->bytes, 0)) {
+        goto error;
+    }
+
+    // the local slots are below the operands
+    if (slot_count > 0 && !bytecode_write_slot(&bytecode->bytes, CODE_FRAME, slot_count)) {
         goto error;
     }
 
     // generate bytecode
-    if (!node_compile(&bytecode, ast, AST_ROOT_NODE_INDEX(ast), 0)) {
+    if (!node_compile(bytecode, ast, &locals, AST_ROOT_NODE_INDEX(ast), slot_count)) {
         goto error;
     }
 
-    if (!bytecode_write_int(&bytecode.bytes, CODE_RET)) {
+    if (!bytecode_write_code(&bytecode->bytes, CODE_RET)) {
         goto error;
     }
 
     // fill in stack size
-    memcpy(bytecode.bytes.data, &bytecode.stack_size, sizeof(size_t));
+    memcpy(bytecode->bytes.data, &bytecode->stack_size, sizeof(size_t));
 
+    ok = true;
     goto end;
 
 error:
     // TODO: better error handling
-    bytecode.stack_size = 0;
+    bytecode->stack_size = 0;
 
 end:
+    allocator_free(allocator, slots);
+    allocator_free(allocator, uses);
 
-    return bytecode;
+    return ok;
 }
 
-long bytecode_eval(const void *bytecode, const long args[]) {
-    long *stack = malloc(sizeof(long) * *(const size_t*)bytecode);
-    if (stack == NULL) {
-        // TODO: better error handling
-        perror("allocating varialbe stack");
-        return LONG_MAX;
+static bool is_fusable_compact_var(const struct CompactAst *ast, uint32_t node_index) {
+    return ast->types[node_index] == COMPACT_VAR && ast->left[node_index] <= UINT16_MAX;
+}
+
+static bool is_fusable_compact_val(const struct CompactAst *ast, uint32_t node_index) {
+    if (ast->types[node_index] != COMPACT_INT) {
+        return false;
     }
+    const long value = ast->consts[ast->left[node_index]];
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// Same superinstruction selection as node_compile(). leaf is the index of the
+// fused operand (if any).
+static enum ByteCode compact_fusion(const struct CompactAst *ast, size_t node_index, uint32_t *leaf) {
+    const enum ByteCode code = (enum ByteCode)(CODE_ADD + ast->types[node_index] - COMPACT_ADD);
+    const uint32_t left  = ast->left[node_index];
+    const uint32_t right = ast->right[node_index];
+    const bool commutative = code == CODE_ADD || code == CODE_MUL;
+
+    if (is_fusable_compact_var(ast, left) && is_fusable_compact_var(ast, right)) {
+        return CODE_VAR_VAR_ADD + code;
+    }
+
+    *leaf = right;
+    if (commutative && !is_fusable_compact_var(ast, right) && !is_fusable_compact_val(ast, right) &&
+        (is_fusable_compact_var(ast, left) || is_fusable_compact_val(ast, left))) {
+        *leaf = left;
+    }
+
+    if (is_fusable_compact_var(ast, *leaf)) {
+        return CODE_ADD_VAR + code;
+    }
+
+    if (is_fusable_compact_val(ast, *leaf)) {
+        return CODE_ADD_VAL + code;
+    }
+
+    return code;
+}
+
+struct Bytecode bytecode_compile_compact(const struct CompactAst *ast) {
+    struct Bytecode bytecode = { .bytes = BUFFER_INIT, .stack_size = 0 };
+    // leaves that are emitted as operand of a superinstruction of their parent
+    bool *fused = NULL;
+    bool *referenced = NULL;
+    size_t stack_size = 0;
+
+    if (!buffer_reserve(&bytecode.bytes, bytecode_estimate_size(ast->nodes_used, 0)) ||
+        !bytecode_write_size(&bytecode.bytes, 0)) {
+        goto error;
+    }
+
+    if (ast->nodes_used == 0) {
+        // evaluates to 0, like compact_ast_eval()
+        if (!bytecode_write_val(&bytecode.bytes, 0)) {
+            goto error;
+        }
+        bytecode.stack_size = 1;
+    } else {
+        fused = calloc(ast->nodes_used, sizeof(bool));
+        referenced = calloc(ast->nodes_used, sizeof(bool));
+        if (fused == NULL || referenced == NULL) {
+            goto error;
+        }
+
+        // Shared nodes would have to be pushed again at their later uses,
+        // which don't have a place in the post-order.
+        for (size_t index = 0; index < ast->nodes_used; ++ index) {
+            const uint8_t type = ast->types[index];
+
+            if (type <= COMPACT_INV) {
+                if (referenced[ast->left[index]]) {
+                    goto error;
+                }
+                referenced[ast->left[index]] = true;
+            }
+
+            if (type <= COMPACT_SAR) {
+                if (referenced[ast->right[index]]) {
+                    goto error;
+                }
+                referenced[ast->right[index]] = true;
+            }
+        }
+
+        // The fusion of a node has to be known before its children are
+        // visited, but post-order visits children first. So mark them upfront.
+        for (size_t index = 0; index < ast->nodes_used; ++ index) {
+            if (ast->types[index] <= COMPACT_DIV) {
+                uint32_t leaf = 0;
+                const enum ByteCode code = compact_fusion(ast, index, &leaf);
+
+                if (code >= CODE_VAR_VAR_ADD) {
+                    fused[ast->left[index]]  = true;
+                    fused[ast->right[index]] = true;
+                } else if (code >= CODE_ADD_VAR) {
+                    fused[leaf] = true;
+                }
+            } else if (ast->types[index] <= COMPACT_SAR) {
+                // the shift count or factor is an immediate
+                fused[ast->right[index]] = true;
+            }
+        }
+
+        // Post-order is exactly the order of a stack machine, so the bytecode
+        // is emitted in one linear pass without recursion.
+        for (size_t index = 0; index < ast->nodes_used; ++ index) {
+            if (fused[index]) {
+                continue;
+            }
+
+            const uint32_t left = ast->left[index];
+
+            switch (ast->types[index]) {
+                case COMPACT_ADD:
+                case COMPACT_SUB:
+                case COMPACT_MUL:
+                case COMPACT_DIV:
+                {
+                    uint32_t leaf = 0;
+                    const enum ByteCode code = compact_fusion(ast, index, &leaf);
+
+                    if (!bytecode_write_code(&bytecode.bytes, code)) {
+                        goto error;
+                    }
+
+                    if (code >= CODE_VAR_VAR_ADD) {
+                        const uint16_t operands[2] = { (uint16_t)ast->left[left], (uint16_t)ast->left[ast->right[index]] };
+                        if (!buffer_append(&bytecode.bytes, (const char*)operands, sizeof(operands))) {
+                            goto error;
+                        }
+                        ++ stack_size;
+                    } else if (code >= CODE_ADD_VAL) {
+                        const int32_t value = (int32_t)ast->consts[ast->left[leaf]];
+                        if (!buffer_append(&bytecode.bytes, (const char*)&value, sizeof(value))) {
+                            goto error;
+                        }
+                    } else if (code >= CODE_ADD_VAR) {
+                        const uint16_t arg_index = (uint16_t)ast->left[leaf];
+                        if (!buffer_append(&bytecode.bytes, (const char*)&arg_index, sizeof(arg_index))) {
+                            goto error;
+                        }
+                    } else {
+                        -- stack_size;
+                    }
+                    break;
+                }
+
+                case COMPACT_SHL:
+                {
+                    const uint32_t count = ast->right[index];
+                    if (ast->types[count] != COMPACT_INT) {
+                        goto error;
+                    }
+                    const long value = ast->consts[ast->left[count]];
+                    if (value < 0 || value > 63 || !bytecode_write_shift(&bytecode.bytes, CODE_SHL, value)) {
+                        goto error;
+                    }
+                    break;
+                }
+
+                case COMPACT_SAR:
+                {
+                    const uint32_t count = ast->right[index];
+                    if (ast->types[count] != COMPACT_INT) {
+                        goto error;
+                    }
+                    const long value = ast->consts[ast->left[count]];
+                    if (value < 0 || value > 63 || !bytecode_write_shift(&bytecode.bytes, CODE_SAR, value)) {
+                        goto error;
+                    }
+                    break;
+                }
+
+                case COMPACT_MULHI:
+                {
+                    const uint32_t factor = ast->right[index];
+                    if (ast->types[factor] != COMPACT_INT ||
+                        !bytecode_write_mulhi(&bytecode.bytes, ast->consts[ast->left[factor]])) {
+                        goto error;
+                    }
+                    break;
+                }
+
+                case COMPACT_INV:
+                    if (!bytecode_write_code(&bytecode.bytes, CODE_INV)) {
+                        goto error;
+                    }
+                    break;
+
+                case COMPACT_INT:
+                    if (!bytecode_write_val(&bytecode.bytes, ast->consts[left])) {
+                        goto error;
+                    }
+                    ++ stack_size;
+                    break;
 
+                case COMPACT_VAR:
+                    if (!bytecode_write_var(&bytecode.bytes, left)) {
+                        goto error;
+                    }
+                    ++ stack_size;
+                    break;
+
+                default:
+                    assert(false);
+                    goto error;
+            }
+
+            if (stack_size > bytecode.stack_size) {
+                bytecode.stack_size = stack_size;
+            }
+        }
+    }
+
+    if (!bytecode_write_code(&bytecode.bytes, CODE_RET)) {
+        goto error;
+    }
+
+    memcpy(bytecode.bytes.data, &bytecode.stack_size, sizeof(size_t));
+
+    goto end;
+
+error:
+    bytecode.stack_size = 0;
+
+end:
+    free(fused);
+    free(referenced);
+
+    return bytecode;
+}
+
+static long bytecode_exec(const void *bytecode, const long args[], long *stack) {
     // non-standard address from label for faster interpreter loop
     // This feature is supported by GCC and LLVM.
     static const void *table[] = {
-        [CODE_ADD] = &&add,
-        [CODE_SUB] = &&sub,
-        [CODE_MUL] = &&mul,
-        [CODE_DIV] = &&div,
-        [CODE_INV] = &&inv,
-        [CODE_VAL] = &&val,
-        [CODE_VAR] = &&var,
-        [CODE_RET] = &&ret,
+        [CODE_ADD]   = &&add,
+        [CODE_SUB]   = &&sub,
+        [CODE_MUL]   = &&mul,
+        [CODE_DIV]   = &&div,
+        [CODE_INV]   = &&inv,
+        [CODE_SHL]   = &&shl,
+        [CODE_MULHI] = &&mulhi,
+        [CODE_SAR]   = &&sar,
+        [CODE_ADD_VAR] = &&add_var,
+        [CODE_SUB_VAR] = &&sub_var,
+        [CODE_MUL_VAR] = &&mul_var,
+        [CODE_DIV_VAR] = &&div_var,
+        [CODE_ADD_VAL] = &&add_val,
+        [CODE_SUB_VAL] = &&sub_val,
+        [CODE_MUL_VAL] = &&mul_val,
+        [CODE_DIV_VAL] = &&div_val,
+        [CODE_VAR_VAR_ADD] = &&var_var_add,
+        [CODE_VAR_VAR_SUB] = &&var_var_sub,
+        [CODE_VAR_VAR_MUL] = &&var_var_mul,
+        [CODE_VAR_VAR_DIV] = &&var_var_div,
+        [CODE_VAL8]  = &&val8,
+        [CODE_VAL16] = &&val16,
+        [CODE_VAL32] = &&val32,
+        [CODE_VAL64] = &&val64,
+        [CODE_VAR8]  = &&var8,
+        [CODE_VAR16] = &&var16,
+        [CODE_VAR32] = &&var32,
+        [CODE_VAR64] = &&var64,
+        [CODE_FRAME] = &&frame,
+        [CODE_LOAD]  = &&load,
+        [CODE_STORE] = &&store,
+        [CODE_RET]   = &&ret,
     };
 
-    const void *codeptr = bytecode + sizeof(size_t);
+    const uint8_t *codeptr = (const uint8_t*)bytecode + sizeof(size_t);
     long *stackptr = stack;
 
-    goto *table[*(const long*)codeptr];
+    goto *table[*codeptr];
 
 add:
     -- stackptr;
     stackptr[-1] += *stackptr;
-    codeptr += sizeof(long);
-    goto *table[*(const long*)codeptr];
+    ++ codeptr;
+    goto *table[*codeptr];
 
 sub:
     -- stackptr;
     stackptr[-1] -= *stackptr;
-    codeptr += sizeof(long);
-    goto *table[*(const long*)codeptr];
+    ++ codeptr;
+    goto *table[*codeptr];
 
 mul:
     -- stackptr;
     stackptr[-1] *= *stackptr;
-    codeptr += sizeof(long);
-    goto *table[*(const long*)codeptr];
+    ++ codeptr;
+    goto *table[*codeptr];
 
 div:
     -- stackptr;
     stackptr[-1] /= *stackptr;
-    codeptr += sizeof(long);
-    goto *table[*(const long*)codeptr];
+    ++ codeptr;
+    goto *table[*codeptr];
 
 inv:
     stackptr[-1] = -stackptr[-1];
-    codeptr += sizeof(long);
-    goto *table[*(const long*)codeptr];
+    ++ codeptr;
+    goto *table[*codeptr];
+
+shl:
+    stackptr[-1] = ast_shl(stackptr[-1], codeptr[1]);
+    codeptr += 1 + sizeof(uint8_t);
+    goto *table[*codeptr];
+
+mulhi:
+    stackptr[-1] = ast_mulhi(stackptr[-1], bytecode_read_int64(codeptr + 1));
+    codeptr += 1 + sizeof(int64_t);
+    goto *table[*codeptr];
+
+sar:
+    stackptr[-1] = ast_sar(stackptr[-1], codeptr[1]);
+    codeptr += 1 + sizeof(uint8_t);
+    goto *table[*codeptr];
+
+add_var:
+    stackptr[-1] += args[bytecode_read_uint16(codeptr + 1)];
+    codeptr += 1 + sizeof(uint16_t);
+    goto *table[*codeptr];
+
+sub_var:
+    stackptr[-1] -= args[bytecode_read_uint16(codeptr + 1)];
+    codeptr += 1 + sizeof(uint16_t);
+    goto *table[*codeptr];
+
+mul_var:
+    stackptr[-1] *= args[bytecode_read_uint16(codeptr + 1)];
+    codeptr += 1 + sizeof(uint16_t);
+    goto *table[*codeptr];
+
+div_var:
+    stackptr[-1] /= args[bytecode_read_uint16(codeptr + 1)];
+    codeptr += 1 + sizeof(uint16_t);
+    goto *table[*codeptr];
+
+add_val:
+    stackptr[-1] += bytecode_read_int32(codeptr + 1);
+    codeptr += 1 + sizeof(int32_t);
+    goto *table[*codeptr];
+
+sub_val:
+    stackptr[-1] -= bytecode_read_int32(codeptr + 1);
+    codeptr += 1 + sizeof(int32_t);
+    goto *table[*codeptr];
+
+mul_val:
+    stackptr[-1] *= bytecode_read_int32(codeptr + 1);
+    codeptr += 1 + sizeof(int32_t);
+    goto *table[*codeptr];
+
+div_val:
+    stackptr[-1] /= bytecode_read_int32(codeptr + 1);
+    codeptr += 1 + sizeof(int32_t);
+    goto *table[*codeptr];
+
+var_var_add:
+    *stackptr = args[bytecode_read_uint16(codeptr + 1)] + args[bytecode_read_uint16(codeptr + 3)];
+    ++ stackptr;
+    codeptr += 1 + 2 * sizeof(uint16_t);
+    goto *table[*codeptr];
+
+var_var_sub:
+    *stackptr = args[bytecode_read_uint16(codeptr + 1)] - args[bytecode_read_uint16(codeptr + 3)];
+    ++ stackptr;
+    codeptr += 1 + 2 * sizeof(uint16_t);
+    goto *table[*codeptr];
+
+var_var_mul:
+    *stackptr = args[bytecode_read_uint16(codeptr + 1)] * args[bytecode_read_uint16(codeptr + 3)];
+    ++ stackptr;
+    codeptr += 1 + 2 * sizeof(uint16_t);
+    goto *table[*codeptr];
+
+var_var_div:
+    *stackptr = args[bytecode_read_uint16(codeptr + 1)] / args[bytecode_read_uint16(codeptr + 3)];
+    ++ stackptr;
+    codeptr += 1 + 2 * sizeof(uint16_t);
+    goto *table[*codeptr];
 
-val:
-    codeptr += sizeof(long);
-    *stackptr = *(const long*)codeptr;
+val8:
+    *stackptr = (int8_t)codeptr[1];
     ++ stackptr;
-    codeptr += sizeof(long);
-    goto *table[*(const long*)codeptr];
+    codeptr += 1 + sizeof(int8_t);
+    goto *table[*codeptr];
 
-var:
-    codeptr += sizeof(long);
-    const size_t arg_index = *(const size_t*)codeptr;
-    *stackptr = args[arg_index];
+val16:
+    *stackptr = bytecode_read_int16(codeptr + 1);
     ++ stackptr;
-    codeptr += sizeof(size_t);
-    goto *table[*(const long*)codeptr];
+    codeptr += 1 + sizeof(int16_t);
+    goto *table[*codeptr];
+
+val32:
+    *stackptr = bytecode_read_int32(codeptr + 1);
+    ++ stackptr;
+    codeptr += 1 + sizeof(int32_t);
+    goto *table[*codeptr];
+
+val64:
+    *stackptr = bytecode_read_int64(codeptr + 1);
+    ++ stackptr;
+    codeptr += 1 + sizeof(int64_t);
+    goto *table[*codeptr];
+
+var8:
+    *stackptr = args[codeptr[1]];
+    ++ stackptr;
+    codeptr += 1 + sizeof(uint8_t);
+    goto *table[*codeptr];
+
+var16:
+    *stackptr = args[bytecode_read_uint16(codeptr + 1)];
+    ++ stackptr;
+    codeptr += 1 + sizeof(uint16_t);
+    goto *table[*codeptr];
+
+var32:
+    *stackptr = args[bytecode_read_uint32(codeptr + 1)];
+    ++ stackptr;
+    codeptr += 1 + sizeof(uint32_t);
+    goto *table[*codeptr];
+
+var64:
+    *stackptr = args[bytecode_read_uint64(codeptr + 1)];
+    ++ stackptr;
+    codeptr += 1 + sizeof(uint64_t);
+    goto *table[*codeptr];
+
+frame:
+    stackptr = stack + bytecode_read_uint32(codeptr + 1);
+    codeptr += 1 + sizeof(uint32_t);
+    goto *table[*codeptr];
+
+load:
+    *stackptr = stack[bytecode_read_uint32(codeptr + 1)];
+    ++ stackptr;
+    codeptr += 1 + sizeof(uint32_t);
+    goto *table[*codeptr];
+
+store:
+    stack[bytecode_read_uint32(codeptr + 1)] = stackptr[-1];
+    codeptr += 1 + sizeof(uint32_t);
+    goto *table[*codeptr];
 
 ret:
-    -- stackptr;
-    const long result = *stackptr;
+    return stackptr[-1];
+}
+
+long bytecode_eval(const void *bytecode, const long args[]) {
+    const size_t stack_size = *(const size_t*)bytecode;
+
+    if (stack_size <= VM_SCRATCH_SIZE) {
+        long scratch[VM_SCRATCH_SIZE];
+        return bytecode_exec(bytecode, args, scratch);
+    }
+
+    long *stack = malloc(sizeof(long) * stack_size);
+    if (stack == NULL) {
+        // use bytecode_eval_ctx() for proper error handling
+        perror("allocating varialbe stack");
+        return LONG_MAX;
+    }
+
+    const long result = bytecode_exec(bytecode, args, stack);
     free(stack);
     return result;
 }
 
+bool vm_context_reserve(struct VmContext *ctx, size_t stack_size) {
+    if (stack_size <= ctx->stack_size) {
+        return true;
+    }
+
+    if (stack_size > SIZE_MAX / sizeof(long)) {
+        ctx->error = VM_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+
+    long *new_stack = allocator_realloc(ctx->allocator, ctx->stack,
+        sizeof(long) * ctx->stack_size, sizeof(long) * stack_size);
+    if (new_stack == NULL) {
+        ctx->error = VM_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+
+    ctx->stack = new_stack;
+    ctx->stack_size = stack_size;
+
+    return true;
+}
+
+bool vm_context_init(struct VmContext *ctx, const void *bytecode) {
+    return vm_context_init_with_allocator(ctx, bytecode, NULL);
+}
+
+bool vm_context_init_with_allocator(struct VmContext *ctx, const void *bytecode, const struct Allocator *allocator) {
+    *ctx = VM_CONTEXT_INIT;
+    ctx->allocator = allocator;
+
+    if (bytecode == NULL) {
+        return true;
+    }
+
+    const size_t stack_size = *(const size_t*)bytecode;
+    if (stack_size <= VM_SCRATCH_SIZE) {
+        return true;
+    }
+
+    return vm_context_reserve(ctx, stack_size);
+}
+
+bool bytecode_eval_ctx(struct VmContext *ctx, const void *bytecode, const long args[], long *result) {
+    const size_t stack_size = *(const size_t*)bytecode;
+
+    ctx->error = VM_ERROR_NONE;
+
+    if (stack_size <= ctx->stack_size) {
+        *result = bytecode_exec(bytecode, args, ctx->stack);
+        return true;
+    }
+
+    if (stack_size <= VM_SCRATCH_SIZE) {
+        long scratch[VM_SCRATCH_SIZE];
+        *result = bytecode_exec(bytecode, args, scratch);
+        return true;
+    }
+
+    if (!vm_context_reserve(ctx, stack_size)) {
+        return false;
+    }
+
+    *result = bytecode_exec(bytecode, args, ctx->stack);
+    return true;
+}
+
+void vm_context_destroy(struct VmContext *ctx) {
+    allocator_free(ctx->allocator, ctx->stack);
+    *ctx = VM_CONTEXT_INIT;
+}
+
+const char *get_vm_error_message(enum VmError error) {
+    switch (error) {
+        case VM_ERROR_NONE:          return "no error";
+        case VM_ERROR_OUT_OF_MEMORY: return "out of memory";
+        default:
+            assert(false);
+            return "illegal error code";
+    }
+}
+
 void bytecode_destroy(struct Bytecode *bytecode) {
     buffer_destroy(&bytecode->bytes);
     bytecode->stack_size = 0;
 }
 
+static const char *get_operation_name(enum ByteCode code) {
+    switch (code) {
+        case CODE_ADD: return "ADD";
+        case CODE_SUB: return "SUB";
+        case CODE_MUL: return "MUL";
+        case CODE_DIV: return "DIV";
+
+        default:
+            assert(false);
+            return "???";
+    }
+}
+
 void bytecode_print(const void *bytecode, char *const *const args, FILE *stream) {
     const size_t stack_size = sizeof(long) * *(const size_t*)bytecode;
-    const void *codeptr = bytecode + sizeof(long);
+    const uint8_t *codeptr = (const uint8_t*)bytecode + sizeof(size_t);
 
     fprintf(stdout, "stack size: %zu cells (%zu B)\n\n", stack_size / sizeof(long), stack_size);
 
     for (;;) {
-        const long code = *(const long*)codeptr;
-        codeptr += sizeof(long);
+        const uint8_t code = *codeptr;
+        ++ codeptr;
 
         switch (code) {
             case CODE_ADD:
@@ -263,22 +995,172 @@ void bytecode_print(const void *bytecode, char *const *const args, FILE *stream)
                 fprintf(stream, "INV\n");
                 break;
 
-            case CODE_VAL:
-                fprintf(stream, "VAL %ld\n", *(const long*)codeptr);
-                codeptr += sizeof(long);
+            case CODE_SHL:
+                fprintf(stream, "SHL %u\n", *codeptr);
+                codeptr += sizeof(uint8_t);
                 break;
 
-            case CODE_VAR:
-            {
-                const size_t arg_index = *(const size_t*)codeptr;
-                codeptr += sizeof(size_t);
-                fprintf(stream, "VAR %s\n", args[arg_index]);
+            case CODE_MULHI:
+                fprintf(stream, "MULHI %ld\n", (long)bytecode_read_int64(codeptr));
+                codeptr += sizeof(int64_t);
+                break;
+
+            case CODE_SAR:
+                fprintf(stream, "SAR %u\n", *codeptr);
+                codeptr += sizeof(uint8_t);
+                break;
+
+            case CODE_ADD_VAR:
+            case CODE_SUB_VAR:
+            case CODE_MUL_VAR:
+            case CODE_DIV_VAR:
+                fprintf(stream, "%s_VAR %s\n",
+                    get_operation_name(code - CODE_ADD_VAR),
+                    args[bytecode_read_uint16(codeptr)]);
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_ADD_VAL:
+            case CODE_SUB_VAL:
+            case CODE_MUL_VAL:
+            case CODE_DIV_VAL:
+                fprintf(stream, "%s_VAL %d\n",
+                    get_operation_name(code - CODE_ADD_VAL),
+                    bytecode_read_int32(codeptr));
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_VAR_VAR_ADD:
+            case CODE_VAR_VAR_SUB:
+            case CODE_VAR_VAR_MUL:
+            case CODE_VAR_VAR_DIV:
+                fprintf(stream, "VAR_VAR_%s %s %s\n",
+                    get_operation_name(code - CODE_VAR_VAR_ADD),
+                    args[bytecode_read_uint16(codeptr)],
+                    args[bytecode_read_uint16(codeptr + sizeof(uint16_t))]);
+                codeptr += 2 * sizeof(uint16_t);
+                break;
+
+            case CODE_VAL8:
+                fprintf(stream, "VAL8 %d\n", (int8_t)*codeptr);
+                codeptr += sizeof(int8_t);
+                break;
+
+            case CODE_VAL16:
+                fprintf(stream, "VAL16 %d\n", bytecode_read_int16(codeptr));
+                codeptr += sizeof(int16_t);
+                break;
+
+            case CODE_VAL32:
+                fprintf(stream, "VAL32 %d\n", bytecode_read_int32(codeptr));
+                codeptr += sizeof(int32_t);
+                break;
+
+            case CODE_VAL64:
+                fprintf(stream, "VAL64 %ld\n", (long)bytecode_read_int64(codeptr));
+                codeptr += sizeof(int64_t);
+                break;
+
+            case CODE_VAR8:
+                fprintf(stream, "VAR8 %s\n", args[*codeptr]);
+                codeptr += sizeof(uint8_t);
+                break;
+
+            case CODE_VAR16:
+                fprintf(stream, "VAR16 %s\n", args[bytecode_read_uint16(codeptr)]);
+                codeptr += sizeof(uint16_t);
+                break;
+
+            case CODE_VAR32:
+                fprintf(stream, "VAR32 %s\n", args[bytecode_read_uint32(codeptr)]);
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_VAR64:
+                fprintf(stream, "VAR64 %s\n", args[bytecode_read_uint64(codeptr)]);
+                codeptr += sizeof(uint64_t);
+                break;
+
+            case CODE_FRAME:
+                fprintf(stream, "FRAME %u\n", bytecode_read_uint32(codeptr));
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_LOAD:
+                fprintf(stream, "LOAD %u\n", bytecode_read_uint32(codeptr));
+                codeptr += sizeof(uint32_t);
+                break;
+
+            case CODE_STORE:
+                fprintf(stream, "STORE %u\n", bytecode_read_uint32(codeptr));
+                codeptr += sizeof(uint32_t);
                 break;
-            }
 
             case CODE_RET:
                 fprintf(stream, "RET\n");
                 return;
+
+            default:
+                fprintf(stream, "illegal opcode: %u\n", code);
+                assert(false);
+                return;
+        }
+    }
+}
+
+size_t bytecode_count_instructions(const void *bytecode) {
+    const uint8_t *codeptr = (const uint8_t*)bytecode + sizeof(size_t);
+    size_t count = 0;
+
+    for (;;) {
+        const uint8_t code = *codeptr;
+        ++ codeptr;
+        ++ count;
+
+        switch (code) {
+            case CODE_VAL8:
+            case CODE_VAR8:
+            case CODE_SHL:
+            case CODE_SAR:
+                codeptr += 1;
+                break;
+
+            case CODE_VAL16:
+            case CODE_VAR16:
+            case CODE_ADD_VAR:
+            case CODE_SUB_VAR:
+            case CODE_MUL_VAR:
+            case CODE_DIV_VAR:
+                codeptr += 2;
+                break;
+
+            case CODE_VAL32:
+            case CODE_VAR32:
+            case CODE_ADD_VAL:
+            case CODE_SUB_VAL:
+            case CODE_MUL_VAL:
+            case CODE_DIV_VAL:
+            case CODE_VAR_VAR_ADD:
+            case CODE_VAR_VAR_SUB:
+            case CODE_VAR_VAR_MUL:
+            case CODE_VAR_VAR_DIV:
+            case CODE_FRAME:
+            case CODE_LOAD:
+            case CODE_STORE:
+                codeptr += 4;
+                break;
+
+            case CODE_VAL64:
+            case CODE_VAR64:
+            case CODE_MULHI:
+                codeptr += 8;
+                break;
+
+            case CODE_RET:
+                return count;
+
+            default:
+                break;
         }
     }
 }
@@ -4,13 +4,104 @@
 
 #include "buffer.h"
 #include "parser.h"
+#include "compact_ast.h"
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// This bytecode is endian dependant!
+//
+// Layout: a size_t header holding the stack size, followed by 1 byte opcodes.
+// VAL and VAR opcodes are followed by an immediate of the width encoded in
+// the opcode. Immediates are not aligned.
+//
+// The <OP>_VAR, <OP>_VAL and VAR_VAR_<OP> superinstructions fuse the most
+// common instruction pairs/triples. They take 16 bit argument indices and
+// 32 bit values. Their order within each group must match CODE_ADD..CODE_DIV.
+//
+// SHL and SAR are followed by an 8 bit shift count, MULHI by a 64 bit factor
+// (see optimize_strength()).
+//
+// Values of shared nodes (see optimize_cse()) are kept in local slots at the
+// bottom of the stack. FRAME reserves them, STORE copies the top of the stack
+// into a slot and LOAD pushes a slot. They take 32 bit slot indices.
+enum ByteCode {
+    CODE_ADD,
+    CODE_SUB,
+    CODE_MUL,
+    CODE_DIV,
+    CODE_INV,
+    CODE_SHL,
+    CODE_MULHI,
+    CODE_SAR,
+    CODE_ADD_VAR,
+    CODE_SUB_VAR,
+    CODE_MUL_VAR,
+    CODE_DIV_VAR,
+    CODE_ADD_VAL,
+    CODE_SUB_VAL,
+    CODE_MUL_VAL,
+    CODE_DIV_VAL,
+    CODE_VAR_VAR_ADD,
+    CODE_VAR_VAR_SUB,
+    CODE_VAR_VAR_MUL,
+    CODE_VAR_VAR_DIV,
+    CODE_VAL8,
+    CODE_VAL16,
+    CODE_VAL32,
+    CODE_VAL64,
+    CODE_VAR8,
+    CODE_VAR16,
+    CODE_VAR32,
+    CODE_VAR64,
+    CODE_FRAME,
+    CODE_LOAD,
+    CODE_STORE,
+    CODE_RET,
+};
+
+// unaligned reads of immediates
+static inline int16_t bytecode_read_int16(const uint8_t *ptr) {
+    int16_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline int32_t bytecode_read_int32(const uint8_t *ptr) {
+    int32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline int64_t bytecode_read_int64(const uint8_t *ptr) {
+    int64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint16_t bytecode_read_uint16(const uint8_t *ptr) {
+    uint16_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint32_t bytecode_read_uint32(const uint8_t *ptr) {
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static inline uint64_t bytecode_read_uint64(const uint8_t *ptr) {
+    uint64_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
 struct Bytecode {
     struct Buffer bytes;
     size_t stack_size;
@@ -18,11 +109,52 @@ struct Bytecode {
 
 #define BYTECODE_INIT { .bytes = BUFFER_INIT, .stack_size = 0 }
 
+// Stacks of up to this many cells are placed on the native stack instead of
+// the heap.
+#define VM_SCRATCH_SIZE 64
+
+enum VmError {
+    VM_ERROR_NONE,
+    VM_ERROR_OUT_OF_MEMORY,
+};
+
+// Reusable execution state for bytecode_eval_ctx(). A context may be used for
+// any number of evaluations of any bytecode, but only by one thread at a time.
+struct VmContext {
+    long *stack;
+    size_t stack_size;
+    enum VmError error;
+    // of the stack, NULL for malloc()
+    const struct Allocator *allocator;
+};
+
+#define VM_CONTEXT_INIT (struct VmContext){ .stack = NULL, .stack_size = 0, .error = VM_ERROR_NONE, .allocator = NULL }
+
 struct Bytecode bytecode_compile(const struct Ast *ast);
+// The bytes and the temporary memory come from the given allocator.
+struct Bytecode bytecode_compile_with_allocator(const struct Ast *ast, const struct Allocator *allocator);
+// Compiles into the memory of earlier bytecode (or BYTECODE_INIT), using the
+// allocator of its bytes. Returns false on error, then stack_size is 0.
+bool bytecode_compile_into(struct Bytecode *bytecode, const struct Ast *ast);
+// Compiles without recursion in one pass over the post-order node arrays. The
+// AST must be a tree, i.e. not be processed by optimize_cse().
+struct Bytecode bytecode_compile_compact(const struct CompactAst *ast);
 void bytecode_destroy(struct Bytecode *bytecode);
 
 long bytecode_eval(const void *bytecode, const long args[]);
+
+// Preallocates the stack needed by the given bytecode (may be NULL).
+bool vm_context_init(struct VmContext *ctx, const void *bytecode);
+bool vm_context_init_with_allocator(struct VmContext *ctx, const void *bytecode, const struct Allocator *allocator);
+// Makes sure the stack of ctx has at least stack_size cells.
+bool vm_context_reserve(struct VmContext *ctx, size_t stack_size);
+// Returns false on error and sets ctx->error. The stack grows as needed.
+bool bytecode_eval_ctx(struct VmContext *ctx, const void *bytecode, const long args[], long *result);
+void vm_context_destroy(struct VmContext *ctx);
+
+const char *get_vm_error_message(enum VmError error);
 void bytecode_print(const void *bytecode, char *const *const args, FILE *stream);
+size_t bytecode_count_instructions(const void *bytecode);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,196 @@
+#include "closure.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+enum ClosureOperandKind {
+    CLOSURE_OPERAND_NODE,
+    CLOSURE_OPERAND_VAR,
+    CLOSURE_OPERAND_CONST,
+};
+
+#define CLOSURE_OPERAND_node(OPERAND)  (OPERAND).node->func((OPERAND).node, args)
+#define CLOSURE_OPERAND_var(OPERAND)   args[(OPERAND).arg_index]
+#define CLOSURE_OPERAND_const(OPERAND) (OPERAND).value
+
+#define CLOSURE_OP_ADD(LEFT, RIGHT) ((LEFT) + (RIGHT))
+#define CLOSURE_OP_SUB(LEFT, RIGHT) ((LEFT) - (RIGHT))
+#define CLOSURE_OP_MUL(LEFT, RIGHT) ((LEFT) * (RIGHT))
+#define CLOSURE_OP_DIV(LEFT, RIGHT) ((LEFT) / (RIGHT))
+#define CLOSURE_OP_SHL(LEFT, RIGHT) ast_shl((LEFT), (RIGHT))
+#define CLOSURE_OP_MULHI(LEFT, RIGHT) ast_mulhi((LEFT), (RIGHT))
+#define CLOSURE_OP_SAR(LEFT, RIGHT) ast_sar((LEFT), (RIGHT))
+
+// e.g. closure_add_node_var()
+#define CLOSURE_BINARY(NAME, OP, LEFT, RIGHT) \
+    static long closure_ ## NAME ## _ ## LEFT ## _ ## RIGHT(const struct Closure *closure, const long args[]) { \
+        (void)args; \
+        const long left = CLOSURE_OPERAND_ ## LEFT(closure->left); \
+        return OP(left, CLOSURE_OPERAND_ ## RIGHT(closure->right)); \
+    }
+
+// all combinations of operand kinds plus a table indexed by them
+#define CLOSURE_BINARIES(NAME, OP) \
+    CLOSURE_BINARY(NAME, OP, node,  node) \
+    CLOSURE_BINARY(NAME, OP, node,  var) \
+    CLOSURE_BINARY(NAME, OP, node,  const) \
+    CLOSURE_BINARY(NAME, OP, var,   node) \
+    CLOSURE_BINARY(NAME, OP, var,   var) \
+    CLOSURE_BINARY(NAME, OP, var,   const) \
+    CLOSURE_BINARY(NAME, OP, const, node) \
+    CLOSURE_BINARY(NAME, OP, const, var) \
+    CLOSURE_BINARY(NAME, OP, const, const) \
+    \
+    static const ClosureFunc closure_ ## NAME ## _funcs[3][3] = { \
+        [CLOSURE_OPERAND_NODE] = { \
+            [CLOSURE_OPERAND_NODE]  = closure_ ## NAME ## _node_node, \
+            [CLOSURE_OPERAND_VAR]   = closure_ ## NAME ## _node_var, \
+            [CLOSURE_OPERAND_CONST] = closure_ ## NAME ## _node_const, \
+        }, \
+        [CLOSURE_OPERAND_VAR] = { \
+            [CLOSURE_OPERAND_NODE]  = closure_ ## NAME ## _var_node, \
+            [CLOSURE_OPERAND_VAR]   = closure_ ## NAME ## _var_var, \
+            [CLOSURE_OPERAND_CONST] = closure_ ## NAME ## _var_const, \
+        }, \
+        [CLOSURE_OPERAND_CONST] = { \
+            [CLOSURE_OPERAND_NODE]  = closure_ ## NAME ## _const_node, \
+            [CLOSURE_OPERAND_VAR]   = closure_ ## NAME ## _const_var, \
+            [CLOSURE_OPERAND_CONST] = closure_ ## NAME ## _const_const, \
+        }, \
+    };
+
+CLOSURE_BINARIES(add,   CLOSURE_OP_ADD)
+CLOSURE_BINARIES(sub,   CLOSURE_OP_SUB)
+CLOSURE_BINARIES(mul,   CLOSURE_OP_MUL)
+CLOSURE_BINARIES(div,   CLOSURE_OP_DIV)
+CLOSURE_BINARIES(shl,   CLOSURE_OP_SHL)
+CLOSURE_BINARIES(mulhi, CLOSURE_OP_MULHI)
+CLOSURE_BINARIES(sar,   CLOSURE_OP_SAR)
+
+static long closure_inv_node(const struct Closure *closure, const long args[]) {
+    return -CLOSURE_OPERAND_node(closure->left);
+}
+
+static long closure_inv_var(const struct Closure *closure, const long args[]) {
+    return -CLOSURE_OPERAND_var(closure->left);
+}
+
+static long closure_var(const struct Closure *closure, const long args[]) {
+    return CLOSURE_OPERAND_var(closure->left);
+}
+
+static long closure_const(const struct Closure *closure, const long args[]) {
+    (void)args;
+    return CLOSURE_OPERAND_const(closure->left);
+}
+
+// Binds a child node as operand, leaves are inlined.
+static enum ClosureOperandKind bind_operand(const struct Ast *ast, struct Closure *closures, size_t node_index,
+        union ClosureOperand *operand) {
+    const struct AstNode *node = &ast->nodes[node_index];
+
+    switch (node->type) {
+        case NODE_VAR:
+            operand->arg_index = node->arg_index;
+            return CLOSURE_OPERAND_VAR;
+
+        case NODE_INT:
+            operand->value = node->value;
+            return CLOSURE_OPERAND_CONST;
+
+        default:
+            operand->node = &closures[node_index];
+            return CLOSURE_OPERAND_NODE;
+    }
+}
+
+struct ClosureCode closure_compile(const struct Ast *ast) {
+    struct ClosureCode code = CLOSURE_CODE_INIT;
+    const size_t nodes_used = ast->nodes_used;
+
+    code.closures = malloc(sizeof(struct Closure) * (nodes_used + 1));
+    if (code.closures == NULL) {
+        return code;
+    }
+
+    if (nodes_used == 0) {
+        code.closures[0] = (struct Closure){ .func = closure_const, .left = { .value = 0 } };
+        code.closures_used = 1;
+        code.root = &code.closures[0];
+        return code;
+    }
+
+    for (size_t index = 0; index < nodes_used; ++ index) {
+        const struct AstNode *node = &ast->nodes[index];
+        struct Closure *closure = &code.closures[index];
+
+        *closure = (struct Closure){ .func = NULL, .left = { .value = 0 }, .right = { .value = 0 } };
+
+        switch (node->type) {
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+            case NODE_SHL:
+            case NODE_MULHI:
+            case NODE_SAR:
+            {
+                const enum ClosureOperandKind left  = bind_operand(ast, code.closures, node->binary.left_index,  &closure->left);
+                const enum ClosureOperandKind right = bind_operand(ast, code.closures, node->binary.right_index, &closure->right);
+
+                switch (node->type) {
+                    case NODE_ADD:   closure->func = closure_add_funcs[left][right];   break;
+                    case NODE_SUB:   closure->func = closure_sub_funcs[left][right];   break;
+                    case NODE_MUL:   closure->func = closure_mul_funcs[left][right];   break;
+                    case NODE_DIV:   closure->func = closure_div_funcs[left][right];   break;
+                    case NODE_SHL:   closure->func = closure_shl_funcs[left][right];   break;
+                    case NODE_MULHI: closure->func = closure_mulhi_funcs[left][right]; break;
+                    default:         closure->func = closure_sar_funcs[left][right];   break;
+                }
+                break;
+            }
+
+            case NODE_INV:
+                switch (bind_operand(ast, code.closures, node->child_index, &closure->left)) {
+                    case CLOSURE_OPERAND_NODE:
+                        closure->func = closure_inv_node;
+                        break;
+
+                    case CLOSURE_OPERAND_VAR:
+                        closure->func = closure_inv_var;
+                        break;
+
+                    case CLOSURE_OPERAND_CONST:
+                        closure->func = closure_const;
+                        closure->left.value = -closure->left.value;
+                        break;
+                }
+                break;
+
+            case NODE_INT:
+                closure->func = closure_const;
+                closure->left.value = node->value;
+                break;
+
+            case NODE_VAR:
+                closure->func = closure_var;
+                closure->left.arg_index = node->arg_index;
+                break;
+
+            default:
+                assert(false);
+                free(code.closures);
+                return CLOSURE_CODE_INIT;
+        }
+    }
+
+    code.closures_used = nodes_used;
+    code.root = &code.closures[AST_ROOT_NODE_INDEX(ast)];
+
+    return code;
+}
+
+void closure_destroy(struct ClosureCode *code) {
+    free(code->closures);
+    *code = CLOSURE_CODE_INIT;
+}
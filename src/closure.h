@@ -0,0 +1,60 @@
+#ifndef CLOSURE_H
+#define CLOSURE_H
+#pragma once
+
+#include <stddef.h>
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Portable alternative to the JIT: every node becomes a closure holding a
+// function specialized for its operation and operand kinds (e.g. ADD of a
+// child node and an argument), with the operands pre-bound. Evaluation is a
+// chain of direct calls through these function pointers, without decoding any
+// opcodes. Nothing is written to executable memory.
+//
+// Like the JIT, shared nodes (see optimize_cse()) are computed again for
+// every use.
+
+struct Closure;
+
+typedef long (*ClosureFunc)(const struct Closure *closure, const long args[]);
+
+// What an operand holds depends on func.
+union ClosureOperand {
+    const struct Closure *node;
+    size_t arg_index;
+    long value;
+};
+
+struct Closure {
+    ClosureFunc func;
+    union ClosureOperand left;
+    // unused by unary operations and leaves
+    union ClosureOperand right;
+};
+
+struct ClosureCode {
+    struct Closure *closures;
+    size_t closures_used;
+    const struct Closure *root;
+};
+
+#define CLOSURE_CODE_INIT (struct ClosureCode){ .closures = NULL, .closures_used = 0, .root = NULL }
+
+// On error closures is NULL.
+struct ClosureCode closure_compile(const struct Ast *ast);
+void closure_destroy(struct ClosureCode *code);
+
+static inline long closure_eval(const struct ClosureCode *code, const long args[]) {
+    return code->root->func(code->root, args);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
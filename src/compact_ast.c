@@ -0,0 +1,651 @@
+#include "compact_ast.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+
+bool compact_ast_init(struct CompactAst *compact, struct Ast *ast, bool keep_ranges) {
+    *compact = COMPACT_AST_INIT;
+
+    if (!ast_compact(ast)) {
+        return false;
+    }
+
+    const size_t nodes_used = ast->nodes_used;
+
+    if (nodes_used > UINT32_MAX) {
+        return false;
+    }
+
+    if (nodes_used == 0) {
+        return true;
+    }
+
+    size_t consts_used = 0;
+    for (size_t index = 0; index < nodes_used; ++ index) {
+        if (ast->nodes[index].type == NODE_INT) {
+            ++ consts_used;
+        }
+    }
+
+    compact->types  = malloc(sizeof(uint8_t)  * nodes_used);
+    compact->left   = malloc(sizeof(uint32_t) * nodes_used);
+    compact->right  = malloc(sizeof(uint32_t) * nodes_used);
+    compact->consts = consts_used == 0 ? NULL : malloc(sizeof(long) * consts_used);
+
+    if (keep_ranges) {
+        compact->ranges = malloc(sizeof(struct CompactAstRange) * nodes_used);
+    }
+
+    if (compact->types == NULL || compact->left == NULL || compact->right == NULL ||
+        (consts_used > 0 && compact->consts == NULL) ||
+        (keep_ranges && compact->ranges == NULL)) {
+        goto error;
+    }
+
+    for (size_t index = 0; index < nodes_used; ++ index) {
+        const struct AstNode *node = &ast->nodes[index];
+        uint32_t left  = 0;
+        uint32_t right = 0;
+        uint8_t type;
+
+        switch (node->type) {
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+            case NODE_SHL:
+            case NODE_MULHI:
+            case NODE_SAR:
+                switch (node->type) {
+                    case NODE_ADD:   type = COMPACT_ADD;   break;
+                    case NODE_SUB:   type = COMPACT_SUB;   break;
+                    case NODE_MUL:   type = COMPACT_MUL;   break;
+                    case NODE_DIV:   type = COMPACT_DIV;   break;
+                    case NODE_SHL:   type = COMPACT_SHL;   break;
+                    case NODE_MULHI: type = COMPACT_MULHI; break;
+                    default:         type = COMPACT_SAR;   break;
+                }
+                left  = (uint32_t)node->binary.left_index;
+                right = (uint32_t)node->binary.right_index;
+                break;
+
+            case NODE_INV:
+                type = COMPACT_INV;
+                left = (uint32_t)node->child_index;
+                break;
+
+            case NODE_INT:
+                type = COMPACT_INT;
+                left = (uint32_t)compact->consts_used;
+                compact->consts[compact->consts_used] = node->value;
+                ++ compact->consts_used;
+                break;
+
+            case NODE_VAR:
+                if (node->arg_index > UINT32_MAX) {
+                    goto error;
+                }
+                type = COMPACT_VAR;
+                left = (uint32_t)node->arg_index;
+                break;
+
+            default:
+                assert(false);
+                goto error;
+        }
+
+        compact->types[index] = type;
+        compact->left[index]  = left;
+        compact->right[index] = right;
+
+        if (compact->ranges != NULL) {
+            compact->ranges[index] = (struct CompactAstRange){
+                .start_index = node->start_index,
+                .end_index   = node->end_index,
+            };
+        }
+    }
+
+    compact->nodes_used = nodes_used;
+
+    return true;
+
+error:
+    compact_ast_destroy(compact);
+    return false;
+}
+
+void compact_ast_destroy(struct CompactAst *compact) {
+    free(compact->types);
+    free(compact->left);
+    free(compact->right);
+    free(compact->consts);
+    free(compact->ranges);
+    *compact = COMPACT_AST_INIT;
+}
+
+long compact_ast_eval(const struct CompactAst *compact, const long args[], long values[]) {
+    // see bytecode_exec()
+    static const void *table[] = {
+        [COMPACT_ADD]   = &&add,
+        [COMPACT_SUB]   = &&sub,
+        [COMPACT_MUL]   = &&mul,
+        [COMPACT_DIV]   = &&div,
+        [COMPACT_SHL]   = &&shl,
+        [COMPACT_MULHI] = &&mulhi,
+        [COMPACT_SAR]   = &&sar,
+        [COMPACT_INV]   = &&inv,
+        [COMPACT_INT]   = &&val,
+        [COMPACT_VAR]   = &&var,
+    };
+
+    const uint8_t  *types  = compact->types;
+    const uint32_t *left   = compact->left;
+    const uint32_t *right  = compact->right;
+    const long     *consts = compact->consts;
+    const size_t nodes_used = compact->nodes_used;
+    size_t index = 0;
+
+    if (nodes_used == 0) {
+        return 0;
+    }
+
+    goto *table[types[0]];
+
+#define COMPACT_NEXT() \
+    if (++ index == nodes_used) { \
+        return values[nodes_used - 1]; \
+    } \
+    goto *table[types[index]];
+
+add:
+    values[index] = values[left[index]] + values[right[index]];
+    COMPACT_NEXT();
+
+sub:
+    values[index] = values[left[index]] - values[right[index]];
+    COMPACT_NEXT();
+
+mul:
+    values[index] = values[left[index]] * values[right[index]];
+    COMPACT_NEXT();
+
+div:
+    values[index] = values[left[index]] / values[right[index]];
+    COMPACT_NEXT();
+
+shl:
+    values[index] = ast_shl(values[left[index]], values[right[index]]);
+    COMPACT_NEXT();
+
+mulhi:
+    values[index] = ast_mulhi(values[left[index]], values[right[index]]);
+    COMPACT_NEXT();
+
+sar:
+    values[index] = ast_sar(values[left[index]], values[right[index]]);
+    COMPACT_NEXT();
+
+inv:
+    values[index] = -values[left[index]];
+    COMPACT_NEXT();
+
+val:
+    values[index] = consts[left[index]];
+    COMPACT_NEXT();
+
+var:
+    values[index] = args[left[index]];
+    COMPACT_NEXT();
+
+#undef COMPACT_NEXT
+}
+
+size_t compact_ast_memory_size(const struct CompactAst *compact) {
+    size_t size =
+        compact->nodes_used * (sizeof(uint8_t) + 2 * sizeof(uint32_t)) +
+        compact->consts_used * sizeof(long);
+
+    if (compact->ranges != NULL) {
+        size += compact->nodes_used * sizeof(struct CompactAstRange);
+    }
+
+    return size;
+}
+
+// signed overflow is undefined behavior, so wrap explicitly
+static long compact_wrapping_add(long a, long b) {
+    return (long)((unsigned long)a + (unsigned long)b);
+}
+
+static long compact_wrapping_sub(long a, long b) {
+    return (long)((unsigned long)a - (unsigned long)b);
+}
+
+static long compact_wrapping_mul(long a, long b) {
+    return (long)((unsigned long)a * (unsigned long)b);
+}
+
+// Result of rewriting one node: an existing node, a constant or a new node.
+enum CompactRewriteKind {
+    COMPACT_REWRITE_ALIAS,
+    COMPACT_REWRITE_CONST,
+    COMPACT_REWRITE_NODE,
+};
+
+struct CompactRewrite {
+    enum CompactRewriteKind kind;
+    uint8_t  type;
+    uint32_t left;
+    uint32_t right;
+    long value;
+};
+
+struct CompactRewriter {
+    struct CompactAst *compact;
+    // merge structurally equal nodes
+    bool merge;
+    // nodes written so far, they replace the old ones from the start
+    uint32_t used;
+    // pool of the written INT nodes
+    long *consts;
+    size_t consts_used;
+    // open addressing hash table of written nodes, UINT32_MAX for empty slots
+    uint32_t *table;
+    size_t table_size;
+};
+
+static bool compact_is_same_var(const struct CompactAst *compact, uint32_t left, uint32_t right) {
+    return
+        compact->types[left]  == COMPACT_VAR &&
+        compact->types[right] == COMPACT_VAR &&
+        compact->left[left] == compact->left[right];
+}
+
+// Same per-node rules as node_optimize() in optimizer.c, except for the
+// reassociations, which would need more than one new node. Children are
+// already rewritten.
+static struct CompactRewrite compact_fold(const struct CompactRewriter *rewriter, uint8_t type, uint32_t left, uint32_t right) {
+    const struct CompactAst *compact = rewriter->compact;
+    const bool binary = type <= COMPACT_SAR;
+    const bool left_const  = (binary || type == COMPACT_INV) && compact->types[left] == COMPACT_INT;
+    const bool right_const = binary && compact->types[right] == COMPACT_INT;
+    const long a = left_const  ? rewriter->consts[compact->left[left]]  : 0;
+    const long b = right_const ? rewriter->consts[compact->left[right]] : 0;
+
+#define COMPACT_CONST(VALUE) (struct CompactRewrite){ .kind = COMPACT_REWRITE_CONST, .value = (VALUE) }
+#define COMPACT_ALIAS(INDEX) (struct CompactRewrite){ .kind = COMPACT_REWRITE_ALIAS, .left = (INDEX) }
+
+    switch (type) {
+        case COMPACT_ADD:
+            if (left_const && right_const) {
+                return COMPACT_CONST(compact_wrapping_add(a, b));
+            }
+            if (left_const && a == 0) {
+                return COMPACT_ALIAS(right);
+            }
+            if (right_const && b == 0) {
+                return COMPACT_ALIAS(left);
+            }
+            break;
+
+        case COMPACT_SUB:
+            if (left_const && right_const) {
+                return COMPACT_CONST(compact_wrapping_sub(a, b));
+            }
+            if (right_const && b == 0) {
+                return COMPACT_ALIAS(left);
+            }
+            if (left_const && a == 0) {
+                // 0 - X -> -X
+                if (compact->types[right] == COMPACT_INV) {
+                    return COMPACT_ALIAS(compact->left[right]);
+                }
+                return (struct CompactRewrite){ .kind = COMPACT_REWRITE_NODE, .type = COMPACT_INV, .left = right };
+            }
+            if (compact_is_same_var(compact, left, right)) {
+                return COMPACT_CONST(0);
+            }
+            break;
+
+        case COMPACT_MUL:
+            if (left_const && right_const) {
+                return COMPACT_CONST(compact_wrapping_mul(a, b));
+            }
+            if ((left_const && a == 0) || (right_const && b == 0)) {
+                return COMPACT_CONST(0);
+            }
+            if (right_const && b == 1) {
+                return COMPACT_ALIAS(left);
+            }
+            if (left_const && a == 1) {
+                return COMPACT_ALIAS(right);
+            }
+            break;
+
+        case COMPACT_DIV:
+            if (left_const && right_const && b != 0 && !(a == LONG_MIN && b == -1)) {
+                return COMPACT_CONST(a / b);
+            }
+            if (left_const && a == 0) {
+                return COMPACT_CONST(0);
+            }
+            if (compact_is_same_var(compact, left, right)) {
+                return COMPACT_CONST(1);
+            }
+            break;
+
+        case COMPACT_SHL:
+            if (left_const && right_const) {
+                return COMPACT_CONST(ast_shl(a, b));
+            }
+            break;
+
+        case COMPACT_MULHI:
+            if (left_const && right_const) {
+                return COMPACT_CONST(ast_mulhi(a, b));
+            }
+            break;
+
+        case COMPACT_SAR:
+            if (left_const && right_const) {
+                return COMPACT_CONST(ast_sar(a, b));
+            }
+            break;
+
+        case COMPACT_INV:
+            if (left_const) {
+                return COMPACT_CONST(compact_wrapping_sub(0, a));
+            }
+            if (compact->types[left] == COMPACT_INV) {
+                return COMPACT_ALIAS(compact->left[left]);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+#undef COMPACT_ALIAS
+#undef COMPACT_CONST
+
+    return (struct CompactRewrite){ .kind = COMPACT_REWRITE_NODE, .type = type, .left = left, .right = right };
+}
+
+static bool compact_is_commutative(uint8_t type) {
+    return type == COMPACT_ADD || type == COMPACT_MUL;
+}
+
+// Key of a node: its type and two words, with constants by value.
+static void compact_node_key(const struct CompactRewriter *rewriter, uint8_t type, uint32_t left, uint32_t right,
+        uint64_t *first, uint64_t *second) {
+    if (type == COMPACT_INT) {
+        *first  = (uint64_t)rewriter->consts[left];
+        *second = 0;
+    } else if (compact_is_commutative(type) && left > right) {
+        *first  = right;
+        *second = left;
+    } else {
+        *first  = left;
+        *second = right;
+    }
+}
+
+static size_t compact_hash(uint8_t type, uint64_t first, uint64_t second) {
+    // FNV-1a over the three words
+    uint64_t hash = 14695981039346656037UL;
+    const uint64_t words[] = { type, first, second };
+    for (size_t index = 0; index < sizeof(words) / sizeof(words[0]); ++ index) {
+        uint64_t word = words[index];
+        for (size_t byte = 0; byte < sizeof(word); ++ byte) {
+            hash ^= word & 0xff;
+            hash *= 1099511628211UL;
+            word >>= 8;
+        }
+    }
+
+    return (size_t)hash;
+}
+
+// Writes a node at the end of the rewritten nodes, or returns an equal one if
+// merging. left of an INT node is its index into rewriter->consts.
+static uint32_t compact_emit(struct CompactRewriter *rewriter, uint8_t type, uint32_t left, uint32_t right,
+        const struct CompactAstRange *range) {
+    struct CompactAst *compact = rewriter->compact;
+    size_t slot = 0;
+
+    if (rewriter->merge) {
+        uint64_t first, second;
+        compact_node_key(rewriter, type, left, right, &first, &second);
+
+        const size_t mask = rewriter->table_size - 1;
+        slot = compact_hash(type, first, second) & mask;
+
+        for (;;) {
+            const uint32_t other = rewriter->table[slot];
+
+            if (other == UINT32_MAX) {
+                break;
+            }
+
+            if (compact->types[other] == type) {
+                uint64_t other_first, other_second;
+                compact_node_key(rewriter, type, compact->left[other], compact->right[other], &other_first, &other_second);
+
+                if (other_first == first && other_second == second) {
+                    if (type == COMPACT_INT) {
+                        // the constant was appended for nothing
+                        -- rewriter->consts_used;
+                    }
+                    return other;
+                }
+            }
+
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    const uint32_t index = rewriter->used;
+
+    compact->types[index] = type;
+    compact->left[index]  = left;
+    compact->right[index] = right;
+    if (compact->ranges != NULL) {
+        compact->ranges[index] = *range;
+    }
+
+    if (rewriter->merge) {
+        rewriter->table[slot] = index;
+    }
+
+    ++ rewriter->used;
+
+    return index;
+}
+
+// Rewrites all nodes bottom up in one linear pass, in place. Every old node
+// writes at most one new node, so writes never overtake reads. Returns the
+// index of the new root.
+static uint32_t compact_rewrite_nodes(struct CompactRewriter *rewriter, uint32_t *map) {
+    struct CompactAst *compact = rewriter->compact;
+    uint32_t root_index = 0;
+
+    for (size_t index = 0; index < compact->nodes_used; ++ index) {
+        const uint8_t type = compact->types[index];
+        uint32_t left  = compact->left[index];
+        uint32_t right = compact->right[index];
+        const struct CompactAstRange range = compact->ranges != NULL ?
+            compact->ranges[index] : (struct CompactAstRange){ .start_index = 0, .end_index = 0 };
+        struct CompactRewrite rewrite;
+
+        if (type <= COMPACT_SAR) {
+            left  = map[left];
+            right = map[right];
+            rewrite = compact_fold(rewriter, type, left, right);
+        } else if (type == COMPACT_INV) {
+            left = map[left];
+            rewrite = compact_fold(rewriter, type, left, 0);
+        } else if (type == COMPACT_INT) {
+            rewrite = (struct CompactRewrite){ .kind = COMPACT_REWRITE_CONST, .value = compact->consts[left] };
+        } else {
+            rewrite = (struct CompactRewrite){ .kind = COMPACT_REWRITE_NODE, .type = type, .left = left, .right = right };
+        }
+
+        switch (rewrite.kind) {
+            case COMPACT_REWRITE_ALIAS:
+                map[index] = rewrite.left;
+                break;
+
+            case COMPACT_REWRITE_CONST:
+                rewriter->consts[rewriter->consts_used] = rewrite.value;
+                ++ rewriter->consts_used;
+                map[index] = compact_emit(rewriter, COMPACT_INT, (uint32_t)(rewriter->consts_used - 1), 0, &range);
+                break;
+
+            case COMPACT_REWRITE_NODE:
+                map[index] = compact_emit(rewriter, rewrite.type, rewrite.left, rewrite.right, &range);
+                break;
+        }
+
+        root_index = map[index];
+    }
+
+    return root_index;
+}
+
+// Drops the nodes that aren't reachable from root_index anymore and moves the
+// constant pool into place.
+static void compact_sweep(struct CompactRewriter *rewriter, uint32_t root_index, uint32_t *map) {
+    struct CompactAst *compact = rewriter->compact;
+    const uint32_t used = rewriter->used;
+
+    // the root comes after all its descendants, so one backward pass marks
+    // every reachable node
+    for (uint32_t index = 0; index < used; ++ index) {
+        map[index] = 0;
+    }
+    map[root_index] = 1;
+
+    for (uint32_t index = root_index + 1; index -- > 0;) {
+        if (map[index] == 0) {
+            continue;
+        }
+
+        const uint8_t type = compact->types[index];
+        if (type <= COMPACT_INV) {
+            map[compact->left[index]] = 1;
+        }
+        if (type <= COMPACT_SAR) {
+            map[compact->right[index]] = 1;
+        }
+    }
+
+    // renumber, the order stays the same
+    uint32_t nodes_used = 0;
+    size_t consts_used = 0;
+
+    for (uint32_t index = 0; index <= root_index; ++ index) {
+        if (map[index] == 0) {
+            continue;
+        }
+
+        const uint8_t type = compact->types[index];
+        uint32_t left  = compact->left[index];
+        uint32_t right = compact->right[index];
+
+        if (type <= COMPACT_INV) {
+            left = map[left];
+        }
+        if (type <= COMPACT_SAR) {
+            right = map[right];
+        }
+        if (type == COMPACT_INT) {
+            // in the order of the nodes, so this doesn't overtake reads either
+            rewriter->consts[consts_used] = rewriter->consts[left];
+            left = (uint32_t)consts_used;
+            ++ consts_used;
+        }
+
+        compact->types[nodes_used] = type;
+        compact->left[nodes_used]  = left;
+        compact->right[nodes_used] = right;
+        if (compact->ranges != NULL) {
+            compact->ranges[nodes_used] = compact->ranges[index];
+        }
+
+        map[index] = nodes_used;
+        ++ nodes_used;
+    }
+
+    compact->nodes_used = nodes_used;
+
+    free(compact->consts);
+    compact->consts = rewriter->consts;
+    compact->consts_used = consts_used;
+    rewriter->consts = NULL;
+}
+
+static bool compact_ast_rewrite(struct CompactAst *compact, bool merge, size_t *removed) {
+    const size_t nodes_used = compact->nodes_used;
+
+    *removed = 0;
+
+    if (nodes_used == 0) {
+        return true;
+    }
+
+    struct CompactRewriter rewriter = {
+        .compact     = compact,
+        .merge       = merge,
+        .used        = 0,
+        .consts      = NULL,
+        .consts_used = 0,
+        .table       = NULL,
+        .table_size  = 0,
+    };
+
+    // every node can become a constant once
+    rewriter.consts = malloc(sizeof(long) * nodes_used);
+    uint32_t *map = malloc(sizeof(uint32_t) * nodes_used);
+
+    if (merge) {
+        // power of two with a load factor of at most 1/2
+        rewriter.table_size = 16;
+        while (rewriter.table_size < nodes_used * 2) {
+            rewriter.table_size *= 2;
+        }
+
+        rewriter.table = malloc(sizeof(uint32_t) * rewriter.table_size);
+    }
+
+    // nothing has been changed yet
+    if (rewriter.consts == NULL || map == NULL || (merge && rewriter.table == NULL)) {
+        free(rewriter.table);
+        free(map);
+        free(rewriter.consts);
+        return false;
+    }
+
+    for (size_t slot = 0; slot < rewriter.table_size; ++ slot) {
+        rewriter.table[slot] = UINT32_MAX;
+    }
+
+    const uint32_t root_index = compact_rewrite_nodes(&rewriter, map);
+    compact_sweep(&rewriter, root_index, map);
+
+    free(rewriter.table);
+    free(map);
+
+    *removed = nodes_used - compact->nodes_used;
+
+    return true;
+}
+
+bool compact_ast_optimize(struct CompactAst *compact, size_t *removed) {
+    return compact_ast_rewrite(compact, false, removed);
+}
+
+bool compact_ast_cse(struct CompactAst *compact, size_t *eliminated) {
+    return compact_ast_rewrite(compact, true, eliminated);
+}
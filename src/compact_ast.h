@@ -0,0 +1,89 @@
+#ifndef COMPACT_AST_H
+#define COMPACT_AST_H
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum CompactNodeType {
+    COMPACT_ADD,
+    COMPACT_SUB,
+    COMPACT_MUL,
+    COMPACT_DIV,
+    COMPACT_SHL,
+    COMPACT_MULHI,
+    COMPACT_SAR,
+    COMPACT_INV,
+    COMPACT_INT,
+    COMPACT_VAR,
+};
+
+struct CompactAstRange {
+    size_t start_index;
+    size_t end_index;
+};
+
+// Structure-of-arrays layout of a compacted AST (see ast_compact()): 9 bytes
+// per node plus 8 bytes per constant, instead of sizeof(struct AstNode).
+//
+// Nodes are in post-order, so the root is the last node and children always
+// come before their parents. What left and right hold depends on the type:
+//
+//     binary: left and right child index
+//     INV:    child index in left
+//     INT:    index into consts in left
+//     VAR:    argument index in left
+//
+// Unused fields are 0.
+struct CompactAst {
+    uint8_t  *types;
+    uint32_t *left;
+    uint32_t *right;
+    size_t nodes_used;
+
+    long *consts;
+    size_t consts_used;
+
+    // source ranges per node, NULL unless requested
+    struct CompactAstRange *ranges;
+};
+
+#define COMPACT_AST_INIT (struct CompactAst){ .types = NULL, .left = NULL, .right = NULL, .nodes_used = 0, .consts = NULL, .consts_used = 0, .ranges = NULL }
+
+// Converts an AST, which is compacted first. Source ranges are only kept if
+// keep_ranges is true. Returns false if out of memory or if the AST has too
+// many nodes for 32 bit indices.
+bool compact_ast_init(struct CompactAst *compact, struct Ast *ast, bool keep_ranges);
+void compact_ast_destroy(struct CompactAst *compact);
+
+// Evaluates in one linear pass. values needs space for nodes_used elements.
+long compact_ast_eval(const struct CompactAst *compact, const long args[], long values[]);
+
+// Folds constants and applies the same per-node simplifications as optimize()
+// (x + 0, x * 1, x * 0, -(-x), ...) in one linear pass over the post-order,
+// without recursion and without touching struct Ast. The result stays a tree.
+// Reassociation and polynomial normalization still need optimize(). Reports
+// the number of removed nodes in removed. Returns false if out of memory, in
+// which case compact is unchanged.
+bool compact_ast_optimize(struct CompactAst *compact, size_t *removed);
+
+// Same as compact_ast_optimize(), but also merges structurally equal sub-trees
+// like optimize_cse() does, which turns the AST into a DAG. That can still be
+// evaluated with compact_ast_eval(), but not compiled with
+// bytecode_compile_compact().
+bool compact_ast_cse(struct CompactAst *compact, size_t *eliminated);
+
+// Heap memory used by the node arrays, constant pool and ranges.
+size_t compact_ast_memory_size(const struct CompactAst *compact);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,301 @@
+#include "jit.h"
+#include "buffer.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+
+// Calling convention is System V AMD64:
+//
+//  * rdi ... pointer to args[]
+//  * rax ... result of the current node
+//  * rcx ... right hand operand of a binary operation
+//  * rdx ... clobbered by cqo/idiv
+//
+// Intermediate results of non-trivial right hand sub-trees are saved on the
+// native stack with push/pop.
+
+static bool jit_emit(struct Buffer *buffer, const char *bytes, size_t size) {
+    return buffer_append(buffer, bytes, size);
+}
+
+static bool jit_emit_int32(struct Buffer *buffer, int32_t value) {
+    return buffer_append(buffer, (const char*)&value, sizeof(value));
+}
+
+static bool jit_emit_int64(struct Buffer *buffer, int64_t value) {
+    return buffer_append(buffer, (const char*)&value, sizeof(value));
+}
+
+static bool is_int32(long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool is_leaf(const struct AstNode *node) {
+    return node->type == NODE_INT || node->type == NODE_VAR;
+}
+
+static bool jit_get_arg_offset(size_t arg_index, int32_t *offset) {
+    if (arg_index > INT32_MAX / sizeof(long)) {
+        return false;
+    }
+    *offset = (int32_t)(arg_index * sizeof(long));
+    return true;
+}
+
+// mov rax, <leaf>
+static bool jit_compile_load(struct Buffer *buffer, const struct AstNode *node) {
+    switch (node->type) {
+        case NODE_INT:
+            if (is_int32(node->value)) {
+                // mov rax, imm32 (sign extended)
+                return jit_emit(buffer, "\x48\xC7\xC0", 3) && jit_emit_int32(buffer, (int32_t)node->value);
+            }
+            // movabs rax, imm64
+            return jit_emit(buffer, "\x48\xB8", 2) && jit_emit_int64(buffer, node->value);
+
+        case NODE_VAR:
+        {
+            int32_t offset;
+            if (!jit_get_arg_offset(node->arg_index, &offset)) {
+                return false;
+            }
+            // mov rax, [rdi + disp32]
+            return jit_emit(buffer, "\x48\x8B\x87", 3) && jit_emit_int32(buffer, offset);
+        }
+
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+// <op> rax, rcx
+static bool jit_compile_op_rcx(struct Buffer *buffer, enum NodeType type) {
+    switch (type) {
+        case NODE_ADD: return jit_emit(buffer, "\x48\x01\xC8", 3);
+        case NODE_SUB: return jit_emit(buffer, "\x48\x29\xC8", 3);
+        case NODE_MUL: return jit_emit(buffer, "\x48\x0F\xAF\xC1", 4);
+        // cqo; idiv rcx
+        case NODE_DIV: return jit_emit(buffer, "\x48\x99\x48\xF7\xF9", 5);
+
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+// <op> rax, <leaf>
+static bool jit_compile_op_leaf(struct Buffer *buffer, enum NodeType type, const struct AstNode *right) {
+    if (right->type == NODE_VAR) {
+        int32_t offset;
+        if (!jit_get_arg_offset(right->arg_index, &offset)) {
+            return false;
+        }
+
+        bool ok;
+        switch (type) {
+            case NODE_ADD: ok = jit_emit(buffer, "\x48\x03\x87", 3); break;
+            case NODE_SUB: ok = jit_emit(buffer, "\x48\x2B\x87", 3); break;
+            case NODE_MUL: ok = jit_emit(buffer, "\x48\x0F\xAF\x87", 4); break;
+            // cqo; idiv qword [rdi + disp32]
+            case NODE_DIV: ok = jit_emit(buffer, "\x48\x99\x48\xF7\xBF", 5); break;
+
+            default:
+                assert(false);
+                return false;
+        }
+
+        return ok && jit_emit_int32(buffer, offset);
+    }
+
+    assert(right->type == NODE_INT);
+
+    if (type != NODE_DIV && is_int32(right->value)) {
+        bool ok;
+        switch (type) {
+            case NODE_ADD: ok = jit_emit(buffer, "\x48\x05", 2); break;
+            case NODE_SUB: ok = jit_emit(buffer, "\x48\x2D", 2); break;
+            case NODE_MUL: ok = jit_emit(buffer, "\x48\x69\xC0", 3); break;
+
+            default:
+                assert(false);
+                return false;
+        }
+
+        return ok && jit_emit_int32(buffer, (int32_t)right->value);
+    }
+
+    // movabs rcx, imm64
+    if (!jit_emit(buffer, "\x48\xB9", 2) || !jit_emit_int64(buffer, right->value)) {
+        return false;
+    }
+
+    return jit_compile_op_rcx(buffer, type);
+}
+
+static bool jit_compile_node(struct Buffer *buffer, const struct Ast *ast, size_t node_index) {
+    assert(node_index < ast->nodes_used);
+
+    const struct AstNode *node = &ast->nodes[node_index];
+
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        {
+            const struct AstNode *left  = &ast->nodes[node->binary.left_index];
+            const struct AstNode *right = &ast->nodes[node->binary.right_index];
+
+            if (is_leaf(right)) {
+                return
+                    jit_compile_node(buffer, ast, node->binary.left_index) &&
+                    jit_compile_op_leaf(buffer, node->type, right);
+            }
+
+            if (is_leaf(left)) {
+                // no need to save anything on the stack:
+                // <right>; mov rcx, rax; mov rax, <left>; <op> rax, rcx
+                return
+                    jit_compile_node(buffer, ast, node->binary.right_index) &&
+                    jit_emit(buffer, "\x48\x89\xC1", 3) &&
+                    jit_compile_load(buffer, left) &&
+                    jit_compile_op_rcx(buffer, node->type);
+            }
+
+            // <left>; push rax; <right>; mov rcx, rax; pop rax; <op> rax, rcx
+            return
+                jit_compile_node(buffer, ast, node->binary.left_index) &&
+                jit_emit(buffer, "\x50", 1) &&
+                jit_compile_node(buffer, ast, node->binary.right_index) &&
+                jit_emit(buffer, "\x48\x89\xC1\x58", 4) &&
+                jit_compile_op_rcx(buffer, node->type);
+        }
+
+        case NODE_SHL:
+        {
+            const struct AstNode *count = &ast->nodes[node->binary.right_index];
+            if (count->type != NODE_INT || count->value < 0 || count->value > 63) {
+                return false;
+            }
+
+            // <left>; shl rax, imm8
+            const char shift = (char)count->value;
+            return
+                jit_compile_node(buffer, ast, node->binary.left_index) &&
+                jit_emit(buffer, "\x48\xC1\xE0", 3) &&
+                jit_emit(buffer, &shift, 1);
+        }
+
+        case NODE_SAR:
+        {
+            const struct AstNode *count = &ast->nodes[node->binary.right_index];
+            if (count->type != NODE_INT || count->value < 0 || count->value > 63) {
+                return false;
+            }
+
+            // <left>; sar rax, imm8
+            const char shift = (char)count->value;
+            return
+                jit_compile_node(buffer, ast, node->binary.left_index) &&
+                jit_emit(buffer, "\x48\xC1\xF8", 3) &&
+                jit_emit(buffer, &shift, 1);
+        }
+
+        case NODE_MULHI:
+        {
+            const struct AstNode *factor = &ast->nodes[node->binary.right_index];
+            if (factor->type != NODE_INT) {
+                return false;
+            }
+
+            // <left>; mov rcx, imm64; imul rcx; mov rax, rdx
+            return
+                jit_compile_node(buffer, ast, node->binary.left_index) &&
+                jit_emit(buffer, "\x48\xB9", 2) &&
+                jit_emit_int64(buffer, factor->value) &&
+                jit_emit(buffer, "\x48\xF7\xE9\x48\x89\xD0", 6);
+        }
+
+        case NODE_INV:
+            // <child>; neg rax
+            return
+                jit_compile_node(buffer, ast, node->child_index) &&
+                jit_emit(buffer, "\x48\xF7\xD8", 3);
+
+        case NODE_INT:
+        case NODE_VAR:
+            return jit_compile_load(buffer, node);
+
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+struct JitFunction jit_compile(const struct Ast *ast) {
+    struct JitFunction jit = JIT_FUNCTION_INIT;
+    struct Buffer buffer = BUFFER_INIT;
+
+    if (ast->nodes_used == 0) {
+        // xor eax, eax
+        if (!jit_emit(&buffer, "\x31\xC0", 2)) {
+            goto cleanup;
+        }
+    } else if (!jit_compile_node(&buffer, ast, AST_ROOT_NODE_INDEX(ast))) {
+        goto cleanup;
+    }
+
+    // ret
+    if (!jit_emit(&buffer, "\xC3", 1)) {
+        goto cleanup;
+    }
+
+    // W^X: write the code while the pages are writable, then flip them to
+    // executable.
+    void *code = mmap(NULL, buffer.used, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        goto cleanup;
+    }
+
+    memcpy(code, buffer.data, buffer.used);
+
+    if (mprotect(code, buffer.used, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, buffer.used);
+        goto cleanup;
+    }
+
+    jit.code      = code;
+    jit.code_size = buffer.used;
+    jit.func      = (JitFunc)code;
+
+cleanup:
+    buffer_destroy(&buffer);
+
+    return jit;
+}
+
+void jit_destroy(struct JitFunction *jit) {
+    if (jit->code != NULL) {
+        munmap(jit->code, jit->code_size);
+    }
+
+    *jit = JIT_FUNCTION_INIT;
+}
+
+#else
+
+struct JitFunction jit_compile(const struct Ast *ast) {
+    (void)ast;
+    return JIT_FUNCTION_INIT;
+}
+
+void jit_destroy(struct JitFunction *jit) {
+    *jit = JIT_FUNCTION_INIT;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef JIT_H
+#define JIT_H
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__x86_64__)
+    #define JIT_SUPPORTED 1
+#else
+    #define JIT_SUPPORTED 0
+#endif
+
+typedef long (*JitFunc)(const long args[]);
+
+struct JitFunction {
+    // executable (read only) memory returned by mmap()
+    void *code;
+    size_t code_size;
+
+    // same address as code, but callable
+    JitFunc func;
+};
+
+#define JIT_FUNCTION_INIT (struct JitFunction){ .code = NULL, .code_size = 0, .func = NULL }
+
+// Compiles the given AST to native x86_64 code. On error or on other
+// architectures func is NULL.
+struct JitFunction jit_compile(const struct Ast *ast);
+void jit_destroy(struct JitFunction *jit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,15 +1,19 @@
 #include "ast.h"
 #include "parser.h"
 #include "optimizer.h"
+#include "strength.h"
 #include "bytecode.h"
+#include "jit.h"
+#include "regvm.h"
 
 #include <stdio.h>
 #include <stdlib.h>
-
-// TODO: x86_64 compiler
+#include <string.h>
 
 static void usage(int argc, char *argv[]) {
-    printf("Usage: %s [parameter-names...] code\n", argc > 0 ? argv[0] : "parser_example");
+    const char *prog = argc > 0 ? argv[0] : "parser_example";
+    printf("Usage: %s [parameter-names...] code\n", prog);
+    printf("       %s -f file [parameter-names...]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
@@ -18,24 +22,40 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    const char *code = argv[argc - 1];
+    // the code is either the last argument or read from a file
+    const bool from_file = strcmp(argv[1], "-f") == 0;
+    if (from_file && argc < 3) {
+        usage(argc, argv);
+        return 1;
+    }
+
+    char **arg_names = from_file ? &argv[3] : &argv[1];
+    const int arg_count = from_file ? argc - 3 : argc - 2;
+    const char *code = from_file ? argv[2] : argv[argc - 1];
+
     long *args = NULL;
-    struct Parser parser = parse_string(code, &argv[1], argc - 2);
+    struct Parser parser = from_file ?
+        parse_file(code, arg_names, arg_count) :
+        parse_string(code, arg_names, arg_count);
     int status = 0;
 
     if (parser.error != ERROR_NONE) {
-        parser_print_error(&parser, stderr);
+        if (from_file && parser.error == ERROR_IO) {
+            fprintf(stderr, "Error: %s: %s\n", code, strerror(parser.error_info.errnum));
+        } else {
+            parser_print_error(&parser, stderr);
+        }
         goto error;
     }
 
-    args = calloc(argc - 2, sizeof(long));
+    args = calloc(arg_count + 1, sizeof(long));
     if (args == NULL) {
         perror("allocating arguments");
-        return 1;
+        goto error;
     }
 
-    for (int argind = 1; argind < argc - 1; ++ argind) {
-        const char *name = argv[argind];
+    for (int argind = 0; argind < arg_count; ++ argind) {
+        const char *name = arg_names[argind];
         const char *strvalue = getenv(name);
         if (strvalue == NULL) {
             fprintf(stderr, "Error: Environment variable not set: %s\n", name);
@@ -52,30 +72,34 @@ int main(int argc, char *argv[]) {
             goto error;
         }
 
-        args[argind - 1] = value;
+        args[argind] = value;
     }
 
     putchar('(');
-    for (int argind = 1; argind < argc - 1;) {
-        printf("%s", argv[argind]);
+    for (int argind = 0; argind < arg_count;) {
+        printf("%s", arg_names[argind]);
         ++ argind;
-        if (argind < argc - 1) {
+        if (argind < arg_count) {
             printf(", ");
         }
     }
-    printf(") -> %s\n\n", code);
+    if (from_file) {
+        printf(") -> file %s\n\n", code);
+    } else {
+        printf(") -> %s\n\n", code);
+    }
 
     printf("AST\n");
     printf("---\n");
 
     printf("Parsed AST: ");
-    ast_print(&parser.ast, &argv[1], stdout);
+    ast_print(&parser.ast, arg_names, stdout);
     const long value_ast = ast_eval(&parser.ast, args);
     printf(" = %ld\n", value_ast);
 
     printf("Optimized AST: ");
     optimize(&parser.ast);
-    ast_print(&parser.ast, &argv[1], stdout);
+    ast_print(&parser.ast, arg_names, stdout);
     const long value_opt = ast_eval(&parser.ast, args);
     printf(" = %ld\n\n", value_opt);
 
@@ -84,13 +108,28 @@ int main(int argc, char *argv[]) {
         status = 1;
     }
 
+    size_t eliminated = 0;
+    if (!optimize_cse(&parser.ast, &eliminated)) {
+        perror("eliminating common subexpressions");
+        goto error;
+    }
+    printf("Common subexpressions: %zu nodes eliminated\n", eliminated);
+
+    const enum StrengthTarget strength_target = STRENGTH_TARGET_VM;
+    size_t lowered = 0;
+    if (!optimize_strength(&parser.ast, get_strength_costs(strength_target), &lowered)) {
+        perror("reducing strength");
+        goto error;
+    }
+    printf("Strength reduction (%s costs): %zu multiplications and divisions lowered\n\n", get_strength_target_name(strength_target), lowered);
+
     printf("Byte Code\n");
     printf("---------\n");
     struct Bytecode bytecode = bytecode_compile(&parser.ast);
     if (bytecode.stack_size == 0) {
         fprintf(stderr, "Error (probably out of memory)\n"); // TODO: better error messages
     } else {
-        bytecode_print(bytecode.bytes.data, &argv[1], stdout);
+        bytecode_print(bytecode.bytes.data, arg_names, stdout);
         const long value_bc = bytecode_eval(bytecode.bytes.data, args);
         printf("\nresult = %ld\n", value_bc);
 
@@ -102,6 +141,48 @@ int main(int argc, char *argv[]) {
 
     bytecode_destroy(&bytecode);
 
+    printf("\nRegister Code\n");
+    printf("-------------\n");
+    struct RegCode regcode = regcode_compile(&parser.ast);
+    if (regcode.reg_count == 0) {
+        fprintf(stderr, "Error (probably out of memory)\n");
+        status = 1;
+    } else {
+        regcode_print(&regcode, arg_names, stdout);
+        const long value_reg = regcode_eval(&regcode, args);
+        printf("\nresult = %ld\n", value_reg);
+
+        if (value_ast != value_reg) {
+            fprintf(stderr, "\nError: register code gives a different result!\n");
+            status = 1;
+        }
+    }
+
+    regcode_destroy(&regcode);
+
+    printf("\nJIT\n");
+    printf("---\n");
+    struct JitFunction jit = jit_compile(&parser.ast);
+    if (jit.func == NULL) {
+        if (JIT_SUPPORTED) {
+            fprintf(stderr, "Error (probably out of memory)\n");
+            status = 1;
+        } else {
+            printf("not supported on this architecture\n");
+        }
+    } else {
+        const long value_jit = jit.func(args);
+        printf("machine code size: %zu B\n", jit.code_size);
+        printf("result = %ld\n", value_jit);
+
+        if (value_ast != value_jit) {
+            fprintf(stderr, "\nError: JIT compiled code gives a different result!\n");
+            status = 1;
+        }
+    }
+
+    jit_destroy(&jit);
+
     goto cleanup;
 
 error:
@@ -1,6 +1,9 @@
 #include "optimizer.h"
+#include "polynomial.h"
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 static void node_optimize_recursive(struct Ast *ast, size_t node_index);
 static void node_optimize(struct Ast *ast, const size_t node_index);
@@ -8,6 +11,9 @@ static void node_optimize(struct Ast *ast, const size_t node_index);
 void optimize(struct Ast *ast) {
     const size_t node_index = AST_ROOT_NODE_INDEX(ast);
     node_optimize_recursive(ast, node_index);
+
+    // Optional, if it runs out of memory the AST is just less optimized.
+    optimize_polynomials(ast);
 }
 
 // TODO: deeper optimizations
@@ -20,6 +26,9 @@ void node_optimize_recursive(struct Ast *ast, const size_t node_index) {
         case NODE_SUB:
         case NODE_MUL:
         case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
             node_optimize_recursive(ast, node->binary.left_index);
             node_optimize_recursive(ast, node->binary.right_index);
             break;
@@ -547,6 +556,37 @@ void node_optimize(struct Ast *ast, const size_t node_index) {
                 }
                 return;
             }
+            case NODE_SHL:
+            {
+                const struct AstNode *left  = &ast->nodes[node->binary.left_index];
+                const struct AstNode *right = &ast->nodes[node->binary.right_index];
+                if (left->type == NODE_INT && right->type == NODE_INT) {
+                    *node = (struct AstNode) {
+                        .type = NODE_INT,
+                        .start_index = node->start_index,
+                        .end_index   = node->end_index,
+                        .value = ast_shl(left->value, right->value),
+                    };
+                }
+                return;
+            }
+            case NODE_MULHI:
+            case NODE_SAR:
+            {
+                const struct AstNode *left  = &ast->nodes[node->binary.left_index];
+                const struct AstNode *right = &ast->nodes[node->binary.right_index];
+                if (left->type == NODE_INT && right->type == NODE_INT) {
+                    *node = (struct AstNode) {
+                        .type = NODE_INT,
+                        .start_index = node->start_index,
+                        .end_index   = node->end_index,
+                        .value = node->type == NODE_MULHI ?
+                            ast_mulhi(left->value, right->value) :
+                            ast_sar(left->value, right->value),
+                    };
+                }
+                return;
+            }
             case NODE_INT:
             case NODE_VAR:
                 return;
@@ -557,3 +597,182 @@ void node_optimize(struct Ast *ast, const size_t node_index) {
         }
     }
 }
+
+static bool is_commutative(enum NodeType type) {
+    return type == NODE_ADD || type == NODE_MUL;
+}
+
+static size_t node_hash(const struct AstNode *node) {
+    size_t first  = 0;
+    size_t second = 0;
+
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+            first  = node->binary.left_index;
+            second = node->binary.right_index;
+            if (is_commutative(node->type) && first > second) {
+                first  = node->binary.right_index;
+                second = node->binary.left_index;
+            }
+            break;
+
+        case NODE_INV:
+            first = node->child_index;
+            break;
+
+        case NODE_INT:
+            first = (size_t)node->value;
+            break;
+
+        case NODE_VAR:
+            first = node->arg_index;
+            break;
+    }
+
+    // FNV-1a over the three words
+    uint64_t hash = 14695981039346656037UL;
+    const uint64_t words[] = { (uint64_t)node->type, first, second };
+    for (size_t index = 0; index < sizeof(words) / sizeof(words[0]); ++ index) {
+        uint64_t word = words[index];
+        for (size_t byte = 0; byte < sizeof(word); ++ byte) {
+            hash ^= word & 0xff;
+            hash *= 1099511628211UL;
+            word >>= 8;
+        }
+    }
+
+    return (size_t)hash;
+}
+
+// Children are already canonical, so a shallow comparison is enough.
+static bool node_equals(const struct AstNode *a, const struct AstNode *b) {
+    if (a->type != b->type) {
+        return false;
+    }
+
+    switch (a->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+            if (a->binary.left_index == b->binary.left_index && a->binary.right_index == b->binary.right_index) {
+                return true;
+            }
+            return is_commutative(a->type) &&
+                a->binary.left_index == b->binary.right_index &&
+                a->binary.right_index == b->binary.left_index;
+
+        case NODE_INV:
+            return a->child_index == b->child_index;
+
+        case NODE_INT:
+            return a->value == b->value;
+
+        case NODE_VAR:
+            return a->arg_index == b->arg_index;
+
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+bool optimize_cse(struct Ast *ast, size_t *eliminated) {
+    *eliminated = 0;
+
+    // post-order makes it possible to canonicalize bottom up in one pass
+    if (!ast_compact(ast)) {
+        return false;
+    }
+
+    if (ast->nodes_used == 0) {
+        return true;
+    }
+
+    const size_t nodes_used = ast->nodes_used;
+
+    // power of two with a load factor of at most 1/2
+    size_t table_size = 16;
+    while (table_size < nodes_used * 2) {
+        if (table_size > SIZE_MAX / 2 / sizeof(size_t)) {
+            return false;
+        }
+        table_size *= 2;
+    }
+
+    size_t *table = allocator_alloc(ast->allocator, sizeof(size_t) * table_size);
+    size_t *canonical = allocator_alloc(ast->allocator, sizeof(size_t) * nodes_used);
+
+    if (table == NULL || canonical == NULL) {
+        allocator_free(ast->allocator, canonical);
+        allocator_free(ast->allocator, table);
+        return false;
+    }
+
+    for (size_t index = 0; index < table_size; ++ index) {
+        table[index] = SIZE_MAX;
+    }
+
+    for (size_t index = 0; index < nodes_used; ++ index) {
+        struct AstNode *node = &ast->nodes[index];
+
+        switch (node->type) {
+            case NODE_ADD:
+            case NODE_SUB:
+            case NODE_MUL:
+            case NODE_DIV:
+            case NODE_SHL:
+            case NODE_MULHI:
+            case NODE_SAR:
+                node->binary.left_index  = canonical[node->binary.left_index];
+                node->binary.right_index = canonical[node->binary.right_index];
+                break;
+
+            case NODE_INV:
+                node->child_index = canonical[node->child_index];
+                break;
+
+            default:
+                break;
+        }
+
+        size_t slot = node_hash(node) & (table_size - 1);
+        for (;;) {
+            const size_t other = table[slot];
+
+            if (other == SIZE_MAX) {
+                table[slot] = index;
+                canonical[index] = index;
+                break;
+            }
+
+            if (node_equals(&ast->nodes[other], node)) {
+                canonical[index] = other;
+                break;
+            }
+
+            slot = (slot + 1) & (table_size - 1);
+        }
+    }
+
+    allocator_free(ast->allocator, canonical);
+    allocator_free(ast->allocator, table);
+
+    // drop the now unreachable duplicates
+    if (!ast_compact(ast)) {
+        return false;
+    }
+
+    *eliminated = nodes_used - ast->nodes_used;
+
+    return true;
+}
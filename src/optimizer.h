@@ -2,6 +2,9 @@
 #define OPTIMIZER_H
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "ast.h"
 
 #ifdef __cplusplus
@@ -10,6 +13,15 @@ extern "C" {
 
 void optimize(struct Ast *ast);
 
+// Common subexpression elimination: merges structurally equal sub-trees
+// (including a + b and b + a), which turns the AST into a DAG. Reports the
+// number of removed nodes in eliminated. Returns false if out of memory, in
+// which case the AST is still valid, but maybe not fully merged.
+//
+// Run this last: optimize() rewrites child nodes in place and therefore must
+// not be used on a DAG.
+bool optimize_cse(struct Ast *ast, size_t *eliminated);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,56 +2,270 @@
 
 #include <errno.h>
 #include <limits.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static void parser_skip_ignoreable(struct Parser *parser);
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+// Same as isspace() in the C locale.
+#define IS_SPACE(SYM) ((SYM) == ' ' || (unsigned char)((SYM) - '\t') <= '\r' - '\t')
+
+// Bytes classified one at a time before the vectorized loop of lex_count_class().
+#define LEX_SCALAR_PREFIX 4
+
+// Integer literals with up to this many digits can't overflow a long.
+#define LEX_MAX_SAFE_DIGITS 18
+
+// Bytes read at once from files that can't be mapped.
+#define PARSE_FD_CHUNK_SIZE 16384
+
+static bool parser_skip_ignoreable(struct Parser *parser);
 static bool parse_token(struct Parser *parser);
 
+static bool parser_read_token(struct Parser *parser);
 static bool parser_peek_token(struct Parser *parser);
 static bool parser_consume_token(struct Parser *parser);
 static bool parser_append_node(struct Parser *parser, const struct AstNode *node);
-static size_t parser_get_arg_index(struct Parser *parser, const char *name);
+static size_t parser_get_arg_index(struct Parser *parser, const char *name, size_t name_len);
 
-static bool parse_expr(struct Parser *parser);
-static bool parse_add_sub(struct Parser *parser, struct AstNode *node);
-static bool parse_mul_div(struct Parser *parser, struct AstNode *node);
-static bool parse_signed(struct Parser *parser, struct AstNode *node);
+struct ParseState;
+
+static void parse_all(struct Parser *parser);
+static void parser_stream_destroy(struct Parser *parser);
+static bool parser_stream_end(struct Parser *parser);
+static bool parse_step(struct Parser *parser, struct ParseState *state);
 static bool parse_atom(struct Parser *parser, struct AstNode *node);
-static bool parse_paren(struct Parser *parser, struct AstNode *node);
 
-size_t parser_get_arg_index(struct Parser *parser, const char *name) {
-    size_t argindex = 0;
+struct ArgSchemaSlot {
+    size_t hash;
+    // SIZE_MAX for empty slots
+    size_t arg_index;
+};
+
+static size_t arg_name_hash(const char *name, size_t name_len) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t index = 0; index < name_len; ++ index) {
+        hash ^= (unsigned char)name[index];
+        hash *= 1099511628211UL;
+    }
+    return (size_t)hash;
+}
+
+// Finds the slot holding the given name or the empty slot where it belongs.
+static size_t arg_schema_find_slot(const struct ArgSchema *schema, size_t hash, const char *name, size_t name_len) {
+    const size_t mask = schema->slots_capacity - 1;
+    size_t slot = hash & mask;
+
+    for (;;) {
+        const struct ArgSchemaSlot *entry = &schema->slots[slot];
+
+        if (entry->arg_index == SIZE_MAX) {
+            return slot;
+        }
+
+        if (entry->hash == hash) {
+            const char *arg = schema->args[entry->arg_index];
+            if (strncmp(arg, name, name_len) == 0 && arg[name_len] == 0) {
+                return slot;
+            }
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+bool arg_schema_init(struct ArgSchema *schema, char *const *const args, size_t argc) {
+    *schema = ARG_SCHEMA_INIT;
+
+    schema->args = args;
+    schema->argc = argc;
+
+    if (argc == 0) {
+        return true;
+    }
+
+    // load factor at most 1/2
+    size_t capacity = 4;
+    while (capacity < argc * 2) {
+        if (capacity > SIZE_MAX / 2 / sizeof(struct ArgSchemaSlot)) {
+            schema->error = ERROR_OUT_OF_MEMORY;
+            return false;
+        }
+        capacity *= 2;
+    }
+
+    schema->slots = malloc(sizeof(struct ArgSchemaSlot) * capacity);
+    if (schema->slots == NULL) {
+        schema->error = ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+    schema->slots_capacity = capacity;
+
+    for (size_t slot = 0; slot < capacity; ++ slot) {
+        schema->slots[slot].arg_index = SIZE_MAX;
+    }
+
+    for (size_t arg_index = 0; arg_index < argc; ++ arg_index) {
+        const char *name = args[arg_index];
+
+        if (!is_identifier(name)) {
+            schema->error = ERROR_ILLEGAL_ARG_NAME;
+            schema->error_arg_index = arg_index;
+            return false;
+        }
+
+        const size_t name_len = strlen(name);
+        const size_t hash = arg_name_hash(name, name_len);
+        struct ArgSchemaSlot *entry = &schema->slots[arg_schema_find_slot(schema, hash, name, name_len)];
 
-    for (; argindex < parser->argc; ++ argindex) {
-        if (strcmp(parser->args[argindex], name) == 0) {
+        if (entry->arg_index != SIZE_MAX) {
+            schema->error = ERROR_DUPLICATED_ARG_NAME;
+            schema->error_arg_index = arg_index;
+            return false;
+        }
+
+        entry->hash = hash;
+        entry->arg_index = arg_index;
+    }
+
+    return true;
+}
+
+void arg_schema_destroy(struct ArgSchema *schema) {
+    free(schema->slots);
+    *schema = ARG_SCHEMA_INIT;
+}
+
+size_t arg_schema_find(const struct ArgSchema *schema, const char *name, size_t name_len) {
+    if (schema->slots_capacity == 0) {
+        return schema->argc;
+    }
+
+    const size_t hash = arg_name_hash(name, name_len);
+    const size_t arg_index = schema->slots[arg_schema_find_slot(schema, hash, name, name_len)].arg_index;
+
+    return arg_index == SIZE_MAX ? schema->argc : arg_index;
+}
+
+size_t parser_get_arg_index(struct Parser *parser, const char *name, size_t name_len) {
+    return arg_schema_find(parser->schema, name, name_len);
+}
+
+// Counts the bytes starting at index that are either in the range
+// [low, low + span] or equal to extra.
+static size_t lex_count_class(const char *code, size_t size, size_t index, unsigned char low, unsigned char span, char extra) {
+    const size_t start_index = index;
+
+    // most runs are short, those are done before setting up any vectors
+    const size_t scalar_end = size - index < LEX_SCALAR_PREFIX ? size : index + LEX_SCALAR_PREFIX;
+    while (index < scalar_end) {
+        const char sym = code[index];
+        if ((unsigned char)(sym - low) > span && sym != extra) {
+            return index - start_index;
+        }
+        ++ index;
+    }
+
+#if defined(__x86_64__)
+    // SSE2 is part of the x86_64 baseline, 16 bytes are classified per step
+    const __m128i vlow   = _mm_set1_epi8((char)low);
+    const __m128i vspan  = _mm_set1_epi8((char)span);
+    const __m128i vextra = _mm_set1_epi8(extra);
+
+    while (index + 16 <= size) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*)(code + index));
+        const __m128i offset = _mm_sub_epi8(bytes, vlow);
+        // unsigned offset <= span
+        const __m128i in_range = _mm_cmpeq_epi8(_mm_min_epu8(offset, vspan), offset);
+        const __m128i matches = _mm_or_si128(in_range, _mm_cmpeq_epi8(bytes, vextra));
+        const unsigned mask = (unsigned)_mm_movemask_epi8(matches);
+
+        if (mask != 0xFFFF) {
+            return index + (size_t)__builtin_ctz(~mask) - start_index;
+        }
+
+        index += 16;
+    }
+#endif
+
+    while (index < size) {
+        const char sym = code[index];
+        if ((unsigned char)(sym - low) > span && sym != extra) {
             break;
         }
+        ++ index;
     }
 
-    return argindex;
+    return index - start_index;
 }
 
-void parser_skip_ignoreable(struct Parser *parser) {
+// Parses count <= LEX_MAX_SAFE_DIGITS decimal digits.
+static long lex_parse_digits(const char *digits, size_t count) {
+    uint64_t value = 0;
+    size_t index = 0;
+
+    assert(count <= LEX_MAX_SAFE_DIGITS);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // SWAR: 8 digits at once, the first digit is in the lowest byte
+    for (; index + 8 <= count; index += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, digits + index, sizeof(chunk));
+
+        chunk -= 0x3030303030303030UL;
+        // pairs of digits
+        chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFUL;
+        // groups of 4 digits
+        chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFUL;
+        // all 8 digits
+        chunk = (chunk * 10000 + (chunk >> 32)) & 0xFFFFFFFFUL;
+
+        value = value * 100000000 + chunk;
+    }
+#endif
+
+    for (; index < count; ++ index) {
+        value = value * 10 + (uint64_t)(digits[index] - '0');
+    }
+
+    return (long)value;
+}
+
+// Returns true if the code ends within a comment.
+bool parser_skip_ignoreable(struct Parser *parser) {
     while (parser->index < parser->code_size) {
         char sym = parser->code[parser->index];
 
         if (sym == '#') { // comment
-            ++ parser->index;
-
-            while (parser->index < parser->code_size && parser->code[parser->index] != '\n') {
-                ++ parser->index;
+            const char *newline = memchr(parser->code + parser->index, '\n', parser->code_size - parser->index);
+            if (newline == NULL) {
+                parser->index = parser->code_size;
+                return true;
             }
-        } else if (!isspace(sym)) {
+            parser->index = (size_t)(newline - parser->code);
+        } else if (!IS_SPACE(sym)) {
             break;
         } else {
             ++ parser->index;
+
+            // single spaces between tokens are the common case
+            if (parser->index < parser->code_size && IS_SPACE(parser->code[parser->index])) {
+                parser->index += lex_count_class(parser->code, parser->code_size, parser->index, '\t', '\r' - '\t', ' ');
+            }
         }
     }
+
+    return false;
 }
 
 struct Location get_location(const char *code, size_t size, size_t index) {
@@ -86,6 +300,156 @@ size_t get_line_end(const char *code, size_t size, size_t index) {
     return endptr == NULL ? size : (size_t)(endptr - code);
 }
 
+void line_index_init(struct LineIndex *lines, const char *code, size_t code_size) {
+    *lines = LINE_INDEX_INIT;
+    lines->code = code;
+    lines->code_size = code_size;
+}
+
+void line_index_destroy(struct LineIndex *lines) {
+    free(lines->line_starts);
+    *lines = LINE_INDEX_INIT;
+}
+
+static bool line_index_append(struct LineIndex *lines, size_t line_start) {
+    if (lines->lines_used == lines->lines_capacity) {
+        const size_t new_capacity = lines->lines_capacity * 2;
+
+        if (new_capacity > SIZE_MAX / sizeof(size_t)) {
+            return false;
+        }
+
+        size_t *line_starts = realloc(lines->line_starts, sizeof(size_t) * new_capacity);
+        if (line_starts == NULL) {
+            return false;
+        }
+
+        lines->line_starts = line_starts;
+        lines->lines_capacity = new_capacity;
+    }
+
+    lines->line_starts[lines->lines_used ++] = line_start;
+
+    return true;
+}
+
+bool line_index_build(struct LineIndex *lines) {
+    if (lines->line_starts != NULL) {
+        return true;
+    }
+
+    const char *code = lines->code;
+    const size_t size = lines->code_size;
+
+    // a guess for typical line lengths
+    lines->lines_capacity = size / 32 + 16;
+    lines->line_starts = malloc(sizeof(size_t) * lines->lines_capacity);
+    if (lines->line_starts == NULL) {
+        lines->lines_capacity = 0;
+        return false;
+    }
+
+    lines->line_starts[0] = 0;
+    lines->lines_used = 1;
+
+    size_t index = 0;
+
+#if defined(__x86_64__)
+    // 16 bytes at a time, one bit per newline
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    for (; index + 16 <= size; index += 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)(code + index));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        while (mask != 0) {
+            if (!line_index_append(lines, index + (size_t)__builtin_ctz(mask) + 1)) {
+                goto error;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (index < size) {
+        const char *newline_ptr = memchr(code + index, '\n', size - index);
+        if (newline_ptr == NULL) {
+            break;
+        }
+
+        index = (size_t)(newline_ptr - code) + 1;
+        if (!line_index_append(lines, index)) {
+            goto error;
+        }
+    }
+
+    return true;
+
+error:
+    free(lines->line_starts);
+    lines->line_starts = NULL;
+    lines->lines_used = 0;
+    lines->lines_capacity = 0;
+
+    return false;
+}
+
+// Index of the line containing the index (which is clamped to the code size).
+static size_t line_index_find(const struct LineIndex *lines, size_t index) {
+    size_t low = 0;
+    size_t high = lines->lines_used;
+
+    // the last line start <= index
+    while (high - low > 1) {
+        const size_t mid = low + (high - low) / 2;
+        if (lines->line_starts[mid] <= index) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+struct Location line_index_get_location(struct LineIndex *lines, size_t index) {
+    if (index > lines->code_size) {
+        index = lines->code_size;
+    }
+
+    if (!line_index_build(lines)) {
+        return get_location(lines->code, lines->code_size, index);
+    }
+
+    const size_t line = line_index_find(lines, index);
+
+    return (struct Location) {
+        .lineno = line + 1,
+        .column = index - lines->line_starts[line] + 1,
+    };
+}
+
+struct Range line_index_get_line_range(struct LineIndex *lines, size_t index) {
+    if (index > lines->code_size) {
+        index = lines->code_size;
+    }
+
+    if (!line_index_build(lines)) {
+        const struct Location loc = get_location(lines->code, lines->code_size, index);
+        return (struct Range) {
+            .start_index = index - (loc.column - 1),
+            .end_index   = get_line_end(lines->code, lines->code_size, index),
+        };
+    }
+
+    const size_t line = line_index_find(lines, index);
+
+    return (struct Range) {
+        .start_index = lines->line_starts[line],
+        .end_index   = line + 1 < lines->lines_used ? lines->line_starts[line + 1] - 1 : lines->code_size,
+    };
+}
+
 static size_t get_number_length(size_t number) {
     if (number == 0) {
         return 1;
@@ -146,6 +510,19 @@ bool parse_token(struct Parser *parser) {
         default:
             if (sym >= '0' && sym <= '9') {
                 parser->token.start_index = parser->index;
+
+                const size_t digit_count = lex_count_class(parser->code, parser->code_size, parser->index, '0', 9, '0');
+                if (digit_count <= LEX_MAX_SAFE_DIGITS) {
+                    parser->index += digit_count;
+                    parser->state = PARSER_TOKEN_READY;
+                    parser->token.end_index = parser->index;
+                    parser->token.type = TOK_INT;
+                    parser->token.value = lex_parse_digits(parser->code + parser->token.start_index, digit_count);
+
+                    return true;
+                }
+
+                // long literals (possibly with leading zeros) are checked digit by digit
                 long value = 0;
 
                 while (parser->index < parser->code_size) {
@@ -190,29 +567,8 @@ bool parse_token(struct Parser *parser) {
                 }
 
                 parser->token.end_index = parser->index;
-                const size_t namelen = parser->index - parser->token.start_index;
-
-                buffer_clear(&parser->buffer);
-
-                if (!buffer_append(&parser->buffer, parser->code + parser->token.start_index, namelen)) {
-                    parser->state = PARSER_ERROR;
-                    parser->error = ERROR_OUT_OF_MEMORY;
-                    parser->error_info.code.start_index = parser->token.start_index;
-                    parser->error_info.code.end_index   = parser->token.end_index;
-                    return false;
-                }
-
-                if (!buffer_append_byte(&parser->buffer, 0)) {
-                    parser->state = PARSER_ERROR;
-                    parser->error = ERROR_OUT_OF_MEMORY;
-                    parser->error_info.code.start_index = parser->token.start_index;
-                    parser->error_info.code.end_index   = parser->token.end_index;
-                    return false;
-                }
-
                 parser->state = PARSER_TOKEN_READY;
                 parser->token.type = TOK_IDENT;
-                parser->token.name = parser->buffer.data;
 
                 return true;
             } else {
@@ -226,71 +582,380 @@ bool parse_token(struct Parser *parser) {
     }
 }
 
+// Token types in TokenStream::types, operators are stored as their character.
+enum PackedTokenType {
+    PACKED_TOK_EOF   = 0,
+    PACKED_TOK_INT   = 1,
+    PACKED_TOK_IDENT = 2,
+};
+
+static uint8_t pack_token_type(enum TokenType type) {
+    switch (type) {
+        case TOK_EOF:   return PACKED_TOK_EOF;
+        case TOK_INT:   return PACKED_TOK_INT;
+        case TOK_IDENT: return PACKED_TOK_IDENT;
+        default:        return (uint8_t)type;
+    }
+}
+
+static enum TokenType unpack_token_type(uint8_t type) {
+    switch (type) {
+        case PACKED_TOK_EOF:   return TOK_EOF;
+        case PACKED_TOK_INT:   return TOK_INT;
+        case PACKED_TOK_IDENT: return TOK_IDENT;
+        default:               return (enum TokenType)type;
+    }
+}
+
+static bool token_stream_append(struct TokenStream *tokens, const struct Token *token) {
+    if (tokens->tokens_used == tokens->tokens_capacity) {
+        const size_t new_capacity = tokens->tokens_capacity == 0 ? 256 : tokens->tokens_capacity * 2;
+
+        if (new_capacity > SIZE_MAX / sizeof(uint32_t)) {
+            return false;
+        }
+
+        uint8_t *types = realloc(tokens->types, new_capacity);
+        if (types == NULL) {
+            return false;
+        }
+        tokens->types = types;
+
+        uint32_t *start_offsets = realloc(tokens->start_offsets, sizeof(uint32_t) * new_capacity);
+        if (start_offsets == NULL) {
+            return false;
+        }
+        tokens->start_offsets = start_offsets;
+
+        uint32_t *end_offsets = realloc(tokens->end_offsets, sizeof(uint32_t) * new_capacity);
+        if (end_offsets == NULL) {
+            return false;
+        }
+        tokens->end_offsets = end_offsets;
+
+        tokens->tokens_capacity = new_capacity;
+    }
+
+    if (token->type == TOK_INT) {
+        if (tokens->literals_used == tokens->literals_capacity) {
+            const size_t new_capacity = tokens->literals_capacity == 0 ? 64 : tokens->literals_capacity * 2;
+
+            if (new_capacity > SIZE_MAX / sizeof(long)) {
+                return false;
+            }
+
+            long *literals = realloc(tokens->literals, sizeof(long) * new_capacity);
+            if (literals == NULL) {
+                return false;
+            }
+            tokens->literals = literals;
+            tokens->literals_capacity = new_capacity;
+        }
+
+        tokens->literals[tokens->literals_used ++] = token->value;
+    }
+
+    const size_t index = tokens->tokens_used ++;
+    tokens->types[index] = pack_token_type(token->type);
+    tokens->start_offsets[index] = (uint32_t)token->start_index;
+    tokens->end_offsets[index]   = (uint32_t)token->end_index;
+
+    return true;
+}
+
+bool tokenize_slice(struct TokenStream *tokens, const char *code, size_t code_size) {
+    struct Parser lexer = PARSER_INIT;
+
+    tokens->tokens_used = 0;
+    tokens->literals_used = 0;
+    tokens->error = ERROR_NONE;
+    tokens->error_range = (struct Range){ .start_index = 0, .end_index = 0 };
+
+    if (code_size >= UINT32_MAX) {
+        tokens->error = ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+
+    lexer.code = code;
+    lexer.code_size = code_size;
+    lexer.state = PARSER_TOKEN_PENDING;
+
+    for (;;) {
+        if (!parse_token(&lexer)) {
+            tokens->error = lexer.error;
+            tokens->error_range = lexer.error_info.code;
+            return false;
+        }
+
+        if (!token_stream_append(tokens, &lexer.token)) {
+            tokens->error = ERROR_OUT_OF_MEMORY;
+            tokens->error_range = (struct Range){
+                .start_index = lexer.token.start_index,
+                .end_index   = lexer.token.end_index,
+            };
+            return false;
+        }
+
+        if (lexer.token.type == TOK_EOF) {
+            return true;
+        }
+    }
+}
+
+void token_stream_destroy(struct TokenStream *tokens) {
+    free(tokens->types);
+    free(tokens->start_offsets);
+    free(tokens->end_offsets);
+    free(tokens->literals);
+    *tokens = TOKEN_STREAM_INIT;
+}
+
+// Loads the next token of parser->tokens, the final TOK_EOF is repeated.
+bool parser_read_token(struct Parser *parser) {
+    const struct TokenStream *tokens = parser->tokens;
+    const size_t index = parser->token_index;
+
+    assert(index < tokens->tokens_used);
+
+    const enum TokenType type = unpack_token_type(tokens->types[index]);
+
+    parser->token.type = type;
+    parser->token.start_index = tokens->start_offsets[index];
+    parser->token.end_index   = tokens->end_offsets[index];
+
+    if (type == TOK_INT) {
+        assert(parser->literal_index < tokens->literals_used);
+        parser->token.value = tokens->literals[parser->literal_index ++];
+    }
+
+    if (type != TOK_EOF) {
+        ++ parser->token_index;
+    }
+
+    parser->state = PARSER_TOKEN_READY;
+
+    return true;
+}
+
 struct Parser parse_string(const char *code, char *const *const args, size_t argc) {
     return parse_slice(code, strlen(code), args, argc);
 }
 
 struct Parser parse_slice(const char *code, size_t code_size, char *const *const args, size_t argc) {
-    struct Parser parser = {
-        .args = args,
-        .argc = argc,
-        .state = PARSER_TOKEN_PENDING,
-        .error = ERROR_NONE,
-        .error_info = {
-            .code = {
-                .start_index = 0,
-                .end_index   = 0,
-            }
-        },
-        .code = code,
-        .code_size = code_size,
-        .index = 0,
-        .token = {
-            .type = TOK_EOF,
-        },
-        .ast = AST_INIT,
-        .buffer = BUFFER_INIT,
-    };
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
 
-    for (size_t arg_index = 0; arg_index < argc; ++ arg_index) {
-        if (!is_identifier(args[arg_index])) {
-            parser.state = PARSER_ERROR;
-            parser.error = ERROR_ILLEGAL_ARG_NAME;
-            parser.error_info.arg_index = arg_index;
-            return parser;
-        }
+    arg_schema_init(&schema, args, argc);
+    struct Parser parser = parse_slice_with_schema(code, code_size, &schema);
+    arg_schema_destroy(&schema);
+
+    return parser;
+}
+
+// Reads the code in chunks, see parse_stream().
+static struct Parser parse_fd(int fd, char *const *const args, size_t argc) {
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    char chunk[PARSE_FD_CHUNK_SIZE];
+
+    arg_schema_init(&schema, args, argc);
+    struct Parser parser = parse_stream(&schema, &PARSER_OPTIONS_INIT);
 
-        for (size_t other_index = 0; other_index < arg_index; ++ other_index) {
-            if (strcmp(args[arg_index], args[other_index]) == 0) {
-                parser.state = PARSER_ERROR;
-                parser.error = ERROR_DUPLICATED_ARG_NAME;
-                parser.error_info.arg_index = arg_index;
-                return parser;
+    while (parser.stream != NULL) {
+        const ssize_t count = read(fd, chunk, sizeof(chunk));
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            parser.state = PARSER_ERROR;
+            parser.error = ERROR_IO;
+            parser.error_info.errnum = errno;
+            parser_stream_end(&parser);
+        } else if (count == 0) {
+            parser_finish(&parser);
+        } else {
+            parser_feed(&parser, chunk, (size_t)count);
         }
     }
 
-    if (!parse_expr(&parser)) {
-        return parser;
+    arg_schema_destroy(&schema);
+
+    return parser;
+}
+
+struct Parser parse_file(const char *path, char *const *const args, size_t argc) {
+    struct Parser parser = PARSER_INIT;
+    const char *code = "";
+    struct stat info;
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        goto error;
     }
 
-    if (!parser_peek_token(&parser)) {
+    if (fstat(fd, &info) != 0) {
+        goto error;
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+        errno = EISDIR;
+        goto error;
+    }
+
+    if (!S_ISREG(info.st_mode)) {
+        // pipes and devices can't be mapped
+        parser = parse_fd(fd, args, argc);
+        close(fd);
         return parser;
     }
 
-    if (parser.token.type != TOK_EOF) {
-        parser.state = PARSER_ERROR;
-        parser.error = ERROR_ILLEGAL_TOKEN;
-        parser.error_info.code.start_index = parser.token.start_index;
-        parser.error_info.code.end_index   = parser.token.end_index;
+    if ((uintmax_t)info.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        goto error;
+    }
+
+    const size_t code_size = (size_t)info.st_size;
+
+    // nothing to map for empty files
+    if (code_size > 0) {
+        // the code is read once from start to end
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        void *mapping = mmap(NULL, code_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            goto error;
+        }
+        madvise(mapping, code_size, MADV_SEQUENTIAL);
+        code = mapping;
+    }
+
+    close(fd);
+
+    parser = parse_slice(code, code_size, args, argc);
+    parser.code_mapped = code_size > 0;
+
+    return parser;
+
+error:
+    parser.state = PARSER_ERROR;
+    parser.error = ERROR_IO;
+    parser.error_info.errnum = errno;
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return parser;
+}
+
+// Puts the parser in the error state if the schema is invalid.
+static void parser_begin_into(struct Parser *parser, const char *code, size_t code_size, const struct ArgSchema *schema) {
+    parser_reset(parser, code, code_size);
+
+    parser->args = schema->args;
+    parser->argc = schema->argc;
+    parser->schema = schema;
+
+    if (schema->error != ERROR_NONE) {
+        parser->schema = NULL;
+        parser->state = PARSER_ERROR;
+        parser->error = schema->error;
+        if (schema->error != ERROR_OUT_OF_MEMORY) {
+            parser->error_info.arg_index = schema->error_arg_index;
+        }
+    }
+}
+
+static struct Parser parser_begin(const char *code, size_t code_size, const struct ArgSchema *schema) {
+    struct Parser parser = PARSER_INIT;
+    parser_begin_into(&parser, code, code_size, schema);
+    return parser;
+}
+
+struct Parser parse_slice_with_schema(const char *code, size_t code_size, const struct ArgSchema *schema) {
+    const struct ParserOptions options = PARSER_OPTIONS_INIT;
+    return parse_slice_with_options(code, code_size, schema, &options);
+}
+
+// Every token adds at most one node and takes at least one byte, so codes up
+// to this size get all the nodes they can need up front.
+#define PARSER_EXACT_RESERVE_SIZE 4096
+
+// About 2.5 MB of nodes. Bigger codes may be mostly whitespace or comments,
+// so they grow from there instead of reserving memory by their size.
+#define PARSER_MAX_ESTIMATED_NODES 65536
+
+static size_t parser_estimate_nodes(size_t code_size) {
+    if (code_size <= PARSER_EXACT_RESERVE_SIZE) {
+        return code_size;
+    }
+
+    // about the density of dense code like "(a + 3)", the rest grows
+    const size_t estimate = code_size / 2;
+    return estimate < PARSER_MAX_ESTIMATED_NODES ? estimate : PARSER_MAX_ESTIMATED_NODES;
+}
+
+static bool parser_reserve_nodes(struct Parser *parser, size_t capacity) {
+    if (!ast_reserve(&parser->ast, capacity)) {
+        parser->state = PARSER_ERROR;
+        parser->error = ERROR_OUT_OF_MEMORY;
+        parser->error_info.code.start_index = 0;
+        parser->error_info.code.end_index   = 0;
+        return false;
+    }
+
+    return true;
+}
+
+struct Parser parse_slice_with_options(const char *code, size_t code_size, const struct ArgSchema *schema,
+        const struct ParserOptions *options) {
+    struct Parser parser = PARSER_INIT;
+    parse_slice_into(&parser, code, code_size, schema, options);
+    return parser;
+}
+
+bool parse_slice_into(struct Parser *parser, const char *code, size_t code_size, const struct ArgSchema *schema,
+        const struct ParserOptions *options) {
+    if (parser->ast.allocator != options->allocator) {
+        ast_destroy(&parser->ast);
+        parser->ast.allocator = options->allocator;
+    }
+
+    parser_begin_into(parser, code, code_size, schema);
+    parser->max_depth = options->max_depth;
+
+    if (parser->state != PARSER_ERROR) {
+        if (options->reserve_nodes == 0) {
+            // only a hint, if it can't be reserved the AST just grows while
+            // parsing
+            (void)ast_reserve(&parser->ast, parser_estimate_nodes(code_size));
+            parse_all(parser);
+        } else if (parser_reserve_nodes(parser, options->reserve_nodes)) {
+            parse_all(parser);
+        }
+    }
+    parser->schema = NULL;
+
+    return parser->state == PARSER_DONE;
+}
+
+struct Parser parse_tokens(const struct TokenStream *tokens, const char *code, size_t code_size, const struct ArgSchema *schema) {
+    struct Parser parser = parser_begin(code, code_size, schema);
+
+    if (parser.state == PARSER_ERROR) {
         return parser;
     }
 
-    if (!parser_consume_token(&parser)) {
-        return parser;
+    if (tokens->error != ERROR_NONE) {
+        parser.state = PARSER_ERROR;
+        parser.error = tokens->error;
+        parser.error_info.code = tokens->error_range;
+    } else if (parser_reserve_nodes(&parser, tokens->tokens_used)) {
+        parser.tokens = tokens;
+        parse_all(&parser);
     }
 
-    parser.state = PARSER_DONE;
+    parser.schema = NULL;
+    parser.tokens = NULL;
 
     return parser;
 }
@@ -301,7 +966,7 @@ bool parser_peek_token(struct Parser *parser) {
         return true;
 
     case PARSER_TOKEN_PENDING:
-        return parse_token(parser);
+        return parser->tokens == NULL ? parse_token(parser) : parser_read_token(parser);
 
     default:
         return false;
@@ -335,192 +1000,576 @@ bool parser_append_node(struct Parser *parser, const struct AstNode *node) {
     return true;
 }
 
-bool parse_expr(struct Parser *parser) {
+// Binary operator waiting for its right operand.
+struct PendingOp {
+    // TOK_EOF if there is none
+    enum TokenType type;
+    size_t start_index;
+    size_t end_index;
+    size_t left_index;
+};
+
+#define PENDING_OP_NONE (struct PendingOp){ .type = TOK_EOF, .start_index = 0, .end_index = 0, .left_index = 0 }
+
+// State of the enclosing expression while a parenthesized one is parsed.
+struct ParseFrame {
+    struct PendingOp add_sub;
+    struct PendingOp mul_div;
+    // signs in front of the parenthesis
+    size_t signed_start_index;
+    bool inverse;
+    size_t paren_start_index;
+};
+
+// Frames kept inline before the frame stack is moved to the heap.
+#define PARSE_INLINE_FRAMES 16
+
+enum ParseStep {
+    // the next token starts an operand
+    PARSE_STEP_OPERAND,
+    // within the signs in front of an operand
+    PARSE_STEP_SIGNS,
+    // the next token follows a complete operand
+    PARSE_STEP_OPERATOR,
+};
+
+// State of parse_step() between tokens. Frames points into the struct itself
+// at first, so it must not be moved.
+struct ParseState {
+    enum ParseStep step;
+    struct PendingOp add_sub;
+    struct PendingOp mul_div;
+    // signs in front of the current operand
+    size_t signed_start_index;
+    bool inverse;
+    // the current operand in PARSE_STEP_OPERATOR
     struct AstNode node;
-    if (!parse_add_sub(parser, &node)) {
+
+    struct ParseFrame *frames;
+    size_t frames_capacity;
+    size_t depth;
+    struct ParseFrame inline_frames[PARSE_INLINE_FRAMES];
+    // the allocator of the AST
+    const struct Allocator *allocator;
+};
+
+static void parse_state_init(struct ParseState *state, const struct Allocator *allocator) {
+    state->step = PARSE_STEP_OPERAND;
+    state->add_sub = PENDING_OP_NONE;
+    state->mul_div = PENDING_OP_NONE;
+    state->signed_start_index = 0;
+    state->inverse = false;
+    state->frames = state->inline_frames;
+    state->frames_capacity = PARSE_INLINE_FRAMES;
+    state->depth = 0;
+    state->allocator = allocator;
+}
+
+static void parse_state_destroy(struct ParseState *state) {
+    if (state->frames != state->inline_frames) {
+        allocator_free(state->allocator, state->frames);
+    }
+    state->frames = state->inline_frames;
+    state->frames_capacity = PARSE_INLINE_FRAMES;
+    state->depth = 0;
+}
+
+// Appends the left operand and consumes the operator.
+static bool parse_begin_op(struct Parser *parser, const struct AstNode *left, struct PendingOp *op) {
+    const enum TokenType token_type = parser->token.type;
+    const size_t start_index = parser->token.start_index;
+    const size_t end_index   = parser->token.end_index;
+
+    if (!parser_append_node(parser, left) || !parser_consume_token(parser)) {
         return false;
     }
 
-    return parser_append_node(parser, &node);
+    *op = (struct PendingOp) {
+        .type        = token_type,
+        .start_index = start_index,
+        .end_index   = end_index,
+        .left_index  = AST_ROOT_NODE_INDEX(&parser->ast),
+    };
+
+    return true;
 }
 
-bool parse_add_sub(struct Parser *parser, struct AstNode *node) {
-    if (!parse_mul_div(parser, node)) {
+// Appends the right operand and replaces it with the binary node.
+static bool parse_end_op(struct Parser *parser, struct AstNode *node, struct PendingOp *op) {
+    if (!parser_append_node(parser, node)) {
         return false;
     }
 
-    for (;;) {
-        if (!parser_peek_token(parser)) {
-            return false;
+    *node = (struct AstNode) {
+        .type = (enum NodeType) op->type,
+        .start_index = op->start_index,
+        .end_index   = op->end_index,
+        .binary = {
+            .left_index  = op->left_index,
+            .right_index = AST_ROOT_NODE_INDEX(&parser->ast),
         }
+    };
+    *op = PENDING_OP_NONE;
 
-        const enum TokenType token_type = parser->token.type;
-        const size_t start_index = parser->token.start_index;
-        const size_t end_index   = parser->token.end_index;
+    return true;
+}
 
-        if (token_type != TOK_PLUS && token_type != TOK_MINUS) {
-            break;
-        }
+// Applies the folded signs in front of an atom.
+static bool parse_apply_sign(struct Parser *parser, struct AstNode *node, size_t start_index, bool inverse) {
+    if (!inverse) {
+        node->start_index = start_index;
+        return true;
+    }
 
-        if (!parser_append_node(parser, node) || !parser_consume_token(parser)) {
+    if (node->type == NODE_INT) {
+        // apply sign to integer
+        if (node->value == LONG_MAX) {
+            parser->state = PARSER_ERROR;
+            parser->error = ERROR_VALUE_OUT_OF_RANGE;
+            parser->error_info.code.start_index = start_index;
+            parser->error_info.code.end_index   = node->end_index;
             return false;
         }
 
-        const size_t left_index = AST_ROOT_NODE_INDEX(&parser->ast);
-        struct AstNode right;
+        node->start_index = start_index;
+        node->value = -node->value;
+        return true;
+    }
+
+    if (!parser_append_node(parser, node)) {
+        return false;
+    }
+
+    *node = (struct AstNode) {
+        .type        = NODE_INV,
+        .start_index = start_index,
+        .end_index   = node->end_index,
+        .child_index = AST_ROOT_NODE_INDEX(&parser->ast),
+    };
+
+    return true;
+}
+
+// Reduces an operand (an atom or a parenthesized expression) that is complete.
+static bool parse_end_operand(struct Parser *parser, struct ParseState *state) {
+    if (!parse_apply_sign(parser, &state->node, state->signed_start_index, state->inverse)) {
+        return false;
+    }
 
-        if (!parse_mul_div(parser, &right)) {
+    // MUL_DIV := SIGNED {( "*" | "/" ) SIGNED}
+    if (state->mul_div.type != TOK_EOF) {
+        if (state->mul_div.type == TOK_DIV && state->node.type == NODE_INT && state->node.value == 0) {
+            parser->state = PARSER_ERROR;
+            parser->error = ERROR_DIV_BY_ZERO;
+            parser->error_info.code.start_index = state->node.start_index;
+            parser->error_info.code.end_index   = state->node.end_index;
             return false;
         }
 
-        if (!parser_append_node(parser, &right)) {
+        if (!parse_end_op(parser, &state->node, &state->mul_div)) {
             return false;
         }
-        const size_t right_index = AST_ROOT_NODE_INDEX(&parser->ast);
-
-        *node = (struct AstNode) {
-            .type = (enum NodeType) token_type,
-            .start_index = start_index,
-            .end_index   = end_index,
-            .binary = {
-                .left_index  = left_index,
-                .right_index = right_index,
-            }
-        };
     }
 
+    state->step = PARSE_STEP_OPERATOR;
+
     return true;
 }
 
-bool parse_mul_div(struct Parser *parser, struct AstNode *node) {
-    if (!parse_signed(parser, node)) {
+// Saves the state of the enclosing expression at an opening parenthesis.
+static bool parse_push_frame(struct Parser *parser, struct ParseState *state) {
+    if (state->depth == parser->max_depth) {
+        parser->state = PARSER_ERROR;
+        parser->error = ERROR_NESTING_TOO_DEEP;
+        parser->error_info.code.start_index = parser->token.start_index;
+        parser->error_info.code.end_index   = parser->token.end_index;
         return false;
     }
 
-    for (;;) {
-        if (!parser_peek_token(parser)) {
+    if (state->depth == state->frames_capacity) {
+        const size_t new_capacity = state->frames_capacity * 2;
+        struct ParseFrame *new_frames = new_capacity > SIZE_MAX / sizeof(struct ParseFrame) ? NULL :
+            state->frames == state->inline_frames ?
+            allocator_alloc(state->allocator, sizeof(struct ParseFrame) * new_capacity) :
+            allocator_realloc(state->allocator, state->frames,
+                sizeof(struct ParseFrame) * state->frames_capacity, sizeof(struct ParseFrame) * new_capacity);
+
+        if (new_frames == NULL) {
+            parser->state = PARSER_ERROR;
+            parser->error = ERROR_OUT_OF_MEMORY;
+            parser->error_info.code.start_index = parser->token.start_index;
+            parser->error_info.code.end_index   = parser->token.end_index;
             return false;
         }
 
-        const enum TokenType token_type = parser->token.type;
-        const size_t start_index = parser->token.start_index;
-        const size_t end_index   = parser->token.end_index;
-
-        if (token_type != TOK_MUL && token_type != TOK_DIV) {
-            break;
+        if (state->frames == state->inline_frames) {
+            memcpy(new_frames, state->inline_frames, sizeof(state->inline_frames));
         }
 
-        if (!parser_append_node(parser, node) || !parser_consume_token(parser)) {
-            return false;
-        }
+        state->frames = new_frames;
+        state->frames_capacity = new_capacity;
+    }
 
-        const size_t left_index = AST_ROOT_NODE_INDEX(&parser->ast);
-        struct AstNode right;
+    state->frames[state->depth ++] = (struct ParseFrame) {
+        .add_sub = state->add_sub,
+        .mul_div = state->mul_div,
+        .signed_start_index = state->signed_start_index,
+        .inverse = state->inverse,
+        .paren_start_index = parser->token.start_index,
+    };
 
-        if (!parse_signed(parser, &right)) {
-            return false;
-        }
+    state->add_sub = PENDING_OP_NONE;
+    state->mul_div = PENDING_OP_NONE;
 
-        if (token_type == TOK_DIV && right.type == NODE_INT && right.value == 0) {
-            parser->state = PARSER_ERROR;
-            parser->error = ERROR_DIV_BY_ZERO;
-            parser->error_info.code.start_index = right.start_index;
-            parser->error_info.code.end_index   = right.end_index;
+    return true;
+}
+
+// Operator precedence parser without recursion, fed one token at a time, so it
+// can be driven by parse_all() as well as by parser_feed(). Nodes are appended
+// in the same order as a recursive descent parser would. Consumes the current
+// token unless there is an error.
+bool parse_step(struct Parser *parser, struct ParseState *state) {
+    const enum TokenType token_type = parser->token.type;
+
+    switch (state->step) {
+        case PARSE_STEP_OPERAND:
+            // SIGNED := {"+" | "-"} ATOM
+            state->signed_start_index = parser->token.start_index;
+            state->inverse = false;
+            state->step = PARSE_STEP_SIGNS;
+            // fall through
+
+        case PARSE_STEP_SIGNS:
+            if (token_type == TOK_PLUS || token_type == TOK_MINUS) {
+                // fold series of signs
+                if (token_type == TOK_MINUS) {
+                    state->inverse = !state->inverse;
+                }
+                return parser_consume_token(parser);
+            }
+
+            if (token_type == TOK_PAREN_OPEN) {
+                // PAREN := "(" EXPR ")"
+                if (!parse_push_frame(parser, state)) {
+                    return false;
+                }
+                state->step = PARSE_STEP_OPERAND;
+                return parser_consume_token(parser);
+            }
+
+            return parse_atom(parser, &state->node) && parse_end_operand(parser, state);
+
+        case PARSE_STEP_OPERATOR:
+            if (token_type == TOK_MUL || token_type == TOK_DIV) {
+                state->step = PARSE_STEP_OPERAND;
+                return parse_begin_op(parser, &state->node, &state->mul_div);
+            }
+
+            // ADD_SUB := MUL_DIV {( "+" | "-" ) MUL_DIV}
+            if (state->add_sub.type != TOK_EOF && !parse_end_op(parser, &state->node, &state->add_sub)) {
+                return false;
+            }
+
+            if (token_type == TOK_PLUS || token_type == TOK_MINUS) {
+                state->step = PARSE_STEP_OPERAND;
+                return parse_begin_op(parser, &state->node, &state->add_sub);
+            }
+
+            if (state->depth == 0) {
+                // the expression is complete, only the end of the code may follow
+                if (!parser_append_node(parser, &state->node)) {
+                    return false;
+                }
+
+                if (token_type != TOK_EOF) {
+                    parser->state = PARSER_ERROR;
+                    parser->error = ERROR_ILLEGAL_TOKEN;
+                    parser->error_info.code.start_index = parser->token.start_index;
+                    parser->error_info.code.end_index   = parser->token.end_index;
+                    return false;
+                }
+
+                if (!parser_consume_token(parser)) {
+                    return false;
+                }
+
+                parser->state = PARSER_DONE;
+                return true;
+            }
+
+            // end of a parenthesized expression, which is an operand of the enclosing one
+            const struct ParseFrame *frame = &state->frames[-- state->depth];
+
+            if (token_type != TOK_PAREN_CLOSE) {
+                parser->state = PARSER_ERROR;
+                parser->error = ERROR_EXPECTED_CLOSE_PAREN;
+                parser->error_info.code.start_index = frame->paren_start_index;
+                parser->error_info.code.end_index   = parser->token.end_index;
+                return false;
+            }
+
+            if (!parser_consume_token(parser)) {
+                return false;
+            }
+
+            state->add_sub = frame->add_sub;
+            state->mul_div = frame->mul_div;
+            state->signed_start_index = frame->signed_start_index;
+            state->inverse = frame->inverse;
+
+            return parse_end_operand(parser, state);
+
+        default:
+            assert(false);
             return false;
+    }
+}
+
+void parse_all(struct Parser *parser) {
+    struct ParseState state;
+
+    parse_state_init(&state, parser->ast.allocator);
+    while (parser_peek_token(parser) && parse_step(parser, &state)) {}
+    parse_state_destroy(&state);
+}
+
+// State of a streamed parser between chunks.
+struct ParserStream {
+    struct ParseState parse;
+
+    // unfinished identifier or integer at the end of the last chunk
+    char *carry;
+    size_t carry_used;
+    size_t carry_capacity;
+    size_t carry_offset;
+
+    // the last chunk ended within a comment
+    bool in_comment;
+};
+
+static void parser_stream_destroy(struct Parser *parser) {
+    struct ParserStream *stream = parser->stream;
+
+    if (stream != NULL) {
+        parse_state_destroy(&stream->parse);
+        free(stream->carry);
+        free(stream);
+        parser->stream = NULL;
+    }
+}
+
+// Ends streaming, the parser stays in its final state.
+static bool parser_stream_end(struct Parser *parser) {
+    parser_stream_destroy(parser);
+    parser->schema = NULL;
+    parser->code = NULL;
+
+    return parser->state == PARSER_DONE;
+}
+
+struct Parser parse_stream(const struct ArgSchema *schema, const struct ParserOptions *options) {
+    struct Parser parser = parser_begin(NULL, 0, schema);
+    parser.max_depth = options->max_depth;
+    parser.ast.allocator = options->allocator;
+
+    // the code size isn't known
+    if (parser.state == PARSER_ERROR || !parser_reserve_nodes(&parser, options->reserve_nodes)) {
+        parser.schema = NULL;
+        return parser;
+    }
+
+    struct ParserStream *stream = malloc(sizeof(struct ParserStream));
+    if (stream == NULL) {
+        parser.schema = NULL;
+        parser.state = PARSER_ERROR;
+        parser.error = ERROR_OUT_OF_MEMORY;
+        return parser;
+    }
+
+    parse_state_init(&stream->parse, parser.ast.allocator);
+    stream->carry = NULL;
+    stream->carry_used = 0;
+    stream->carry_capacity = 0;
+    stream->carry_offset = 0;
+    stream->in_comment = false;
+
+    parser.stream = stream;
+
+    return parser;
+}
+
+static bool parser_carry(struct Parser *parser, const char *chars, size_t count) {
+    struct ParserStream *stream = parser->stream;
+
+    if (count > stream->carry_capacity - stream->carry_used) {
+        size_t new_capacity = stream->carry_capacity == 0 ? 64 : stream->carry_capacity;
+        while (new_capacity - stream->carry_used < count) {
+            if (new_capacity > SIZE_MAX / 2) {
+                new_capacity = SIZE_MAX;
+                break;
+            }
+            new_capacity *= 2;
         }
 
-        if (!parser_append_node(parser, &right)) {
+        char *carry = new_capacity - stream->carry_used < count ? NULL : realloc(stream->carry, new_capacity);
+        if (carry == NULL) {
+            parser->state = PARSER_ERROR;
+            parser->error = ERROR_OUT_OF_MEMORY;
+            parser->error_info.code.start_index = stream->carry_offset;
+            parser->error_info.code.end_index   = stream->carry_offset + stream->carry_used + count;
             return false;
         }
-        const size_t right_index = AST_ROOT_NODE_INDEX(&parser->ast);
 
-        *node = (struct AstNode) {
-            .type = (enum NodeType) token_type,
-            .start_index = start_index,
-            .end_index   = end_index,
-            .binary = {
-                .left_index  = left_index,
-                .right_index = right_index,
-            }
-        };
+        stream->carry = carry;
+        stream->carry_capacity = new_capacity;
     }
 
+    memcpy(stream->carry + stream->carry_used, chars, count);
+    stream->carry_used += count;
+
     return true;
 }
 
-bool parse_signed(struct Parser *parser, struct AstNode *node) {
-    bool inverse = false;
+// Lexes code[index ..] and feeds the tokens to the parser, code[0] is at offset
+// in the whole code. Unless the code is complete an identifier or integer at
+// its end may continue in the next chunk, it isn't parsed and its start is
+// returned in *rest_index (code_size if there is none).
+static bool parser_feed_window(struct Parser *parser, const char *code, size_t code_size, size_t offset,
+        size_t index, bool complete, size_t *rest_index) {
+    struct ParserStream *stream = parser->stream;
+    bool ok = true;
+
+    parser->code = code;
+    parser->code_size = code_size;
+    parser->code_offset = offset;
+    parser->index = index;
+    *rest_index = code_size;
 
-    if (!parser_peek_token(parser)) {
-        return false;
-    }
+    for (;;) {
+        stream->in_comment = parser_skip_ignoreable(parser);
 
-    const size_t start_index = parser->token.start_index;
+        if (parser->index >= code_size) {
+            break;
+        }
 
-    for (;;) {
-        // fold series of signs
-        if (!parser_peek_token(parser)) {
-            return false;
+        if (!parse_token(parser)) {
+            parser->error_info.code.start_index += offset;
+            parser->error_info.code.end_index   += offset;
+            ok = false;
+            break;
+        }
+
+        if (!complete && parser->token.end_index == code_size &&
+            (parser->token.type == TOK_INT || parser->token.type == TOK_IDENT)) {
+            *rest_index = parser->token.start_index;
+            parser->state = PARSER_TOKEN_PENDING;
+            break;
         }
 
-        const enum TokenType token_type = parser->token.type;
+        parser->token.start_index += offset;
+        parser->token.end_index   += offset;
 
-        if (token_type == TOK_MINUS) {
-            inverse = !inverse;
-        } else if (token_type != TOK_PLUS) {
+        if (!parse_step(parser, &stream->parse)) {
+            ok = false;
             break;
         }
+    }
 
-        if (!parser_consume_token(parser)) {
-            return false;
+    parser->code = NULL;
+    parser->code_size = offset + code_size;
+    parser->code_offset = 0;
+    parser->index = parser->code_size;
+
+    return ok;
+}
+
+bool parser_feed(struct Parser *parser, const char *chunk, size_t chunk_size) {
+    struct ParserStream *stream = parser->stream;
+
+    // errors end streaming
+    if (stream == NULL) {
+        return false;
+    }
+
+    // size of the code so far
+    const size_t offset = parser->code_size;
+    size_t index = 0;
+    size_t rest_index = chunk_size;
+
+    if (stream->in_comment) {
+        const char *newline = memchr(chunk, '\n', chunk_size);
+        if (newline == NULL) {
+            parser->code_size = offset + chunk_size;
+            parser->index = parser->code_size;
+            return true;
         }
+        index = (size_t)(newline - chunk);
+        stream->in_comment = false;
     }
 
-    if (inverse) {
-        struct AstNode child;
+    if (stream->carry_used > 0) {
+        // the unfinished token may go on
+        const bool is_int = stream->carry[0] >= '0' && stream->carry[0] <= '9';
+        size_t count = 0;
 
-        if (!parse_atom(parser, &child)) {
-            return false;
+        while (index + count < chunk_size && (is_int ?
+                chunk[index + count] >= '0' && chunk[index + count] <= '9' :
+                IS_IDENT_TAIL(chunk[index + count]))) {
+            ++ count;
         }
 
-        if (child.type == NODE_INT) {
-            // apply sign to integer
-            if (child.value == LONG_MAX) {
-                parser->state = PARSER_ERROR;
-                parser->error = ERROR_VALUE_OUT_OF_RANGE;
-                parser->error_info.code.start_index = start_index;
-                parser->error_info.code.end_index   = child.end_index;
-                return false;
-            }
+        if (!parser_carry(parser, chunk + index, count)) {
+            return parser_stream_end(parser);
+        }
+        index += count;
 
-            *node = (struct AstNode) {
-                .type        = NODE_INT,
-                .start_index = start_index,
-                .end_index   = child.end_index,
-                .value       = -child.value,
-            };
+        if (index == chunk_size) {
+            parser->code_size = offset + chunk_size;
+            parser->index = parser->code_size;
             return true;
         }
 
-        if (!parser_append_node(parser, &child)) {
-            return false;
+        if (!parser_feed_window(parser, stream->carry, stream->carry_used, stream->carry_offset, 0, true, &rest_index)) {
+            return parser_stream_end(parser);
         }
+        stream->carry_used = 0;
+    }
 
-        *node = (struct AstNode) {
-            .type        = NODE_INV,
-            .start_index = start_index,
-            .end_index   = child.end_index,
-            .child_index = AST_ROOT_NODE_INDEX(&parser->ast),
-        };
+    if (!parser_feed_window(parser, chunk, chunk_size, offset, index, false, &rest_index)) {
+        return parser_stream_end(parser);
+    }
 
-        return true;
-    } else {
-        if (!parse_atom(parser, node)) {
-            return false;
+    if (rest_index < chunk_size) {
+        stream->carry_offset = offset + rest_index;
+        if (!parser_carry(parser, chunk + rest_index, chunk_size - rest_index)) {
+            return parser_stream_end(parser);
         }
-        node->start_index = start_index;
-        return true;
     }
+
+    return true;
+}
+
+bool parser_finish(struct Parser *parser) {
+    struct ParserStream *stream = parser->stream;
+
+    if (stream == NULL) {
+        return parser->state == PARSER_DONE;
+    }
+
+    size_t rest_index = 0;
+    if (stream->carry_used > 0 &&
+        !parser_feed_window(parser, stream->carry, stream->carry_used, stream->carry_offset, 0, true, &rest_index)) {
+        return parser_stream_end(parser);
+    }
+
+    parser->state = PARSER_TOKEN_READY;
+    parser->token.type = TOK_EOF;
+    parser->token.start_index = parser->code_size;
+    parser->token.end_index   = parser->code_size;
+
+    parse_step(parser, &stream->parse);
+
+    return parser_stream_end(parser);
 }
 
 bool parse_atom(struct Parser *parser, struct AstNode *node) {
@@ -535,7 +1584,8 @@ bool parse_atom(struct Parser *parser, struct AstNode *node) {
             if (!parser_consume_token(parser)) {
                 return false;
             }
-            const size_t arg_index = parser_get_arg_index(parser, parser->token.name);
+            const size_t arg_index = parser_get_arg_index(parser, parser->code + (parser->token.start_index - parser->code_offset),
+                parser->token.end_index - parser->token.start_index);
 
             if (arg_index == parser->argc) {
                 parser->state = PARSER_ERROR;
@@ -565,9 +1615,6 @@ bool parse_atom(struct Parser *parser, struct AstNode *node) {
             };
             return true;
 
-        case TOK_PAREN_OPEN:
-            return parse_paren(parser, node);
-
         default:
             parser->state = PARSER_ERROR;
             parser->error = ERROR_ILLEGAL_TOKEN;
@@ -577,57 +1624,37 @@ bool parse_atom(struct Parser *parser, struct AstNode *node) {
     }
 }
 
-bool parse_paren(struct Parser *parser, struct AstNode *node) {
-    if (!parser_peek_token(parser)) {
-        return false;
-    }
-
-    if (parser->token.type != TOK_PAREN_OPEN) {
-        parser->state = PARSER_ERROR;
-        parser->error = ERROR_ILLEGAL_TOKEN;
-        parser->error_info.code.start_index = parser->token.start_index;
-        parser->error_info.code.end_index   = parser->token.end_index;
-        return false;
-    }
-
-    const size_t start_index = parser->token.start_index;
-
-    if (!parser_consume_token(parser)) {
-        return false;
-    }
-
-    if (!parse_add_sub(parser, node)) {
-        return false;
-    }
-
-    if (parser->token.type != TOK_PAREN_CLOSE) {
-        parser->state = PARSER_ERROR;
-        parser->error = ERROR_EXPECTED_CLOSE_PAREN;
-        parser->error_info.code.start_index = start_index;
-        parser->error_info.code.end_index   = parser->token.end_index;
-        return false;
-    }
+void parser_reset(struct Parser *parser, const char *code, size_t code_size) {
+    parser_stream_destroy(parser);
 
-    if (!parser_consume_token(parser)) {
-        return false;
+    if (parser->code_mapped) {
+        munmap((void*)parser->code, parser->code_size);
     }
 
-    return true;
-}
-
-void parser_destroy(struct Parser *parser) {
     parser->args  = NULL;
     parser->argc  = 0;
-    parser->state = PARSER_DONE;
+    parser->schema = NULL;
+    parser->tokens = NULL;
+    parser->token_index = 0;
+    parser->literal_index = 0;
+    parser->max_depth = PARSER_DEFAULT_MAX_DEPTH;
+    parser->state = PARSER_TOKEN_PENDING;
     parser->error = ERROR_NONE;
     parser->error_info.code.start_index = 0;
     parser->error_info.code.end_index   = 0;
-    parser->code = NULL;
-    parser->code_size = 0;
+    parser->code = code;
+    parser->code_size = code_size;
+    parser->code_mapped = false;
     parser->index = 0;
+    parser->code_offset = 0;
+    parser->token = (struct Token){ .type = TOK_EOF };
+    parser->ast.nodes_used = 0;
+}
 
+void parser_destroy(struct Parser *parser) {
+    parser_reset(parser, NULL, 0);
     ast_destroy(&parser->ast);
-    buffer_destroy(&parser->buffer);
+    parser->state = PARSER_DONE;
 }
 
 const char *get_parser_state_name(enum ParserState state) {
@@ -656,13 +1683,31 @@ const char *get_parser_error_message(enum ParserError error) {
         case ERROR_OUT_OF_MEMORY:        return "out of memory";
         case ERROR_VALUE_OUT_OF_RANGE:   return "value out of range";
         case ERROR_DIV_BY_ZERO:          return "division by zero";
+        case ERROR_NESTING_TOO_DEEP:     return "nesting too deep";
+        case ERROR_IO:                   return "I/O error";
         default:
             assert(false);
             return "illegal error code";
     }
 }
 
+static void parser_print_error_token(const struct Parser *parser, FILE *stream) {
+    if (parser->error == ERROR_ILLEGAL_TOKEN) {
+        fprintf(stream, " %s", get_token_name(parser->token.type));
+    } else if (parser->error == ERROR_EXPECTED_CLOSE_PAREN) {
+        fprintf(stream, ", but got %s", get_token_name(parser->token.type));
+    }
+}
+
 void parser_print_error(const struct Parser *parser, FILE *stream) {
+    struct LineIndex lines;
+
+    line_index_init(&lines, parser->code, parser->code_size);
+    parser_print_error_with_lines(parser, &lines, stream);
+    line_index_destroy(&lines);
+}
+
+void parser_print_error_with_lines(const struct Parser *parser, struct LineIndex *lines, FILE *stream) {
     switch (parser->error) {
         case ERROR_NONE:
             fprintf(stream, "no error\n");
@@ -675,6 +1720,12 @@ void parser_print_error(const struct Parser *parser, FILE *stream) {
                 parser->args[parser->error_info.arg_index]);
             return;
 
+        case ERROR_IO:
+            fprintf(stream, "Error: %s: %s\n",
+                get_parser_error_message(parser->error),
+                strerror(parser->error_info.errnum));
+            return;
+
         default:
             break;
     }
@@ -682,28 +1733,31 @@ void parser_print_error(const struct Parser *parser, FILE *stream) {
     const size_t start_index = parser->error_info.code.start_index;
     const size_t end_index   = parser->error_info.code.end_index;
 
-    const struct Location start_loc = get_location(parser->code, parser->code_size, start_index);
-    const struct Location end_loc   = get_location(parser->code, parser->code_size, end_index);
-    const size_t line_start = get_line_start(parser->code, parser->code_size, start_index);
+    if (parser->code == NULL) {
+        // the code of a streamed parser isn't kept
+        fprintf(stream, "Error at index %zu to %zu: %s", start_index, end_index, get_parser_error_message(parser->error));
+        parser_print_error_token(parser, stream);
+        fprintf(stream, "\n");
+        return;
+    }
+
+    const struct Location start_loc = line_index_get_location(lines, start_index);
+    const struct Location end_loc   = line_index_get_location(lines, end_index);
 
     fprintf(stream, "Error in line %zu in column %zu: %s",
         start_loc.lineno, start_loc.column,
         get_parser_error_message(parser->error));
 
-    if (parser->error == ERROR_ILLEGAL_TOKEN) {
-        fprintf(stream, " %s", get_token_name(parser->token.type));
-    } else if (parser->error == ERROR_EXPECTED_CLOSE_PAREN) {
-        fprintf(stream, ", but got %s", get_token_name(parser->token.type));
-    }
+    parser_print_error_token(parser, stream);
     fprintf(stream, "\n\n");
 
     const size_t padding_length = get_number_length(end_loc.lineno);
 
-    size_t index = line_start;
+    size_t index = start_index;
     for (size_t lineno = start_loc.lineno; lineno <= end_loc.lineno; ++ lineno) {
-        const size_t line_end = get_line_end(parser->code, parser->code_size, index);
+        const struct Range line = line_index_get_line_range(lines, index);
         fprintf(stream, " %*zu | ", (int)padding_length, lineno);
-        fwrite(parser->code + index, line_end - index, 1, stream);
+        fwrite(parser->code + line.start_index, line.end_index - line.start_index, 1, stream);
         fprintf(stream, "\n ");
         for (size_t pad = 0; pad < padding_length; ++ pad) {
             fputc(' ', stream);
@@ -711,7 +1765,7 @@ void parser_print_error(const struct Parser *parser, FILE *stream) {
         fprintf(stream, " | ");
 
         const size_t start_column = lineno == start_loc.lineno ? start_loc.column - 1 : 0;
-        const size_t end_column   = lineno == end_loc.lineno   ? end_loc.column - 1 : line_end;
+        const size_t end_column   = lineno == end_loc.lineno   ? end_loc.column - 1 : line.end_index - line.start_index;
 
         size_t cursor = 0;
         for (; cursor < start_column; ++ cursor) {
@@ -726,7 +1780,7 @@ void parser_print_error(const struct Parser *parser, FILE *stream) {
         }
         fputc('\n', stream);
 
-        index = line_end + 1;
+        index = line.end_index + 1;
     }
 }
 
@@ -4,9 +4,9 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
-#include "buffer.h"
 #include "ast.h"
 
 /*
@@ -40,15 +40,15 @@ enum TokenType {
     TOK_EOF = -1,
 };
 
+// The name of an identifier is the slice of the code between start_index and
+// end_index, it isn't copied.
 struct Token {
     enum TokenType type;
     size_t start_index;
     size_t end_index;
 
-    union {
-        const char *name;
-        long value;
-    };
+    // only for TOK_INT
+    long value;
 };
 
 struct Location {
@@ -79,24 +79,98 @@ enum ParserError {
     ERROR_OUT_OF_MEMORY,        // raw location
     ERROR_VALUE_OUT_OF_RANGE,   // token or node -> raw location
     ERROR_DIV_BY_ZERO,          // node
+    ERROR_NESTING_TOO_DEEP,     // token
+    ERROR_IO,                   // errnum
+};
+
+// All tokens of a code as parallel arrays, lexed before parsing. Token i
+// spans start_offsets[i] to end_offsets[i] and the values of the TOK_INT
+// tokens are stored in order in literals. The last token is TOK_EOF. The
+// offsets are 32 bit, so the code has to be smaller than 4 GiB.
+struct TokenStream {
+    // packed token types (see parser.c)
+    uint8_t *types;
+    uint32_t *start_offsets;
+    uint32_t *end_offsets;
+    size_t tokens_used;
+    size_t tokens_capacity;
+
+    long *literals;
+    size_t literals_used;
+    size_t literals_capacity;
+
+    // lexer errors, see error_info.code of the parser
+    enum ParserError error;
+    struct Range error_range;
 };
 
+#define TOKEN_STREAM_INIT (struct TokenStream){ .types = NULL, .start_offsets = NULL, .end_offsets = NULL, .tokens_used = 0, .tokens_capacity = 0, .literals = NULL, .literals_used = 0, .literals_capacity = 0, .error = ERROR_NONE, .error_range = { .start_index = 0, .end_index = 0 } }
+
+// Default limit for nested parentheses, see ParserOptions.
+#define PARSER_DEFAULT_MAX_DEPTH 65536
+
+struct ParserOptions {
+    // deeper nesting of parentheses is reported as ERROR_NESTING_TOO_DEEP
+    size_t max_depth;
+    // becomes the allocator of the AST, NULL for malloc()
+    const struct Allocator *allocator;
+    // expected number of AST nodes, 0 to estimate it from the code size (up to
+    // a limit, and without failing if that can't be reserved)
+    size_t reserve_nodes;
+};
+
+#define PARSER_OPTIONS_INIT (struct ParserOptions){ .max_depth = PARSER_DEFAULT_MAX_DEPTH, .allocator = NULL, .reserve_nodes = 0 }
+
+struct ArgSchemaSlot;
+
+// Argument names validated once and hashed for lookup, to be reused across
+// many parses with the same arguments. The names are not copied and must stay
+// alive while the schema is used.
+struct ArgSchema {
+    char *const * args;
+    size_t argc;
+
+    // open addressing hash table, capacity is a power of two or 0
+    struct ArgSchemaSlot *slots;
+    size_t slots_capacity;
+
+    // ERROR_ILLEGAL_ARG_NAME, ERROR_DUPLICATED_ARG_NAME or ERROR_OUT_OF_MEMORY
+    enum ParserError error;
+    size_t error_arg_index;
+};
+
+#define ARG_SCHEMA_INIT (struct ArgSchema){ .args = NULL, .argc = 0, .slots = NULL, .slots_capacity = 0, .error = ERROR_NONE, .error_arg_index = 0 }
+
+struct ParserStream;
+
 struct Parser {
     char *const * args;
     size_t argc;
+    // only set while parsing
+    const struct ArgSchema *schema;
+    const struct TokenStream *tokens;
+    size_t token_index;
+    size_t literal_index;
+    size_t max_depth;
+    // only set between parse_stream() and parser_finish()
+    struct ParserStream *stream;
 
     enum ParserState state;
     enum ParserError error;
     union {
         size_t arg_index;
         struct Range code;
+        int errnum;
     } error_info;
 
     const char *code;
     size_t code_size;
+    // code is a mapping of a file, see parse_file()
+    bool code_mapped;
     size_t index;
+    // index of code[0] in the whole code, only non-zero while a chunk is parsed
+    size_t code_offset;
 
-    struct Buffer buffer;
     struct Token token;
 
     struct Ast ast;
@@ -106,6 +180,12 @@ struct Parser {
     { \
         .args = NULL, \
         .argc = 0, \
+        .schema = NULL, \
+        .tokens = NULL, \
+        .token_index = 0, \
+        .literal_index = 0, \
+        .max_depth = PARSER_DEFAULT_MAX_DEPTH, \
+        .stream = NULL, \
         .state = PARSER_DONE, \
         .error = ERROR_NONE, \
         .error_info = { \
@@ -116,12 +196,13 @@ struct Parser {
         }, \
         .code = NULL, \
         .code_size = 0, \
+        .code_mapped = false, \
         .index = 0, \
+        .code_offset = 0, \
         .token = { \
             .type = TOK_EOF, \
         }, \
         .ast = AST_INIT, \
-        .buffer = BUFFER_INIT, \
     }
 
 struct Location get_location(const char *code, size_t size, size_t index);
@@ -129,15 +210,99 @@ struct Range get_line_range(const char *code, size_t size, size_t index);
 size_t get_line_start(const char *code, size_t size, size_t index);
 size_t get_line_end(const char *code, size_t size, size_t index);
 
+// Start indices of the lines of a code, to look up locations by binary search
+// instead of scanning the code on every call. It is built on first use, so it
+// costs nothing if there is no error, and can be shared by all error reports
+// for the same code. The code is not copied.
+struct LineIndex {
+    const char *code;
+    size_t code_size;
+
+    // line_starts[0] is 0, NULL until built
+    size_t *line_starts;
+    size_t lines_used;
+    size_t lines_capacity;
+};
+
+#define LINE_INDEX_INIT (struct LineIndex){ .code = NULL, .code_size = 0, .line_starts = NULL, .lines_used = 0, .lines_capacity = 0 }
+
+void line_index_init(struct LineIndex *lines, const char *code, size_t code_size);
+void line_index_destroy(struct LineIndex *lines);
+
+// Builds the index if it isn't built yet. Returns false if out of memory, the
+// lookups below then fall back to scanning the code.
+bool line_index_build(struct LineIndex *lines);
+
+struct Location line_index_get_location(struct LineIndex *lines, size_t index);
+// Range of the line containing the index, without the newline.
+struct Range line_index_get_line_range(struct LineIndex *lines, size_t index);
+
 struct Parser parse_slice(const char *code, size_t code_size, char *const *const args, size_t argc);
 struct Parser parse_string(const char *code, char *const *const args, size_t argc);
 
+// Maps the file read-only and parses it without copying. The mapping is kept
+// for parser_print_error() until the parser is destroyed. Files that can't be
+// mapped, like pipes, are read in chunks with parse_stream(). If the file
+// can't be read the error is ERROR_IO and error_info.errnum is set.
+struct Parser parse_file(const char *path, char *const *const args, size_t argc);
+
+// The schema is not referenced by the returned parser. If the schema is
+// invalid its error is reported by the parser.
+struct Parser parse_slice_with_schema(const char *code, size_t code_size, const struct ArgSchema *schema);
+struct Parser parse_slice_with_options(const char *code, size_t code_size, const struct ArgSchema *schema,
+    const struct ParserOptions *options);
+
+// Like parse_slice_with_options(), but into a parser from PARSER_INIT or an
+// earlier parse, keeping the node memory of its AST. Returns false on error.
+bool parse_slice_into(struct Parser *parser, const char *code, size_t code_size, const struct ArgSchema *schema,
+    const struct ParserOptions *options);
+
+// Lexes the whole code, reusing the memory of the stream. Returns false on
+// error and sets tokens->error and tokens->error_range.
+bool tokenize_slice(struct TokenStream *tokens, const char *code, size_t code_size);
+void token_stream_destroy(struct TokenStream *tokens);
+
+// Parses the tokens of the code returned by tokenize_slice(). If lexing failed
+// the error is reported by the parser. Unlike parse_slice() lexer errors take
+// precedence over syntax errors earlier in the code. Neither the tokens nor the
+// schema are referenced by the returned parser.
+struct Parser parse_tokens(const struct TokenStream *tokens, const char *code, size_t code_size, const struct ArgSchema *schema);
+
+// Push parser for code that arrives in chunks, e.g. from a pipe. Only an
+// unfinished token is kept between chunks and all ranges are indices into the
+// whole code. The schema must stay alive until parser_finish(). The code isn't
+// kept: afterwards code is NULL and code_size is the size of the whole code.
+// To print errors with the offending lines point code to the whole code if it
+// is still available, otherwise parser_print_error() only prints the indices.
+struct Parser parse_stream(const struct ArgSchema *schema, const struct ParserOptions *options);
+
+// Returns false on error.
+bool parser_feed(struct Parser *parser, const char *chunk, size_t chunk_size);
+
+// Ends the code. Returns false on error.
+bool parser_finish(struct Parser *parser);
+
+// Returns false on error and sets schema->error.
+bool arg_schema_init(struct ArgSchema *schema, char *const *const args, size_t argc);
+void arg_schema_destroy(struct ArgSchema *schema);
+
+// The name doesn't need to be NUL terminated. Returns argc if there is no
+// argument with that name.
+size_t arg_schema_find(const struct ArgSchema *schema, const char *name, size_t name_len);
+
 void parser_print_error(const struct Parser *parser, FILE *stream);
 
+// Same as parser_print_error() with an index of parser->code, to be shared
+// when reporting many errors in the same code.
+void parser_print_error_with_lines(const struct Parser *parser, struct LineIndex *lines, FILE *stream);
+
 const char *get_parser_state_name(enum ParserState state);
 const char *get_parser_error_message(enum ParserError error);
 const char *get_token_name(enum TokenType token_type);
 
+// Drops the result of the last parse and prepares the parser for the given
+// code. The AST stays allocated with no nodes.
+void parser_reset(struct Parser *parser, const char *code, size_t code_size);
 void parser_destroy(struct Parser *parser);
 
 bool is_identifier(const char *str);
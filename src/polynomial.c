@@ -0,0 +1,883 @@
+#include "polynomial.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+// Bigger polynomials are treated as opaque atoms.
+#define POLY_MAX_TERMS 256
+#define POLY_MAX_DEGREE 16
+
+// Relative cost of the operations, for deciding if a rebuilt tree is better.
+#define POLY_COST_ADD 1
+#define POLY_COST_MUL 3
+#define POLY_COST_DIV 20
+
+struct PolyTerm {
+    long coeff;
+    uint32_t degree;
+    // sorted atom ids
+    uint32_t atoms[POLY_MAX_DEGREE];
+};
+
+struct Poly {
+    struct PolyTerm *terms;
+    size_t terms_used;
+};
+
+#define POLY_INIT (struct Poly){ .terms = NULL, .terms_used = 0 }
+
+// no shape or atom
+#define POLY_NONE UINT32_MAX
+#define POLY_COST_UNKNOWN SIZE_MAX
+
+// Distinct sub-tree, identified by its node type and the shapes of its children
+// (or its value), so structurally equal sub-trees have the same shape id.
+struct PolyShape {
+    enum NodeType type;
+    uint64_t first;
+    uint64_t second;
+    // atom id or POLY_NONE
+    uint32_t atom;
+};
+
+// Computed on demand and remembered, so every node is visited once. Nodes are
+// only changed by poly_replace(), which updates them.
+struct PolyNodeInfo {
+    // shape id or POLY_NONE
+    uint32_t shape;
+    // node_cost() or POLY_COST_UNKNOWN
+    size_t cost;
+};
+
+struct PolyContext {
+    struct Ast *ast;
+    // representative node of each atom (a variable or an opaque sub-tree)
+    size_t *atoms;
+    size_t atoms_used;
+    size_t atoms_capacity;
+
+    // indexed by node
+    struct PolyNodeInfo *infos;
+    size_t infos_capacity;
+
+    struct PolyShape *shapes;
+    size_t shapes_used;
+    size_t shapes_capacity;
+    // open addressing hash table of shape ids, POLY_NONE for empty slots
+    uint32_t *shape_table;
+    size_t shape_table_size;
+};
+
+static bool node_to_poly(struct PolyContext *ctx, size_t node_index, struct Poly *poly);
+
+// signed overflow is undefined behavior, so wrap explicitly
+static long wrapping_add(long a, long b) {
+    return (long)((unsigned long)a + (unsigned long)b);
+}
+
+static long wrapping_mul(long a, long b) {
+    return (long)((unsigned long)a * (unsigned long)b);
+}
+
+static long wrapping_neg(long a) {
+    return (long)(0UL - (unsigned long)a);
+}
+
+static void poly_destroy(const struct PolyContext *ctx, struct Poly *poly) {
+    allocator_free(ctx->ast->allocator, poly->terms);
+    *poly = POLY_INIT;
+}
+
+static bool poly_alloc(const struct PolyContext *ctx, struct Poly *poly, size_t terms_used) {
+    *poly = POLY_INIT;
+
+    if (terms_used == 0) {
+        return true;
+    }
+
+    poly->terms = allocator_alloc(ctx->ast->allocator, sizeof(struct PolyTerm) * terms_used);
+    if (poly->terms == NULL) {
+        return false;
+    }
+
+    poly->terms_used = terms_used;
+    return true;
+}
+
+static bool poly_is_constant(const struct Poly *poly) {
+    return poly->terms_used == 0 || (poly->terms_used == 1 && poly->terms[0].degree == 0);
+}
+
+static long poly_constant(const struct Poly *poly) {
+    return poly->terms_used == 0 ? 0 : poly->terms[0].coeff;
+}
+
+static int term_compare(const void *a, const void *b) {
+    const struct PolyTerm *left  = a;
+    const struct PolyTerm *right = b;
+
+    // constants last, so they become fusable right hand side operands
+    if ((left->degree == 0) != (right->degree == 0)) {
+        return left->degree == 0 ? 1 : -1;
+    }
+
+    const uint32_t degree = left->degree < right->degree ? left->degree : right->degree;
+    for (uint32_t index = 0; index < degree; ++ index) {
+        if (left->atoms[index] != right->atoms[index]) {
+            return left->atoms[index] < right->atoms[index] ? -1 : 1;
+        }
+    }
+
+    return left->degree == right->degree ? 0 : left->degree < right->degree ? -1 : 1;
+}
+
+// Sorts the atoms and terms, merges like terms and drops zero terms.
+static void poly_normalize(struct Poly *poly) {
+    for (size_t index = 0; index < poly->terms_used; ++ index) {
+        struct PolyTerm *term = &poly->terms[index];
+        // insertion sort, degrees are tiny
+        for (uint32_t atom_index = 1; atom_index < term->degree; ++ atom_index) {
+            const uint32_t atom = term->atoms[atom_index];
+            uint32_t insert_index = atom_index;
+            while (insert_index > 0 && term->atoms[insert_index - 1] > atom) {
+                term->atoms[insert_index] = term->atoms[insert_index - 1];
+                -- insert_index;
+            }
+            term->atoms[insert_index] = atom;
+        }
+    }
+
+    qsort(poly->terms, poly->terms_used, sizeof(struct PolyTerm), term_compare);
+
+    size_t terms_used = 0;
+    for (size_t index = 0; index < poly->terms_used; ++ index) {
+        const struct PolyTerm *term = &poly->terms[index];
+
+        if (terms_used > 0 && term_compare(&poly->terms[terms_used - 1], term) == 0) {
+            struct PolyTerm *prev = &poly->terms[terms_used - 1];
+            prev->coeff = wrapping_add(prev->coeff, term->coeff);
+        } else {
+            poly->terms[terms_used] = *term;
+            ++ terms_used;
+        }
+
+        if (poly->terms[terms_used - 1].coeff == 0) {
+            -- terms_used;
+        }
+    }
+
+    poly->terms_used = terms_used;
+}
+
+// Makes room for the infos of all nodes.
+static bool poly_reserve_infos(struct PolyContext *ctx) {
+    const size_t nodes_used = ctx->ast->nodes_used;
+
+    if (nodes_used <= ctx->infos_capacity) {
+        return true;
+    }
+
+    size_t new_capacity = ctx->infos_capacity * 2;
+    if (new_capacity < nodes_used) {
+        new_capacity = nodes_used;
+    }
+
+    if (new_capacity > SIZE_MAX / sizeof(struct PolyNodeInfo)) {
+        return false;
+    }
+
+    struct PolyNodeInfo *new_infos = allocator_realloc(ctx->ast->allocator, ctx->infos,
+        sizeof(struct PolyNodeInfo) * ctx->infos_capacity, sizeof(struct PolyNodeInfo) * new_capacity);
+    if (new_infos == NULL) {
+        return false;
+    }
+
+    for (size_t index = ctx->infos_capacity; index < new_capacity; ++ index) {
+        new_infos[index] = (struct PolyNodeInfo){ .shape = POLY_NONE, .cost = POLY_COST_UNKNOWN };
+    }
+
+    ctx->infos = new_infos;
+    ctx->infos_capacity = new_capacity;
+
+    return true;
+}
+
+static size_t shape_hash(enum NodeType type, uint64_t first, uint64_t second) {
+    // FNV-1a over the three words
+    uint64_t hash = 14695981039346656037UL;
+    const uint64_t words[] = { (uint64_t)type, first, second };
+    for (size_t index = 0; index < sizeof(words) / sizeof(words[0]); ++ index) {
+        uint64_t word = words[index];
+        for (size_t byte = 0; byte < sizeof(word); ++ byte) {
+            hash ^= word & 0xff;
+            hash *= 1099511628211UL;
+            word >>= 8;
+        }
+    }
+
+    return (size_t)hash;
+}
+
+// Finds the slot holding the given shape or the empty slot where it belongs.
+static size_t shape_find_slot(const struct PolyContext *ctx, enum NodeType type, uint64_t first, uint64_t second) {
+    const size_t mask = ctx->shape_table_size - 1;
+    size_t slot = shape_hash(type, first, second) & mask;
+
+    for (;;) {
+        const uint32_t shape = ctx->shape_table[slot];
+
+        if (shape == POLY_NONE) {
+            return slot;
+        }
+
+        const struct PolyShape *entry = &ctx->shapes[shape];
+        if (entry->type == type && entry->first == first && entry->second == second) {
+            return slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Makes room for one more shape, keeping the load factor at or below 1/2.
+static bool shape_reserve(struct PolyContext *ctx) {
+    const struct Allocator *allocator = ctx->ast->allocator;
+
+    if (ctx->shapes_used == POLY_NONE) {
+        return false;
+    }
+
+    if (ctx->shapes_used == ctx->shapes_capacity) {
+        const size_t new_capacity = ctx->shapes_capacity == 0 ? 16 : ctx->shapes_capacity * 2;
+        if (new_capacity > SIZE_MAX / sizeof(struct PolyShape)) {
+            return false;
+        }
+
+        struct PolyShape *new_shapes = allocator_realloc(allocator, ctx->shapes,
+            sizeof(struct PolyShape) * ctx->shapes_capacity, sizeof(struct PolyShape) * new_capacity);
+        if (new_shapes == NULL) {
+            return false;
+        }
+
+        ctx->shapes = new_shapes;
+        ctx->shapes_capacity = new_capacity;
+    }
+
+    if ((ctx->shapes_used + 1) * 2 <= ctx->shape_table_size) {
+        return true;
+    }
+
+    const size_t new_size = ctx->shape_table_size == 0 ? 32 : ctx->shape_table_size * 2;
+    if (new_size > SIZE_MAX / sizeof(uint32_t)) {
+        return false;
+    }
+
+    uint32_t *new_table = allocator_alloc(allocator, sizeof(uint32_t) * new_size);
+    if (new_table == NULL) {
+        return false;
+    }
+
+    for (size_t slot = 0; slot < new_size; ++ slot) {
+        new_table[slot] = POLY_NONE;
+    }
+
+    allocator_free(allocator, ctx->shape_table);
+    ctx->shape_table = new_table;
+    ctx->shape_table_size = new_size;
+
+    for (size_t shape = 0; shape < ctx->shapes_used; ++ shape) {
+        const struct PolyShape *entry = &ctx->shapes[shape];
+        ctx->shape_table[shape_find_slot(ctx, entry->type, entry->first, entry->second)] = (uint32_t)shape;
+    }
+
+    return true;
+}
+
+// Structurally equal sub-trees get the same shape id. Children are hashed by
+// their shape ids, so this is linear in the size of the sub-tree the first
+// time and constant afterwards.
+static bool node_shape(struct PolyContext *ctx, size_t node_index, uint32_t *shape) {
+    assert(node_index < ctx->infos_capacity);
+
+    if (ctx->infos[node_index].shape != POLY_NONE) {
+        *shape = ctx->infos[node_index].shape;
+        return true;
+    }
+
+    const struct AstNode *node = &ctx->ast->nodes[node_index];
+    uint64_t first  = 0;
+    uint64_t second = 0;
+    uint32_t child;
+
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+            if (!node_shape(ctx, node->binary.left_index, &child)) {
+                return false;
+            }
+            first = child;
+
+            if (!node_shape(ctx, node->binary.right_index, &child)) {
+                return false;
+            }
+            second = child;
+            break;
+
+        case NODE_INV:
+            if (!node_shape(ctx, node->child_index, &child)) {
+                return false;
+            }
+            first = child;
+            break;
+
+        case NODE_INT:
+            first = (uint64_t)node->value;
+            break;
+
+        case NODE_VAR:
+            first = node->arg_index;
+            break;
+
+        default:
+            assert(false);
+            return false;
+    }
+
+    if (!shape_reserve(ctx)) {
+        return false;
+    }
+
+    const size_t slot = shape_find_slot(ctx, node->type, first, second);
+
+    if (ctx->shape_table[slot] == POLY_NONE) {
+        ctx->shapes[ctx->shapes_used] = (struct PolyShape){
+            .type   = node->type,
+            .first  = first,
+            .second = second,
+            .atom   = POLY_NONE,
+        };
+        ctx->shape_table[slot] = (uint32_t)ctx->shapes_used;
+        ++ ctx->shapes_used;
+    }
+
+    *shape = ctx->shape_table[slot];
+    ctx->infos[node_index].shape = *shape;
+
+    return true;
+}
+
+// Structurally equal sub-trees get the same atom id.
+static bool get_atom(struct PolyContext *ctx, size_t node_index, uint32_t *atom) {
+    uint32_t shape;
+
+    if (!poly_reserve_infos(ctx) || !node_shape(ctx, node_index, &shape)) {
+        return false;
+    }
+
+    if (ctx->shapes[shape].atom != POLY_NONE) {
+        *atom = ctx->shapes[shape].atom;
+        return true;
+    }
+
+    if (ctx->atoms_used == POLY_NONE) {
+        return false;
+    }
+
+    if (ctx->atoms_used == ctx->atoms_capacity) {
+        const size_t new_capacity = ctx->atoms_capacity == 0 ? 16 : ctx->atoms_capacity * 2;
+        size_t *new_atoms = allocator_realloc(ctx->ast->allocator, ctx->atoms,
+            sizeof(size_t) * ctx->atoms_capacity, sizeof(size_t) * new_capacity);
+        if (new_atoms == NULL) {
+            return false;
+        }
+        ctx->atoms = new_atoms;
+        ctx->atoms_capacity = new_capacity;
+    }
+
+    *atom = (uint32_t)ctx->atoms_used;
+    ctx->atoms[ctx->atoms_used] = node_index;
+    ctx->shapes[shape].atom = *atom;
+    ++ ctx->atoms_used;
+
+    return true;
+}
+
+static bool poly_from_atom(struct PolyContext *ctx, size_t node_index, struct Poly *poly) {
+    uint32_t atom;
+
+    if (!get_atom(ctx, node_index, &atom) || !poly_alloc(ctx, poly, 1)) {
+        return false;
+    }
+
+    poly->terms[0] = (struct PolyTerm){ .coeff = 1, .degree = 1, .atoms = { atom } };
+    return true;
+}
+
+static size_t node_cost(struct PolyContext *ctx, size_t node_index) {
+    assert(node_index < ctx->infos_capacity);
+
+    if (ctx->infos[node_index].cost != POLY_COST_UNKNOWN) {
+        return ctx->infos[node_index].cost;
+    }
+
+    const struct AstNode *node = &ctx->ast->nodes[node_index];
+    size_t cost;
+
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+            cost = POLY_COST_ADD + node_cost(ctx, node->binary.left_index) + node_cost(ctx, node->binary.right_index);
+            break;
+
+        case NODE_MUL:
+            cost = POLY_COST_MUL + node_cost(ctx, node->binary.left_index) + node_cost(ctx, node->binary.right_index);
+            break;
+
+        case NODE_DIV:
+            cost = POLY_COST_DIV + node_cost(ctx, node->binary.left_index) + node_cost(ctx, node->binary.right_index);
+            break;
+
+        case NODE_MULHI:
+            cost = POLY_COST_MUL + node_cost(ctx, node->binary.left_index) + node_cost(ctx, node->binary.right_index);
+            break;
+
+        case NODE_SHL:
+        case NODE_SAR:
+            cost = POLY_COST_ADD + node_cost(ctx, node->binary.left_index) + node_cost(ctx, node->binary.right_index);
+            break;
+
+        case NODE_INV:
+            cost = POLY_COST_ADD + node_cost(ctx, node->child_index);
+            break;
+
+        default:
+            cost = 0;
+            break;
+    }
+
+    ctx->infos[node_index].cost = cost;
+
+    return cost;
+}
+
+static bool append_node(struct Ast *ast, const struct AstNode *node, size_t *node_index) {
+    if (!ast_append_node(ast, node)) {
+        return false;
+    }
+    *node_index = AST_ROOT_NODE_INDEX(ast);
+    return true;
+}
+
+static bool append_binary(struct Ast *ast, enum NodeType type, size_t left_index, size_t right_index,
+        const struct AstNode *range, size_t *node_index) {
+    const struct AstNode node = {
+        .type        = type,
+        .start_index = range->start_index,
+        .end_index   = range->end_index,
+        .binary = {
+            .left_index  = left_index,
+            .right_index = right_index,
+        },
+    };
+    return append_node(ast, &node, node_index);
+}
+
+static bool append_int(struct Ast *ast, long value, const struct AstNode *range, size_t *node_index) {
+    const struct AstNode node = {
+        .type        = NODE_INT,
+        .start_index = range->start_index,
+        .end_index   = range->end_index,
+        .value       = value,
+    };
+    return append_node(ast, &node, node_index);
+}
+
+// Opaque atoms are always copied, so the result stays a tree.
+static bool copy_subtree(struct Ast *ast, size_t node_index, size_t *copy_index) {
+    struct AstNode node = ast->nodes[node_index];
+
+    switch (node.type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+            if (!copy_subtree(ast, node.binary.left_index,  &node.binary.left_index) ||
+                !copy_subtree(ast, node.binary.right_index, &node.binary.right_index)) {
+                return false;
+            }
+            break;
+
+        case NODE_INV:
+            if (!copy_subtree(ast, node.child_index, &node.child_index)) {
+                return false;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return append_node(ast, &node, copy_index);
+}
+
+// Builds abs(coeff) * <atoms>, or just coeff for constant terms. Negative
+// coefficients are handled by the caller.
+static bool build_term(struct PolyContext *ctx, const struct PolyTerm *term, long coeff,
+        const struct AstNode *range, size_t *node_index) {
+    if (term->degree == 0) {
+        return append_int(ctx->ast, coeff, range, node_index);
+    }
+
+    for (uint32_t index = 0; index < term->degree; ++ index) {
+        size_t atom_index;
+        if (!copy_subtree(ctx->ast, ctx->atoms[term->atoms[index]], &atom_index)) {
+            return false;
+        }
+
+        if (index == 0) {
+            *node_index = atom_index;
+        } else if (!append_binary(ctx->ast, NODE_MUL, *node_index, atom_index, range, node_index)) {
+            return false;
+        }
+    }
+
+    if (coeff != 1) {
+        size_t coeff_index;
+        if (!append_int(ctx->ast, coeff, range, &coeff_index) ||
+            !append_binary(ctx->ast, NODE_MUL, *node_index, coeff_index, range, node_index)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Cost of the tree build_term() builds.
+static size_t term_cost(struct PolyContext *ctx, const struct PolyTerm *term, long coeff) {
+    if (term->degree == 0) {
+        return 0;
+    }
+
+    size_t cost = (term->degree - 1) * POLY_COST_MUL;
+    for (uint32_t index = 0; index < term->degree; ++ index) {
+        cost += node_cost(ctx, ctx->atoms[term->atoms[index]]);
+    }
+
+    if (coeff != 1) {
+        cost += POLY_COST_MUL;
+    }
+
+    return cost;
+}
+
+// The rebuilt sum starts with a positive term if possible, so no negation is
+// needed.
+static size_t poly_first_term(const struct Poly *poly) {
+    for (size_t index = 0; index < poly->terms_used; ++ index) {
+        if (poly->terms[index].coeff > 0 && poly->terms[index].degree > 0) {
+            return index;
+        }
+    }
+
+    return 0;
+}
+
+// Cost of the tree poly_build() builds, without building it.
+static size_t poly_cost(struct PolyContext *ctx, const struct Poly *poly) {
+    if (poly->terms_used == 0) {
+        return 0;
+    }
+
+    const size_t first = poly_first_term(poly);
+    const struct PolyTerm *first_term = &poly->terms[first];
+    size_t cost = first_term->coeff == -1 && first_term->degree > 0 ?
+        term_cost(ctx, first_term, 1) + POLY_COST_ADD :
+        term_cost(ctx, first_term, first_term->coeff);
+
+    for (size_t index = 0; index < poly->terms_used; ++ index) {
+        if (index == first) {
+            continue;
+        }
+
+        const struct PolyTerm *term = &poly->terms[index];
+        const bool subtract = term->coeff < 0 && term->coeff != LONG_MIN;
+
+        cost += term_cost(ctx, term, subtract ? -term->coeff : term->coeff) + POLY_COST_ADD;
+    }
+
+    return cost;
+}
+
+static bool poly_build(struct PolyContext *ctx, const struct Poly *poly, const struct AstNode *range, size_t *node_index) {
+    if (poly->terms_used == 0) {
+        return append_int(ctx->ast, 0, range, node_index);
+    }
+
+    const size_t first = poly_first_term(poly);
+
+    const struct PolyTerm *first_term = &poly->terms[first];
+    if (first_term->coeff == -1 && first_term->degree > 0) {
+        size_t child_index;
+        if (!build_term(ctx, first_term, 1, range, &child_index)) {
+            return false;
+        }
+
+        const struct AstNode node = {
+            .type        = NODE_INV,
+            .start_index = range->start_index,
+            .end_index   = range->end_index,
+            .child_index = child_index,
+        };
+        if (!append_node(ctx->ast, &node, node_index)) {
+            return false;
+        }
+    } else if (!build_term(ctx, first_term, first_term->coeff, range, node_index)) {
+        return false;
+    }
+
+    for (size_t index = 0; index < poly->terms_used; ++ index) {
+        if (index == first) {
+            continue;
+        }
+
+        const struct PolyTerm *term = &poly->terms[index];
+        const bool subtract = term->coeff < 0 && term->coeff != LONG_MIN;
+        size_t term_index;
+
+        if (!build_term(ctx, term, subtract ? -term->coeff : term->coeff, range, &term_index) ||
+            !append_binary(ctx->ast, subtract ? NODE_SUB : NODE_ADD, *node_index, term_index, range, node_index)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Replaces the sub-tree at node_index with the rebuilt polynomial, if that is
+// cheaper. The cost is known before building, so only replacements are built.
+// The rebuilt nodes are appended.
+static bool poly_replace(struct PolyContext *ctx, size_t node_index, const struct Poly *poly) {
+    struct Ast *ast = ctx->ast;
+
+    if (!poly_reserve_infos(ctx)) {
+        return false;
+    }
+
+    const size_t cost = poly_cost(ctx, poly);
+    if (cost >= node_cost(ctx, node_index)) {
+        return true;
+    }
+
+    const size_t nodes_used = ast->nodes_used;
+    const struct AstNode range = ast->nodes[node_index];
+    size_t new_index;
+
+    if (!poly_build(ctx, poly, &range, &new_index)) {
+        ast->nodes_used = nodes_used;
+        return false;
+    }
+
+    ast->nodes[node_index] = ast->nodes[new_index];
+    ast->nodes[node_index].start_index = range.start_index;
+    ast->nodes[node_index].end_index   = range.end_index;
+    ctx->infos[node_index] = (struct PolyNodeInfo){ .shape = POLY_NONE, .cost = cost };
+
+    return true;
+}
+
+// The operands of an opaque node are normalized on their own.
+static bool opaque_node(struct PolyContext *ctx, size_t node_index,
+        struct Poly *left, struct Poly *right, struct Poly *poly) {
+    const struct AstNode node = ctx->ast->nodes[node_index];
+
+    const bool ok =
+        poly_replace(ctx, node.binary.left_index,  left) &&
+        poly_replace(ctx, node.binary.right_index, right);
+
+    poly_destroy(ctx, left);
+    poly_destroy(ctx, right);
+
+    return ok && poly_from_atom(ctx, node_index, poly);
+}
+
+static bool poly_scale(struct Poly *poly, long factor) {
+    for (size_t index = 0; index < poly->terms_used; ++ index) {
+        poly->terms[index].coeff = wrapping_mul(poly->terms[index].coeff, factor);
+    }
+    poly_normalize(poly);
+    return true;
+}
+
+static bool node_to_poly(struct PolyContext *ctx, size_t node_index, struct Poly *poly) {
+    // by value, appending nodes might move the node array
+    const struct AstNode node = ctx->ast->nodes[node_index];
+
+    *poly = POLY_INIT;
+
+    switch (node.type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+        {
+            struct Poly left  = POLY_INIT;
+            struct Poly right = POLY_INIT;
+
+            if (!node_to_poly(ctx, node.binary.left_index, &left)) {
+                return false;
+            }
+
+            if (!node_to_poly(ctx, node.binary.right_index, &right)) {
+                poly_destroy(ctx, &left);
+                return false;
+            }
+
+            if (node.type == NODE_DIV || node.type == NODE_MULHI || node.type == NODE_SAR) {
+                return opaque_node(ctx, node_index, &left, &right, poly);
+            }
+
+            if (node.type == NODE_SHL) {
+                // x << n = x * 2^n, the shift count is always a constant
+                assert(poly_is_constant(&right));
+                *poly = left;
+                const long factor = ast_shl(1, poly_constant(&right));
+                poly_destroy(ctx, &right);
+                return poly_scale(poly, factor);
+            }
+
+            if (node.type == NODE_MUL) {
+                if (poly_is_constant(&left)) {
+                    *poly = right;
+                    const long factor = poly_constant(&left);
+                    poly_destroy(ctx, &left);
+                    return poly_scale(poly, factor);
+                }
+
+                if (poly_is_constant(&right)) {
+                    *poly = left;
+                    const long factor = poly_constant(&right);
+                    poly_destroy(ctx, &right);
+                    return poly_scale(poly, factor);
+                }
+
+                if (left.terms_used != 1 || right.terms_used != 1 ||
+                    left.terms[0].degree + right.terms[0].degree > POLY_MAX_DEGREE) {
+                    // don't expand products of sums
+                    return opaque_node(ctx, node_index, &left, &right, poly);
+                }
+
+                struct PolyTerm *term = &left.terms[0];
+                const struct PolyTerm *other = &right.terms[0];
+
+                term->coeff = wrapping_mul(term->coeff, other->coeff);
+                memcpy(term->atoms + term->degree, other->atoms, sizeof(uint32_t) * other->degree);
+                term->degree += other->degree;
+
+                poly_destroy(ctx, &right);
+                *poly = left;
+                poly_normalize(poly);
+                return true;
+            }
+
+            if (left.terms_used + right.terms_used > POLY_MAX_TERMS) {
+                return opaque_node(ctx, node_index, &left, &right, poly);
+            }
+
+            if (!poly_alloc(ctx, poly, left.terms_used + right.terms_used)) {
+                poly_destroy(ctx, &left);
+                poly_destroy(ctx, &right);
+                return false;
+            }
+
+            if (left.terms_used > 0) {
+                memcpy(poly->terms, left.terms, sizeof(struct PolyTerm) * left.terms_used);
+            }
+
+            for (size_t index = 0; index < right.terms_used; ++ index) {
+                struct PolyTerm *term = &poly->terms[left.terms_used + index];
+                *term = right.terms[index];
+                if (node.type == NODE_SUB) {
+                    term->coeff = wrapping_neg(term->coeff);
+                }
+            }
+
+            poly_destroy(ctx, &left);
+            poly_destroy(ctx, &right);
+            poly_normalize(poly);
+            return true;
+        }
+
+        case NODE_INV:
+            if (!node_to_poly(ctx, node.child_index, poly)) {
+                return false;
+            }
+            return poly_scale(poly, -1);
+
+        case NODE_INT:
+            if (node.value == 0) {
+                return true;
+            }
+            if (!poly_alloc(ctx, poly, 1)) {
+                return false;
+            }
+            poly->terms[0] = (struct PolyTerm){ .coeff = node.value, .degree = 0 };
+            return true;
+
+        case NODE_VAR:
+            return poly_from_atom(ctx, node_index, poly);
+
+        default:
+            assert(false);
+            return false;
+    }
+}
+
+bool optimize_polynomials(struct Ast *ast) {
+    if (ast->nodes_used == 0) {
+        return true;
+    }
+
+    struct PolyContext ctx = {
+        .ast              = ast,
+        .atoms            = NULL,
+        .atoms_used       = 0,
+        .atoms_capacity   = 0,
+        .infos            = NULL,
+        .infos_capacity   = 0,
+        .shapes           = NULL,
+        .shapes_used      = 0,
+        .shapes_capacity  = 0,
+        .shape_table      = NULL,
+        .shape_table_size = 0,
+    };
+    const size_t root_index = AST_ROOT_NODE_INDEX(ast);
+    struct Poly poly = POLY_INIT;
+
+    bool ok = node_to_poly(&ctx, root_index, &poly) && poly_replace(&ctx, root_index, &poly);
+
+    poly_destroy(&ctx, &poly);
+    allocator_free(ast->allocator, ctx.shape_table);
+    allocator_free(ast->allocator, ctx.shapes);
+    allocator_free(ast->allocator, ctx.infos);
+    allocator_free(ast->allocator, ctx.atoms);
+
+    // rebuilt nodes were appended after the root
+    ast_set_root(ast, root_index);
+
+    // drop the replaced nodes
+    return ast_compact(ast) && ok;
+}
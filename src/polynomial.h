@@ -0,0 +1,34 @@
+#ifndef POLYNOMIAL_H
+#define POLYNOMIAL_H
+#pragma once
+
+#include <stdbool.h>
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Sums and products are collected into polynomials with integer coefficients.
+// Like terms are merged and the polynomial is rebuilt as a sum of monomials,
+// but only if that is cheaper than the original sub-tree.
+//
+// Products are only expanded if one side is a single monomial. Division is a
+// barrier: its operands are normalized on their own and the division as a
+// whole is treated like a variable. The same is done for sub-trees that would
+// grow too big.
+//
+// Runs in time linear in the number of nodes: equal sub-trees are found by a
+// structural hash and costs are computed once per node.
+//
+// Arithmetic wraps like the evaluators do, so the result is bit-exact. The AST
+// has to be a tree. Returns false if out of memory, in which case the AST is
+// still valid, but maybe not fully normalized.
+bool optimize_polynomials(struct Ast *ast);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,453 @@
+#include "regvm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+
+static bool regcode_append(struct RegCode *code, const struct RegInstr *instr) {
+    if (code->instrs_used == code->instrs_capacity) {
+        if (code->instrs_capacity > SIZE_MAX / 2 / sizeof(struct RegInstr)) {
+            return false;
+        }
+
+        const size_t new_capacity = code->instrs_capacity == 0 ?
+            64 :
+            code->instrs_capacity * 2;
+        struct RegInstr *new_instrs = realloc(code->instrs, new_capacity * sizeof(struct RegInstr));
+
+        if (new_instrs == NULL) {
+            return false;
+        }
+
+        code->instrs = new_instrs;
+        code->instrs_capacity = new_capacity;
+    }
+
+    code->instrs[code->instrs_used] = *instr;
+    ++ code->instrs_used;
+
+    return true;
+}
+
+static bool is_leaf(const struct AstNode *node) {
+    return node->type == NODE_INT || node->type == NODE_VAR;
+}
+
+static enum RegOperandKind get_leaf_operand(const struct AstNode *node, long *operand) {
+    if (node->type == NODE_INT) {
+        *operand = node->value;
+        return REG_OPERAND_IMM;
+    }
+
+    assert(node->type == NODE_VAR);
+    *operand = (long)node->arg_index;
+    return REG_OPERAND_ARG;
+}
+
+// Dedicated registers of shared nodes (see optimize_cse()). regs[node index]
+// is SIZE_MAX until the node was computed the first time.
+struct SharedRegs {
+    const size_t *uses;
+    size_t *regs;
+    size_t regs_used;
+};
+
+static bool is_shared(const struct Ast *ast, const struct SharedRegs *shared, size_t node_index) {
+    return shared->uses[node_index] > 1 && !is_leaf(&ast->nodes[node_index]);
+}
+
+// Registers are allocated like a stack following the post-order layout of the
+// nodes: The result of a node goes into reg, its sub-trees use reg and above.
+// Leaves are never loaded into registers, but used as operands directly.
+//
+// Shared nodes get a dedicated register below the stack of registers instead.
+// result_reg is set to the register that holds the result.
+static bool node_compile(struct RegCode *code, const struct Ast *ast, struct SharedRegs *shared,
+        size_t node_index, size_t reg, size_t *result_reg) {
+    assert(node_index < ast->nodes_used);
+
+    const struct AstNode *node = &ast->nodes[node_index];
+    const bool node_shared = is_shared(ast, shared, node_index);
+
+    if (node_shared && shared->regs[node_index] != SIZE_MAX) {
+        // already computed
+        *result_reg = shared->regs[node_index];
+        return true;
+    }
+
+    if (reg > UINT32_MAX) {
+        return false;
+    }
+
+    if (reg + 1 > code->reg_count) {
+        code->reg_count = reg + 1;
+    }
+
+    struct RegInstr instr = { .dest = (uint32_t)reg, .left = 0, .right = 0 };
+
+    if (node_shared) {
+        instr.dest = (uint32_t)shared->regs_used;
+        shared->regs[node_index] = shared->regs_used;
+        ++ shared->regs_used;
+    }
+
+    *result_reg = instr.dest;
+
+    switch (node->type) {
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_SHL:
+        case NODE_MULHI:
+        case NODE_SAR:
+        {
+            const struct AstNode *left  = &ast->nodes[node->binary.left_index];
+            const struct AstNode *right = &ast->nodes[node->binary.right_index];
+            enum RegOperandKind left_kind;
+            enum RegOperandKind right_kind;
+            size_t next_reg = reg;
+
+            if (is_leaf(left)) {
+                left_kind = get_leaf_operand(left, &instr.left);
+            } else {
+                size_t left_reg;
+                if (!node_compile(code, ast, shared, node->binary.left_index, reg, &left_reg)) {
+                    return false;
+                }
+                left_kind = REG_OPERAND_REG;
+                instr.left = (long)left_reg;
+                if (left_reg == reg) {
+                    ++ next_reg;
+                }
+            }
+
+            if (is_leaf(right)) {
+                right_kind = get_leaf_operand(right, &instr.right);
+            } else {
+                size_t right_reg;
+                if (!node_compile(code, ast, shared, node->binary.right_index, next_reg, &right_reg)) {
+                    return false;
+                }
+                right_kind = REG_OPERAND_REG;
+                instr.right = (long)right_reg;
+            }
+
+            enum RegOperation operation;
+            switch (node->type) {
+                case NODE_ADD:   operation = REG_ADD;   break;
+                case NODE_SUB:   operation = REG_SUB;   break;
+                case NODE_MUL:   operation = REG_MUL;   break;
+                case NODE_DIV:   operation = REG_DIV;   break;
+                case NODE_SHL:   operation = REG_SHL;   break;
+                case NODE_MULHI: operation = REG_MULHI; break;
+                default:         operation = REG_SAR;   break;
+            }
+
+            instr.code = REG_CODE(operation, left_kind, right_kind);
+            break;
+        }
+
+        case NODE_INV:
+        {
+            const struct AstNode *child = &ast->nodes[node->child_index];
+            enum RegOperandKind kind;
+
+            if (is_leaf(child)) {
+                kind = get_leaf_operand(child, &instr.right);
+            } else {
+                size_t child_reg;
+                if (!node_compile(code, ast, shared, node->child_index, reg, &child_reg)) {
+                    return false;
+                }
+                kind = REG_OPERAND_REG;
+                instr.right = (long)child_reg;
+            }
+
+            instr.code = REG_CODE(REG_INV, 0, kind);
+            break;
+        }
+
+        case NODE_INT:
+        case NODE_VAR:
+            // only happens for the root node
+            instr.code = REG_CODE(REG_MOV, 0, get_leaf_operand(node, &instr.right));
+            break;
+
+        default:
+            assert(false);
+            return false;
+    }
+
+    return regcode_append(code, &instr);
+}
+
+struct RegCode regcode_compile(const struct Ast *ast) {
+    struct RegCode code = REGCODE_INIT;
+    struct SharedRegs shared = { .uses = NULL, .regs = NULL, .regs_used = 0 };
+    size_t *uses = NULL;
+    size_t *regs = NULL;
+    size_t result_reg = 0;
+
+    if (ast->nodes_used == 0) {
+        const struct RegInstr instr = {
+            .code  = REG_CODE(REG_MOV, 0, REG_OPERAND_IMM),
+            .dest  = 0,
+            .left  = 0,
+            .right = 0,
+        };
+        code.reg_count = 1;
+        if (!regcode_append(&code, &instr)) {
+            goto error;
+        }
+    } else {
+        uses = malloc(sizeof(size_t) * ast->nodes_used);
+        regs = malloc(sizeof(size_t) * ast->nodes_used);
+
+        if (uses == NULL || regs == NULL || !ast_count_uses(ast, uses)) {
+            goto error;
+        }
+
+        shared.uses = uses;
+        shared.regs = regs;
+
+        size_t shared_count = 0;
+        for (size_t index = 0; index < ast->nodes_used; ++ index) {
+            regs[index] = SIZE_MAX;
+            if (is_shared(ast, &shared, index)) {
+                ++ shared_count;
+            }
+        }
+
+        // the stack of registers starts above the shared ones
+        if (!node_compile(&code, ast, &shared, AST_ROOT_NODE_INDEX(ast), shared_count, &result_reg)) {
+            goto error;
+        }
+    }
+
+    const struct RegInstr ret = { .code = REG_RET, .dest = (uint32_t)result_reg, .left = 0, .right = 0 };
+    if (!regcode_append(&code, &ret)) {
+        goto error;
+    }
+
+    goto end;
+
+error:
+    // TODO: better error handling
+    regcode_destroy(&code);
+
+end:
+    free(uses);
+    free(regs);
+
+    return code;
+}
+
+void regcode_destroy(struct RegCode *code) {
+    free(code->instrs);
+    *code = REGCODE_INIT;
+}
+
+#define REG_OPERAND_0(VALUE) regs[VALUE]
+#define REG_OPERAND_1(VALUE) args[VALUE]
+#define REG_OPERAND_2(VALUE) (VALUE)
+
+#define REG_OP_ADD(LEFT, RIGHT) ((LEFT) + (RIGHT))
+#define REG_OP_SUB(LEFT, RIGHT) ((LEFT) - (RIGHT))
+#define REG_OP_MUL(LEFT, RIGHT) ((LEFT) * (RIGHT))
+#define REG_OP_DIV(LEFT, RIGHT) ((LEFT) / (RIGHT))
+#define REG_OP_SHL(LEFT, RIGHT) ast_shl((LEFT), (RIGHT))
+#define REG_OP_MULHI(LEFT, RIGHT) ast_mulhi((LEFT), (RIGHT))
+#define REG_OP_SAR(LEFT, RIGHT) ast_sar((LEFT), (RIGHT))
+
+#define REG_BINARY_HANDLER(LABEL, OP, LEFT, RIGHT) \
+    LABEL ## _ ## LEFT ## RIGHT: \
+        regs[instr->dest] = OP(REG_OPERAND_ ## LEFT(instr->left), REG_OPERAND_ ## RIGHT(instr->right)); \
+        ++ instr; \
+        goto *table[instr->code];
+
+#define REG_BINARY_HANDLERS(LABEL, OP) \
+    REG_BINARY_HANDLER(LABEL, OP, 0, 0) \
+    REG_BINARY_HANDLER(LABEL, OP, 0, 1) \
+    REG_BINARY_HANDLER(LABEL, OP, 0, 2) \
+    REG_BINARY_HANDLER(LABEL, OP, 1, 0) \
+    REG_BINARY_HANDLER(LABEL, OP, 1, 1) \
+    REG_BINARY_HANDLER(LABEL, OP, 1, 2) \
+    REG_BINARY_HANDLER(LABEL, OP, 2, 0) \
+    REG_BINARY_HANDLER(LABEL, OP, 2, 1) \
+    REG_BINARY_HANDLER(LABEL, OP, 2, 2)
+
+#define REG_UNARY_HANDLER(LABEL, OP, RIGHT) \
+    LABEL ## _ ## RIGHT: \
+        regs[instr->dest] = OP REG_OPERAND_ ## RIGHT(instr->right); \
+        ++ instr; \
+        goto *table[instr->code];
+
+#define REG_UNARY_HANDLERS(LABEL, OP) \
+    REG_UNARY_HANDLER(LABEL, OP, 0) \
+    REG_UNARY_HANDLER(LABEL, OP, 1) \
+    REG_UNARY_HANDLER(LABEL, OP, 2)
+
+#define REG_BINARY_TABLE(OPERATION, LABEL) \
+    [OPERATION + 0] = &&LABEL ## _00, \
+    [OPERATION + 1] = &&LABEL ## _01, \
+    [OPERATION + 2] = &&LABEL ## _02, \
+    [OPERATION + 3] = &&LABEL ## _10, \
+    [OPERATION + 4] = &&LABEL ## _11, \
+    [OPERATION + 5] = &&LABEL ## _12, \
+    [OPERATION + 6] = &&LABEL ## _20, \
+    [OPERATION + 7] = &&LABEL ## _21, \
+    [OPERATION + 8] = &&LABEL ## _22
+
+#define REG_UNARY_TABLE(OPERATION, LABEL) \
+    [OPERATION + 0] = &&LABEL ## _0, \
+    [OPERATION + 1] = &&LABEL ## _1, \
+    [OPERATION + 2] = &&LABEL ## _2
+
+static long regcode_exec(const struct RegCode *code, const long args[], long *regs) {
+    // see bytecode_exec()
+    static const void *table[] = {
+        REG_BINARY_TABLE(REG_ADD, add),
+        REG_BINARY_TABLE(REG_SUB, sub),
+        REG_BINARY_TABLE(REG_MUL, mul),
+        REG_BINARY_TABLE(REG_DIV, div),
+        REG_BINARY_TABLE(REG_SHL, shl),
+        REG_BINARY_TABLE(REG_MULHI, mulhi),
+        REG_BINARY_TABLE(REG_SAR, sar),
+        REG_UNARY_TABLE(REG_INV, inv),
+        REG_UNARY_TABLE(REG_MOV, mov),
+        [REG_RET] = &&ret,
+    };
+
+    const struct RegInstr *instr = code->instrs;
+
+    goto *table[instr->code];
+
+    REG_BINARY_HANDLERS(add, REG_OP_ADD)
+    REG_BINARY_HANDLERS(sub, REG_OP_SUB)
+    REG_BINARY_HANDLERS(mul, REG_OP_MUL)
+    REG_BINARY_HANDLERS(div, REG_OP_DIV)
+    REG_BINARY_HANDLERS(shl, REG_OP_SHL)
+    REG_BINARY_HANDLERS(mulhi, REG_OP_MULHI)
+    REG_BINARY_HANDLERS(sar, REG_OP_SAR)
+    REG_UNARY_HANDLERS(inv, -)
+    REG_UNARY_HANDLERS(mov, +)
+
+ret:
+    return regs[instr->dest];
+}
+
+long regcode_eval(const struct RegCode *code, const long args[]) {
+    if (code->reg_count <= VM_SCRATCH_SIZE) {
+        long scratch[VM_SCRATCH_SIZE];
+        return regcode_exec(code, args, scratch);
+    }
+
+    long *regs = malloc(sizeof(long) * code->reg_count);
+    if (regs == NULL) {
+        // use regcode_eval_ctx() for proper error handling
+        perror("allocating registers");
+        return LONG_MAX;
+    }
+
+    const long result = regcode_exec(code, args, regs);
+    free(regs);
+    return result;
+}
+
+bool regcode_eval_ctx(struct VmContext *ctx, const struct RegCode *code, const long args[], long *result) {
+    ctx->error = VM_ERROR_NONE;
+
+    if (code->reg_count <= ctx->stack_size) {
+        *result = regcode_exec(code, args, ctx->stack);
+        return true;
+    }
+
+    if (code->reg_count <= VM_SCRATCH_SIZE) {
+        long scratch[VM_SCRATCH_SIZE];
+        *result = regcode_exec(code, args, scratch);
+        return true;
+    }
+
+    if (!vm_context_reserve(ctx, code->reg_count)) {
+        return false;
+    }
+
+    *result = regcode_exec(code, args, ctx->stack);
+    return true;
+}
+
+static void regcode_print_operand(enum RegOperandKind kind, long operand, char *const *const args, FILE *stream) {
+    switch (kind) {
+        case REG_OPERAND_REG:
+            fprintf(stream, "r%ld", operand);
+            break;
+
+        case REG_OPERAND_ARG:
+            fprintf(stream, "%s", args[operand]);
+            break;
+
+        case REG_OPERAND_IMM:
+            fprintf(stream, "%ld", operand);
+            break;
+    }
+}
+
+void regcode_print(const struct RegCode *code, char *const *const args, FILE *stream) {
+    fprintf(stream, "registers: %zu\n\n", code->reg_count);
+
+    for (size_t index = 0; index < code->instrs_used; ++ index) {
+        const struct RegInstr *instr = &code->instrs[index];
+
+        if (instr->code == REG_RET) {
+            fprintf(stream, "RET r%u\n", instr->dest);
+            continue;
+        }
+
+        const char *name;
+        enum RegOperation operation;
+        bool binary = true;
+
+        if (instr->code >= REG_MOV) {
+            name = "MOV";
+            operation = REG_MOV;
+            binary = false;
+        } else if (instr->code >= REG_INV) {
+            name = "INV";
+            operation = REG_INV;
+            binary = false;
+        } else if (instr->code >= REG_SAR) {
+            name = "SAR";
+            operation = REG_SAR;
+        } else if (instr->code >= REG_MULHI) {
+            name = "MULHI";
+            operation = REG_MULHI;
+        } else if (instr->code >= REG_SHL) {
+            name = "SHL";
+            operation = REG_SHL;
+        } else if (instr->code >= REG_DIV) {
+            name = "DIV";
+            operation = REG_DIV;
+        } else if (instr->code >= REG_MUL) {
+            name = "MUL";
+            operation = REG_MUL;
+        } else if (instr->code >= REG_SUB) {
+            name = "SUB";
+            operation = REG_SUB;
+        } else {
+            name = "ADD";
+            operation = REG_ADD;
+        }
+
+        const uint32_t kinds = instr->code - operation;
+
+        fprintf(stream, "%s r%u, ", name, instr->dest);
+        if (binary) {
+            regcode_print_operand((enum RegOperandKind)(kinds / 3), instr->left, args, stream);
+            fprintf(stream, ", ");
+        }
+        regcode_print_operand((enum RegOperandKind)(kinds % 3), instr->right, args, stream);
+        fputc('\n', stream);
+    }
+}
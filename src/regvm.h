@@ -0,0 +1,74 @@
+#ifndef REGVM_H
+#define REGVM_H
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ast.h"
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Three-address code for a register machine. Each operand is either a
+// register, an argument or an immediate. Which kind it is, is encoded in the
+// instruction code: code = <operation> + 3 * <left kind> + <right kind>.
+enum RegOperandKind {
+    REG_OPERAND_REG,
+    REG_OPERAND_ARG,
+    REG_OPERAND_IMM,
+};
+
+enum RegOperation {
+    REG_ADD = 0,
+    REG_SUB = REG_ADD + 9,
+    REG_MUL = REG_SUB + 9,
+    REG_DIV = REG_MUL + 9,
+    // the right operand is always an immediate shift count
+    REG_SHL = REG_DIV + 9,
+    // the right operand is always an immediate factor
+    REG_MULHI = REG_SHL + 9,
+    // the right operand is always an immediate shift count
+    REG_SAR = REG_MULHI + 9,
+    // unary operations only use the right operand
+    REG_INV = REG_SAR + 9,
+    REG_MOV = REG_INV + 3,
+    // returns the register in dest
+    REG_RET = REG_MOV + 3,
+};
+
+#define REG_CODE(OPERATION, LEFT, RIGHT) ((OPERATION) + 3 * (LEFT) + (RIGHT))
+
+struct RegInstr {
+    uint32_t code;
+    uint32_t dest;
+    // register index, argument index or immediate, depending on code
+    long left;
+    long right;
+};
+
+struct RegCode {
+    struct RegInstr *instrs;
+    size_t instrs_used;
+    size_t instrs_capacity;
+    size_t reg_count;
+};
+
+#define REGCODE_INIT (struct RegCode){ .instrs = NULL, .instrs_used = 0, .instrs_capacity = 0, .reg_count = 0 }
+
+// On error reg_count is 0.
+struct RegCode regcode_compile(const struct Ast *ast);
+void regcode_destroy(struct RegCode *code);
+
+long regcode_eval(const struct RegCode *code, const long args[]);
+// Uses the stack of ctx as register file. Returns false on error and sets ctx->error.
+bool regcode_eval_ctx(struct VmContext *ctx, const struct RegCode *code, const long args[], long *result);
+void regcode_print(const struct RegCode *code, char *const *const args, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
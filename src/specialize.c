@@ -0,0 +1,341 @@
+#include "specialize.h"
+#include "optimizer.h"
+#include "strength.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+struct SpecializeCacheEntry {
+    size_t hash;
+    // NULL for empty slots
+    struct Specialization *spec;
+};
+
+// Resolves names to argument indices.
+static bool find_args(char *const *args, size_t argc, const char *const names[], size_t count,
+        size_t indices[], enum SpecializeError *error) {
+    for (size_t index = 0; index < count; ++ index) {
+        size_t arg_index = 0;
+        while (arg_index < argc && strcmp(args[arg_index], names[index]) != 0) {
+            ++ arg_index;
+        }
+
+        if (arg_index == argc) {
+            *error = SPECIALIZE_ERROR_UNDEFINED_ARG;
+            return false;
+        }
+
+        for (size_t other = 0; other < index; ++ other) {
+            if (indices[other] == arg_index) {
+                *error = SPECIALIZE_ERROR_DUPLICATED_ARG;
+                return false;
+            }
+        }
+
+        indices[index] = arg_index;
+    }
+
+    return true;
+}
+
+static bool specialize_args(struct Specialization *spec, const struct Ast *ast, size_t argc,
+        const size_t bound_args[], const long values[], size_t count) {
+    struct Ast copy = AST_INIT;
+    // per argument: index into values if bound, SIZE_MAX otherwise
+    size_t *bound = NULL;
+    // per argument: index in the specialized argument vector
+    size_t *new_indices = NULL;
+
+    *spec = SPECIALIZATION_INIT;
+
+    assert(count <= argc);
+
+    bound       = malloc(sizeof(size_t) * (argc + 1));
+    new_indices = malloc(sizeof(size_t) * (argc + 1));
+    spec->free_args = malloc(sizeof(size_t) * (argc - count + 1));
+
+    if (bound == NULL || new_indices == NULL || spec->free_args == NULL) {
+        goto error;
+    }
+
+    for (size_t arg_index = 0; arg_index < argc; ++ arg_index) {
+        bound[arg_index] = SIZE_MAX;
+    }
+
+    for (size_t index = 0; index < count; ++ index) {
+        assert(bound_args[index] < argc);
+        bound[bound_args[index]] = index;
+    }
+
+    for (size_t arg_index = 0; arg_index < argc; ++ arg_index) {
+        if (bound[arg_index] == SIZE_MAX) {
+            new_indices[arg_index] = spec->free_argc;
+            spec->free_args[spec->free_argc] = arg_index;
+            ++ spec->free_argc;
+        }
+    }
+
+    if (!ast_copy(&copy, ast)) {
+        goto error;
+    }
+
+    for (size_t index = 0; index < copy.nodes_used; ++ index) {
+        struct AstNode *node = &copy.nodes[index];
+
+        if (node->type != NODE_VAR) {
+            continue;
+        }
+
+        assert(node->arg_index < argc);
+
+        if (bound[node->arg_index] != SIZE_MAX) {
+            *node = (struct AstNode){
+                .type        = NODE_INT,
+                .start_index = node->start_index,
+                .end_index   = node->end_index,
+                .value       = values[bound[node->arg_index]],
+            };
+        } else {
+            node->arg_index = new_indices[node->arg_index];
+        }
+    }
+
+    if (copy.nodes_used > 0) {
+        optimize(&copy);
+    }
+
+    size_t eliminated = 0;
+    size_t lowered = 0;
+    if (!optimize_cse(&copy, &eliminated) ||
+        !optimize_strength(&copy, get_strength_costs(STRENGTH_TARGET_VM), &lowered)) {
+        goto error;
+    }
+
+    spec->bytecode = bytecode_compile(&copy);
+    if (spec->bytecode.stack_size == 0) {
+        goto error;
+    }
+
+    ast_destroy(&copy);
+    free(bound);
+    free(new_indices);
+
+    return true;
+
+error:
+    ast_destroy(&copy);
+    free(bound);
+    free(new_indices);
+    specialization_destroy(spec);
+    spec->error = SPECIALIZE_ERROR_OUT_OF_MEMORY;
+
+    return false;
+}
+
+bool specialize(struct Specialization *spec, const struct Ast *ast, char *const *args, size_t argc,
+        const char *const names[], const long values[], size_t count) {
+    *spec = SPECIALIZATION_INIT;
+
+    size_t *bound_args = malloc(sizeof(size_t) * (count + 1));
+    if (bound_args == NULL) {
+        spec->error = SPECIALIZE_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+
+    enum SpecializeError error = SPECIALIZE_ERROR_NONE;
+    if (!find_args(args, argc, names, count, bound_args, &error)) {
+        free(bound_args);
+        spec->error = error;
+        return false;
+    }
+
+    const bool ok = specialize_args(spec, ast, argc, bound_args, values, count);
+    free(bound_args);
+
+    return ok;
+}
+
+void specialization_destroy(struct Specialization *spec) {
+    bytecode_destroy(&spec->bytecode);
+    free(spec->free_args);
+    *spec = SPECIALIZATION_INIT;
+}
+
+void specialization_gather_args(const struct Specialization *spec, const long args[], long free_args[]) {
+    for (size_t index = 0; index < spec->free_argc; ++ index) {
+        free_args[index] = args[spec->free_args[index]];
+    }
+}
+
+bool specialize_cache_init(struct SpecializeCache *cache, const struct Ast *ast, char *const *args, size_t argc,
+        const char *const names[], size_t count) {
+    *cache = SPECIALIZE_CACHE_INIT;
+
+    cache->ast = ast;
+    cache->argc = argc;
+    cache->bound_args = malloc(sizeof(size_t) * (count + 1));
+
+    if (cache->bound_args == NULL) {
+        cache->error = SPECIALIZE_ERROR_OUT_OF_MEMORY;
+        return false;
+    }
+
+    if (!find_args(args, argc, names, count, cache->bound_args, &cache->error)) {
+        free(cache->bound_args);
+        cache->bound_args = NULL;
+        return false;
+    }
+
+    cache->bound_count = count;
+
+    return true;
+}
+
+static size_t values_hash(const long values[], size_t count) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t index = 0; index < count; ++ index) {
+        uint64_t word = (uint64_t)values[index];
+        for (size_t byte = 0; byte < sizeof(word); ++ byte) {
+            hash ^= word & 0xff;
+            hash *= 1099511628211UL;
+            word >>= 8;
+        }
+    }
+    return (size_t)hash;
+}
+
+// Finds the slot holding the given values or the empty slot where they belong.
+static size_t cache_find_slot(const struct SpecializeCache *cache, size_t hash, const long values[]) {
+    const size_t mask = cache->entries_capacity - 1;
+    size_t slot = hash & mask;
+
+    for (;;) {
+        const struct SpecializeCacheEntry *entry = &cache->entries[slot];
+
+        if (entry->spec == NULL) {
+            return slot;
+        }
+
+        if (entry->hash == hash &&
+            memcmp(cache->keys + slot * cache->bound_count, values, sizeof(long) * cache->bound_count) == 0) {
+            return slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Keeps the load factor at or below 3/4.
+static bool cache_reserve(struct SpecializeCache *cache) {
+    if (cache->entries_capacity > 0 && (cache->entries_used + 1) * 4 <= cache->entries_capacity * 3) {
+        return true;
+    }
+
+    const size_t key_size = sizeof(long) * (cache->bound_count + 1);
+    const size_t new_capacity = cache->entries_capacity == 0 ? 16 : cache->entries_capacity * 2;
+
+    if (new_capacity > SIZE_MAX / key_size || new_capacity > SIZE_MAX / sizeof(struct SpecializeCacheEntry)) {
+        return false;
+    }
+
+    struct SpecializeCacheEntry *new_entries = calloc(new_capacity, sizeof(struct SpecializeCacheEntry));
+    long *new_keys = malloc(new_capacity * key_size);
+
+    if (new_entries == NULL || new_keys == NULL) {
+        free(new_entries);
+        free(new_keys);
+        return false;
+    }
+
+    struct SpecializeCacheEntry *old_entries = cache->entries;
+    long *old_keys = cache->keys;
+    const size_t old_capacity = cache->entries_capacity;
+
+    cache->entries = new_entries;
+    cache->keys = new_keys;
+    cache->entries_capacity = new_capacity;
+
+    for (size_t index = 0; index < old_capacity; ++ index) {
+        const struct SpecializeCacheEntry *entry = &old_entries[index];
+        if (entry->spec == NULL) {
+            continue;
+        }
+
+        const long *values = old_keys + index * cache->bound_count;
+        const size_t slot = cache_find_slot(cache, entry->hash, values);
+
+        cache->entries[slot] = *entry;
+        memcpy(cache->keys + slot * cache->bound_count, values, sizeof(long) * cache->bound_count);
+    }
+
+    free(old_entries);
+    free(old_keys);
+
+    return true;
+}
+
+const struct Specialization *specialize_cache_get(struct SpecializeCache *cache, const long values[]) {
+    cache->error = SPECIALIZE_ERROR_NONE;
+
+    if (!cache_reserve(cache)) {
+        cache->error = SPECIALIZE_ERROR_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    const size_t hash = values_hash(values, cache->bound_count);
+    const size_t slot = cache_find_slot(cache, hash, values);
+    struct SpecializeCacheEntry *entry = &cache->entries[slot];
+
+    if (entry->spec != NULL) {
+        return entry->spec;
+    }
+
+    struct Specialization *spec = malloc(sizeof(struct Specialization));
+    if (spec == NULL) {
+        cache->error = SPECIALIZE_ERROR_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    if (!specialize_args(spec, cache->ast, cache->argc, cache->bound_args, values, cache->bound_count)) {
+        cache->error = spec->error;
+        free(spec);
+        return NULL;
+    }
+
+    entry->hash = hash;
+    entry->spec = spec;
+    memcpy(cache->keys + slot * cache->bound_count, values, sizeof(long) * cache->bound_count);
+    ++ cache->entries_used;
+
+    return spec;
+}
+
+void specialize_cache_destroy(struct SpecializeCache *cache) {
+    for (size_t index = 0; index < cache->entries_capacity; ++ index) {
+        struct Specialization *spec = cache->entries[index].spec;
+        if (spec != NULL) {
+            specialization_destroy(spec);
+            free(spec);
+        }
+    }
+
+    free(cache->entries);
+    free(cache->keys);
+    free(cache->bound_args);
+    *cache = SPECIALIZE_CACHE_INIT;
+}
+
+const char *get_specialize_error_message(enum SpecializeError error) {
+    switch (error) {
+        case SPECIALIZE_ERROR_NONE:           return "no error";
+        case SPECIALIZE_ERROR_OUT_OF_MEMORY:  return "out of memory";
+        case SPECIALIZE_ERROR_UNDEFINED_ARG:  return "undefined argument";
+        case SPECIALIZE_ERROR_DUPLICATED_ARG: return "duplicated argument";
+        default:
+            assert(false);
+            return "illegal error code";
+    }
+}
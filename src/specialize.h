@@ -0,0 +1,87 @@
+#ifndef SPECIALIZE_H
+#define SPECIALIZE_H
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ast.h"
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum SpecializeError {
+    SPECIALIZE_ERROR_NONE,
+    SPECIALIZE_ERROR_OUT_OF_MEMORY,
+    SPECIALIZE_ERROR_UNDEFINED_ARG,
+    SPECIALIZE_ERROR_DUPLICATED_ARG,
+};
+
+// Bytecode of an expression with some of its arguments bound to constants. It
+// only takes the free arguments: free_args[i] is the index of its i-th
+// argument in the argument vector of the original expression.
+struct Specialization {
+    struct Bytecode bytecode;
+    size_t *free_args;
+    size_t free_argc;
+    enum SpecializeError error;
+};
+
+#define SPECIALIZATION_INIT (struct Specialization){ .bytecode = BYTECODE_INIT, .free_args = NULL, .free_argc = 0, .error = SPECIALIZE_ERROR_NONE }
+
+// Partial evaluation: substitutes values[i] for the argument called names[i]
+// (see args and argc of the parser), runs optimize(), optimize_cse() and
+// optimize_strength() for the VM and compiles the result. The AST has to be a
+// tree, like the parser returns it, and is not changed. Returns false on error
+// and sets spec->error.
+bool specialize(struct Specialization *spec, const struct Ast *ast, char *const *args, size_t argc,
+    const char *const names[], const long values[], size_t count);
+void specialization_destroy(struct Specialization *spec);
+
+// Copies the free arguments out of a full argument vector.
+void specialization_gather_args(const struct Specialization *spec, const long args[], long free_args[]);
+
+struct SpecializeCacheEntry;
+
+// Specializations of one AST for one set of bound arguments, keyed by the
+// tuple of their values. The AST is not owned and must stay alive and
+// unchanged while the cache is used.
+struct SpecializeCache {
+    const struct Ast *ast;
+    size_t argc;
+    // argument index per bound argument
+    size_t *bound_args;
+    size_t bound_count;
+
+    // open addressing hash table, keys holds bound_count values per entry
+    struct SpecializeCacheEntry *entries;
+    long *keys;
+    size_t entries_used;
+    size_t entries_capacity;
+
+    enum SpecializeError error;
+};
+
+#define SPECIALIZE_CACHE_INIT (struct SpecializeCache){ .ast = NULL, .argc = 0, .bound_args = NULL, .bound_count = 0, .entries = NULL, .keys = NULL, .entries_used = 0, .entries_capacity = 0, .error = SPECIALIZE_ERROR_NONE }
+
+// Binds the arguments called names[0 .. count - 1]. Returns false on error and
+// sets cache->error.
+bool specialize_cache_init(struct SpecializeCache *cache, const struct Ast *ast, char *const *args, size_t argc,
+    const char *const names[], size_t count);
+
+// Returns the specialization for the given values of the bound arguments (in
+// the order of their names), creating it if it isn't cached yet. The pointer
+// stays valid until the cache is destroyed. Returns NULL on error and sets
+// cache->error.
+const struct Specialization *specialize_cache_get(struct SpecializeCache *cache, const long values[]);
+void specialize_cache_destroy(struct SpecializeCache *cache);
+
+const char *get_specialize_error_message(enum SpecializeError error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,563 @@
+#include "strength.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+// How many factors of the form 2^k or 2^k +/- 1 are split off at most.
+#define STRENGTH_MAX_FACTORS 3
+
+static const struct StrengthCosts strength_costs_vm = {
+    // Every instruction costs a dispatch, which dominates. MUL_VAL is a single
+    // instruction too, so only replacing it by a single SHL pays off. The same
+    // goes for DIV_VAL: idiv is cheaper than the four dispatches of even the
+    // shortest MULHI sequence.
+    .add   = 2,
+    .shl   = 2,
+    .inv   = 2,
+    .mul   = 3,
+    .mulhi = 3,
+    .div   = 7,
+    // STORE and LOAD of a local slot
+    .reuse = 4,
+};
+
+static const struct StrengthCosts strength_costs_batch = {
+    // Every instruction is a pass over a tile. 64 bit multiplication is
+    // composed of three 32 bit multiplications plus shifts and additions, so
+    // its pass costs a few times more than the others. MULHI needs four 32 bit
+    // multiplications, but division has no SIMD instruction at all and is
+    // done one row at a time.
+    .add   = 2,
+    .shl   = 2,
+    .inv   = 2,
+    .mul   = 5,
+    .mulhi = 8,
+    .div   = 24,
+    // STORE and LOAD copy a whole tile each
+    .reuse = 2,
+};
+
+static const struct StrengthCosts strength_costs_jit = {
+    // imul has a latency of 3 cycles, shl, sar, add, sub and neg of 1 cycle.
+    // idiv takes 15 to 90 cycles, depending on the CPU and the operands.
+    .add   = 1,
+    .shl   = 1,
+    .inv   = 1,
+    .mul   = 3,
+    .mulhi = 3,
+    .div   = 20,
+    // the JIT computes shared nodes again for every use
+    .reuse = 100,
+};
+
+const struct StrengthCosts *get_strength_costs(enum StrengthTarget target) {
+    switch (target) {
+        case STRENGTH_TARGET_VM:    return &strength_costs_vm;
+        case STRENGTH_TARGET_BATCH: return &strength_costs_batch;
+        case STRENGTH_TARGET_JIT:   return &strength_costs_jit;
+        default:
+            assert(false);
+            return &strength_costs_vm;
+    }
+}
+
+const char *get_strength_target_name(enum StrengthTarget target) {
+    switch (target) {
+        case STRENGTH_TARGET_VM:    return "VM";
+        case STRENGTH_TARGET_BATCH: return "batch";
+        case STRENGTH_TARGET_JIT:   return "JIT";
+        default:
+            assert(false);
+            return "illegal target";
+    }
+}
+
+enum FactorKind {
+    // t << k
+    FACTOR_SHIFT,
+    // (t << k) + t
+    FACTOR_ADD,
+    // (t << k) - t
+    FACTOR_SUB,
+};
+
+struct Factor {
+    enum FactorKind kind;
+    unsigned int shift;
+};
+
+struct Digit {
+    unsigned int shift;
+    bool negative;
+};
+
+// x * c is computed as the sum of +/- (x << shift) for all digits, followed by
+// the factors, innermost first.
+struct MulPlan {
+    unsigned int cost;
+    size_t factor_count;
+    struct Factor factors[STRENGTH_MAX_FACTORS];
+    size_t digit_count;
+    struct Digit digits[64];
+};
+
+// Non-adjacent form of the multiplier: the signed binary representation with
+// the fewest non-zero digits. magnitude is at most 2^63, so the digits fit
+// into 64 bits and magnitude + 1 can't overflow.
+static void plan_digits(unsigned long magnitude, bool negative, const struct StrengthCosts *costs, bool leaf, struct MulPlan *plan) {
+    bool has_positive = false;
+
+    plan->factor_count = 0;
+    plan->digit_count = 0;
+    plan->cost = 0;
+
+    for (unsigned int shift = 0; magnitude != 0; ++ shift, magnitude >>= 1) {
+        if ((magnitude & 1) == 0) {
+            continue;
+        }
+
+        const bool digit_negative = (magnitude & 3) == 3;
+        if (digit_negative) {
+            ++ magnitude;
+        } else {
+            -- magnitude;
+        }
+
+        plan->digits[plan->digit_count] = (struct Digit){
+            .shift    = shift,
+            .negative = digit_negative != negative,
+        };
+        ++ plan->digit_count;
+
+        if (shift > 0) {
+            plan->cost += costs->shl;
+        }
+        if (digit_negative == negative) {
+            has_positive = true;
+        }
+    }
+
+    assert(plan->digit_count > 0);
+
+    plan->cost += (unsigned int)(plan->digit_count - 1) * (leaf ? costs->add : costs->add + costs->reuse);
+    if (!has_positive) {
+        plan->cost += costs->inv;
+    }
+}
+
+static bool plan_is_identity(const struct MulPlan *plan) {
+    return
+        plan->factor_count == 0 && plan->digit_count == 1 &&
+        plan->digits[0].shift == 0 && !plan->digits[0].negative;
+}
+
+static void plan_factor(unsigned long magnitude, bool negative, const struct StrengthCosts *costs, bool leaf,
+        size_t depth, enum FactorKind kind, unsigned int shift, struct MulPlan *best);
+
+static void plan_mul(unsigned long magnitude, bool negative, const struct StrengthCosts *costs, bool leaf,
+        size_t depth, struct MulPlan *best) {
+    plan_digits(magnitude, negative, costs, leaf, best);
+
+    if (depth == STRENGTH_MAX_FACTORS) {
+        return;
+    }
+
+    if ((magnitude & 1) == 0) {
+        const unsigned int shift = (unsigned int)__builtin_ctzl(magnitude);
+        plan_factor(magnitude >> shift, negative, costs, leaf, depth, FACTOR_SHIFT, shift, best);
+    }
+
+    for (unsigned int shift = 1; shift < 64; ++ shift) {
+        const unsigned long factor = (1UL << shift) + 1;
+        if (factor > magnitude) {
+            break;
+        }
+        if (magnitude % factor == 0) {
+            plan_factor(magnitude / factor, negative, costs, leaf, depth, FACTOR_ADD, shift, best);
+        }
+    }
+
+    for (unsigned int shift = 2; shift < 64; ++ shift) {
+        const unsigned long factor = (1UL << shift) - 1;
+        if (factor > magnitude) {
+            break;
+        }
+        if (magnitude % factor == 0) {
+            plan_factor(magnitude / factor, negative, costs, leaf, depth, FACTOR_SUB, shift, best);
+        }
+    }
+}
+
+// Replaces best if splitting off the given factor is cheaper.
+static void plan_factor(unsigned long magnitude, bool negative, const struct StrengthCosts *costs, bool leaf,
+        size_t depth, enum FactorKind kind, unsigned int shift, struct MulPlan *best) {
+    struct MulPlan plan;
+
+    plan_mul(magnitude, negative, costs, leaf, depth + 1, &plan);
+
+    plan.cost += costs->shl;
+    if (kind != FACTOR_SHIFT) {
+        // the inner value is used twice
+        plan.cost += costs->add;
+        if (!leaf || !plan_is_identity(&plan)) {
+            plan.cost += costs->reuse;
+        }
+    }
+
+    if (plan.cost < best->cost) {
+        assert(plan.factor_count < STRENGTH_MAX_FACTORS);
+        plan.factors[plan.factor_count] = (struct Factor){ .kind = kind, .shift = shift };
+        ++ plan.factor_count;
+        *best = plan;
+    }
+}
+
+static bool append_node(struct Ast *ast, const struct AstNode *node, size_t *node_index) {
+    if (!ast_append_node(ast, node)) {
+        return false;
+    }
+    *node_index = AST_ROOT_NODE_INDEX(ast);
+    return true;
+}
+
+static bool append_binary(struct Ast *ast, enum NodeType type, size_t left_index, size_t right_index,
+        const struct AstNode *range, size_t *node_index) {
+    const struct AstNode node = {
+        .type        = type,
+        .start_index = range->start_index,
+        .end_index   = range->end_index,
+        .binary = {
+            .left_index  = left_index,
+            .right_index = right_index,
+        },
+    };
+    return append_node(ast, &node, node_index);
+}
+
+static bool append_unary(struct Ast *ast, enum NodeType type, size_t child_index,
+        const struct AstNode *range, size_t *node_index) {
+    const struct AstNode node = {
+        .type        = type,
+        .start_index = range->start_index,
+        .end_index   = range->end_index,
+        .child_index = child_index,
+    };
+    return append_node(ast, &node, node_index);
+}
+
+// Binary node with a constant right operand.
+static bool append_immediate(struct Ast *ast, enum NodeType type, size_t operand_index, long value,
+        const struct AstNode *range, size_t *node_index) {
+    const struct AstNode immediate = {
+        .type        = NODE_INT,
+        .start_index = range->start_index,
+        .end_index   = range->end_index,
+        .value       = value,
+    };
+    size_t immediate_index;
+
+    return
+        append_node(ast, &immediate, &immediate_index) &&
+        append_binary(ast, type, operand_index, immediate_index, range, node_index);
+}
+
+// NODE_SHL or NODE_SAR, nothing for a shift by 0.
+static bool append_shift(struct Ast *ast, enum NodeType type, size_t operand_index, unsigned int shift,
+        const struct AstNode *range, size_t *node_index) {
+    if (shift == 0) {
+        *node_index = operand_index;
+        return true;
+    }
+
+    return append_immediate(ast, type, operand_index, (long)shift, range, node_index);
+}
+
+static bool append_shl(struct Ast *ast, size_t operand_index, unsigned int shift,
+        const struct AstNode *range, size_t *node_index) {
+    return append_shift(ast, NODE_SHL, operand_index, shift, range, node_index);
+}
+
+// Appends the nodes of the plan and returns the index of the last one.
+static bool plan_build(struct Ast *ast, const struct MulPlan *plan, size_t operand_index,
+        const struct AstNode *range, size_t *node_index) {
+    // start with a positive digit, so no INV is needed if there is one
+    size_t first = 0;
+    while (first < plan->digit_count && plan->digits[first].negative) {
+        ++ first;
+    }
+
+    size_t acc_index;
+
+    if (first == plan->digit_count) {
+        first = 0;
+
+        size_t term_index;
+        if (!append_shl(ast, operand_index, plan->digits[first].shift, range, &term_index) ||
+            !append_unary(ast, NODE_INV, term_index, range, &acc_index)) {
+            return false;
+        }
+    } else if (!append_shl(ast, operand_index, plan->digits[first].shift, range, &acc_index)) {
+        return false;
+    }
+
+    for (size_t index = 0; index < plan->digit_count; ++ index) {
+        if (index == first) {
+            continue;
+        }
+
+        const struct Digit *digit = &plan->digits[index];
+        size_t term_index;
+
+        if (!append_shl(ast, operand_index, digit->shift, range, &term_index) ||
+            !append_binary(ast, digit->negative ? NODE_SUB : NODE_ADD, acc_index, term_index, range, &acc_index)) {
+            return false;
+        }
+    }
+
+    for (size_t index = 0; index < plan->factor_count; ++ index) {
+        const struct Factor *factor = &plan->factors[index];
+        size_t shifted_index;
+
+        if (!append_shl(ast, acc_index, factor->shift, range, &shifted_index)) {
+            return false;
+        }
+
+        switch (factor->kind) {
+            case FACTOR_SHIFT:
+                acc_index = shifted_index;
+                break;
+
+            case FACTOR_ADD:
+                if (!append_binary(ast, NODE_ADD, shifted_index, acc_index, range, &acc_index)) {
+                    return false;
+                }
+                break;
+
+            case FACTOR_SUB:
+                if (!append_binary(ast, NODE_SUB, shifted_index, acc_index, range, &acc_index)) {
+                    return false;
+                }
+                break;
+        }
+    }
+
+    *node_index = acc_index;
+
+    return true;
+}
+
+// x / d is computed as floor(x * magic / 2^(64 + shift)), corrected to round
+// towards zero, see Hacker's Delight, chapter 10 "Integer Division by
+// Constants". Negative divisors use x / d = -(x / |d|).
+struct DivPlan {
+    unsigned int cost;
+    long magic;
+    unsigned int shift;
+    bool negative;
+};
+
+// The smallest shift with a magic number that gives exact quotients for all
+// 64 bit dividends. magnitude is in the range [2, 2^63]. magic = 2^(64 + shift) / magnitude
+// rounded up, which doesn't fit into 64 bits signed if it is >= 2^63. It is used
+// wrapped to a negative value then, which is corrected by adding x again.
+static void div_magic(unsigned long magnitude, long *magic, unsigned int *shift) {
+    const unsigned long two63 = 1UL << 63;
+    // largest dividend whose remainder is magnitude - 1
+    const unsigned long limit = two63 - 1 - two63 % magnitude;
+
+    unsigned int p = 63;
+    unsigned long q1 = two63 / limit;
+    unsigned long r1 = two63 - q1 * limit;
+    unsigned long q2 = two63 / magnitude;
+    unsigned long r2 = two63 - q2 * magnitude;
+    unsigned long delta;
+
+    do {
+        ++ p;
+
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= limit) {
+            ++ q1;
+            r1 -= limit;
+        }
+
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= magnitude) {
+            ++ q2;
+            r2 -= magnitude;
+        }
+
+        delta = magnitude - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (long)(q2 + 1);
+    *shift = p - 64;
+}
+
+static bool is_leaf(const struct AstNode *node) {
+    return node->type == NODE_INT || node->type == NODE_VAR;
+}
+
+// Plans x / value for |value| >= 2.
+static void plan_div(long value, const struct StrengthCosts *costs, bool leaf, struct DivPlan *plan) {
+    plan->negative = value < 0;
+    div_magic(plan->negative ? 0UL - (unsigned long)value : (unsigned long)value, &plan->magic, &plan->shift);
+
+    // mulhi(x, magic) [+ x] >> shift, minus (x >> 63)
+    unsigned int uses = 2;
+    plan->cost = costs->mulhi + costs->shl + costs->add;
+    if (plan->magic < 0) {
+        plan->cost += costs->add;
+        ++ uses;
+    }
+    if (plan->shift > 0) {
+        plan->cost += costs->shl;
+    }
+    if (plan->negative) {
+        plan->cost += costs->inv;
+    }
+    if (!leaf) {
+        plan->cost += (uses - 1) * costs->reuse;
+    }
+}
+
+static bool div_plan_build(struct Ast *ast, const struct DivPlan *plan, size_t operand_index,
+        const struct AstNode *range, size_t *node_index) {
+    size_t quotient_index;
+    size_t sign_index;
+
+    if (!append_immediate(ast, NODE_MULHI, operand_index, plan->magic, range, &quotient_index)) {
+        return false;
+    }
+
+    if (plan->magic < 0 &&
+        !append_binary(ast, NODE_ADD, quotient_index, operand_index, range, &quotient_index)) {
+        return false;
+    }
+
+    // floor(x / d) + 1 for negative x is x / d rounded towards zero
+    if (!append_shift(ast, NODE_SAR, quotient_index, plan->shift, range, &quotient_index) ||
+        !append_shift(ast, NODE_SAR, operand_index, 63, range, &sign_index) ||
+        !append_binary(ast, NODE_SUB, quotient_index, sign_index, range, &quotient_index)) {
+        return false;
+    }
+
+    if (plan->negative && !append_unary(ast, NODE_INV, quotient_index, range, &quotient_index)) {
+        return false;
+    }
+
+    *node_index = quotient_index;
+
+    return true;
+}
+
+// Replaces the multiplication or division at index if that is cheaper.
+// Returns false if out of memory.
+static bool lower_node(struct Ast *ast, size_t index, const struct StrengthCosts *costs, size_t *lowered) {
+    // by value, appending nodes might move the node array
+    const struct AstNode node = ast->nodes[index];
+    const struct AstNode *left  = &ast->nodes[node.binary.left_index];
+    const struct AstNode *right = &ast->nodes[node.binary.right_index];
+    size_t operand_index;
+    size_t result_index;
+    long value;
+
+    if (right->type == NODE_INT && left->type != NODE_INT) {
+        operand_index = node.binary.left_index;
+        value = right->value;
+    } else if (node.type == NODE_MUL && left->type == NODE_INT && right->type != NODE_INT) {
+        operand_index = node.binary.right_index;
+        value = left->value;
+    } else {
+        return true;
+    }
+
+    const bool leaf = is_leaf(&ast->nodes[operand_index]);
+
+    if (node.type == NODE_MUL) {
+        // x * 0 and x * 1 are left to optimize()
+        if (value == 0 || value == 1) {
+            return true;
+        }
+
+        const bool negative = value < 0;
+        const unsigned long magnitude = negative ? 0UL - (unsigned long)value : (unsigned long)value;
+        struct MulPlan plan;
+
+        plan_mul(magnitude, negative, costs, leaf, 0, &plan);
+
+        if (plan.cost >= costs->mul) {
+            return true;
+        }
+
+        if (!plan_build(ast, &plan, operand_index, &node, &result_index)) {
+            return false;
+        }
+    } else {
+        // division by zero has to stay what it is
+        if (value == 0) {
+            return true;
+        }
+
+        if (value == 1) {
+            result_index = operand_index;
+        } else if (value == -1) {
+            if (!append_unary(ast, NODE_INV, operand_index, &node, &result_index)) {
+                return false;
+            }
+        } else {
+            struct DivPlan plan;
+
+            plan_div(value, costs, leaf, &plan);
+
+            if (plan.cost >= costs->div) {
+                return true;
+            }
+
+            if (!div_plan_build(ast, &plan, operand_index, &node, &result_index)) {
+                return false;
+            }
+        }
+    }
+
+    // Overwrite the node in place, so all its parents (it might be shared) use
+    // the result. The appended copy becomes unreachable.
+    ast->nodes[index] = ast->nodes[result_index];
+    ++ *lowered;
+
+    return true;
+}
+
+bool optimize_strength(struct Ast *ast, const struct StrengthCosts *costs, size_t *lowered) {
+    *lowered = 0;
+
+    if (!ast_compact(ast)) {
+        return false;
+    }
+
+    if (ast->nodes_used == 0) {
+        return true;
+    }
+
+    const size_t nodes_used = ast->nodes_used;
+    const size_t root_index = AST_ROOT_NODE_INDEX(ast);
+    bool ok = true;
+
+    for (size_t index = 0; index < nodes_used; ++ index) {
+        const enum NodeType type = ast->nodes[index].type;
+
+        if ((type == NODE_MUL || type == NODE_DIV) && !lower_node(ast, index, costs, lowered)) {
+            ok = false;
+            break;
+        }
+    }
+
+    // the new nodes were appended after the root
+    ast_set_root(ast, root_index);
+
+    // drop the copies and put the new nodes into post-order
+    return ast_compact(ast) && ok;
+}
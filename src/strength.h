@@ -0,0 +1,61 @@
+#ifndef STRENGTH_H
+#define STRENGTH_H
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum StrengthTarget {
+    STRENGTH_TARGET_VM,
+    STRENGTH_TARGET_BATCH,
+    STRENGTH_TARGET_JIT,
+};
+
+// Relative cost of operations on a backend.
+struct StrengthCosts {
+    // also used for subtraction
+    unsigned int add;
+    // also used for arithmetic shift right
+    unsigned int shl;
+    unsigned int inv;
+    unsigned int mul;
+    // high half of a 64 x 64 bit multiplication
+    unsigned int mulhi;
+    unsigned int div;
+    // additional cost of using a non-leaf value more than once
+    unsigned int reuse;
+};
+
+const struct StrengthCosts *get_strength_costs(enum StrengthTarget target);
+const char *get_strength_target_name(enum StrengthTarget target);
+
+// Strength reduction: replaces multiplications by constants with shifts,
+// additions and subtractions if that is cheaper according to costs. Constants
+// are written as signed powers of two, optionally after splitting off factors
+// of the form 2^k and 2^k +/- 1 (e.g. x * 45 = t + (t << 3) with
+// t = x + (x << 2)). The result is bit-exact, since everything wraps.
+//
+// Divisions by constants are replaced with a multiplication by a magic number
+// that only keeps the high half (NODE_MULHI), followed by arithmetic shifts
+// (NODE_SAR) that round towards zero, e.g. x / 7 = (mulhi(x, M) >> 1) - (x >> 63).
+// The result is exactly that of the division for every dividend and divisor
+// except for 0, which is kept as a division. LONG_MIN / -1 becomes -LONG_MIN,
+// which wraps to LONG_MIN instead of trapping.
+//
+// Operands that are used more than once are shared, so this turns the AST into
+// a DAG and has to run after optimize() and optimize_cse(). Reports the number
+// of replaced multiplications and divisions in lowered. Returns false if out of memory, in
+// which case the AST is still valid, but maybe not fully lowered.
+bool optimize_strength(struct Ast *ast, const struct StrengthCosts *costs, size_t *lowered);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -91,7 +91,41 @@ EXTERN_TEST(x_times_3);
 EXTERN_TEST(many_mul);
 EXTERN_TEST(times_0);
 EXTERN_TEST(many_mul_div);
+EXTERN_TEST(big_consts);
+EXTERN_TEST(int_literals);
+EXTERN_TEST(layout);
+EXTERN_TEST(leaf_left);
+EXTERN_TEST(narrow_immediates);
+EXTERN_TEST(superinstructions);
+EXTERN_TEST(deep_stack);
+EXTERN_TEST(shared_subexprs);
+EXTERN_TEST(like_terms);
+EXTERN_TEST(poly_div_barrier);
+EXTERN_TEST(poly_wrapping);
+EXTERN_TEST(strength_consts);
+EXTERN_TEST(strength_divisions);
+EXTERN_TEST(batch_rows);
+EXTERN_TEST(compact);
+EXTERN_TEST(compact_ast);
+EXTERN_TEST(compact_optimize);
+EXTERN_TEST(cse);
+EXTERN_TEST(polynomial);
+EXTERN_TEST(poly_opaque_chain);
+EXTERN_TEST(strength_reduction);
+EXTERN_TEST(strength_division);
+EXTERN_TEST(specialize);
+EXTERN_TEST(arg_schema);
+EXTERN_TEST(token_stream);
+EXTERN_TEST(deep_nesting);
+EXTERN_TEST(stream);
+EXTERN_TEST(parse_file);
+EXTERN_TEST(line_index);
+EXTERN_TEST(allocator);
+EXTERN_TEST(reserve);
+EXTERN_TEST(sparse_code);
+EXTERN_TEST(reuse);
 EXTERN_TEST(undef_var);
+EXTERN_TEST(value_out_of_range);
 EXTERN_TEST(illegal_arg_name);
 EXTERN_TEST(div_by_zero1);
 EXTERN_TEST(div_by_zero2);
@@ -114,7 +148,41 @@ struct TestDecl const* const tests[] = {
     TEST_REF(many_mul),
     TEST_REF(times_0),
     TEST_REF(many_mul_div),
+    TEST_REF(big_consts),
+    TEST_REF(int_literals),
+    TEST_REF(layout),
+    TEST_REF(leaf_left),
+    TEST_REF(narrow_immediates),
+    TEST_REF(superinstructions),
+    TEST_REF(deep_stack),
+    TEST_REF(shared_subexprs),
+    TEST_REF(like_terms),
+    TEST_REF(poly_div_barrier),
+    TEST_REF(poly_wrapping),
+    TEST_REF(strength_consts),
+    TEST_REF(strength_divisions),
+    TEST_REF(batch_rows),
+    TEST_REF(compact),
+    TEST_REF(compact_ast),
+    TEST_REF(compact_optimize),
+    TEST_REF(cse),
+    TEST_REF(polynomial),
+    TEST_REF(poly_opaque_chain),
+    TEST_REF(strength_reduction),
+    TEST_REF(strength_division),
+    TEST_REF(specialize),
+    TEST_REF(arg_schema),
+    TEST_REF(token_stream),
+    TEST_REF(deep_nesting),
+    TEST_REF(stream),
+    TEST_REF(parse_file),
+    TEST_REF(line_index),
+    TEST_REF(allocator),
+    TEST_REF(reserve),
+    TEST_REF(sparse_code),
+    TEST_REF(reuse),
     TEST_REF(undef_var),
+    TEST_REF(value_out_of_range),
     TEST_REF(illegal_arg_name),
     TEST_REF(div_by_zero1),
     TEST_REF(div_by_zero2),
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -99,11 +100,15 @@ struct TestArg {
 #define ASSERT_NOT_EQUAL(EXPECTED, ACTUAL, MSG, ...) \
     ASSERT_WITH_MESSAGE(EXPECTED != ACTUAL, MSG, __VA_ARGS__)
 
+// not a multiple of the tile size or vector width to test the remainders
+#define TEST_BATCH_ROWS (BATCH_TILE_SIZE * 2 + 3)
+
 #define ASSERT_OK_EXPR(EXPR, RESULT, ...) \
     { \
         const struct TestArg test_args[] = { __VA_ARGS__ }; \
-        const char *arg_names[sizeof(test_args) / sizeof(struct TestArg)]; \
-        long arg_values[sizeof(test_args) / sizeof(struct TestArg)]; \
+        /* + 1 so expressions without arguments don't get zero sized arrays */ \
+        const char *arg_names[sizeof(test_args) / sizeof(struct TestArg) + 1] = { NULL }; \
+        long arg_values[sizeof(test_args) / sizeof(struct TestArg) + 1] = { 0 }; \
         size_t size = sizeof(test_args) / sizeof(struct TestArg); \
         for (size_t index = 0; index < size; ++ index) { \
             arg_names[index]  = test_args[index].name; \
@@ -122,28 +127,185 @@ struct TestArg {
         const long ast_result = ast_eval(&parser.ast, arg_values); \
         ASSERT_EQUAL(RESULT, ast_result, "AST interpretation failed: %ld != %ld", (long)(RESULT), ast_result); \
         \
+        ASSERT_TRUE(arg_schema_init(&schema, (char *const *const)arg_names, size), \
+            "argument schema failed: %s", get_parser_error_message(schema.error)); \
+        ASSERT_TRUE(tokenize_slice(&tokens, (EXPR), strlen(EXPR)), \
+            "tokenizing failed: %s", get_parser_error_message(tokens.error)); \
+        \
+        tokens_parser = parse_tokens(&tokens, (EXPR), strlen(EXPR), &schema); \
+        ASSERT_EQUAL(ERROR_NONE, tokens_parser.error, "parser error with tokens: %s", \
+            get_parser_error_message(tokens_parser.error)); \
+        ASSERT_EQUAL(parser.ast.nodes_used, tokens_parser.ast.nodes_used, "parsing tokens gives a different AST size: %zu != %zu", \
+            parser.ast.nodes_used, tokens_parser.ast.nodes_used); \
+        \
+        const long tokens_result = ast_eval(&tokens_parser.ast, arg_values); \
+        ASSERT_EQUAL(RESULT, tokens_result, "AST of parsed tokens interpretation failed: %ld != %ld", (long)(RESULT), tokens_result); \
+        \
+        /* one byte chunks split every token */ \
+        parser_destroy(&tokens_parser); \
+        tokens_parser = parse_stream(&schema, &PARSER_OPTIONS_INIT); \
+        for (const char *chunk = (EXPR); *chunk; ++ chunk) { \
+            ASSERT_TRUE(parser_feed(&tokens_parser, chunk, 1), "streamed parser error: %s", \
+                get_parser_error_message(tokens_parser.error)); \
+        } \
+        ASSERT_TRUE(parser_finish(&tokens_parser), "streamed parser error: %s", get_parser_error_message(tokens_parser.error)); \
+        ASSERT_EQUAL(parser.ast.nodes_used, tokens_parser.ast.nodes_used, "streamed parsing gives a different AST size: %zu != %zu", \
+            parser.ast.nodes_used, tokens_parser.ast.nodes_used); \
+        \
+        const long stream_result = ast_eval(&tokens_parser.ast, arg_values); \
+        ASSERT_EQUAL(RESULT, stream_result, "AST of streamed parser interpretation failed: %ld != %ld", (long)(RESULT), stream_result); \
+        \
         optimize(&parser.ast); \
         \
         const long opt_result = ast_eval(&parser.ast, arg_values); \
         ASSERT_EQUAL(RESULT, opt_result, "optimized AST interpretation failed: %ld != %ld", (long)(RESULT), opt_result); \
         \
+        ASSERT_TRUE(ast_compact(&parser.ast), "AST compaction failed"); \
+        \
+        linear_values = malloc(sizeof(long) * (parser.ast.nodes_used + 1)); \
+        ASSERT_TRUE(linear_values != NULL, "allocating linear values failed"); \
+        \
+        const long linear_result = ast_eval_linear(&parser.ast, arg_values, linear_values); \
+        ASSERT_EQUAL(RESULT, linear_result, "linear AST interpretation failed: %ld != %ld", (long)(RESULT), linear_result); \
+        \
+        ASSERT_TRUE(compact_ast_init(&compact_ast, &parser.ast, false), "compact AST conversion failed"); \
+        \
+        const long compact_result = compact_ast_eval(&compact_ast, arg_values, linear_values); \
+        ASSERT_EQUAL(RESULT, compact_result, "compact AST interpretation failed: %ld != %ld", (long)(RESULT), compact_result); \
+        \
+        compact_bytecode = bytecode_compile_compact(&compact_ast); \
+        ASSERT_NOT_EQUAL(0, compact_bytecode.stack_size, "bytecode compilation of compact AST failed"); \
+        \
+        const long compact_bytecode_result = bytecode_eval(compact_bytecode.bytes.data, arg_values); \
+        ASSERT_EQUAL(RESULT, compact_bytecode_result, "bytecode of compact AST interpretation failed: %ld != %ld", \
+            (long)(RESULT), compact_bytecode_result); \
+        \
         bytecode = bytecode_compile(&parser.ast); \
         ASSERT_NOT_EQUAL(0, bytecode.stack_size, "bytecode compilation failed"); \
         \
+        ASSERT_TRUE(bytecode.bytes.used == compact_bytecode.bytes.used && \
+            memcmp(bytecode.bytes.data, compact_bytecode.bytes.data, bytecode.bytes.used) == 0, \
+            "bytecode of compact AST differs"); \
+        \
+        /* everything below runs on the DAG */ \
+        size_t cse_eliminated = 0; \
+        ASSERT_TRUE(optimize_cse(&parser.ast, &cse_eliminated), "common subexpression elimination failed"); \
+        \
+        const long cse_result = ast_eval_linear(&parser.ast, arg_values, linear_values); \
+        ASSERT_EQUAL(RESULT, cse_result, "linear DAG interpretation failed: %ld != %ld", (long)(RESULT), cse_result); \
+        \
+        /* so all backends below get to run SHL */ \
+        size_t strength_lowered = 0; \
+        ASSERT_TRUE(optimize_strength(&parser.ast, get_strength_costs(STRENGTH_TARGET_BATCH), &strength_lowered), \
+            "strength reduction failed"); \
+        \
+        free(linear_values); \
+        linear_values = malloc(sizeof(long) * (parser.ast.nodes_used + 1)); \
+        ASSERT_TRUE(linear_values != NULL, "allocating linear values failed"); \
+        \
+        const long strength_result = ast_eval_linear(&parser.ast, arg_values, linear_values); \
+        ASSERT_EQUAL(RESULT, strength_result, "linear interpretation after strength reduction failed: %ld != %ld", \
+            (long)(RESULT), strength_result); \
+        \
+        bytecode_destroy(&bytecode); \
+        bytecode = bytecode_compile(&parser.ast); \
+        ASSERT_NOT_EQUAL(0, bytecode.stack_size, "bytecode compilation of DAG failed"); \
+        \
         const long bytecode_result = bytecode_eval(bytecode.bytes.data, arg_values); \
         ASSERT_EQUAL(RESULT, bytecode_result, "bytecode interpretation failed: %ld != %ld", (long)(RESULT), bytecode_result); \
+        \
+        ASSERT_TRUE(vm_context_init(&vm_ctx, bytecode.bytes.data), "VM context creation failed: %s", \
+            get_vm_error_message(vm_ctx.error)); \
+        \
+        long ctx_result = 0; \
+        ASSERT_TRUE(bytecode_eval_ctx(&vm_ctx, bytecode.bytes.data, arg_values, &ctx_result), \
+            "bytecode interpretation with context failed: %s", get_vm_error_message(vm_ctx.error)); \
+        ASSERT_EQUAL(RESULT, ctx_result, "bytecode interpretation with context failed: %ld != %ld", (long)(RESULT), ctx_result); \
+        \
+        batch_data = malloc(sizeof(long) * TEST_BATCH_ROWS * (size + 1)); \
+        ASSERT_TRUE(batch_data != NULL, "allocating batch data failed"); \
+        \
+        const long *batch_columns[sizeof(test_args) / sizeof(struct TestArg) + 1] = { NULL }; \
+        long *batch_results = batch_data + TEST_BATCH_ROWS * size; \
+        for (size_t index = 0; index < size; ++ index) { \
+            long *column = batch_data + TEST_BATCH_ROWS * index; \
+            for (size_t row = 0; row < TEST_BATCH_ROWS; ++ row) { \
+                column[row] = arg_values[index]; \
+            } \
+            batch_columns[index] = column; \
+        } \
+        \
+        for (enum BatchIsa isa = BATCH_ISA_SCALAR; isa <= batch_detect_isa(); ++ isa) { \
+            ASSERT_TRUE(bytecode_eval_batch_isa(&vm_ctx, bytecode.bytes.data, batch_columns, batch_results, TEST_BATCH_ROWS, isa), \
+                "%s batch interpretation failed: %s", get_batch_isa_name(isa), get_vm_error_message(vm_ctx.error)); \
+            \
+            for (size_t row = 0; row < TEST_BATCH_ROWS; ++ row) { \
+                ASSERT_EQUAL(RESULT, batch_results[row], "%s batch interpretation failed in row %zu: %ld != %ld", \
+                    get_batch_isa_name(isa), row, (long)(RESULT), batch_results[row]); \
+            } \
+        } \
+        \
+        regcode = regcode_compile(&parser.ast); \
+        ASSERT_NOT_EQUAL(0, regcode.reg_count, "register code compilation failed"); \
+        \
+        const long regcode_result = regcode_eval(&regcode, arg_values); \
+        ASSERT_EQUAL(RESULT, regcode_result, "register code interpretation failed: %ld != %ld", (long)(RESULT), regcode_result); \
+        \
+        ASSERT_TRUE(regcode_eval_ctx(&vm_ctx, &regcode, arg_values, &ctx_result), \
+            "register code interpretation with context failed: %s", get_vm_error_message(vm_ctx.error)); \
+        ASSERT_EQUAL(RESULT, ctx_result, "register code interpretation with context failed: %ld != %ld", (long)(RESULT), ctx_result); \
+        \
+        closure = closure_compile(&parser.ast); \
+        ASSERT_TRUE(closure.closures != NULL, "closure compilation failed"); \
+        \
+        const long closure_result = closure_eval(&closure, arg_values); \
+        ASSERT_EQUAL(RESULT, closure_result, "closure evaluation failed: %ld != %ld", (long)(RESULT), closure_result); \
+        \
+        jit = jit_compile(&parser.ast); \
+        ASSERT_TRUE(!JIT_SUPPORTED || jit.func != NULL, "JIT compilation failed"); \
+        \
+        if (jit.func != NULL) { \
+            const long jit_result = jit.func(arg_values); \
+            ASSERT_EQUAL(RESULT, jit_result, "JIT compiled code failed: %ld != %ld", (long)(RESULT), jit_result); \
+        } \
     }
 
 #define TEST_OK_EXPR(NAME, EXPR, RESULT, ...) \
-    TEST_DECL_SYM(NAME, TEST_STR(NAME) ": " EXPR " == " TEST_STR(RESULT)) { \
+    TEST_OK_EXPR_TITLE(NAME, TEST_STR(NAME) ": " EXPR " == " TEST_STR(RESULT), EXPR, RESULT, __VA_ARGS__)
+
+// for expressions too long to be used in the test name
+#define TEST_OK_EXPR_TITLE(NAME, TITLE, EXPR, RESULT, ...) \
+    TEST_DECL_SYM(NAME, TITLE) { \
         struct Parser parser = PARSER_INIT; \
+        struct Parser tokens_parser = PARSER_INIT; \
+        struct ArgSchema schema = ARG_SCHEMA_INIT; \
+        struct TokenStream tokens = TOKEN_STREAM_INIT; \
         struct Bytecode bytecode = BYTECODE_INIT; \
+        struct JitFunction jit = JIT_FUNCTION_INIT; \
+        struct VmContext vm_ctx = VM_CONTEXT_INIT; \
+        struct RegCode regcode = REGCODE_INIT; \
+        struct ClosureCode closure = CLOSURE_CODE_INIT; \
+        long *batch_data = NULL; \
+        long *linear_values = NULL; \
+        struct CompactAst compact_ast = COMPACT_AST_INIT; \
+        struct Bytecode compact_bytecode = BYTECODE_INIT; \
         \
         ASSERT_OK_EXPR(EXPR, RESULT, __VA_ARGS__); \
         \
     cleanup: \
         parser_destroy(&parser); \
+        parser_destroy(&tokens_parser); \
+        arg_schema_destroy(&schema); \
+        token_stream_destroy(&tokens); \
         bytecode_destroy(&bytecode); \
+        jit_destroy(&jit); \
+        vm_context_destroy(&vm_ctx); \
+        regcode_destroy(&regcode); \
+        closure_destroy(&closure); \
+        free(batch_data); \
+        free(linear_values); \
+        compact_ast_destroy(&compact_ast); \
+        bytecode_destroy(&compact_bytecode); \
     }
 
 #define ASSERT_PARSER_ERROR(EXPR, ERROR, ...) \
@@ -158,16 +320,43 @@ struct TestArg {
         ASSERT_EQUAL(ERROR, parser.error, "wrong parser error: %s != %s", \
             get_parser_error_message(ERROR), \
             get_parser_error_message(parser.error)); \
+        \
+        arg_schema_init(&schema, (char *const *const)arg_names, sizeof(arg_names) / sizeof(char*)); \
+        tokenize_slice(&tokens, (EXPR), strlen(EXPR)); \
+        tokens_parser = parse_tokens(&tokens, (EXPR), strlen(EXPR), &schema); \
+        \
+        ASSERT_EQUAL(ERROR, tokens_parser.error, "wrong parser error with tokens: %s != %s", \
+            get_parser_error_message(ERROR), \
+            get_parser_error_message(tokens_parser.error)); \
+        \
+        parser_destroy(&tokens_parser); \
+        tokens_parser = parse_stream(&schema, &PARSER_OPTIONS_INIT); \
+        for (const char *chunk = (EXPR); *chunk && parser_feed(&tokens_parser, chunk, 1); ++ chunk) {} \
+        \
+        ASSERT_TRUE(!parser_finish(&tokens_parser), "streamed parser succeeded"); \
+        ASSERT_EQUAL(ERROR, tokens_parser.error, "wrong streamed parser error: %s != %s", \
+            get_parser_error_message(ERROR), \
+            get_parser_error_message(tokens_parser.error)); \
+        ASSERT_TRUE(parser.error_info.code.start_index == tokens_parser.error_info.code.start_index && \
+            parser.error_info.code.end_index == tokens_parser.error_info.code.end_index, \
+            "wrong streamed parser error location: %zu ... %zu", \
+            tokens_parser.error_info.code.start_index, tokens_parser.error_info.code.end_index); \
     }
 
 #define TESTS_PARSER_ERROR(NAME, EXPR, ERROR, ...) \
     TEST_DECL_SYM(NAME, TEST_STR(NAME) ": " EXPR " -> " TEST_STR(ERROR)) { \
         struct Parser parser = PARSER_INIT; \
+        struct Parser tokens_parser = PARSER_INIT; \
+        struct ArgSchema schema = ARG_SCHEMA_INIT; \
+        struct TokenStream tokens = TOKEN_STREAM_INIT; \
         \
         ASSERT_PARSER_ERROR(EXPR, ERROR, __VA_ARGS__); \
         \
     cleanup: \
         parser_destroy(&parser); \
+        parser_destroy(&tokens_parser); \
+        arg_schema_destroy(&schema); \
+        token_stream_destroy(&tokens); \
     }
 
 bool test_run(struct TestDecl const* const tests[]);
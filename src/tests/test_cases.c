@@ -3,6 +3,20 @@
 #include "parser.h"
 #include "bytecode.h"
 #include "optimizer.h"
+#include "jit.h"
+#include "regvm.h"
+#include "batch.h"
+#include "compact_ast.h"
+#include "strength.h"
+#include "specialize.h"
+#include "closure.h"
+#include "buffer.h"
+#include "polynomial.h"
+#include "allocator.h"
+
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 
 TEST_OK_EXPR(const, "123", 123)
 
@@ -40,10 +54,1563 @@ TEST_OK_EXPR(many_mul_div,
     TEST_ARG(y, 6),
     TEST_ARG(z, -7))
 
+TEST_OK_EXPR(big_consts,
+    "x * 10000000000 + 20000000000 - x / 3000000000 + 2 / x", 90000000000,
+    TEST_ARG(x, 7))
+
+// literals around the 8 digit chunks and the safe digit count of the lexer
+TEST_OK_EXPR(int_literals,
+    "1234567 + 12345678 * x - 123456789 + 1234567890123456 - 12345678901234567 + 123456789012345678 * x"
+    " - 1234567890123456789 + 0000000000000000000042 + (9223372036854775807 - 9223372036854775000)", -875308634182715205,
+    TEST_ARG(x, 3))
+
+// whitespace runs longer than a vector, every kind of whitespace and comments
+TEST_OK_EXPR(layout,
+    "                                        x # comment ( with $ illegal\n"
+    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t*\r\n\v\f  \n"
+    "# only a comment\n"
+    "   (y   +                            2)   # trailing comment", 15,
+    TEST_ARG(x, 3),
+    TEST_ARG(y, 3))
+
+TEST_OK_EXPR(leaf_left,
+    "x - (y * (x + 1)) / y - 100 / (x - y)", -51,
+    TEST_ARG(x, 5),
+    TEST_ARG(y, 3))
+
+TEST_OK_EXPR(narrow_immediates,
+    "x * 1000 + 100000 - x * -200 + -5 + 2147483648 * x", 6442554539,
+    TEST_ARG(x, 3))
+
+TEST_OK_EXPR(superinstructions,
+    "x*3 + y - 7*x + x/y - y/2 + (x-y)*(y-x) + 100/x - (x*y)", -173,
+    TEST_ARG(x, 13),
+    TEST_ARG(y, 4))
+
+// needs more than VM_SCRATCH_SIZE stack cells
+TEST_OK_EXPR_TITLE(deep_stack, "deep_stack: x / (1 + x / (1 + ... x)) == 3",
+    "x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + "
+    "x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + "
+    "x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + "
+    "x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + x / (1 + "
+    "x))))))))))))))))))))))))))))))))))))))))", 3,
+    TEST_ARG(x, 3))
+
+TEST_OK_EXPR(shared_subexprs,
+    "(x*y + 3) * (x*y + 3) - (y*x + 3) / (3 + x*y) + -(x*y + 3) * -(3 + y*x)", 2887,
+    TEST_ARG(x, 5),
+    TEST_ARG(y, 7))
+
+TEST_OK_EXPR(like_terms, "x + 3*x - 2*x + y*x - x*y", 10,
+    TEST_ARG(x, 5),
+    TEST_ARG(y, 7))
+
+TEST_OK_EXPR(poly_div_barrier, "(x*3 - x - x) / (2*y - y) + (x + x) * y / 2 - y*x + -(-x * 2 + x)", 5,
+    TEST_ARG(x, 5),
+    TEST_ARG(y, 7))
+
+TEST_OK_EXPR(poly_wrapping, "x * 4611686018427387904 * 4 + x * 3 - -x * (9223372036854775807 + 2)", -9223372036854775788,
+    TEST_ARG(x, 5))
+
 // TODO: more positive tests
 
+TEST_OK_EXPR(strength_consts, "x*8 + y*9 - (x - y)*15 + x*-12 + y*(-4611686018427387904 * 2) + (x + y)*45", -9223372036854775195,
+    TEST_ARG(x, 5), TEST_ARG(y, 7))
+
+TEST_OK_EXPR(strength_divisions, "x/7 + y/-3 - x/10 + (x - y)/641 + y/16 - x/-1 + (x + y)/(-4611686018427387904 * 2)", -13078,
+    TEST_ARG(x, -12345), TEST_ARG(y, 678))
+
+TEST_DECL(batch_rows) {
+    char *const arg_names[] = { "a", "b", "c", "d" };
+    struct Parser parser = parse_string(
+        "a * b - c * 3 + (a - b) * (c + 7) / d - -a * 1000000007 + a * a * b",
+        arg_names, 4);
+    struct Bytecode bytecode = BYTECODE_INIT;
+    struct VmContext vm_ctx = VM_CONTEXT_INIT;
+    long *data = NULL;
+
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s",
+        get_parser_error_message(parser.error));
+
+    optimize(&parser.ast);
+
+    bytecode = bytecode_compile(&parser.ast);
+    ASSERT_NOT_EQUAL(0, bytecode.stack_size, "bytecode compilation failed");
+
+    const size_t rows = TEST_BATCH_ROWS;
+    data = malloc(sizeof(long) * rows * 5);
+    ASSERT_TRUE(data != NULL, "allocating batch data failed");
+
+    const long *columns[] = { data, data + rows, data + 2 * rows, data + 3 * rows };
+    long *results = data + 4 * rows;
+
+    // values that overflow the 32 bit partial products of the vectorized multiplication
+    unsigned long state = 88172645463325252UL;
+    for (size_t index = 0; index < rows * 4; ++ index) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        data[index] = (long)(state % 20000000000UL) - 10000000000L;
+    }
+    for (size_t row = 0; row < rows; ++ row) {
+        long *divisor = &data[3 * rows + row];
+        if (*divisor == 0) {
+            *divisor = 1;
+        }
+    }
+
+    for (enum BatchIsa isa = BATCH_ISA_SCALAR; isa <= batch_detect_isa(); ++ isa) {
+        ASSERT_TRUE(bytecode_eval_batch_isa(&vm_ctx, bytecode.bytes.data, columns, results, rows, isa),
+            "%s batch interpretation failed: %s", get_batch_isa_name(isa), get_vm_error_message(vm_ctx.error));
+
+        for (size_t row = 0; row < rows; ++ row) {
+            const long args[] = { columns[0][row], columns[1][row], columns[2][row], columns[3][row] };
+            const long expected = bytecode_eval(bytecode.bytes.data, args);
+            ASSERT_EQUAL(expected, results[row], "%s batch interpretation failed in row %zu: %ld != %ld",
+                get_batch_isa_name(isa), row, expected, results[row]);
+        }
+    }
+
+cleanup:
+    parser_destroy(&parser);
+    bytecode_destroy(&bytecode);
+    vm_context_destroy(&vm_ctx);
+    free(data);
+}
+
+TEST_DECL(compact) {
+    char *const arg_names[] = { "x", "y" };
+    struct Parser parser = parse_string("(x * 0 + 3 * 4) * y - (y - y) + x * (2 - 1)", arg_names, 2);
+    long *values = NULL;
+
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s",
+        get_parser_error_message(parser.error));
+
+    // the old root becomes unreachable
+    const struct AstNode root = parser.ast.nodes[AST_ROOT_NODE_INDEX(&parser.ast)];
+    ASSERT_TRUE(ast_append_node(&parser.ast, &root), "appending node failed");
+
+    const size_t nodes_used = parser.ast.nodes_used;
+    const long args[] = { 5, 7 };
+    const long expected = ast_eval(&parser.ast, args);
+
+    ASSERT_TRUE(ast_compact(&parser.ast), "AST compaction failed");
+    ASSERT_TRUE(parser.ast.nodes_used < nodes_used, "no unreachable nodes were dropped: %zu >= %zu",
+        parser.ast.nodes_used, nodes_used);
+
+    for (size_t index = 0; index < parser.ast.nodes_used; ++ index) {
+        const struct AstNode *node = &parser.ast.nodes[index];
+        if (node->type == NODE_INV) {
+            ASSERT_TRUE(node->child_index < index, "child after parent: %zu >= %zu", node->child_index, index);
+        } else if (node->type != NODE_INT && node->type != NODE_VAR) {
+            ASSERT_TRUE(node->binary.left_index < index, "left child after parent: %zu >= %zu", node->binary.left_index, index);
+            ASSERT_TRUE(node->binary.right_index < index, "right child after parent: %zu >= %zu", node->binary.right_index, index);
+        }
+    }
+
+    values = malloc(sizeof(long) * parser.ast.nodes_used);
+    ASSERT_TRUE(values != NULL, "allocating values failed");
+
+    const long result = ast_eval_linear(&parser.ast, args, values);
+    ASSERT_EQUAL(expected, result, "linear AST interpretation failed: %ld != %ld", expected, result);
+
+cleanup:
+    parser_destroy(&parser);
+    free(values);
+}
+
+TEST_DECL(compact_ast) {
+    char *const arg_names[] = { "x", "y" };
+    struct Parser parser = parse_string("x * 3 + 1000000000000 - -y / x", arg_names, 2);
+    struct CompactAst compact = COMPACT_AST_INIT;
+
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s",
+        get_parser_error_message(parser.error));
+
+    ASSERT_TRUE(compact_ast_init(&compact, &parser.ast, false), "compact AST conversion failed");
+    ASSERT_TRUE(compact.ranges == NULL, "source ranges were kept");
+    compact_ast_destroy(&compact);
+
+    ASSERT_TRUE(compact_ast_init(&compact, &parser.ast, true), "compact AST conversion failed");
+    ASSERT_TRUE(compact.ranges != NULL, "source ranges were dropped");
+    ASSERT_EQUAL(parser.ast.nodes_used, compact.nodes_used, "wrong node count: %zu != %zu",
+        parser.ast.nodes_used, compact.nodes_used);
+    ASSERT_EQUAL(2, compact.consts_used, "wrong constant count: 2 != %zu", compact.consts_used);
+
+    for (size_t index = 0; index < compact.nodes_used; ++ index) {
+        const struct AstNode *node = &parser.ast.nodes[index];
+        ASSERT_TRUE(
+            compact.ranges[index].start_index == node->start_index &&
+            compact.ranges[index].end_index   == node->end_index,
+            "wrong source range of node %zu", index);
+    }
+
+    const size_t ast_size = parser.ast.nodes_used * sizeof(struct AstNode);
+    const size_t compact_size = compact_ast_memory_size(&compact);
+    ASSERT_TRUE(compact_size < ast_size, "compact AST isn't smaller: %zu >= %zu", compact_size, ast_size);
+
+cleanup:
+    parser_destroy(&parser);
+    compact_ast_destroy(&compact);
+}
+
+TEST_DECL(compact_optimize) {
+    static const struct {
+        const char *code;
+        size_t nodes;
+    } cases[] = {
+        { "x * (3 - 3) + (2 + 5) * y - 0", 3 },
+        { "-(-x) * 1 + 0 / y", 1 },
+        { "0 - (x - x) * y + 10 / -3 / (1 + 1)", 1 },
+        { "(x + 1) * y - 2 * 4 / x", 9 },
+    };
+    char *const arg_names[] = { "x", "y" };
+    const long args[] = { 5, 7 };
+    struct Parser parser = PARSER_INIT;
+    struct CompactAst compact = COMPACT_AST_INIT;
+    struct Bytecode bytecode = BYTECODE_INIT;
+    long *values = NULL;
+
+    for (size_t index = 0; index < sizeof(cases) / sizeof(cases[0]); ++ index) {
+        parser = parse_string(cases[index].code, arg_names, 2);
+        ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+
+        const long expected = ast_eval(&parser.ast, args);
+        const size_t nodes_used = parser.ast.nodes_used;
+
+        ASSERT_TRUE(compact_ast_init(&compact, &parser.ast, true), "compact AST conversion failed");
+
+        size_t removed = 0;
+        ASSERT_TRUE(compact_ast_optimize(&compact, &removed), "compact AST optimization failed");
+        ASSERT_EQUAL(cases[index].nodes, compact.nodes_used, "%s: wrong node count after optimization: %zu != %zu",
+            cases[index].code, cases[index].nodes, compact.nodes_used);
+        ASSERT_EQUAL(nodes_used - compact.nodes_used, removed, "%s: wrong number of removed nodes: %zu != %zu",
+            cases[index].code, nodes_used - compact.nodes_used, removed);
+
+        values = malloc(sizeof(long) * compact.nodes_used);
+        ASSERT_TRUE(values != NULL, "out of memory");
+
+        long result = compact_ast_eval(&compact, args, values);
+        ASSERT_EQUAL(expected, result, "%s: wrong result: %ld != %ld", cases[index].code, expected, result);
+
+        // still a tree
+        bytecode = bytecode_compile_compact(&compact);
+        ASSERT_NOT_EQUAL(0, bytecode.stack_size, "%s: bytecode compilation failed", cases[index].code);
+        result = bytecode_eval(bytecode.bytes.data, args);
+        ASSERT_EQUAL(expected, result, "%s: wrong bytecode result: %ld != %ld", cases[index].code, expected, result);
+
+        free(values);
+        values = NULL;
+        bytecode_destroy(&bytecode);
+        compact_ast_destroy(&compact);
+        parser_destroy(&parser);
+    }
+
+    // the same expression as in the cse test, but without optimize()
+    parser = parse_string("(x*y + 3) * (x*y + 3) - (y*x + 3) / (3 + x*y) + (x - y) * (x*y + 3)", arg_names, 2);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_TRUE(compact_ast_init(&compact, &parser.ast, false), "compact AST conversion failed");
+
+    size_t eliminated = 0;
+    ASSERT_TRUE(compact_ast_cse(&compact, &eliminated), "compact common subexpression elimination failed");
+    // 4 of the 5 copies of x*y + 3 (5 nodes each) and the x and y of x - y
+    ASSERT_EQUAL(22, eliminated, "wrong number of eliminated nodes: 22 != %zu", eliminated);
+    ASSERT_EQUAL(1, compact.consts_used, "wrong constant count: 1 != %zu", compact.consts_used);
+
+    values = malloc(sizeof(long) * compact.nodes_used);
+    ASSERT_TRUE(values != NULL, "out of memory");
+
+    const long expected = 38 * 38 - 1 + (5 - 7) * 38;
+    const long result = compact_ast_eval(&compact, args, values);
+    ASSERT_EQUAL(expected, result, "wrong result of compact DAG: %ld != %ld", expected, result);
+
+cleanup:
+    free(values);
+    bytecode_destroy(&bytecode);
+    compact_ast_destroy(&compact);
+    parser_destroy(&parser);
+}
+
+TEST_DECL(cse) {
+    char *const arg_names[] = { "x", "y" };
+    struct Parser parser = parse_string(
+        "(x*y + 3) * (x*y + 3) - (y*x + 3) / (3 + x*y) + (x - y) * (x*y + 3)",
+        arg_names, 2);
+    struct Bytecode tree_bytecode = BYTECODE_INIT;
+    struct Bytecode dag_bytecode = BYTECODE_INIT;
+    struct CompactAst compact = COMPACT_AST_INIT;
+    struct Bytecode compact_bytecode = BYTECODE_INIT;
+
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s",
+        get_parser_error_message(parser.error));
+
+    optimize(&parser.ast);
+
+    tree_bytecode = bytecode_compile(&parser.ast);
+    ASSERT_NOT_EQUAL(0, tree_bytecode.stack_size, "bytecode compilation failed");
+
+    size_t eliminated = 0;
+    ASSERT_TRUE(optimize_cse(&parser.ast, &eliminated), "common subexpression elimination failed");
+    // 4 of the 5 copies of x*y + 3 (5 nodes each) and the x and y of x - y
+    ASSERT_EQUAL(22, eliminated, "wrong number of eliminated nodes: 22 != %zu", eliminated);
+
+    dag_bytecode = bytecode_compile(&parser.ast);
+    ASSERT_NOT_EQUAL(0, dag_bytecode.stack_size, "bytecode compilation of DAG failed");
+    ASSERT_TRUE(dag_bytecode.bytes.used < tree_bytecode.bytes.used, "bytecode of DAG isn't smaller: %zu >= %zu",
+        dag_bytecode.bytes.used, tree_bytecode.bytes.used);
+
+    const long args[] = { 5, 7 };
+    const long expected = 38 * 38 - 1 + (5 - 7) * 38;
+    const long result = bytecode_eval(dag_bytecode.bytes.data, args);
+    ASSERT_EQUAL(expected, result, "bytecode interpretation of DAG failed: %ld != %ld", expected, result);
+
+    // a compact AST of a DAG can't be compiled in one pass
+    ASSERT_TRUE(compact_ast_init(&compact, &parser.ast, false), "compact AST conversion failed");
+    compact_bytecode = bytecode_compile_compact(&compact);
+    ASSERT_EQUAL(0, compact_bytecode.stack_size, "bytecode compilation of compact DAG didn't fail");
+
+cleanup:
+    parser_destroy(&parser);
+    bytecode_destroy(&tree_bytecode);
+    bytecode_destroy(&dag_bytecode);
+    compact_ast_destroy(&compact);
+    bytecode_destroy(&compact_bytecode);
+}
+
+TEST_DECL(polynomial) {
+    static const struct {
+        const char *code;
+        size_t nodes;
+    } cases[] = {
+        { "x + 3*x - 2*x + y*x - x*y", 3 },
+        { "x*y - y*x + 7", 1 },
+        { "(x + 1) * 3 - x*3 - 3", 1 },
+        { "-(x - y) + (x - y)", 1 },
+        { "x*x*y - y*x*x + x / (y + y - y)", 3 },
+    };
+    char *const arg_names[] = { "x", "y" };
+    struct Parser parser = PARSER_INIT;
+
+    for (size_t index = 0; index < sizeof(cases) / sizeof(cases[0]); ++ index) {
+        parser = parse_string(cases[index].code, arg_names, 2);
+
+        ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s",
+            get_parser_error_message(parser.error));
+
+        const long args[] = { 5, 7 };
+        const long expected = ast_eval(&parser.ast, args);
+
+        optimize(&parser.ast);
+
+        ASSERT_EQUAL(cases[index].nodes, parser.ast.nodes_used, "%s: wrong node count after optimization: %zu != %zu",
+            cases[index].code, cases[index].nodes, parser.ast.nodes_used);
+
+        const long result = ast_eval(&parser.ast, args);
+        ASSERT_EQUAL(expected, result, "%s: wrong result: %ld != %ld", cases[index].code, expected, result);
+
+        parser_destroy(&parser);
+    }
+
+cleanup:
+    parser_destroy(&parser);
+}
+
+TEST_DECL(poly_opaque_chain) {
+    char *const arg_names[] = { "x" };
+    const long arg_values[] = { 1000003 };
+    const size_t term_count = 16384;
+    struct Buffer code = BUFFER_INIT;
+    struct Parser parser = PARSER_INIT;
+
+    // x/2 + x/3 + ... is a long sum of atoms that can't be merged, the
+    // polynomial pass used to be quadratic on it (see the optimize table of
+    // the bench for the timing)
+    for (size_t index = 0; index < term_count; ++ index) {
+        char str[32];
+        const int len = snprintf(str, sizeof(str), index == 0 ? "x/%zu" : " + x/%zu", index + 2);
+        ASSERT_TRUE(buffer_append(&code, str, (size_t)len), "out of memory");
+    }
+
+    parser = parse_slice(code.data, code.used, arg_names, 1);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+
+    const long expected = ast_eval(&parser.ast, arg_values);
+    const size_t node_count = parser.ast.nodes_used;
+
+    optimize(&parser.ast);
+
+    ASSERT_EQUAL(node_count, parser.ast.nodes_used, "wrong node count after optimization: %zu != %zu",
+        node_count, parser.ast.nodes_used);
+
+    const long result = ast_eval(&parser.ast, arg_values);
+    ASSERT_EQUAL(expected, result, "wrong result: %ld != %ld", expected, result);
+
+cleanup:
+    buffer_destroy(&code);
+    parser_destroy(&parser);
+}
+
+// x * c or (x + y) * c
+// x <op> value or (x + y) <op> value
+static bool strength_test_ast(struct Ast *ast, enum NodeType type, long value, bool leaf) {
+    const struct AstNode var_x = { .type = NODE_VAR, .arg_index = 0 };
+    const struct AstNode var_y = { .type = NODE_VAR, .arg_index = 1 };
+    const struct AstNode add   = { .type = NODE_ADD, .binary = { .left_index = 0, .right_index = 1 } };
+    const struct AstNode val   = { .type = NODE_INT, .value = value };
+
+    if (!ast_append_node(ast, &var_x)) {
+        return false;
+    }
+
+    if (!leaf && (!ast_append_node(ast, &var_y) || !ast_append_node(ast, &add))) {
+        return false;
+    }
+
+    const size_t operand_index = AST_ROOT_NODE_INDEX(ast);
+    if (!ast_append_node(ast, &val)) {
+        return false;
+    }
+
+    const struct AstNode node = { .type = type, .binary = { .left_index = operand_index, .right_index = operand_index + 1 } };
+    return ast_append_node(ast, &node);
+}
+
+TEST_DECL(strength_reduction) {
+    // lowers everything that can be lowered
+    static const struct StrengthCosts eager_costs = { .add = 1, .shl = 1, .inv = 1, .mul = 1000, .mulhi = 1, .div = 0, .reuse = 0 };
+    static const struct {
+        enum StrengthTarget target;
+        long value;
+        bool leaf;
+        size_t lowered;
+    } decisions[] = {
+        { STRENGTH_TARGET_VM,    8, true,  1 },
+        { STRENGTH_TARGET_VM,    9, true,  0 },
+        { STRENGTH_TARGET_JIT,   9, true,  1 },
+        { STRENGTH_TARGET_JIT,   9, false, 0 },
+        { STRENGTH_TARGET_JIT,   8, false, 1 },
+        { STRENGTH_TARGET_BATCH, 9, true,  1 },
+        { STRENGTH_TARGET_BATCH, 9, false, 0 },
+        { STRENGTH_TARGET_BATCH, -8, false, 1 },
+        { STRENGTH_TARGET_BATCH, 73, true, 0 },
+    };
+    static const long values[] = {
+        -1, 2, 3, 5, 7, 8, 9, 10, 15, 17, 24, 45, 63, 64, 65, 100, 255, 1000,
+        -2, -3, -8, -9, -45, -1000, 1L << 40, (1L << 40) + 1, 0x5555555555555555,
+        LONG_MAX, LONG_MIN, LONG_MIN + 1, LONG_MIN + 3,
+    };
+    static const long args[][2] = {
+        { 0, 0 }, { 1, 2 }, { -1, 5 }, { 12345, -678 }, { LONG_MAX, 1 }, { LONG_MIN, -1 },
+    };
+    struct Ast ast = AST_INIT;
+    struct Bytecode bytecode = BYTECODE_INIT;
+    struct RegCode regcode = REGCODE_INIT;
+    struct JitFunction jit = JIT_FUNCTION_INIT;
+    long *values_buffer = NULL;
+
+    for (size_t index = 0; index < sizeof(decisions) / sizeof(decisions[0]); ++ index) {
+        ASSERT_TRUE(strength_test_ast(&ast, NODE_MUL, decisions[index].value, decisions[index].leaf), "building AST failed");
+
+        size_t lowered = 0;
+        ASSERT_TRUE(optimize_strength(&ast, get_strength_costs(decisions[index].target), &lowered), "strength reduction failed");
+        ASSERT_EQUAL(decisions[index].lowered, lowered, "%s: %s * %ld: wrong number of lowered multiplications: %zu != %zu",
+            get_strength_target_name(decisions[index].target), decisions[index].leaf ? "x" : "(x + y)",
+            decisions[index].value, decisions[index].lowered, lowered);
+
+        ast_destroy(&ast);
+    }
+
+    for (size_t index = 0; index < sizeof(values) / sizeof(values[0]) * 2; ++ index) {
+        const long value = values[index / 2];
+        const bool leaf = index % 2 == 0;
+
+        ASSERT_TRUE(strength_test_ast(&ast, NODE_MUL, value, leaf), "building AST failed");
+
+        size_t lowered = 0;
+        ASSERT_TRUE(optimize_strength(&ast, &eager_costs, &lowered), "strength reduction failed");
+        ASSERT_EQUAL((size_t)1, lowered, "%ld: multiplication wasn't lowered", value);
+
+        values_buffer = malloc(sizeof(long) * ast.nodes_used);
+        ASSERT_TRUE(values_buffer != NULL, "allocating values failed");
+
+        bytecode = bytecode_compile(&ast);
+        ASSERT_NOT_EQUAL(0, bytecode.stack_size, "bytecode compilation failed");
+
+        regcode = regcode_compile(&ast);
+        ASSERT_NOT_EQUAL(0, regcode.reg_count, "register code compilation failed");
+
+        jit = jit_compile(&ast);
+        ASSERT_TRUE(!JIT_SUPPORTED || jit.func != NULL, "JIT compilation failed");
+
+        for (size_t arg_index = 0; arg_index < sizeof(args) / sizeof(args[0]); ++ arg_index) {
+            const long *arg_values = args[arg_index];
+            const unsigned long operand = leaf ? (unsigned long)arg_values[0] : (unsigned long)arg_values[0] + (unsigned long)arg_values[1];
+            const long expected = (long)(operand * (unsigned long)value);
+
+            const long linear_result = ast_eval_linear(&ast, arg_values, values_buffer);
+            ASSERT_EQUAL(expected, linear_result, "%ld: linear AST interpretation failed: %ld != %ld", value, expected, linear_result);
+
+            const long bytecode_result = bytecode_eval(bytecode.bytes.data, arg_values);
+            ASSERT_EQUAL(expected, bytecode_result, "%ld: bytecode interpretation failed: %ld != %ld", value, expected, bytecode_result);
+
+            const long regcode_result = regcode_eval(&regcode, arg_values);
+            ASSERT_EQUAL(expected, regcode_result, "%ld: register code interpretation failed: %ld != %ld", value, expected, regcode_result);
+
+            if (jit.func != NULL) {
+                const long jit_result = jit.func(arg_values);
+                ASSERT_EQUAL(expected, jit_result, "%ld: JIT compiled code failed: %ld != %ld", value, expected, jit_result);
+            }
+        }
+
+        free(values_buffer);
+        values_buffer = NULL;
+        bytecode_destroy(&bytecode);
+        regcode_destroy(&regcode);
+        jit_destroy(&jit);
+        ast_destroy(&ast);
+    }
+
+cleanup:
+    ast_destroy(&ast);
+    bytecode_destroy(&bytecode);
+    regcode_destroy(&regcode);
+    jit_destroy(&jit);
+    free(values_buffer);
+}
+
+TEST_DECL(strength_division) {
+    // lowers every division
+    static const struct StrengthCosts eager_costs = { .add = 1, .shl = 1, .inv = 1, .mul = 0, .mulhi = 1, .div = 1000, .reuse = 0 };
+    static const struct {
+        enum StrengthTarget target;
+        long value;
+        bool leaf;
+        size_t lowered;
+    } decisions[] = {
+        { STRENGTH_TARGET_VM,    7,  true,  0 },
+        { STRENGTH_TARGET_VM,    -1, true,  1 },
+        { STRENGTH_TARGET_JIT,   7,  true,  1 },
+        { STRENGTH_TARGET_JIT,   7,  false, 0 },
+        { STRENGTH_TARGET_BATCH, 7,  true,  1 },
+        { STRENGTH_TARGET_BATCH, -7, false, 1 },
+    };
+    static const long values[] = {
+        1, -1, 2, 3, 5, 6, 7, 10, 16, 100, 641, 1000, 1000000007, 1L << 40, (1L << 40) + 1, 0x5555555555555555,
+        -2, -3, -7, -16, -100, -1000000007, LONG_MAX, LONG_MAX - 1, LONG_MIN, LONG_MIN + 1, LONG_MIN / 3,
+    };
+    static const long args[] = {
+        0, 1, -1, 2, -2, 6, 7, -7, 8, 12345, -12345, 999999999, 1L << 40, -(1L << 40),
+        LONG_MAX, LONG_MAX - 1, LONG_MIN, LONG_MIN + 1, LONG_MIN + 2, LONG_MIN / 3,
+    };
+    const size_t arg_count = sizeof(args) / sizeof(args[0]);
+    struct Ast ast = AST_INIT;
+    struct Bytecode bytecode = BYTECODE_INIT;
+    struct RegCode regcode = REGCODE_INIT;
+    struct JitFunction jit = JIT_FUNCTION_INIT;
+    struct VmContext vm_ctx = VM_CONTEXT_INIT;
+    long *values_buffer = NULL;
+    long columns_data[2][sizeof(args) / sizeof(args[0])];
+    long batch_results[sizeof(args) / sizeof(args[0])];
+    const long *columns[2] = { columns_data[0], columns_data[1] };
+
+    for (size_t index = 0; index < sizeof(decisions) / sizeof(decisions[0]); ++ index) {
+        ASSERT_TRUE(strength_test_ast(&ast, NODE_DIV, decisions[index].value, decisions[index].leaf), "building AST failed");
+
+        size_t lowered = 0;
+        ASSERT_TRUE(optimize_strength(&ast, get_strength_costs(decisions[index].target), &lowered), "strength reduction failed");
+        ASSERT_EQUAL(decisions[index].lowered, lowered, "%s: %s / %ld: wrong number of lowered divisions: %zu != %zu",
+            get_strength_target_name(decisions[index].target), decisions[index].leaf ? "x" : "(x + y)",
+            decisions[index].value, decisions[index].lowered, lowered);
+
+        ast_destroy(&ast);
+    }
+
+    // (x + y) with y = 0, so the operand covers the same values
+    for (size_t index = 0; index < arg_count; ++ index) {
+        columns_data[0][index] = args[index];
+        columns_data[1][index] = 0;
+    }
+
+    for (size_t index = 0; index < sizeof(values) / sizeof(values[0]) * 2; ++ index) {
+        const long value = values[index / 2];
+        const bool leaf = index % 2 == 0;
+
+        ASSERT_TRUE(strength_test_ast(&ast, NODE_DIV, value, leaf), "building AST failed");
+
+        size_t lowered = 0;
+        ASSERT_TRUE(optimize_strength(&ast, &eager_costs, &lowered), "strength reduction failed");
+        ASSERT_EQUAL((size_t)1, lowered, "%ld: division wasn't lowered", value);
+
+        values_buffer = malloc(sizeof(long) * ast.nodes_used);
+        ASSERT_TRUE(values_buffer != NULL, "allocating values failed");
+
+        bytecode = bytecode_compile(&ast);
+        ASSERT_NOT_EQUAL(0, bytecode.stack_size, "bytecode compilation failed");
+
+        regcode = regcode_compile(&ast);
+        ASSERT_NOT_EQUAL(0, regcode.reg_count, "register code compilation failed");
+
+        jit = jit_compile(&ast);
+        ASSERT_TRUE(!JIT_SUPPORTED || jit.func != NULL, "JIT compilation failed");
+
+        for (size_t arg_index = 0; arg_index < arg_count; ++ arg_index) {
+            const long arg_values[2] = { args[arg_index], 0 };
+            // LONG_MIN / -1 traps as a division, but wraps when lowered
+            const long expected = value == -1 ? (long)(0UL - (unsigned long)arg_values[0]) : arg_values[0] / value;
+
+            const long linear_result = ast_eval_linear(&ast, arg_values, values_buffer);
+            ASSERT_EQUAL(expected, linear_result, "%ld / %ld: linear AST interpretation failed: %ld != %ld", arg_values[0], value, expected, linear_result);
+
+            const long bytecode_result = bytecode_eval(bytecode.bytes.data, arg_values);
+            ASSERT_EQUAL(expected, bytecode_result, "%ld / %ld: bytecode interpretation failed: %ld != %ld", arg_values[0], value, expected, bytecode_result);
+
+            const long regcode_result = regcode_eval(&regcode, arg_values);
+            ASSERT_EQUAL(expected, regcode_result, "%ld / %ld: register code interpretation failed: %ld != %ld", arg_values[0], value, expected, regcode_result);
+
+            if (jit.func != NULL) {
+                const long jit_result = jit.func(arg_values);
+                ASSERT_EQUAL(expected, jit_result, "%ld / %ld: JIT compiled code failed: %ld != %ld", arg_values[0], value, expected, jit_result);
+            }
+        }
+
+        // every row has a different dividend, so all SIMD lanes are checked
+        for (enum BatchIsa isa = BATCH_ISA_SCALAR; isa <= batch_detect_isa(); ++ isa) {
+            ASSERT_TRUE(bytecode_eval_batch_isa(&vm_ctx, bytecode.bytes.data, columns, batch_results, arg_count, isa),
+                "%s batch interpretation failed: %s", get_batch_isa_name(isa), get_vm_error_message(vm_ctx.error));
+
+            for (size_t row = 0; row < arg_count; ++ row) {
+                const long expected = value == -1 ? (long)(0UL - (unsigned long)args[row]) : args[row] / value;
+                ASSERT_EQUAL(expected, batch_results[row], "%ld / %ld: %s batch interpretation failed: %ld != %ld",
+                    args[row], value, get_batch_isa_name(isa), expected, batch_results[row]);
+            }
+        }
+
+        free(values_buffer);
+        values_buffer = NULL;
+        bytecode_destroy(&bytecode);
+        regcode_destroy(&regcode);
+        jit_destroy(&jit);
+        ast_destroy(&ast);
+    }
+
+cleanup:
+    ast_destroy(&ast);
+    bytecode_destroy(&bytecode);
+    regcode_destroy(&regcode);
+    jit_destroy(&jit);
+    vm_context_destroy(&vm_ctx);
+    free(values_buffer);
+}
+
+TEST_DECL(specialize) {
+    char *const arg_names[] = { "x", "tenant", "rate", "y", "scale" };
+    struct Parser parser = parse_string(
+        "tenant * 1000 + rate * x - (y + tenant * rate) / scale + x * y * scale - rate * rate * 7",
+        arg_names, 5);
+    const char *const bound_names[] = { "scale", "tenant", "rate" };
+    const char *const undefined_names[] = { "tenant", "z" };
+    const char *const duplicated_names[] = { "rate", "tenant", "rate" };
+    const long bound_values[] = { 5, 42, -3 };
+    struct Bytecode bytecode = BYTECODE_INIT;
+    struct Specialization spec = SPECIALIZATION_INIT;
+    struct SpecializeCache cache = SPECIALIZE_CACHE_INIT;
+
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s",
+        get_parser_error_message(parser.error));
+
+    ASSERT_TRUE(!specialize(&spec, &parser.ast, arg_names, 5, undefined_names, bound_values, 2), "undefined argument was bound");
+    ASSERT_EQUAL(SPECIALIZE_ERROR_UNDEFINED_ARG, spec.error, "wrong error: %s", get_specialize_error_message(spec.error));
+
+    ASSERT_TRUE(!specialize(&spec, &parser.ast, arg_names, 5, duplicated_names, bound_values, 3), "duplicated argument was bound");
+    ASSERT_EQUAL(SPECIALIZE_ERROR_DUPLICATED_ARG, spec.error, "wrong error: %s", get_specialize_error_message(spec.error));
+
+    ASSERT_TRUE(specialize(&spec, &parser.ast, arg_names, 5, bound_names, bound_values, 3),
+        "specialization failed: %s", get_specialize_error_message(spec.error));
+
+    ASSERT_EQUAL((size_t)2, spec.free_argc, "wrong number of free arguments: %zu", spec.free_argc);
+    ASSERT_EQUAL((size_t)0, spec.free_args[0], "wrong first free argument: %zu", spec.free_args[0]);
+    ASSERT_EQUAL((size_t)3, spec.free_args[1], "wrong second free argument: %zu", spec.free_args[1]);
+
+    // the AST of the parser is left alone
+    bytecode = bytecode_compile(&parser.ast);
+    ASSERT_NOT_EQUAL(0, bytecode.stack_size, "bytecode compilation failed");
+
+    const size_t full_count = bytecode_count_instructions(bytecode.bytes.data);
+    const size_t spec_count = bytecode_count_instructions(spec.bytecode.bytes.data);
+    ASSERT_TRUE(spec_count < full_count, "specialization isn't smaller: %zu >= %zu instructions", spec_count, full_count);
+
+    ASSERT_TRUE(specialize_cache_init(&cache, &parser.ast, arg_names, 5, bound_names, 3),
+        "initializing cache failed: %s", get_specialize_error_message(cache.error));
+
+    const struct Specialization *cached = specialize_cache_get(&cache, bound_values);
+    ASSERT_TRUE(cached != NULL, "cache lookup failed: %s", get_specialize_error_message(cache.error));
+
+    // enough tuples to grow the table a few times
+    for (long tenant = 0; tenant < 100; ++ tenant) {
+        const long values[] = { tenant % 7 + 1, tenant, tenant - 50 };
+        const struct Specialization *other = specialize_cache_get(&cache, values);
+        ASSERT_TRUE(other != NULL, "cache lookup failed: %s", get_specialize_error_message(cache.error));
+        ASSERT_TRUE(other != cached, "different values share a specialization");
+
+        for (long x = -2; x <= 2; ++ x) {
+            const long args[] = { x * 1000003, values[1], values[2], x * 17 - 3, values[0] };
+            long free_args[2];
+            specialization_gather_args(other, args, free_args);
+
+            const long expected = bytecode_eval(bytecode.bytes.data, args);
+            const long actual = bytecode_eval(other->bytecode.bytes.data, free_args);
+            ASSERT_EQUAL(expected, actual, "tenant %ld, x %ld: specialization gives a different result: %ld != %ld",
+                tenant, x, expected, actual);
+        }
+    }
+
+    ASSERT_EQUAL((size_t)101, cache.entries_used, "wrong number of cache entries: %zu", cache.entries_used);
+    ASSERT_TRUE(specialize_cache_get(&cache, bound_values) == cached, "specialization wasn't cached");
+
+    for (long x = -1000; x <= 1000; x += 250) {
+        const long args[] = { x, bound_values[1], bound_values[2], -x * 3, bound_values[0] };
+        long free_args[2];
+        specialization_gather_args(&spec, args, free_args);
+
+        const long expected = bytecode_eval(bytecode.bytes.data, args);
+        const long actual = bytecode_eval(spec.bytecode.bytes.data, free_args);
+        const long actual_cached = bytecode_eval(cached->bytecode.bytes.data, free_args);
+        ASSERT_EQUAL(expected, actual, "x %ld: specialization gives a different result: %ld != %ld", x, expected, actual);
+        ASSERT_EQUAL(expected, actual_cached, "x %ld: cached specialization gives a different result: %ld != %ld", x, expected, actual_cached);
+    }
+
+cleanup:
+    parser_destroy(&parser);
+    bytecode_destroy(&bytecode);
+    specialization_destroy(&spec);
+    specialize_cache_destroy(&cache);
+}
+
+#define TEST_SCHEMA_ARGC 5000
+
+TEST_DECL(arg_schema) {
+    char *names = malloc(TEST_SCHEMA_ARGC * 8);
+    char **arg_names = malloc(sizeof(char*) * TEST_SCHEMA_ARGC);
+    long *arg_values = malloc(sizeof(long) * TEST_SCHEMA_ARGC);
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct Parser parser = PARSER_INIT;
+
+    ASSERT_TRUE(names != NULL && arg_names != NULL && arg_values != NULL, "out of memory");
+
+    for (size_t index = 0; index < TEST_SCHEMA_ARGC; ++ index) {
+        arg_names[index] = names + index * 8;
+        snprintf(arg_names[index], 8, "p%zu", index);
+        arg_values[index] = (long)index * 3 - 7;
+    }
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, TEST_SCHEMA_ARGC),
+        "schema initialization failed: %s", get_parser_error_message(schema.error));
+
+    for (size_t index = 0; index < TEST_SCHEMA_ARGC; ++ index) {
+        const size_t found = arg_schema_find(&schema, arg_names[index], strlen(arg_names[index]));
+        ASSERT_EQUAL(index, found, "wrong index for %s: %zu", arg_names[index], found);
+    }
+
+    // names are compared by length, not as prefixes
+    ASSERT_EQUAL((size_t)12, arg_schema_find(&schema, "p123", 3), "prefix lookup failed");
+    ASSERT_EQUAL((size_t)TEST_SCHEMA_ARGC, arg_schema_find(&schema, "p5000", 5), "undefined name was found");
+    ASSERT_EQUAL((size_t)TEST_SCHEMA_ARGC, arg_schema_find(&schema, "p", 1), "undefined name was found");
+
+    const char *const codes[] = { "p0", "p4999 - p17 * p2", "(p1234 + p12) / p3 - p123 * -p9" };
+    for (size_t index = 0; index < sizeof(codes) / sizeof(codes[0]); ++ index) {
+        const char *code = codes[index];
+
+        parser = parse_slice_with_schema(code, strlen(code), &schema);
+        ASSERT_EQUAL(ERROR_NONE, parser.error, "%s: parser error: %s", code, get_parser_error_message(parser.error));
+        const long actual = ast_eval(&parser.ast, arg_values);
+        parser_destroy(&parser);
+
+        parser = parse_string(code, arg_names, TEST_SCHEMA_ARGC);
+        ASSERT_EQUAL(ERROR_NONE, parser.error, "%s: parser error: %s", code, get_parser_error_message(parser.error));
+        const long expected = ast_eval(&parser.ast, arg_values);
+        parser_destroy(&parser);
+
+        ASSERT_EQUAL(expected, actual, "%s: parsing with schema gives a different result: %ld != %ld", code, expected, actual);
+    }
+
+    // identifiers end with the slice, not with the string
+    parser = parse_slice_with_schema("p1 + p23", 7, &schema);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL(arg_values[1] + arg_values[2], ast_eval(&parser.ast, arg_values), "identifier at the end of the slice was misread");
+    parser_destroy(&parser);
+
+    parser = parse_slice_with_schema("p1 + p5000", 10, &schema);
+    ASSERT_EQUAL(ERROR_UNDEFINED_VARIABLE, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    parser_destroy(&parser);
+    arg_schema_destroy(&schema);
+
+    snprintf(arg_names[4000], 8, "p17");
+    ASSERT_TRUE(!arg_schema_init(&schema, arg_names, TEST_SCHEMA_ARGC), "duplicated name was accepted");
+    ASSERT_EQUAL(ERROR_DUPLICATED_ARG_NAME, schema.error, "wrong error: %s", get_parser_error_message(schema.error));
+    ASSERT_EQUAL((size_t)4000, schema.error_arg_index, "wrong argument index: %zu", schema.error_arg_index);
+
+    // an invalid schema is reported by the parser
+    parser = parse_slice_with_schema("p1", 2, &schema);
+    ASSERT_EQUAL(ERROR_DUPLICATED_ARG_NAME, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL((size_t)4000, parser.error_info.arg_index, "wrong argument index: %zu", parser.error_info.arg_index);
+    parser_destroy(&parser);
+    arg_schema_destroy(&schema);
+
+    snprintf(arg_names[4000], 8, "4000");
+    ASSERT_TRUE(!arg_schema_init(&schema, arg_names, TEST_SCHEMA_ARGC), "illegal name was accepted");
+    ASSERT_EQUAL(ERROR_ILLEGAL_ARG_NAME, schema.error, "wrong error: %s", get_parser_error_message(schema.error));
+
+cleanup:
+    parser_destroy(&parser);
+    arg_schema_destroy(&schema);
+    free(names);
+    free(arg_names);
+    free(arg_values);
+}
+
+TEST_DECL(token_stream) {
+    char *const arg_names[] = { "x", "y" };
+    const long arg_values[] = { 3, -5 };
+    struct Buffer code = BUFFER_INIT;
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct TokenStream tokens = TOKEN_STREAM_INIT;
+    struct Parser parser = PARSER_INIT;
+    struct Parser tokens_parser = PARSER_INIT;
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 2), "schema initialization failed");
+
+    // enough tokens and literals to grow the stream a few times
+    for (long index = 0; index < 1000; ++ index) {
+        char term[64];
+        const int len = snprintf(term, sizeof(term), "%s%s * %ld - y / %ld", index > 0 ? " + " : "", index % 2 ? "x" : "y",
+            index * 1000003, index + 1);
+        ASSERT_TRUE(buffer_append(&code, term, (size_t)len), "out of memory");
+    }
+
+    ASSERT_TRUE(tokenize_slice(&tokens, code.data, code.used), "tokenizing failed: %s", get_parser_error_message(tokens.error));
+    ASSERT_EQUAL((size_t)1000 * 8, tokens.tokens_used, "wrong number of tokens: %zu", tokens.tokens_used);
+    ASSERT_EQUAL((size_t)1000 * 2, tokens.literals_used, "wrong number of literals: %zu", tokens.literals_used);
+    ASSERT_EQUAL((long)999 * 1000003, tokens.literals[1998], "wrong literal: %ld", tokens.literals[1998]);
+    ASSERT_EQUAL((uint32_t)code.used, tokens.start_offsets[tokens.tokens_used - 1], "wrong end of file offset: %u",
+        tokens.start_offsets[tokens.tokens_used - 1]);
+
+    parser = parse_slice_with_schema(code.data, code.used, &schema);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+
+    tokens_parser = parse_tokens(&tokens, code.data, code.used, &schema);
+    ASSERT_EQUAL(ERROR_NONE, tokens_parser.error, "parser error with tokens: %s", get_parser_error_message(tokens_parser.error));
+
+    const long expected = ast_eval(&parser.ast, arg_values);
+    const long actual = ast_eval(&tokens_parser.ast, arg_values);
+    ASSERT_EQUAL(expected, actual, "parsing tokens gives a different result: %ld != %ld", expected, actual);
+    parser_destroy(&tokens_parser);
+
+    // the stream is reused
+    ASSERT_TRUE(tokenize_slice(&tokens, "x + 1", 5), "tokenizing failed: %s", get_parser_error_message(tokens.error));
+    ASSERT_EQUAL((size_t)4, tokens.tokens_used, "wrong number of tokens: %zu", tokens.tokens_used);
+
+    tokens_parser = parse_tokens(&tokens, "x + 1", 5, &schema);
+    ASSERT_EQUAL(arg_values[0] + 1, ast_eval(&tokens_parser.ast, arg_values), "parsing reused tokens failed");
+    parser_destroy(&tokens_parser);
+
+    // lexer errors come first, even after a syntax error
+    ASSERT_TRUE(!tokenize_slice(&tokens, "x + * $", 7), "illegal character was lexed");
+    ASSERT_EQUAL((size_t)6, tokens.error_range.start_index, "wrong error location: %zu", tokens.error_range.start_index);
+
+    tokens_parser = parse_tokens(&tokens, "x + * $", 7, &schema);
+    ASSERT_EQUAL(ERROR_ILLEGAL_CHARACTER, tokens_parser.error, "wrong parser error: %s",
+        get_parser_error_message(tokens_parser.error));
+
+cleanup:
+    buffer_destroy(&code);
+    arg_schema_destroy(&schema);
+    token_stream_destroy(&tokens);
+    parser_destroy(&parser);
+    parser_destroy(&tokens_parser);
+}
+
+TEST_DECL(deep_nesting) {
+    char *const arg_names[] = { "x" };
+    const long arg_values[] = { 7 };
+    const size_t depth = 100000;
+    struct Buffer code = BUFFER_INIT;
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct ParserOptions options = PARSER_OPTIONS_INIT;
+    struct Parser parser = PARSER_INIT;
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 1), "schema initialization failed");
+
+    // deeper than the default limit, but must not exhaust the C stack
+    for (size_t index = 0; index < depth; ++ index) {
+        ASSERT_TRUE(buffer_append(&code, "(", 1), "out of memory");
+    }
+    ASSERT_TRUE(buffer_append(&code, "x + 1", 5), "out of memory");
+    for (size_t index = 0; index < depth; ++ index) {
+        ASSERT_TRUE(buffer_append(&code, ")", 1), "out of memory");
+    }
+
+    parser = parse_slice_with_schema(code.data, code.used, &schema);
+    ASSERT_EQUAL(ERROR_NESTING_TOO_DEEP, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL((size_t)PARSER_DEFAULT_MAX_DEPTH, parser.error_info.code.start_index, "wrong error location: %zu",
+        parser.error_info.code.start_index);
+    parser_destroy(&parser);
+
+    options.max_depth = depth;
+    parser = parse_slice_with_options(code.data, code.used, &schema, &options);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL(arg_values[0] + 1, ast_eval(&parser.ast, arg_values), "deeply nested expression gives a wrong result");
+    parser_destroy(&parser);
+
+    options.max_depth = 3;
+    parser = parse_slice_with_options("(((x)))", 7, &schema, &options);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    parser_destroy(&parser);
+
+    parser = parse_slice_with_options("((((x))))", 9, &schema, &options);
+    ASSERT_EQUAL(ERROR_NESTING_TOO_DEEP, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL((size_t)3, parser.error_info.code.start_index, "wrong error location: %zu", parser.error_info.code.start_index);
+    parser_destroy(&parser);
+
+    // signs nest without parentheses and don't count
+    buffer_destroy(&code);
+    for (size_t index = 0; index < depth; ++ index) {
+        ASSERT_TRUE(buffer_append(&code, "-", 1), "out of memory");
+    }
+    ASSERT_TRUE(buffer_append(&code, "x", 1), "out of memory");
+
+    parser = parse_slice_with_schema(code.data, code.used, &schema);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL(arg_values[0], ast_eval(&parser.ast, arg_values), "chained signs give a wrong result");
+
+cleanup:
+    buffer_destroy(&code);
+    arg_schema_destroy(&schema);
+    parser_destroy(&parser);
+}
+
+TEST_DECL(stream) {
+    char *const arg_names[] = { "x", "a_rather_long_argument_name_0123456789" };
+    const long arg_values[] = { 3, -5 };
+    const size_t chunk_sizes[] = { 1, 2, 3, 7, 64, 4096 };
+    struct Buffer code = BUFFER_INIT;
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct Parser parser = PARSER_INIT;
+    struct Parser stream_parser = PARSER_INIT;
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 2), "schema initialization failed");
+
+    // long identifiers and literals, comments and layout to be split by chunks
+    for (long index = 0; index < 500; ++ index) {
+        char term[128];
+        const int len = snprintf(term, sizeof(term), "%s(x * %ld # comment %ld\n\t- a_rather_long_argument_name_0123456789 / %ld)",
+            index > 0 ? "\n+ " : "", index * 1000000000003, index, index + 1);
+        ASSERT_TRUE(buffer_append(&code, term, (size_t)len), "out of memory");
+    }
+    ASSERT_TRUE(buffer_append(&code, " # no newline", 13), "out of memory");
+
+    parser = parse_slice_with_schema(code.data, code.used, &schema);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+
+    const long expected = ast_eval(&parser.ast, arg_values);
+
+    for (size_t size_index = 0; size_index < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++ size_index) {
+        const size_t chunk_size = chunk_sizes[size_index];
+
+        stream_parser = parse_stream(&schema, &PARSER_OPTIONS_INIT);
+        for (size_t index = 0; index < code.used; index += chunk_size) {
+            const size_t size = code.used - index < chunk_size ? code.used - index : chunk_size;
+            ASSERT_TRUE(parser_feed(&stream_parser, code.data + index, size), "streamed parser error with %zu byte chunks: %s",
+                chunk_size, get_parser_error_message(stream_parser.error));
+        }
+        ASSERT_TRUE(parser_finish(&stream_parser), "streamed parser error with %zu byte chunks: %s",
+            chunk_size, get_parser_error_message(stream_parser.error));
+
+        ASSERT_EQUAL(code.used, stream_parser.code_size, "wrong code size: %zu", stream_parser.code_size);
+        ASSERT_EQUAL(parser.ast.nodes_used, stream_parser.ast.nodes_used, "wrong number of nodes with %zu byte chunks: %zu",
+            chunk_size, stream_parser.ast.nodes_used);
+
+        for (size_t index = 0; index < parser.ast.nodes_used; ++ index) {
+            const struct AstNode *node = &parser.ast.nodes[index];
+            const struct AstNode *stream_node = &stream_parser.ast.nodes[index];
+
+            ASSERT_TRUE(node->type == stream_node->type &&
+                node->start_index == stream_node->start_index &&
+                node->end_index == stream_node->end_index,
+                "node %zu differs with %zu byte chunks", index, chunk_size);
+        }
+
+        const long actual = ast_eval(&stream_parser.ast, arg_values);
+        ASSERT_EQUAL(expected, actual, "streamed parsing gives a different result: %ld != %ld", expected, actual);
+        parser_destroy(&stream_parser);
+    }
+
+    // the range of the error starts in an earlier chunk
+    stream_parser = parse_stream(&schema, &PARSER_OPTIONS_INIT);
+    ASSERT_TRUE(parser_feed(&stream_parser, "x + (x", 6), "streamed parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(parser_feed(&stream_parser, " * 2", 4), "streamed parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(!parser_feed(&stream_parser, "(", 1), "missing ')' was accepted");
+    ASSERT_EQUAL(ERROR_EXPECTED_CLOSE_PAREN, stream_parser.error, "wrong parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(stream_parser.error_info.code.start_index == 4 && stream_parser.error_info.code.end_index == 11,
+        "wrong error location: %zu ... %zu", stream_parser.error_info.code.start_index, stream_parser.error_info.code.end_index);
+    ASSERT_TRUE(!parser_feed(&stream_parser, "x", 1), "fed after an error");
+    ASSERT_TRUE(!parser_finish(&stream_parser), "finished after an error");
+    parser_destroy(&stream_parser);
+
+    // an unfinished token is only checked once it is complete
+    stream_parser = parse_stream(&schema, &PARSER_OPTIONS_INIT);
+    ASSERT_TRUE(parser_feed(&stream_parser, "x + 92233720368", 15), "streamed parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(!parser_feed(&stream_parser, "54775808 ", 9), "out of range value was accepted");
+    ASSERT_EQUAL(ERROR_VALUE_OUT_OF_RANGE, stream_parser.error, "wrong parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_EQUAL((size_t)4, stream_parser.error_info.code.start_index, "wrong error location: %zu", stream_parser.error_info.code.start_index);
+    parser_destroy(&stream_parser);
+
+    stream_parser = parse_stream(&schema, &PARSER_OPTIONS_INIT);
+    ASSERT_TRUE(parser_feed(&stream_parser, "x + y", 5), "streamed parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(parser_feed(&stream_parser, "z", 1), "streamed parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(!parser_finish(&stream_parser), "undefined variable was accepted");
+    ASSERT_EQUAL(ERROR_UNDEFINED_VARIABLE, stream_parser.error, "wrong parser error: %s", get_parser_error_message(stream_parser.error));
+    ASSERT_TRUE(stream_parser.error_info.code.start_index == 4 && stream_parser.error_info.code.end_index == 6,
+        "wrong error location: %zu ... %zu", stream_parser.error_info.code.start_index, stream_parser.error_info.code.end_index);
+
+cleanup:
+    buffer_destroy(&code);
+    arg_schema_destroy(&schema);
+    parser_destroy(&parser);
+    parser_destroy(&stream_parser);
+}
+
+TEST_DECL(parse_file) {
+    char *const arg_names[] = { "x", "y" };
+    const long arg_values[] = { 3, -5 };
+    const char code[] = "x * 1000 # comment\n- (y + 7) / 2\n";
+    char path[] = "/tmp/parser_test_XXXXXX";
+    int fd = -1;
+    int pipe_fds[2] = { -1, -1 };
+    bool created = false;
+    struct Parser parser = PARSER_INIT;
+
+    fd = mkstemp(path);
+    ASSERT_TRUE(fd >= 0, "creating temporary file failed: %s", strerror(errno));
+    created = true;
+    ASSERT_TRUE(write(fd, code, sizeof(code) - 1) == (ssize_t)(sizeof(code) - 1), "writing temporary file failed");
+    close(fd);
+    fd = -1;
+
+    parser = parse_file(path, arg_names, 2);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_TRUE(parser.code_mapped, "file wasn't mapped");
+    ASSERT_EQUAL(sizeof(code) - 1, parser.code_size, "wrong code size: %zu", parser.code_size);
+    ASSERT_EQUAL(2999L, ast_eval(&parser.ast, arg_values), "wrong result: %ld", ast_eval(&parser.ast, arg_values));
+    parser_destroy(&parser);
+
+    // the mapping stays for error messages
+    parser = parse_file(path, arg_names, 1);
+    ASSERT_EQUAL(ERROR_UNDEFINED_VARIABLE, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_TRUE(parser.code != NULL && memcmp(parser.code + parser.error_info.code.start_index, "y", 1) == 0,
+        "code isn't available for error messages");
+    parser_destroy(&parser);
+
+    parser = parse_file("/nonexistent/parser_test", arg_names, 2);
+    ASSERT_EQUAL(ERROR_IO, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL(ENOENT, parser.error_info.errnum, "wrong errno: %s", strerror(parser.error_info.errnum));
+    parser_destroy(&parser);
+
+    // pipes are streamed
+    ASSERT_TRUE(pipe(pipe_fds) == 0, "creating pipe failed: %s", strerror(errno));
+    ASSERT_TRUE(write(pipe_fds[1], code, sizeof(code) - 1) == (ssize_t)(sizeof(code) - 1), "writing pipe failed");
+    close(pipe_fds[1]);
+    pipe_fds[1] = -1;
+
+    char pipe_path[64];
+    snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%d", pipe_fds[0]);
+
+    parser = parse_file(pipe_path, arg_names, 2);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_TRUE(!parser.code_mapped, "pipe was mapped");
+    ASSERT_EQUAL(2999L, ast_eval(&parser.ast, arg_values), "wrong result: %ld", ast_eval(&parser.ast, arg_values));
+
+cleanup:
+    parser_destroy(&parser);
+    if (fd >= 0) {
+        close(fd);
+    }
+    for (size_t index = 0; index < 2; ++ index) {
+        if (pipe_fds[index] >= 0) {
+            close(pipe_fds[index]);
+        }
+    }
+    if (created) {
+        unlink(path);
+    }
+}
+
+TEST_DECL(line_index) {
+    // newlines at and around the vector width, empty lines and no trailing newline
+    const char *const codes[] = {
+        "",
+        "\n",
+        "x + 1",
+        "x\n\n+ 1\n",
+        "0123456789abcde\n0123456789abcdef\n\n\n0123456789abcdefghijklmnopqrstuvwxyz\r\n# comment\n\n1",
+    };
+    struct LineIndex lines = LINE_INDEX_INIT;
+
+    for (size_t code_index = 0; code_index < sizeof(codes) / sizeof(codes[0]); ++ code_index) {
+        const char *code = codes[code_index];
+        const size_t size = strlen(code);
+
+        line_index_init(&lines, code, size);
+
+        // one past the end is the location of the end of file
+        for (size_t index = 0; index <= size + 1; ++ index) {
+            const struct Location expected = get_location(code, size, index);
+            const struct Location actual = line_index_get_location(&lines, index);
+
+            ASSERT_TRUE(expected.lineno == actual.lineno && expected.column == actual.column,
+                "code %zu, index %zu: wrong location: line %zu column %zu != line %zu column %zu",
+                code_index, index, expected.lineno, expected.column, actual.lineno, actual.column);
+
+            const size_t clamped = index > size ? size : index;
+            const struct Range line = line_index_get_line_range(&lines, index);
+
+            ASSERT_TRUE(line.start_index == clamped - (expected.column - 1) && line.end_index == get_line_end(code, size, clamped),
+                "code %zu, index %zu: wrong line range: %zu ... %zu", code_index, index, line.start_index, line.end_index);
+        }
+
+        line_index_destroy(&lines);
+    }
+
+    // built once and shared
+    line_index_init(&lines, codes[4], strlen(codes[4]));
+    ASSERT_TRUE(line_index_build(&lines), "building line index failed");
+    ASSERT_EQUAL((size_t)8, lines.lines_used, "wrong number of lines: %zu", lines.lines_used);
+
+    const size_t *line_starts = lines.line_starts;
+    ASSERT_TRUE(line_index_build(&lines) && lines.line_starts == line_starts, "line index was built again");
+
+cleanup:
+    line_index_destroy(&lines);
+}
+
+// Delegates to malloc() and keeps track of the memory that is still allocated.
+struct CountingAllocator {
+    size_t allocs;
+    size_t reallocs;
+    size_t outstanding;
+    // larger allocations fail, 0 for no limit
+    size_t max_size;
+};
+
+static void *counting_alloc(void *ctx, size_t size) {
+    struct CountingAllocator *counter = ctx;
+    if (counter->max_size != 0 && size > counter->max_size) {
+        return NULL;
+    }
+    void *ptr = malloc(size);
+    if (ptr != NULL) {
+        ++ counter->allocs;
+        ++ counter->outstanding;
+    }
+    return ptr;
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    (void)old_size;
+    struct CountingAllocator *counter = ctx;
+    if (ptr == NULL) {
+        return counting_alloc(ctx, new_size);
+    }
+    if (counter->max_size != 0 && new_size > counter->max_size) {
+        return NULL;
+    }
+    ++ counter->reallocs;
+    return realloc(ptr, new_size);
+}
+
+static void counting_free(void *ctx, void *ptr) {
+    struct CountingAllocator *counter = ctx;
+    if (ptr != NULL) {
+        -- counter->outstanding;
+        free(ptr);
+    }
+}
+
+TEST_DECL(allocator) {
+    char *const arg_names[] = { "x", "y" };
+    const long arg_values[] = { 5, 3 };
+    // shared sub-expressions, a polynomial and nesting deeper than the inline frames of the parser
+    const char *code = "(x + 1) * (x + 1) - (x + 1) * (x + 1) / y + ((((((((((((((((((((y))))))))))))))))))))";
+    const long expected = 36 - 36 / 3 + 3;
+    struct CountingAllocator counter = { .allocs = 0, .reallocs = 0, .outstanding = 0 };
+    const struct Allocator counting = {
+        .alloc   = counting_alloc,
+        .realloc = counting_realloc,
+        .free    = counting_free,
+        .ctx     = &counter,
+    };
+    struct Arena arena;
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct ParserOptions options = PARSER_OPTIONS_INIT;
+    struct Parser parser = PARSER_INIT;
+    struct Bytecode bytecode = { .bytes = BUFFER_INIT, .stack_size = 0 };
+    struct VmContext ctx = VM_CONTEXT_INIT;
+    size_t eliminated = 0;
+    long result = 0;
+
+    arena_init(&arena, 256);
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 2), "schema initialization failed");
+
+    // everything goes through the allocator and is given back
+    options.allocator = &counting;
+    parser = parse_slice_with_options(code, strlen(code), &schema, &options);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+
+    ASSERT_TRUE(optimize_polynomials(&parser.ast), "polynomial normalization failed");
+    optimize(&parser.ast);
+    ASSERT_TRUE(optimize_cse(&parser.ast, &eliminated), "common subexpression elimination failed");
+
+    bytecode = bytecode_compile_with_allocator(&parser.ast, &counting);
+    ASSERT_TRUE(bytecode.stack_size > 0, "compiling bytecode failed");
+
+    ASSERT_TRUE(vm_context_init_with_allocator(&ctx, bytecode.bytes.data, &counting), "VM context initialization failed");
+    ASSERT_TRUE(vm_context_reserve(&ctx, VM_SCRATCH_SIZE * 2), "reserving VM stack failed");
+    ASSERT_TRUE(bytecode_eval_ctx(&ctx, bytecode.bytes.data, arg_values, &result), "evaluation failed: %s",
+        get_vm_error_message(ctx.error));
+    ASSERT_EQUAL(expected, result, "wrong result: %ld", result);
+
+    ASSERT_TRUE(counter.allocs >= 4, "allocator was not used: %zu allocations", counter.allocs);
+
+    vm_context_destroy(&ctx);
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+    ASSERT_EQUAL((size_t)0, counter.outstanding, "%zu allocations were not freed", counter.outstanding);
+
+    // parse, compile, evaluate and discard without allocating from the system once warmed up
+    options.allocator = &arena.allocator;
+    size_t capacity = 0;
+    for (size_t round = 0; round < 4; ++ round) {
+        parser = parse_slice_with_options(code, strlen(code), &schema, &options);
+        ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+
+        ASSERT_TRUE(optimize_polynomials(&parser.ast), "polynomial normalization failed");
+        optimize(&parser.ast);
+        ASSERT_TRUE(optimize_cse(&parser.ast, &eliminated), "common subexpression elimination failed");
+
+        bytecode = bytecode_compile_with_allocator(&parser.ast, &arena.allocator);
+        ASSERT_TRUE(bytecode.stack_size > 0, "compiling bytecode failed");
+
+        ASSERT_TRUE(vm_context_init_with_allocator(&ctx, bytecode.bytes.data, &arena.allocator), "VM context initialization failed");
+        ASSERT_TRUE(vm_context_reserve(&ctx, VM_SCRATCH_SIZE * 2), "reserving VM stack failed");
+        ASSERT_TRUE(bytecode_eval_ctx(&ctx, bytecode.bytes.data, arg_values, &result), "evaluation failed: %s",
+            get_vm_error_message(ctx.error));
+        ASSERT_EQUAL(expected, result, "wrong result: %ld", result);
+
+        // nothing needs to be freed
+        ctx = VM_CONTEXT_INIT;
+        bytecode.bytes = BUFFER_INIT;
+        parser.ast = (struct Ast)AST_INIT;
+        arena_reset(&arena);
+
+        ASSERT_TRUE(arena.chunks != NULL && arena.capacity > 0, "arena is empty after reset");
+        if (round == 0) {
+            capacity = arena.capacity;
+        } else {
+            ASSERT_EQUAL(capacity, arena.capacity, "arena grew after the first round: %zu != %zu", capacity, arena.capacity);
+        }
+    }
+
+cleanup:
+    vm_context_destroy(&ctx);
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+    arg_schema_destroy(&schema);
+    arena_destroy(&arena);
+}
+
+TEST_DECL(reserve) {
+    char *const arg_names[] = { "x", "y" };
+    const long arg_values[] = { 5, 3 };
+    const char *code = "(x + 1) * (x + 1) - (x + 1) * (x + 1) / y + ((((((((((((((((((((y))))))))))))))))))))";
+    const long expected = 36 - 36 / 3 + 3;
+    struct CountingAllocator counter = { .allocs = 0, .reallocs = 0, .outstanding = 0 };
+    const struct Allocator counting = {
+        .alloc   = counting_alloc,
+        .realloc = counting_realloc,
+        .free    = counting_free,
+        .ctx     = &counter,
+    };
+    char storage[8192];
+    struct Arena arena;
+    struct Buffer buffer = BUFFER_INIT;
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct ParserOptions options = PARSER_OPTIONS_INIT;
+    struct TokenStream tokens = TOKEN_STREAM_INIT;
+    struct Parser parser = PARSER_INIT;
+    struct Bytecode bytecode = { .bytes = BUFFER_INIT, .stack_size = 0 };
+    struct VmContext ctx = VM_CONTEXT_INIT;
+    long result = 0;
+
+    arena_init_with_storage(&arena, storage, sizeof(storage));
+
+    // appending more than twice the capacity at once
+    ASSERT_TRUE(buffer_append(&buffer, "x", 1), "out of memory");
+    ASSERT_TRUE(buffer_append(&buffer, storage, sizeof(storage)), "out of memory");
+    ASSERT_EQUAL(sizeof(storage) + 1, buffer.used, "wrong buffer size: %zu", buffer.used);
+
+    ASSERT_TRUE(buffer_reserve(&buffer, buffer.used * 2), "out of memory");
+    const char *data = buffer.data;
+    ASSERT_TRUE(buffer_append(&buffer, storage, sizeof(storage)), "out of memory");
+    ASSERT_TRUE(buffer.data == data, "buffer was reallocated despite the reserved capacity");
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 2), "schema initialization failed");
+
+    // nodes, bytecode and temporaries are allocated once each, the parentheses
+    // need a frame stack besides the nodes
+    options.allocator = &counting;
+    parser = parse_slice_with_options(code, strlen(code), &schema, &options);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL((size_t)2, counter.allocs, "parsing took %zu allocations", counter.allocs);
+
+    bytecode = bytecode_compile_with_allocator(&parser.ast, &counting);
+    ASSERT_TRUE(bytecode.stack_size > 0, "compiling bytecode failed");
+    ASSERT_EQUAL((size_t)0, counter.reallocs, "%zu reallocations", counter.reallocs);
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+
+    counter.allocs = 0;
+    ASSERT_TRUE(tokenize_slice(&tokens, code, strlen(code)), "lexing failed");
+    parser = parse_tokens(&tokens, code, strlen(code), &schema);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_TRUE(parser.ast.nodes_capacity <= tokens.tokens_used, "more nodes reserved than tokens: %zu > %zu",
+        parser.ast.nodes_capacity, tokens.tokens_used);
+    parser_destroy(&parser);
+
+    // larger codes grow from the hint
+    options.reserve_nodes = 2;
+    parser = parse_slice_with_options(code, strlen(code), &schema, &options);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_TRUE(counter.reallocs > 0, "AST didn't grow");
+    parser_destroy(&parser);
+    ASSERT_EQUAL((size_t)0, counter.outstanding, "%zu allocations were not freed", counter.outstanding);
+
+    // small expressions don't touch the heap at all with storage on the stack
+    options.allocator = &arena.allocator;
+    options.reserve_nodes = 0;
+    for (size_t round = 0; round < 2; ++ round) {
+        parser = parse_slice_with_options(code, strlen(code), &schema, &options);
+        ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+        optimize(&parser.ast);
+
+        bytecode = bytecode_compile_with_allocator(&parser.ast, &arena.allocator);
+        ASSERT_TRUE(bytecode.stack_size > 0, "compiling bytecode failed");
+
+        ASSERT_TRUE(vm_context_init_with_allocator(&ctx, bytecode.bytes.data, &arena.allocator), "VM context initialization failed");
+        ASSERT_TRUE(bytecode_eval_ctx(&ctx, bytecode.bytes.data, arg_values, &result), "evaluation failed: %s",
+            get_vm_error_message(ctx.error));
+        ASSERT_EQUAL(expected, result, "wrong result: %ld", result);
+
+        ctx = VM_CONTEXT_INIT;
+        bytecode.bytes = BUFFER_INIT;
+        parser.ast = (struct Ast)AST_INIT;
+        ASSERT_TRUE(arena.chunks == NULL, "arena allocated from the heap");
+        arena_reset(&arena);
+    }
+
+    // storage that doesn't suffice is replaced by a chunk
+    ASSERT_TRUE(arena_alloc(&arena, sizeof(storage) + 1) != NULL, "out of memory");
+    ASSERT_TRUE(arena.chunks != NULL, "allocation larger than the storage was in the storage");
+    arena_reset(&arena);
+    ASSERT_TRUE(arena.storage == NULL && arena.chunks != NULL, "arena wasn't merged");
+
+    const struct ArenaChunk *chunks = arena.chunks;
+    const size_t capacity = arena.capacity;
+    ASSERT_TRUE(arena_alloc(&arena, sizeof(storage)) != NULL, "out of memory");
+    ASSERT_TRUE(arena.chunks == chunks && arena.capacity == capacity, "merged arena allocated again");
+
+cleanup:
+    vm_context_destroy(&ctx);
+    bytecode_destroy(&bytecode);
+    parser_destroy(&parser);
+    token_stream_destroy(&tokens);
+    arg_schema_destroy(&schema);
+    buffer_destroy(&buffer);
+    arena_destroy(&arena);
+}
+
+TEST_DECL(sparse_code) {
+    char *const arg_names[] = { "x" };
+    const long arg_values[] = { 5 };
+    // mostly whitespace, like big generated or commented sources
+    const size_t code_size = 16 * 1024 * 1024;
+    struct CountingAllocator counter = { .allocs = 0, .reallocs = 0, .outstanding = 0, .max_size = 1024 * 1024 };
+    const struct Allocator limited = {
+        .alloc   = counting_alloc,
+        .realloc = counting_realloc,
+        .free    = counting_free,
+        .ctx     = &counter,
+    };
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct ParserOptions options = PARSER_OPTIONS_INIT;
+    struct Parser parser = PARSER_INIT;
+    char *code = malloc(code_size);
+
+    ASSERT_TRUE(code != NULL, "out of memory");
+    memset(code, ' ', code_size);
+    code[0] = 'x';
+    memcpy(code + code_size - 2, "+1", 2);
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 1), "schema initialization failed");
+
+    // the node estimate is capped instead of growing with the code size
+    parser = parse_slice_with_schema(code, code_size, &schema);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL((size_t)3, parser.ast.nodes_used, "wrong node count: %zu", parser.ast.nodes_used);
+    ASSERT_TRUE(parser.ast.nodes_capacity * sizeof(struct AstNode) <= 4 * 1024 * 1024,
+        "%zu nodes reserved for 3", parser.ast.nodes_capacity);
+    parser_destroy(&parser);
+
+    // and if even that can't be reserved, the AST grows from nothing
+    options.allocator = &limited;
+    parser = parse_slice_with_options(code, code_size, &schema, &options);
+    ASSERT_EQUAL(ERROR_NONE, parser.error, "parser error: %s", get_parser_error_message(parser.error));
+    ASSERT_EQUAL(arg_values[0] + 1, ast_eval(&parser.ast, arg_values), "wrong result: %ld", ast_eval(&parser.ast, arg_values));
+    parser_destroy(&parser);
+
+    // an explicit hint that can't be reserved is still an error
+    options.reserve_nodes = code_size;
+    parser = parse_slice_with_options(code, code_size, &schema, &options);
+    ASSERT_EQUAL(ERROR_OUT_OF_MEMORY, parser.error, "wrong parser error: %s", get_parser_error_message(parser.error));
+    parser_destroy(&parser);
+    ASSERT_EQUAL((size_t)0, counter.outstanding, "%zu allocations were not freed", counter.outstanding);
+
+cleanup:
+    parser_destroy(&parser);
+    arg_schema_destroy(&schema);
+    free(code);
+}
+
+TEST_DECL(reuse) {
+    char *const arg_names[] = { "x", "y" };
+    const long arg_values[] = { 5, 3 };
+    // largest first, the others fit into its memory
+    const char *const codes[] = {
+        "(x + 1) * (x + 2) - (x + 3) * (y - 1) / y + x * y * 3 - (y + 7) * 2",
+        "x",
+        "x +",
+        "(x - y) * 1000000000000",
+        "-y",
+    };
+    const long expected[] = { 42 - 16 / 3 + 45 - 20, 5, 0, 2000000000000, -3 };
+    struct CountingAllocator counter = { .allocs = 0, .reallocs = 0, .outstanding = 0 };
+    const struct Allocator counting = {
+        .alloc   = counting_alloc,
+        .realloc = counting_realloc,
+        .free    = counting_free,
+        .ctx     = &counter,
+    };
+    struct ArgSchema schema = ARG_SCHEMA_INIT;
+    struct ParserOptions options = PARSER_OPTIONS_INIT;
+    struct Parser parser = PARSER_INIT;
+    struct Bytecode bytecode = BYTECODE_INIT;
+    const struct AstNode *nodes = NULL;
+    const char *bytes = NULL;
+
+    ASSERT_TRUE(arg_schema_init(&schema, arg_names, 2), "schema initialization failed");
+
+    options.allocator = &counting;
+    bytecode.bytes.allocator = &counting;
+
+    for (size_t round = 0; round < 2; ++ round) {
+        for (size_t index = 0; index < sizeof(codes) / sizeof(codes[0]); ++ index) {
+            const char *code = codes[index];
+            const bool ok = parse_slice_into(&parser, code, strlen(code), &schema, &options);
+
+            if (index == 2) {
+                ASSERT_TRUE(!ok, "%s: error not reported", code);
+                ASSERT_EQUAL(ERROR_ILLEGAL_TOKEN, parser.error, "%s: wrong parser error: %s", code,
+                    get_parser_error_message(parser.error));
+                continue;
+            }
+
+            ASSERT_TRUE(ok, "%s: parser error: %s", code, get_parser_error_message(parser.error));
+            ASSERT_TRUE(bytecode_compile_into(&bytecode, &parser.ast), "%s: compiling bytecode failed", code);
+
+            const long result = bytecode_eval(bytecode.bytes.data, arg_values);
+            ASSERT_EQUAL(expected[index], result, "%s: wrong result: %ld", code, result);
+
+            if (nodes == NULL) {
+                nodes = parser.ast.nodes;
+                bytes = bytecode.bytes.data;
+            } else {
+                ASSERT_TRUE(parser.ast.nodes == nodes && bytecode.bytes.data == bytes, "%s: memory was not reused", code);
+            }
+        }
+    }
+
+    // nodes and bytes once, then only the three temporaries of each of the eight
+    // compilations
+    ASSERT_EQUAL((size_t)0, counter.reallocs, "%zu reallocations", counter.reallocs);
+    ASSERT_EQUAL((size_t)2 + 3 * 8, counter.allocs, "%zu allocations", counter.allocs);
+
+    // the passes compact the nodes in place, so optimizing keeps them as well
+    nodes = NULL;
+    size_t capacity = 0;
+    for (size_t round = 0; round < 2; ++ round) {
+        for (size_t index = 0; index < sizeof(codes) / sizeof(codes[0]); ++ index) {
+            const char *code = codes[index];
+
+            if (index == 2) {
+                continue;
+            }
+
+            ASSERT_TRUE(parse_slice_into(&parser, code, strlen(code), &schema, &options), "%s: parser error: %s", code,
+                get_parser_error_message(parser.error));
+
+            optimize(&parser.ast);
+            size_t eliminated = 0;
+            ASSERT_TRUE(optimize_cse(&parser.ast, &eliminated), "%s: common subexpression elimination failed", code);
+
+            ASSERT_TRUE(bytecode_compile_into(&bytecode, &parser.ast), "%s: compiling bytecode failed", code);
+
+            const long result = bytecode_eval(bytecode.bytes.data, arg_values);
+            ASSERT_EQUAL(expected[index], result, "%s: wrong result: %ld", code, result);
+
+            if (nodes == NULL) {
+                nodes = parser.ast.nodes;
+                capacity = parser.ast.nodes_capacity;
+            } else {
+                ASSERT_TRUE(parser.ast.nodes == nodes, "%s: nodes were not reused", code);
+                ASSERT_EQUAL(capacity, parser.ast.nodes_capacity, "%s: node capacity changed: %zu != %zu", code,
+                    capacity, parser.ast.nodes_capacity);
+            }
+        }
+    }
+
+    parser_reset(&parser, NULL, 0);
+    ASSERT_TRUE(parser.ast.nodes == nodes && parser.ast.nodes_used == 0 && parser.state == PARSER_TOKEN_PENDING,
+        "parser wasn't reset");
+
+    parser_destroy(&parser);
+    bytecode_destroy(&bytecode);
+    ASSERT_EQUAL((size_t)0, counter.outstanding, "%zu allocations were not freed", counter.outstanding);
+
+    // switching the allocator drops the old memory
+    options.allocator = NULL;
+    ASSERT_TRUE(parse_slice_into(&parser, codes[0], strlen(codes[0]), &schema, &options), "parser error: %s",
+        get_parser_error_message(parser.error));
+    ASSERT_TRUE(parser.ast.allocator == NULL, "allocator wasn't switched");
+
+cleanup:
+    parser_destroy(&parser);
+    bytecode_destroy(&bytecode);
+    arg_schema_destroy(&schema);
+}
+
 TESTS_PARSER_ERROR(undef_var, "x", ERROR_UNDEFINED_VARIABLE, "y")
 
+TESTS_PARSER_ERROR(value_out_of_range, "9223372036854775808", ERROR_VALUE_OUT_OF_RANGE)
+
 TESTS_PARSER_ERROR(illegal_arg_name, "0", ERROR_ILLEGAL_ARG_NAME, "foo bar")
 
 TESTS_PARSER_ERROR(div_by_zero1, "1 / 0", ERROR_DIV_BY_ZERO)